@@ -20,7 +20,20 @@
 #define CFG_RECORD_FALL_THROUGH_COUNT 1
 
 
+/// If we're recording basic block execution counts, then should each counter
+/// be split into several shards that are summed at report time? The shard
+/// that a thread increments is chosen by hashing its stack pointer, so that
+/// threads running on different CPUs usually don't contend on the same cache
+/// lines.
+#define CFG_SHARD_EXEC_COUNTS 1
+
+
 /// Should we record indirect branch targets?
 #define CFG_RECORD_INDIRECT_TARGETS 1
 
+
+/// Should the report be a binary profile (see `clients/cfg/profile.h`)? If
+/// not, then the report is printed as text.
+#define CFG_BINARY_PROFILE 1
+
 #endif /* CFG_CONFIG_H_ */
@@ -10,6 +10,7 @@
 #include "clients/cfg/config.h"
 
 #include "granary/hash_table.h"
+#include "granary/spin_lock.h"
 
 using namespace granary;
 
@@ -58,35 +59,25 @@ namespace client {
 #if CFG_RECORD_INDIRECT_TARGETS
     /// Add an entry to a basic block's set of indirect CALL/JMP targets.
     void add_indirect_target(app_pc target_addr, indirect_cti *cti) {
-        cti->update_lock.acquire();
+        const uintptr_t hash(reinterpret_cast<uintptr_t>(target_addr) >> 4);
 
-        app_pc *new_targets(nullptr);
+        for(unsigned i(0); i < NUM_INDIRECT_TARGET_SLOTS; ++i) {
+            std::atomic<app_pc> &slot(cti->indirect_targets[
+                (hash + i) % NUM_INDIRECT_TARGET_SLOTS]);
 
-        // Search and possibly add.
-        for(unsigned i(0); i < cti->num_indirect_targets; ++i) {
-            if(!cti->indirect_targets[i]) {
-                cti->indirect_targets[i] = target_addr;
-                goto done;
-            } else if(target_addr == cti->indirect_targets[i]) {
-                goto done;
+            app_pc found(slot.load(std::memory_order_acquire));
+            if(!found && slot.compare_exchange_strong(found, target_addr)) {
+                return;
             }
-        }
-
-        // Resize and copy.
-        new_targets = allocate_memory<app_pc>(cti->num_indirect_targets * 2);
-        memcpy(
-            new_targets, cti->indirect_targets,
-            cti->num_indirect_targets * sizeof(app_pc));
-
-        // Free
-        free_memory<app_pc>(cti->indirect_targets, cti->num_indirect_targets);
 
-        // Update
-        cti->num_indirect_targets *= 2;
-        cti->indirect_targets = new_targets;
+            // Either the target was already in the set, or another thread
+            // added the target after we loaded the slot.
+            if(target_addr == found) {
+                return;
+            }
+        }
 
-    done:
-        cti->update_lock.release();
+        cti->num_dropped_targets.fetch_add(1);
     }
 
 
@@ -100,21 +91,109 @@ namespace client {
 #endif
 
 
-    /// Insert an execution counter that saves and restores the flags, as well
-    /// as protects against the user space red zone.
+#if CFG_RECORD_EXEC_COUNT && CFG_SHARD_EXEC_COUNTS
+
+    /// Lock that protects the current chunk of counters.
+    static atomic_spin_lock COUNTER_CHUNK_LOCK;
+
+
+    /// The chunk of counters from which new counters are allocated, and the
+    /// index of the next unallocated counter in that chunk.
+    static cfg_counter_chunk *COUNTER_CHUNK = nullptr;
+    static unsigned NEXT_COUNTER = NUM_CFG_COUNTERS_PER_SHARD;
+
+
+    /// Allocate a new sharded execution counter.
+    ///
+    /// Note: Counters are never freed, even if their basic block is
+    ///       discarded, as the counter might still be referenced by the
+    ///       discarded block's instrumentation.
+    static exec_counter allocate_exec_counter(void) {
+        COUNTER_CHUNK_LOCK.acquire();
+        if(NUM_CFG_COUNTERS_PER_SHARD <= NEXT_COUNTER) {
+            COUNTER_CHUNK = allocate_memory<cfg_counter_chunk>();
+            NEXT_COUNTER = 0;
+        }
+        exec_counter counter(&(COUNTER_CHUNK->shards[0][NEXT_COUNTER++]));
+        COUNTER_CHUNK_LOCK.release();
+        return counter;
+    }
+
+
+    /// Insert instructions that increment one shard of an execution counter.
+    /// The shard is chosen by hashing the stack pointer. This clobbers the
+    /// flags, and uses the stack.
+    static void insert_shard_increment_before(
+        instruction_list &ls,
+        instruction in,
+        exec_counter counter
+    ) {
+        enum : int32_t {
+            SHARD_HASH = static_cast<int32_t>(0x9E3779B1U)
+        };
+
+        operand shard(reg::rbx + reg::rax);
+        shard.size = dynamorio::OPSZ_8;
+
+        ls.insert_before(in, push_(reg::rax));
+        ls.insert_before(in, push_(reg::rbx));
+        ls.insert_before(in, mov_st_(reg::rax, reg::rsp));
+        ls.insert_before(in, shr_(reg::rax, int8_(CFG_SHARD_STACK_SHIFT)));
+        ls.insert_before(in, imul_imm_(reg::rax, reg::rax, int32_(SHARD_HASH)));
+        ls.insert_before(in,
+            shr_(reg::rax, int8_(64 - CFG_COUNTER_SHARD_BITS)));
+        ls.insert_before(in,
+            shl_(reg::rax, int8_(CFG_COUNTER_SHARD_SIZE_SHIFT)));
+        ls.insert_before(in, mov_imm_(reg::rbx,
+            int64_(reinterpret_cast<uint64_t>(counter))));
+        ls.insert_before(in, inc_(shard));
+        ls.insert_before(in, pop_(reg::rbx));
+        ls.insert_before(in, pop_(reg::rax));
+    }
+#endif
+
+
+#if CFG_RECORD_EXEC_COUNT
+    /// Insert an execution counter that (optionally) saves and restores the
+    /// flags, as well as protects against the user space red zone.
     static void insert_exec_count_before(
         instruction_list &ls,
         instruction in,
-        uint64_t *counter
+        exec_counter &counter,
+        bool save_flags
     ) {
+#   if CFG_SHARD_EXEC_COUNTS
+        if(!counter) {
+            counter = allocate_exec_counter();
+        }
+
+        IF_USER( ls.insert_before(in,
+            lea_(reg::rsp, reg::rsp[-REDZONE_SIZE])); )
+        if(save_flags) {
+            ls.insert_before(in, pushf_());
+        }
+        insert_shard_increment_before(ls, in, counter);
+        if(save_flags) {
+            ls.insert_before(in, popf_());
+        }
+        IF_USER( ls.insert_before(in,
+            lea_(reg::rsp, reg::rsp[REDZONE_SIZE])); )
+#   else
+        if(!save_flags) {
+            ls.insert_before(in, inc_(absmem_(&counter, dynamorio::OPSZ_8)));
+            return;
+        }
+
         IF_USER( ls.insert_before(in,
             lea_(reg::rsp, reg::rsp[-REDZONE_SIZE])); )
         ls.insert_before(in, pushf_());
-        ls.insert_before(in, inc_(absmem_(counter, dynamorio::OPSZ_8)));
+        ls.insert_before(in, inc_(absmem_(&counter, dynamorio::OPSZ_8)));
         ls.insert_before(in, popf_());
         IF_USER( ls.insert_before(in,
             lea_(reg::rsp, reg::rsp[REDZONE_SIZE])); )
+#   endif
     }
+#endif
 
 
 #if CFG_RECORD_INDIRECT_TARGETS
@@ -143,11 +222,7 @@ namespace client {
             reg::indirect_target_addr, data_label_(&cti));
 
         ls.append(hit_in_last_indirect_target);
-
-        // Initialize the `indirect_cti` data structure for this jump.
-        cti.indirect_targets = allocate_memory<app_pc>(4);
-        cti.num_indirect_targets = 4;
-
+        cti.is_instrumented = true;
     }
 #endif
 
@@ -171,7 +246,7 @@ namespace client {
 
             ASSERT(nullptr != bb.indirect_ctis);
             for(unsigned i(0); i < bb.num_indirect_ctis; ++i) {
-                if(!bb.indirect_ctis[i].indirect_targets) {
+                if(!bb.indirect_ctis[i].is_instrumented) {
                     instrument_indirect_cti(ls, bb.indirect_ctis[i]);
                     break;
                 }
@@ -219,13 +294,12 @@ namespace client {
         // modifications done by the increment won't alter the behaviour
         // of the instrumented program.
         if(find_arith_flags_dead_after(ls, in)) {
-            ls.insert_before(in,
-                inc_(absmem_(&(bb.num_executions), dynamorio::OPSZ_8)));
+            insert_exec_count_before(ls, in, bb.num_executions, false);
 
         // We didn't find a good place to add in the execution counter; place
         // it at the beginning of the basic block.
         } else {
-            insert_exec_count_before(ls, label, &(bb.num_executions));
+            insert_exec_count_before(ls, label, bb.num_executions, true);
         }
 
 #   if CFG_RECORD_FALL_THROUGH_COUNT
@@ -237,7 +311,8 @@ namespace client {
             }
 
             in = in.next();
-            insert_exec_count_before(ls, in, &(bb.num_fall_through_executions));
+            insert_exec_count_before(
+                ls, in, bb.num_fall_through_executions, true);
             break;
         }
 #   endif
@@ -0,0 +1,134 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * profile.h
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#ifndef CFG_PROFILE_H_
+#define CFG_PROFILE_H_
+
+#include "granary/globals.h"
+
+namespace client {
+
+
+    /// A binary profile is a `cfg_profile_header` followed by a sequence of
+    /// records. Each record begins with a `cfg_profile_record`, and the
+    /// `size` of a record includes its prefix, so that readers can skip
+    /// kinds of records that they don't understand. Each block record is
+    /// immediately followed by the edge records of its CTIs, and a module
+    /// record is emitted before the first block that references it. All
+    /// values are little-endian.
+    ///
+    /// A reader for this format is in `scripts/cfg_profile.py`.
+    enum : uint32_t {
+        CFG_PROFILE_MAGIC           = 0x47464347, // "GCFG"
+        CFG_PROFILE_VERSION         = 1,
+
+        /// Module id of blocks that aren't in a kernel module.
+        CFG_PROFILE_NO_MODULE       = ~0U,
+
+        CFG_PROFILE_MODULE_NAME_SIZE = 56
+    };
+
+
+    enum cfg_profile_record_kind : uint32_t {
+        CFG_PROFILE_MODULE          = 1,
+        CFG_PROFILE_BLOCK           = 2,
+        CFG_PROFILE_EDGE            = 3
+    };
+
+
+    enum cfg_profile_edge_kind : uint32_t {
+        CFG_EDGE_JMP                = 0,
+        CFG_EDGE_CALL               = 1,
+        CFG_EDGE_JCC                = 2,
+        CFG_EDGE_INDIRECT_JMP       = 3,
+        CFG_EDGE_INDIRECT_CALL      = 4
+    };
+
+
+    struct cfg_profile_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t header_size;
+        uint32_t is_kernel;
+
+        /// Number of block records in the profile.
+        uint64_t num_blocks;
+    };
+
+
+    struct cfg_profile_record {
+        uint32_t kind;
+        uint32_t size;
+    };
+
+
+    /// Names a kernel module.
+    struct cfg_profile_module {
+        cfg_profile_record record;
+        uint32_t module_id;
+        uint32_t reserved;
+        char name[CFG_PROFILE_MODULE_NAME_SIZE];
+    };
+
+
+    /// Describes a basic block and its execution counts.
+    struct cfg_profile_block {
+        cfg_profile_record record;
+
+        /// Native address of the first instruction of the block.
+        uint64_t app_pc;
+
+        /// Offset of the block within the code cache.
+        uint64_t cache_offset;
+
+        /// Address of the allocator that allocated the block.
+        uint64_t allocator;
+
+        uint64_t num_executions;
+        uint64_t num_fall_through_executions;
+
+        uint32_t num_bytes;
+        uint32_t num_bbs_in_trace;
+
+        /// Module that contains the block, and the offset of the block
+        /// within the module's code.
+        uint32_t module_id;
+        uint32_t module_offset;
+
+        /// Number of edge records that follow this record.
+        uint32_t num_edges;
+        uint32_t reserved;
+    };
+
+
+    /// Describes a control-flow transfer out of the preceding block. There is
+    /// one record for each recorded target of an indirect CTI.
+    struct cfg_profile_edge {
+        cfg_profile_record record;
+        uint32_t edge_kind;
+
+        /// For conditional branches, the condition, as an offset from `OP_jo`.
+        uint32_t condition;
+
+        uint64_t cti_pc;
+        uint64_t target_pc;
+
+        /// For conditional branches, the address of the next instruction.
+        uint64_t fall_through_pc;
+    };
+
+
+    static_assert(24 == sizeof(cfg_profile_header)
+        && 72 == sizeof(cfg_profile_module)
+        && 72 == sizeof(cfg_profile_block)
+        && 40 == sizeof(cfg_profile_edge),
+        "The layout of the binary profile has changed; update its version "
+        "and `scripts/cfg_profile.py`.");
+}
+
+#endif /* CFG_PROFILE_H_ */
@@ -7,11 +7,16 @@
  */
 
 #include "clients/cfg/config.h"
+#include "clients/cfg/profile.h"
 
 #include "granary/client.h"
 
 #if CONFIG_ENV_KERNEL
 #   include "granary/kernel/linux/module.h"
+#elif CFG_BINARY_PROFILE
+#   include "granary/user/posix/output_file.h"
+#   include <fcntl.h>
+#   include <unistd.h>
 #endif
 
 #if CFG_RECORD_EXEC_COUNT
@@ -82,32 +87,37 @@ namespace client {
     };
 
 
-    /// Log out information about an individual basic block.
-    static int report_bb(const basic_block_state *state) {
-        const basic_block bb(state->label.translation);
-        const app_pc native_pc_start(
-            bb.info->generating_pc.unmangled_address());
+    enum {
+        /// Maximum number of edges out of a single basic block that are
+        /// reported.
+        MAX_NUM_EDGES = 64
+    };
 
-        IF_KERNEL( const kernel_module *module(
-            kernel_get_module(native_pc_start)); )
 
-        int i(0);
-        i += sprintf(&(LOG_BUFF[i]),
-            "BB(%x,%u,%p,%u,%p" IF_REPORT_COUNT(",%lu") IF_KERNEL(",%x,%s") ")\n",
-            bb.cache_pc_start - GRANARY_EXEC_START,
-            bb.info->num_bytes,
-            bb.info->allocator,
-            bb.info->num_bbs_in_trace,
-            native_pc_start
-            _IF_REPORT_COUNT(state->num_executions)
-            _IF_KERNEL(native_pc_start - module->text_begin)
-            _IF_KERNEL(module->name));
+    /// A control-flow transfer out of a basic block.
+    struct cfg_edge {
+        cfg_profile_edge_kind kind;
+        unsigned condition;
+        app_pc cti_pc;
+        app_pc target_pc;
+        app_pc fall_through_pc;
+    };
 
-        cpu_state_handle cpu;
 
-        // Decode the original instructions and extract the CTIs.
+    /// Edges of the basic block being reported.
+    static cfg_edge EDGES[MAX_NUM_EDGES];
+
+
+    /// Decode the original instructions of a basic block and extract the
+    /// edges out of its CTIs into `EDGES`. Returns the number of edges.
+    static unsigned find_edges(const basic_block &bb) {
+        const app_pc native_pc_start(
+            bb.info->generating_pc.unmangled_address());
+
         app_pc decode_pc(native_pc_start);
+        unsigned num_edges(0);
         unsigned cti_num(0);
+
         for(unsigned j(0); j < bb.info->generating_num_instructions; ++j) {
 
             // Note: Some module code might fault when decoding (e.g. if it was
@@ -118,51 +128,324 @@ namespace client {
             }
 
             instruction in(instruction::decode(&decode_pc));
-
-
             if(!in.is_cti() || in.is_return()) {
                 continue;
             }
 
             operand target(in.cti_target());
+            cfg_edge edge;
+            edge.kind = CFG_EDGE_JMP;
+            edge.condition = 0;
+            edge.cti_pc = in.pc();
+            edge.fall_through_pc = nullptr;
+
             if(dynamorio::PC_kind != target.kind) {
 #if CFG_RECORD_INDIRECT_TARGETS
-                const char *format(nullptr);
                 if(in.is_call()) {
-                    format = "CALL*(%p,%p)\n";
+                    edge.kind = CFG_EDGE_INDIRECT_CALL;
                 } else if(in.is_jump()) {
-                    format = "JMP*(%p,%p)\n";
+                    edge.kind = CFG_EDGE_INDIRECT_JMP;
                 } else {
                     ASSERT(false);
                 }
 
                 const indirect_cti &cti(bb.state()->indirect_ctis[cti_num++]);
-                for(unsigned k(0); k < cti.num_indirect_targets; ++k) {
-                    if(!cti.indirect_targets[k]) {
-                        break;
+                for(unsigned k(0); k < NUM_INDIRECT_TARGET_SLOTS; ++k) {
+                    edge.target_pc = cti.indirect_targets[k].load();
+                    if(edge.target_pc && num_edges < MAX_NUM_EDGES) {
+                        EDGES[num_edges++] = edge;
                     }
-
-                    i += sprintf(
-                        &(LOG_BUFF[i]),
-                        format,
-                        in.pc(), cti.indirect_targets[k]);
                 }
 #endif
+                continue;
             } else if(in.is_call()) {
-                i += sprintf(&(LOG_BUFF[i]), "CALL(%p)\n", target.value.pc);
+                edge.kind = CFG_EDGE_CALL;
             } else if(in.is_jump()) {
-                i += sprintf(&(LOG_BUFF[i]), "JMP(%p)\n", target.value.pc);
+                edge.kind = CFG_EDGE_JMP;
             } else {
+                edge.kind = CFG_EDGE_JCC;
+                edge.condition = in.op_code() - dynamorio::OP_jo;
+                edge.fall_through_pc = decode_pc;
+            }
+
+            edge.target_pc = target.value.pc;
+            if(num_edges < MAX_NUM_EDGES) {
+                EDGES[num_edges++] = edge;
+            }
+        }
+
+        UNUSED(cti_num);
+        return num_edges;
+    }
+
+
+#if CFG_BINARY_PROFILE
+
+#   if CONFIG_ENV_KERNEL
+    enum {
+        MAX_NUM_PROFILE_MODULES = 256
+    };
+
+
+    /// Modules for which a module record has been emitted.
+    static const kernel_module *PROFILE_MODULES[MAX_NUM_PROFILE_MODULES];
+    static unsigned NUM_PROFILE_MODULES(0);
+#   else
+
+    /// File to which the profile is written.
+    static int PROFILE_FD(-1);
+#   endif
+
+
+    /// Number of bytes of the profile that are buffered in `LOG_BUFF`.
+    static unsigned PROFILE_BUFF_SIZE(0);
+
+
+    /// Write out the buffered part of the profile.
+    static void flush_profile(void) {
+#   if CONFIG_ENV_KERNEL
+        log(&(LOG_BUFF[0]), PROFILE_BUFF_SIZE);
+#   else
+        if(-1 != PROFILE_FD) {
+            UNUSED(write(PROFILE_FD, &(LOG_BUFF[0]), PROFILE_BUFF_SIZE));
+        }
+#   endif
+        PROFILE_BUFF_SIZE = 0;
+    }
+
+
+    /// Buffer a record of the profile. Returns a pointer to the buffered
+    /// record, or null if the record doesn't fit into the buffer.
+    template <typename T>
+    static T *buffer_record(const T &record) {
+        if((PROFILE_BUFF_SIZE + sizeof record) > LOG_BUFF_SIZE) {
+            return nullptr;
+        }
+
+        T *buffered(unsafe_cast<T *>(&(LOG_BUFF[PROFILE_BUFF_SIZE])));
+        memcpy(buffered, &record, sizeof record);
+        PROFILE_BUFF_SIZE += sizeof record;
+        return buffered;
+    }
+
+
+    /// Initialise the common prefix of a record.
+    template <typename T>
+    static void initialise_record(T &record, cfg_profile_record_kind kind) {
+        memset(&record, 0, sizeof record);
+        record.record.kind = kind;
+        record.record.size = sizeof record;
+    }
+
+
+#   if CONFIG_ENV_KERNEL
+    /// Returns the id of a kernel module, buffering a module record if this
+    /// is the first time that the module is seen.
+    static uint32_t profile_module_id(const kernel_module *module) {
+        if(!module) {
+            return CFG_PROFILE_NO_MODULE;
+        }
+
+        for(unsigned i(0); i < NUM_PROFILE_MODULES; ++i) {
+            if(module == PROFILE_MODULES[i]) {
+                return i;
+            }
+        }
+
+        if(MAX_NUM_PROFILE_MODULES <= NUM_PROFILE_MODULES) {
+            return CFG_PROFILE_NO_MODULE;
+        }
+
+        cfg_profile_module record;
+        initialise_record(record, CFG_PROFILE_MODULE);
+        record.module_id = NUM_PROFILE_MODULES;
+        for(unsigned i(0); i < (CFG_PROFILE_MODULE_NAME_SIZE - 1); ++i) {
+            record.name[i] = module->name[i];
+            if(!record.name[i]) {
+                break;
+            }
+        }
+
+        if(!buffer_record(record)) {
+            return CFG_PROFILE_NO_MODULE;
+        }
+
+        PROFILE_MODULES[NUM_PROFILE_MODULES] = module;
+        return NUM_PROFILE_MODULES++;
+    }
+#   endif
+
+
+    /// Buffer the records that describe a basic block.
+    static void profile_bb(const basic_block_state *state) {
+        const basic_block bb(state->label.translation);
+        const app_pc native_pc_start(
+            bb.info->generating_pc.unmangled_address());
+
+        cfg_profile_block block;
+        initialise_record(block, CFG_PROFILE_BLOCK);
+        block.app_pc = reinterpret_cast<uint64_t>(native_pc_start);
+        block.cache_offset = static_cast<uint64_t>(
+            bb.cache_pc_start - GRANARY_EXEC_START);
+        block.allocator = reinterpret_cast<uint64_t>(bb.info->allocator);
+        block.num_bytes = bb.info->num_bytes;
+        block.num_bbs_in_trace = bb.info->num_bbs_in_trace;
+        block.module_id = CFG_PROFILE_NO_MODULE;
+
+#   if CFG_RECORD_EXEC_COUNT
+        block.num_executions = read_exec_counter(state->num_executions);
+#       if CFG_RECORD_FALL_THROUGH_COUNT
+        block.num_fall_through_executions = read_exec_counter(
+            state->num_fall_through_executions);
+#       endif
+#   endif
+
+#   if CONFIG_ENV_KERNEL
+        const kernel_module *module(kernel_get_module(native_pc_start));
+        block.module_id = profile_module_id(module);
+        if(module) {
+            block.module_offset = static_cast<uint32_t>(
+                native_pc_start - module->text_begin);
+        }
+#   endif
+
+        const unsigned num_edges(find_edges(bb));
+        cfg_profile_block *buffered(buffer_record(block));
+        if(!buffered) {
+            return;
+        }
+
+        for(unsigned i(0); i < num_edges; ++i) {
+            const cfg_edge &edge(EDGES[i]);
+            cfg_profile_edge record;
+            initialise_record(record, CFG_PROFILE_EDGE);
+            record.edge_kind = edge.kind;
+            record.condition = edge.condition;
+            record.cti_pc = reinterpret_cast<uint64_t>(edge.cti_pc);
+            record.target_pc = reinterpret_cast<uint64_t>(edge.target_pc);
+            record.fall_through_pc = reinterpret_cast<uint64_t>(
+                edge.fall_through_pc);
+
+            if(!buffer_record(record)) {
+                break;
+            }
+            ++(buffered->num_edges);
+        }
+    }
+
+
+    /// Open the profile, and write out its header.
+    static void begin_profile(void) {
+#   if !CONFIG_ENV_KERNEL
+        char path[granary::MAX_OUTPUT_FILE_PATH_LENGTH];
+        PROFILE_FD = granary::create_output_file(
+            path, "/tmp/granary-cfg.", O_WRONLY);
+        if(-1 == PROFILE_FD) {
+            granary::printf("[cfg] Unable to open the profile file %s.\n",
+                &(path[0]));
+        }
+#   endif
+
+        cfg_profile_header header;
+        memset(&header, 0, sizeof header);
+        header.magic = CFG_PROFILE_MAGIC;
+        header.version = CFG_PROFILE_VERSION;
+        header.header_size = sizeof header;
+        header.is_kernel = CONFIG_ENV_KERNEL;
+
+        const basic_block_state *bb(BASIC_BLOCKS.load());
+        for(; bb; bb = bb->next) {
+            ++header.num_blocks;
+        }
+
+        buffer_record(header);
+        flush_profile();
+    }
+
+
+    /// Close the profile.
+    static void end_profile(void) {
+#   if !CONFIG_ENV_KERNEL
+        if(-1 != PROFILE_FD) {
+            close(PROFILE_FD);
+            PROFILE_FD = -1;
+        }
+#   endif
+    }
+
+
+    /// Report on all instrumented basic blocks by emitting a binary profile.
+    void report(void) {
+        const basic_block_state *bb(BASIC_BLOCKS.load());
+
+        begin_profile();
+        for(; bb; bb = bb->next) {
+
+            IF_KERNEL( const eflags flags(granary_disable_interrupts()); )
+            cpu_state_handle cpu;
+            granary::enter(cpu);
+            profile_bb(bb);
+            IF_KERNEL( granary_store_flags(flags); )
+
+            // Log with interrupts enabled.
+            flush_profile();
+        }
+        end_profile();
+    }
+
+#else /* !CFG_BINARY_PROFILE */
+
+    /// Log out information about an individual basic block.
+    static int report_bb(const basic_block_state *state) {
+        const basic_block bb(state->label.translation);
+        const app_pc native_pc_start(
+            bb.info->generating_pc.unmangled_address());
+
+        IF_KERNEL( const kernel_module *module(
+            kernel_get_module(native_pc_start)); )
+
+        int i(0);
+        i += sprintf(&(LOG_BUFF[i]),
+            "BB(%x,%u,%p,%u,%p" IF_REPORT_COUNT(",%lu") IF_KERNEL(",%x,%s") ")\n",
+            bb.cache_pc_start - GRANARY_EXEC_START,
+            bb.info->num_bytes,
+            bb.info->allocator,
+            bb.info->num_bbs_in_trace,
+            native_pc_start
+            _IF_REPORT_COUNT(read_exec_counter(state->num_executions))
+            _IF_KERNEL(native_pc_start - module->text_begin)
+            _IF_KERNEL(module->name));
+
+        const unsigned num_edges(find_edges(bb));
+        for(unsigned j(0); j < num_edges; ++j) {
+            const cfg_edge &edge(EDGES[j]);
+            switch(edge.kind) {
+            case CFG_EDGE_INDIRECT_CALL:
+                i += sprintf(&(LOG_BUFF[i]), "CALL*(%p,%p)\n",
+                    edge.cti_pc, edge.target_pc);
+                break;
+            case CFG_EDGE_INDIRECT_JMP:
+                i += sprintf(&(LOG_BUFF[i]), "JMP*(%p,%p)\n",
+                    edge.cti_pc, edge.target_pc);
+                break;
+            case CFG_EDGE_CALL:
+                i += sprintf(&(LOG_BUFF[i]), "CALL(%p)\n", edge.target_pc);
+                break;
+            case CFG_EDGE_JMP:
+                i += sprintf(&(LOG_BUFF[i]), "JMP(%p)\n", edge.target_pc);
+                break;
+            case CFG_EDGE_JCC:
                 i += sprintf(&(LOG_BUFF[i]),
                     "Jcc(%s,%p,%p" IF_REPORT_JCC_COUNT(",%lu") ")\n",
-                    JCC_NAMES[in.op_code() - dynamorio::OP_jo],
-                    target.value.pc,
-                    decode_pc
-                    _IF_REPORT_JCC_COUNT(state->num_fall_through_executions));
+                    JCC_NAMES[edge.condition],
+                    edge.target_pc,
+                    edge.fall_through_pc
+                    _IF_REPORT_JCC_COUNT(read_exec_counter(
+                        state->num_fall_through_executions)));
+                break;
             }
         }
 
-        UNUSED(cti_num);
         LOG_BUFF[i] = '\0';
         return i;
     }
@@ -184,4 +467,6 @@ namespace client {
             log(&(LOG_BUFF[0]), report_len);
         }
     }
+
+#endif /* CFG_BINARY_PROFILE */
 }
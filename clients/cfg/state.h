@@ -16,11 +16,70 @@
 
 #include "clients/cfg/config.h"
 
-#if CFG_RECORD_INDIRECT_TARGETS
-#   include "granary/spin_lock.h"
+namespace client {
+
+
+#if CFG_RECORD_EXEC_COUNT && CFG_SHARD_EXEC_COUNTS
+    enum {
+        /// Number of shards of each execution counter. This must be a power
+        /// of two.
+        NUM_CFG_COUNTER_SHARDS          = 8,
+        CFG_COUNTER_SHARD_BITS          = 3,
+
+        /// Stack pointers are shifted right by this much before being hashed
+        /// into a shard number, so that a thread usually increments the same
+        /// shard regardless of its stack depth.
+        CFG_SHARD_STACK_SHIFT           = 14,
+
+        /// Size (log2, in bytes) of a single shard of a chunk of counters.
+        CFG_COUNTER_SHARD_SIZE_SHIFT    = 12,
+
+        NUM_CFG_COUNTERS_PER_SHARD      =
+            (1 << CFG_COUNTER_SHARD_SIZE_SHIFT) / sizeof(uint64_t)
+    };
+
+
+    static_assert(NUM_CFG_COUNTER_SHARDS == (1 << CFG_COUNTER_SHARD_BITS),
+        "The number of counter shards must be a power of two.");
+
+
+    /// A chunk of sharded execution counters. Shard `s` of the counter whose
+    /// first shard is at `&(shards[0][i])` is at `&(shards[s][i])`.
+    struct cfg_counter_chunk {
+        uint64_t shards[NUM_CFG_COUNTER_SHARDS][NUM_CFG_COUNTERS_PER_SHARD];
+    };
+
+
+    /// An execution counter is the address of its first shard.
+    typedef uint64_t *exec_counter;
+
+
+    /// Returns the sum of the shards of an execution counter.
+    inline uint64_t read_exec_counter(const exec_counter counter) {
+        uint64_t count(0);
+        if(!counter) {
+            return count;
+        }
+        for(unsigned i(0); i < NUM_CFG_COUNTER_SHARDS; ++i) {
+            count += counter[i * NUM_CFG_COUNTERS_PER_SHARD];
+        }
+        return count;
+    }
+#elif CFG_RECORD_EXEC_COUNT
+    typedef uint64_t exec_counter;
+
+
+    inline uint64_t read_exec_counter(const exec_counter counter) {
+        return counter;
+    }
 #endif
 
-namespace client {
+
+#if CFG_RECORD_INDIRECT_TARGETS
+    enum {
+        /// Maximum number of distinct targets recorded for each indirect CTI.
+        NUM_INDIRECT_TARGET_SLOTS = 16
+    };
 
 
     /// Data recorded about each indirect CTI.
@@ -31,16 +90,20 @@ namespace client {
 
         char padding[CONFIG_ARCH_CACHE_LINE_SIZE - sizeof(granary::app_pc)];
 
-        /// The full set of indirect targets for this
-        granary::app_pc *indirect_targets;
+        /// Open-addressed set of the indirect targets of this CTI. Empty slots
+        /// are null, and a slot never changes once it's filled.
+        std::atomic<granary::app_pc> indirect_targets[
+            NUM_INDIRECT_TARGET_SLOTS];
 
-        /// The number of indirect targets.
-        unsigned num_indirect_targets;
+        /// Number of times that a new target was found when every slot was
+        /// already filled.
+        std::atomic<uint64_t> num_dropped_targets;
 
-        /// Lock for modifying the number of indirect targets.
-        granary::atomic_spin_lock update_lock;
+        /// Whether or not the instrumentation for this CTI has been added.
+        bool is_instrumented;
 
     } __attribute__((aligned (CONFIG_ARCH_CACHE_LINE_SIZE)));
+#endif
 
 
     /// State that is automatically maintained for each instrumented basic
@@ -58,12 +121,12 @@ namespace client {
 
 #if CFG_RECORD_EXEC_COUNT
         /// Number of times this basic block was executed.
-        uint64_t num_executions;
+        exec_counter num_executions;
 
 #   if CFG_RECORD_FALL_THROUGH_COUNT
         /// Number of times the fall-through of this basic block was
         /// executed.
-        uint64_t num_fall_through_executions;
+        exec_counter num_fall_through_executions;
 #   endif
 #endif
 
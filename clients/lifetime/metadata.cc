@@ -14,9 +14,9 @@ namespace client {
 object_metadata DESCRIPTORS[wp::MAX_NUM_WATCHPOINTS];
 
 // Boolean flag that tells us if we should even try to allocate descriptors for
-// objects. We can run out of descriptors pretty quickly.
-//
-// TODO(akshay): Recycle descriptors by modifying `object_metadata::free`.
+// objects. We can run out of descriptors pretty quickly. The watchpoints
+// framework recycles the indexes of freed descriptors, so we try again after a
+// descriptor is freed.
 static std::atomic<bool> try_allocate(ATOMIC_VAR_INIT(true));
 
 // Hash table mapping allocator return addresses to data structure descriptors.
@@ -163,9 +163,11 @@ bool object_metadata::allocate_and_init(
   return false;
 }
 
-// Free the descriptor.
+// Free the descriptor. The descriptor's index is recycled by the watchpoints
+// framework after a grace period, and until then the descriptor is left as-is
+// so that stale pointers to the object still resolve to it.
 void object_metadata::free(object_metadata *, uintptr_t) {
-  // TODO(akshay): Implement me in the future.
+  try_allocate.store(true, std::memory_order_release);
 }
 
 // Get the descriptor of a watchpoint based on its index.
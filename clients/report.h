@@ -31,4 +31,24 @@ namespace client {
 }
 #endif
 
+
+/// How to export a binary log:
+///     1)  Define the `CLIENT_exported_log` macro in here on a per-client
+///         basis.
+///     2)  Define the `const void *exported_log(unsigned long *size) `
+///         function within the `client` namespace within your client code.
+///         It returns the address of the log, and stores the size of the log
+///         into `size`. In kernel space, the log is readable and mappable
+///         through the `granary_log` file in debugfs.
+
+#if defined(CLIENT_RCUDBG)
+#   define CLIENT_exported_log
+#endif
+
+#ifdef CLIENT_exported_log
+namespace client {
+    const void *exported_log(unsigned long *size) ;
+}
+#endif
+
 #endif /* CLIENT_REPORT_H_ */
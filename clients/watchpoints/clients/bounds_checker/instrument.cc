@@ -79,53 +79,23 @@ namespace client { namespace wp {
     bound_descriptor DESCRIPTORS[MAX_NUM_WATCHPOINTS];
 
 
-    inline static uintptr_t index_of(const bound_descriptor *desc) {
-        return desc - &(DESCRIPTORS[0]);
-    }
-
-
     /// Allocate a watchpoint descriptor and assign `desc` and `index`
     /// appropriately.
+    ///
+    /// Note: Counter indexes are recycled by the generic watchpoints
+    ///       framework, which caches them per-CPU.
     bool bound_descriptor::allocate(
         bound_descriptor *&desc,
         uintptr_t &counter_index,
         const uintptr_t inherited_index
     ) {
-        counter_index = 0;
         desc = nullptr;
-
-        IF_KERNEL( eflags flags(granary_disable_interrupts()); )
-        cpu_state_handle state;
-        bound_descriptor *&free_list(state->free_list);
-        if(free_list) {
-            desc = free_list;
-            free_list = free_list->next_free_descriptor;
-        }
-        IF_KERNEL( granary_store_flags(flags); )
-
-        // We got a descriptor from the CPU-private free list.
-        //
-        // TODO: Make the free-list support the idea of inherited index, even
-        //       though the assembly does not yet support this indexing method.
-        counter_index = 0;
-        if(desc) {
-            uintptr_t inherited_index_;
-            destructure_combined_index(
-                index_of(desc), counter_index, inherited_index_);
-
-        // No descriptors in the free list, try to allocate one from our global
-        // pool of descriptors.
-        } else {
-            counter_index = next_counter_index(inherited_index);
-            if(counter_index > MAX_NUM_WATCHPOINTS) {
-                return false;
-            }
-            desc = &(DESCRIPTORS[counter_index]);
+        counter_index = next_counter_index(inherited_index);
+        if(counter_index > MAX_COUNTER_INDEX) {
+            return false;
         }
 
-        ASSERT(counter_index <= MAX_COUNTER_INDEX);
-        ASSERT(counter_index <= MAX_NUM_WATCHPOINTS);
-
+        desc = &(DESCRIPTORS[counter_index]);
         return true;
     }
 
@@ -172,24 +142,87 @@ namespace client { namespace wp {
     }
 
 
-    /// Free a watchpoint descriptor by adding it to a free list.
+    /// Free a watchpoint descriptor.
+    ///
+    /// Note: The descriptor is left intact so that stale watched pointers
+    ///       continue to resolve to it until its counter index is re-used.
     void bound_descriptor::free(
         bound_descriptor *desc,
         uintptr_t IF_TEST( index )
     ) {
-
         ASSERT(is_valid_address(desc));
-        ASSERT(index == index_of(desc));
-
-        IF_KERNEL( eflags flags(granary_disable_interrupts()); )
-        cpu_state_handle state;
-        bound_descriptor *&free_list(state->free_list);
-        desc->next_free_descriptor = free_list;
-        free_list = desc;
-        IF_KERNEL( granary_store_flags(flags); )
+        ASSERT(index < MAX_NUM_WATCHPOINTS);
+        ASSERT(desc == &(DESCRIPTORS[index]));
+        UNUSED(desc);
     }
 
 
+#if WP_INLINE_FAST_PATHS
+    /// Add an inline bounds check of the watched address in `addr` after
+    /// `in`. The common case (an in-bounds access) falls through the check
+    /// without leaving the basic block; only an out-of-bounds access invokes
+    /// the out-of-line `checker`, which re-checks the access and reports it.
+    ///
+    /// The inline check is:
+    ///         MOV     $DESCRIPTORS, table
+    ///         MOV     addr, desc
+    ///         SHR     $49, desc                   ; counter index
+    ///         SHL     $4, desc                    ; * sizeof(bound_descriptor)
+    ///         CMP     (table, desc), addr_32      ; lower bound
+    ///         JB      slow
+    ///         MOV     4(table, desc), desc_32     ; upper bound
+    ///         SUB     $size, desc_32
+    ///         CMP     desc_32, addr_32
+    ///         JBE     done
+    ///     slow:
+    ///         CALL    checker
+    ///     done:
+    static void insert_inline_bounds_check(
+        instruction_list &ls,
+        instruction in,
+        operand addr,
+        dynamorio::reg_id_t table_reg,
+        dynamorio::reg_id_t desc_reg,
+        unsigned size,
+        app_pc checker
+    ) {
+        const operand table(table_reg);
+        const operand desc(desc_reg);
+        const operand desc_32(register_manager::scale(desc_reg, REG_32));
+        const operand addr_32(register_manager::scale(addr.value.reg, REG_32));
+
+        operand lower_bound(table + desc);
+        operand upper_bound((table + desc) + 4);
+        lower_bound.size = dynamorio::OPSZ_4;
+        upper_bound.size = dynamorio::OPSZ_4;
+
+        instruction slow(label_());
+        instruction done(label_());
+
+        in = ls.insert_after(in, mov_imm_(table,
+            int64_(reinterpret_cast<uint64_t>(&(DESCRIPTORS[0])))));
+        in = ls.insert_after(in, mov_ld_(desc, addr));
+        in = ls.insert_after(in, shr_(desc,
+            int8_(DISTINGUISHING_BIT_OFFSET + 1)));
+        in = ls.insert_after(in, shl_(desc, int8_(4)));
+        in = ls.insert_after(in, cmp_(addr_32, lower_bound));
+        in = ls.insert_after(in, mangled(jb_(instr_(slow))));
+        in = ls.insert_after(in, mov_ld_(desc_32, upper_bound));
+        in = ls.insert_after(in, sub_(desc_32, int32_(size)));
+        in = ls.insert_after(in, cmp_(addr_32, desc_32));
+        in = ls.insert_after(in, mangled(jbe_(instr_(done))));
+        in = ls.insert_after(in, slow);
+
+        instruction call(insert_cti_after(ls, in, checker,
+            CTI_DONT_STEAL_REGISTER, operand(),
+            CTI_CALL));
+        call.set_mangled();
+
+        ls.insert_after(call, done);
+    }
+#endif /* WP_INLINE_FAST_PATHS */
+
+
     void bound_policy::visit_read(
         granary::basic_block_state &,
         instruction_list &ls,
@@ -202,8 +235,22 @@ namespace client { namespace wp {
         ASSERT(reg_index < 15);
         ASSERT(size_index < 5);
 
+        const app_pc checker(
+            unsafe_cast<app_pc>(BOUNDS_CHECKERS[reg_index][size_index]));
+
+#if WP_INLINE_FAST_PATHS
+        dynamorio::reg_id_t scratch_regs[2];
+        if(tracker.get_inline_scratch_regs(scratch_regs, 2)) {
+            insert_inline_bounds_check(
+                ls, tracker.labels[i], tracker.regs[i],
+                scratch_regs[0], scratch_regs[1],
+                tracker.sizes[i], checker);
+            return;
+        }
+#endif /* WP_INLINE_FAST_PATHS */
+
         instruction call(insert_cti_after(ls, tracker.labels[i],
-                unsafe_cast<app_pc>(BOUNDS_CHECKERS[reg_index][size_index]),
+            checker,
             CTI_DONT_STEAL_REGISTER, operand(),
             CTI_CALL));
         call.set_mangled();
@@ -182,6 +182,7 @@ namespace client {
 
         // Stage a patched JMP to the upgraded basic block.
         app_pc upgraded_bb_pc(nullptr);
+        code_cache::refresh_cpu_cache(cpu);
         if(!cpu->code_cache.load(am.as_address, upgraded_bb_pc)) {
             upgraded_bb_pc = code_cache::find(cpu, am);
         }
@@ -209,6 +210,7 @@ namespace client {
             app_pc faulting_pc(isf.instruction_pointer);
             app_pc target_addr(nullptr);
 
+            code_cache::refresh_cpu_cache(cpu);
             if(!cpu->code_cache.load(faulting_pc, target_addr)) {
                 target_addr = code_cache::lookup(faulting_pc);
             }
@@ -252,6 +254,7 @@ namespace client {
 
         mangled_address target(isf.instruction_pointer, policy);
         app_pc translated_target(nullptr);
+        code_cache::refresh_cpu_cache(cpu);
         if(!cpu->code_cache.load(target.as_address, translated_target)) {
             translated_target = code_cache::find(cpu, target);
         }
@@ -88,38 +88,22 @@ namespace client { namespace wp {
     bool leak_detector_descriptor::allocate(
         leak_detector_descriptor *&desc,
         uintptr_t &counter_index,
-        const uintptr_t
+        const uintptr_t inherited_index
     ) {
-        counter_index = 0;
         desc = nullptr;
 
-
-        // Try to pull a descriptor off of a CPU-private free list.
-        IF_KERNEL( eflags flags(granary_disable_interrupts()); )
-        cpu_state_handle state;
-        leak_detector_descriptor *&free_list(state->free_list);
-        desc = free_list;
-        if(desc) {
-            free_list = desc->next_free;
+        // Counter indexes are recycled (after a grace period) by the generic
+        // watchpoints framework. A recycled index still maps to the freed
+        // descriptor that was last assigned to it, so re-use that.
+        counter_index = client::wp::next_counter_index();
+        if(counter_index > client::wp::MAX_COUNTER_INDEX) {
+            return false;
         }
-        IF_KERNEL( granary_store_flags(flags); )
-
-        counter_index = 0;
-
-        // We got a descriptor from the free list.
-        if(desc) {
-            uintptr_t inherited_index_;
 
-            client::wp::destructure_combined_index(
-                desc->index, counter_index, inherited_index_);
-
-        // Try to allocate one.
-        } else {
-            counter_index = client::wp::next_counter_index();
-            if(counter_index > client::wp::MAX_COUNTER_INDEX) {
-                return false;
-            }
+        desc = DESCRIPTORS[
+            client::wp::combined_index(counter_index, inherited_index)];
 
+        if(!desc) {
             desc = DESCRIPTOR_ALLOCATOR->allocate<leak_detector_descriptor>();
         }
 
@@ -179,7 +163,8 @@ namespace client { namespace wp {
     }
 
 
-    /// Free a watchpoint descriptor by adding it to a CPU-private free list.
+    /// Free a watchpoint descriptor. The descriptor stays in the descriptor
+    /// table until its counter index is re-used.
     void leak_detector_descriptor::free(
         leak_detector_descriptor *desc,
         uintptr_t index
@@ -211,13 +196,5 @@ namespace client { namespace wp {
 
         //desc->state.was_freed = true;
         //desc->state.is_active = false;
-
-        // Add the descriptor to the free list.
-        IF_KERNEL( eflags flags(granary_disable_interrupts()); )
-        cpu_state_handle state;
-        leak_detector_descriptor *&free_list(state->free_list);
-        desc->next_free = free_list;
-        free_list = desc;
-        IF_KERNEL( granary_store_flags(flags); )
     }
 }}
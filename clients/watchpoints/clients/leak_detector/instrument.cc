@@ -70,6 +70,47 @@ namespace client {
         };
 
 
+#if WP_INLINE_FAST_PATHS && !WP_USE_INHERITED_INDEX
+        /// Pointers to the descriptors (defined in `descriptor.cc`).
+        struct leak_detector_descriptor;
+        extern leak_detector_descriptor *DESCRIPTORS[MAX_NUM_WATCHPOINTS];
+
+
+        /// Add an inline version of `granary_access_descriptor_*` after `in`,
+        /// which marks the descriptor of the watched address in `addr` as
+        /// having been accessed:
+        ///         MOV     $DESCRIPTORS, table
+        ///         MOV     addr, desc
+        ///         SHR     $49, desc               ; counter index
+        ///         MOV     (table, desc, 8), desc  ; descriptor pointer
+        ///         MOVB    $1, (desc)
+        static void insert_inline_access_descriptor(
+            granary::instruction_list &ls,
+            granary::instruction in,
+            granary::operand addr,
+            dynamorio::reg_id_t table_reg,
+            dynamorio::reg_id_t desc_reg
+        ) {
+            using namespace granary;
+
+            const operand table(table_reg);
+            const operand desc(desc_reg);
+
+            operand desc_ptr((table + desc) * 8);
+            operand accessed(*desc);
+            desc_ptr.size = dynamorio::OPSZ_8;
+            accessed.size = dynamorio::OPSZ_1;
+
+            in = ls.insert_after(in, mov_imm_(table,
+                int64_(reinterpret_cast<uint64_t>(&(DESCRIPTORS[0])))));
+            in = ls.insert_after(in, mov_ld_(desc, addr));
+            in = ls.insert_after(in, shr_(desc, int8_(WP_COUNTER_INDEX_RSH)));
+            in = ls.insert_after(in, mov_ld_(desc, desc_ptr));
+            ls.insert_after(in, mov_st_(accessed, int8_(1)));
+        }
+#endif /* WP_INLINE_FAST_PATHS && !WP_USE_INHERITED_INDEX */
+
+
         /// Add instrumentation on every read and write that marks the
         /// watchpoint descriptor as having been accessed.
         void leak_policy::visit_read(
@@ -80,6 +121,17 @@ namespace client {
         ) {
 #if 1
             using namespace granary;
+
+#   if WP_INLINE_FAST_PATHS && !WP_USE_INHERITED_INDEX
+            dynamorio::reg_id_t scratch_regs[2];
+            if(tracker.get_inline_scratch_regs(scratch_regs, 2)) {
+                insert_inline_access_descriptor(
+                    ls, tracker.labels[i], tracker.regs[i],
+                    scratch_regs[0], scratch_regs[1]);
+                return;
+            }
+#   endif /* WP_INLINE_FAST_PATHS && !WP_USE_INHERITED_INDEX */
+
             const unsigned reg_index(REG_TO_INDEX[tracker.regs[i].value.reg]);
             instruction call(insert_cti_after(ls, tracker.labels[i],
                 unsafe_cast<app_pc>(DESCRIPTOR_ACCESSORS[reg_index]),
@@ -120,7 +172,7 @@ namespace client {
 
         extern void leak_notify_thread_enter_module(void) ;
         extern void leak_notify_thread_exit_module(void) ;
-        extern void leak_policy_scan_callback(void) ;
+        extern bool leak_policy_scan_callback(void) ;
         extern void leak_policy_update_rootset(void) ;
     }
 
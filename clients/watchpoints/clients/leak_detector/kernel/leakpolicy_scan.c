@@ -32,6 +32,10 @@ typedef unsigned char* app_pc;
 
 typedef void (scanner_callback)(void);
 
+/* Returns true if the scan callback should be invoked again soon, e.g. to run
+ * the next slice of an incremental mark. */
+typedef bool (scan_slice_callback)(void);
+
 
 /* indices for address_markers; keep sync'd w/ address_markers below */
 enum address_markers_idx {
@@ -88,7 +92,7 @@ typedef struct {
 } kernel_symbol_t;
 
 
-scanner_callback *scan_thread_callback = NULL;
+scan_slice_callback *scan_thread_callback = NULL;
 scanner_callback *update_rootset_callback = NULL;
 
 static int (*module_walk_page_range)(unsigned long, unsigned long, struct mm_walk*) = NULL;
@@ -123,23 +127,22 @@ stop_machine_callback(void *arg){
 int
 leakpolicy_scan_thread(void *arg){
 
-    unsigned long flags;
+    bool scan_again = false;
 
     while(!kthread_should_stop()){
 
-        stop_machine(stop_machine_callback, NULL, NULL);
+        if(!scan_again)
+            stop_machine(stop_machine_callback, NULL, NULL);
 
-        preempt_disable();
-        raw_local_irq_save(flags);
         D(printk("inside scanning thread\n");)
 
+        /* the scan callback stops the machine itself, once per mark slice */
+        scan_again = false;
         if(scan_thread_callback)
-            scan_thread_callback();
+            scan_again = scan_thread_callback();
 
-        raw_local_irq_restore(flags);
-        preempt_enable();
         set_current_state(TASK_INTERRUPTIBLE);
-        schedule_timeout(100*HZ);
+        schedule_timeout(scan_again ? 1 : 100*HZ);
     }
 
     set_current_state(TASK_RUNNING);
@@ -181,10 +184,21 @@ find_kernel_symbol_address(const char *name)
     }
 }
 
+/* Run `func` on every online CPU at once, with the machine stopped. */
+int
+kernel_run_on_each_cpu(int (*func)(void *), void *data){
+    return stop_machine(func, data, cpu_online_mask);
+}
+
+unsigned
+kernel_num_online_cpus(void){
+    return num_online_cpus();
+}
+
 void
 leak_policy_scanner_init(const app_pc thread_callback, const app_pc rootset_callback){
 
-    scan_thread_callback = (scanner_callback*)thread_callback;
+    scan_thread_callback = (scan_slice_callback*)thread_callback;
     update_rootset_callback = (scanner_callback*)rootset_callback;
 
     D(printk("inside function leak_policy_scanner_init\n");)
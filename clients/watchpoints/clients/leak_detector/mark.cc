@@ -0,0 +1,302 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * mark.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/perf.h"
+#include "granary/spin_lock.h"
+
+#include "clients/watchpoints/clients/leak_detector/descriptor.h"
+#include "clients/watchpoints/clients/leak_detector/mark.h"
+
+using namespace granary;
+
+namespace client { namespace wp {
+
+
+    /// A worker's queue of the descriptor indexes of marked objects that still
+    /// need to be scanned. The owning worker pushes and pops at the bottom of
+    /// the queue, and other workers steal from the top.
+    struct mark_queue {
+
+        /// Only contended when another worker is stealing, or when CPUs share
+        /// a queue.
+        atomic_spin_lock lock;
+
+        /// The queued indexes are in `[top, bottom)`, modulo the queue size.
+        uint64_t top;
+        uint64_t bottom;
+
+        uint32_t indexes[MARK_QUEUE_SIZE];
+
+    } __attribute__((aligned (CONFIG_ARCH_CACHE_LINE_SIZE)));
+
+
+    static_assert(MAX_NUM_WATCHPOINTS <= 0x100000000ULL,
+        "Descriptor indexes must fit in 32 bits.");
+
+
+    /// Per-worker queues of objects to scan.
+    static mark_queue MARK_QUEUES[MAX_NUM_MARK_WORKERS];
+
+
+    /// Objects that have been marked as reachable in the current mark phase.
+    static uint64_t MARKED[NUM_MARK_BITMAP_WORDS];
+
+
+    /// Marked objects that did not fit into their worker's queue, and so still
+    /// need to be scanned. The count is incremented before a bit is set, and
+    /// decremented after a bit is cleared, so that it never under-counts.
+    static uint64_t OVERFLOWED[NUM_MARK_BITMAP_WORDS];
+    static std::atomic<unsigned> NUM_OVERFLOWED(ATOMIC_VAR_INIT(0U));
+
+
+    /// Number of workers in the current slice that might still produce work.
+    static std::atomic<unsigned> NUM_ACTIVE_WORKERS(ATOMIC_VAR_INIT(0U));
+
+
+    /// Returns true if the queue has no work in it. This is racy unless the
+    /// queue's lock is held.
+    static bool queue_is_empty(const mark_queue &queue) {
+        return __atomic_load_n(&(queue.top), __ATOMIC_ACQUIRE)
+            == __atomic_load_n(&(queue.bottom), __ATOMIC_ACQUIRE);
+    }
+
+
+    /// Push an index onto the bottom of a queue. Returns false if the queue
+    /// is full.
+    static bool push_bottom(mark_queue &queue, uintptr_t index) {
+        bool pushed(false);
+        queue.lock.acquire();
+        if(MARK_QUEUE_SIZE > (queue.bottom - queue.top)) {
+            queue.indexes[queue.bottom % MARK_QUEUE_SIZE] =
+                static_cast<uint32_t>(index);
+            ++queue.bottom;
+            pushed = true;
+        }
+        queue.lock.release();
+        return pushed;
+    }
+
+
+    /// Pop the most recently pushed index off of the bottom of a queue.
+    static bool pop_bottom(mark_queue &queue, uintptr_t &index) {
+        bool popped(false);
+        queue.lock.acquire();
+        if(queue.top != queue.bottom) {
+            --queue.bottom;
+            index = queue.indexes[queue.bottom % MARK_QUEUE_SIZE];
+            popped = true;
+        }
+        queue.lock.release();
+        return popped;
+    }
+
+
+    /// Steal the least recently pushed index from the top of a queue.
+    static bool steal_top(mark_queue &queue, uintptr_t &index) {
+        if(queue_is_empty(queue)) {
+            return false;
+        }
+
+        bool stolen(false);
+        queue.lock.acquire();
+        if(queue.top != queue.bottom) {
+            index = queue.indexes[queue.top % MARK_QUEUE_SIZE];
+            ++queue.top;
+            stolen = true;
+        }
+        queue.lock.release();
+        return stolen;
+    }
+
+
+    /// Steal work from some other worker's queue.
+    static bool steal_work(unsigned worker, uintptr_t &index) {
+        for(unsigned i(1); i < MAX_NUM_MARK_WORKERS; ++i) {
+            if(steal_top(MARK_QUEUES[(worker + i) % MAX_NUM_MARK_WORKERS],
+                         index)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    /// Record that the object whose descriptor index is `index` is marked but
+    /// not yet scanned.
+    static void overflow(uintptr_t index) {
+        NUM_OVERFLOWED.fetch_add(1);
+        __sync_fetch_and_or(&(OVERFLOWED[index / 64]), 1ULL << (index % 64));
+    }
+
+
+    /// Move overflowed indexes into `queue`. Returns true if any indexes were
+    /// moved.
+    static bool take_overflowed(mark_queue &queue) {
+        if(!NUM_OVERFLOWED.load()) {
+            return false;
+        }
+
+        bool took(false);
+        for(uintptr_t i(0); i < NUM_MARK_BITMAP_WORDS; ++i) {
+            if(!__atomic_load_n(&(OVERFLOWED[i]), __ATOMIC_RELAXED)) {
+                continue;
+            }
+
+            uint64_t bits(__sync_fetch_and_and(&(OVERFLOWED[i]), 0ULL));
+            for(; bits; bits &= bits - 1) {
+                const uintptr_t index((i * 64) + __builtin_ctzll(bits));
+                NUM_OVERFLOWED.fetch_sub(1);
+                if(!push_bottom(queue, index)) {
+                    overflow(index);
+                } else {
+                    took = true;
+                }
+            }
+
+            if(took) {
+                break;
+            }
+        }
+        return took;
+    }
+
+
+    /// Returns true if some worker might have work to do.
+    static bool work_is_visible(void) {
+        if(NUM_OVERFLOWED.load()) {
+            return true;
+        }
+        for(unsigned i(0); i < MAX_NUM_MARK_WORKERS; ++i) {
+            if(!queue_is_empty(MARK_QUEUES[i])) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    /// Scan the memory of the object whose descriptor index is `index` for
+    /// watched pointers, and mark the objects that they point to.
+    static void scan_object(unsigned worker, uintptr_t index) {
+        const leak_detector_descriptor *desc(
+            leak_detector_descriptor::access(index));
+
+        if(!is_valid_address(desc)) {
+            return;
+        }
+
+        uintptr_t addr(desc->base_address
+            | leak_detector_descriptor::BASE_ADDRESS_MASK);
+        const uintptr_t limit(addr + desc->size);
+
+        for(; (addr + sizeof(uintptr_t)) <= limit; addr += sizeof(uintptr_t)) {
+            const uintptr_t val(*unsafe_cast<uintptr_t *>(addr));
+            if(is_watched_address(val)) {
+                mark_object(worker, combined_index_of(val));
+            }
+        }
+    }
+
+
+    /// Start a new mark phase.
+    void begin_mark(void) {
+        memset(&(MARKED[0]), 0, sizeof MARKED);
+        memset(&(OVERFLOWED[0]), 0, sizeof OVERFLOWED);
+        NUM_OVERFLOWED.store(0);
+
+        for(unsigned i(0); i < MAX_NUM_MARK_WORKERS; ++i) {
+            MARK_QUEUES[i].top = 0;
+            MARK_QUEUES[i].bottom = 0;
+        }
+    }
+
+
+    /// Start a new mark slice.
+    void begin_mark_slice(unsigned num_workers) {
+        NUM_ACTIVE_WORKERS.store(num_workers);
+    }
+
+
+    /// Mark an object as reachable and queue it to be scanned.
+    bool mark_object(unsigned worker, uintptr_t index) {
+        if(MAX_NUM_WATCHPOINTS <= index) {
+            return false;
+        }
+
+        const uint64_t bit(1ULL << (index % 64));
+        if(__sync_fetch_and_or(&(MARKED[index / 64]), bit) & bit) {
+            return false;
+        }
+
+        if(!push_bottom(MARK_QUEUES[worker % MAX_NUM_MARK_WORKERS], index)) {
+            overflow(index);
+        }
+        return true;
+    }
+
+
+    /// Scan queued objects, stealing work from other workers as necessary.
+    ///
+    /// Note: A worker only decrements the number of active workers once it
+    ///       has no work left, and only active workers produce work, so once
+    ///       there are no active workers then every queue is empty.
+    void drain_mark_queues(unsigned worker, uint64_t deadline) {
+        mark_queue &queue(MARK_QUEUES[worker % MAX_NUM_MARK_WORKERS]);
+        uintptr_t index(0);
+
+        for(;;) {
+            if(pop_bottom(queue, index) || steal_work(worker, index)) {
+                scan_object(worker, index);
+                if(deadline && perf::timestamp() >= deadline) {
+                    return;
+                }
+                continue;
+            }
+
+            if(take_overflowed(queue)) {
+                continue;
+            }
+
+            // Out of work; wait until either some other worker produces work,
+            // or until every worker is out of work.
+            NUM_ACTIVE_WORKERS.fetch_sub(1);
+            for(;;) {
+                if(!NUM_ACTIVE_WORKERS.load()) {
+                    return;
+                }
+
+                if(deadline && perf::timestamp() >= deadline) {
+                    return;
+                }
+
+                if(work_is_visible()) {
+                    NUM_ACTIVE_WORKERS.fetch_add(1);
+                    break;
+                }
+
+                ASM("pause;");
+            }
+        }
+    }
+
+
+    /// Returns true if no objects are waiting to be scanned.
+    bool mark_is_complete(void) {
+        return !work_is_visible();
+    }
+
+
+    /// Returns true if an object has been marked as reachable.
+    bool is_marked(uintptr_t index) {
+        if(MAX_NUM_WATCHPOINTS <= index) {
+            return false;
+        }
+        return 0 != (MARKED[index / 64] & (1ULL << (index % 64)));
+    }
+
+}}
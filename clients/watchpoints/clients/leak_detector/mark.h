@@ -0,0 +1,76 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * mark.h
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#ifndef LEAK_DETECTOR_MARK_H_
+#define LEAK_DETECTOR_MARK_H_
+
+#include "clients/watchpoints/instrument.h"
+
+
+/// Run each mark phase as a series of time-bounded slices, letting the kernel
+/// run in between slices, instead of stopping the world until the whole object
+/// graph is marked.
+#define LEAK_INCREMENTAL_MARK 1
+
+
+namespace client { namespace wp {
+
+    enum : uint64_t {
+        /// Maximum number of workers that concurrently mark objects. If there
+        /// are more CPUs than this then some CPUs share work queues.
+        MAX_NUM_MARK_WORKERS    = 64,
+
+        /// Number of descriptor indexes that fit in a worker's work queue.
+        /// Indexes that don't fit are added to a global overflow bitmap.
+        MARK_QUEUE_SIZE         = 1024,
+
+        /// Time budget (in cycles) of a single mark slice. Zero means that
+        /// a slice runs until the mark phase is complete.
+#if LEAK_INCREMENTAL_MARK
+        MARK_SLICE_CYCLES       = 2000000ULL,
+#else
+        MARK_SLICE_CYCLES       = 0ULL,
+#endif
+
+        /// Number of 64-bit words in the mark bitmaps.
+        NUM_MARK_BITMAP_WORDS   = (MAX_NUM_WATCHPOINTS + 63) / 64
+    };
+
+
+    /// Start a new mark phase. All objects become unmarked.
+    void begin_mark(void) ;
+
+
+    /// Start a new mark slice, in which `num_workers` workers participate.
+    void begin_mark_slice(unsigned num_workers) ;
+
+
+    /// Mark the object whose descriptor index is `index` as reachable, and
+    /// queue it to be scanned by `worker`. Returns true if the object was not
+    /// already marked.
+    bool mark_object(unsigned worker, uintptr_t index) ;
+
+
+    /// Scan queued objects on behalf of `worker`, stealing work from other
+    /// workers when `worker` runs out. Returns when either no work is left
+    /// in any worker's queue or when the time stamp counter passes
+    /// `deadline`. A zero `deadline` means no deadline.
+    void drain_mark_queues(unsigned worker, uint64_t deadline) ;
+
+
+    /// Returns true if no objects are waiting to be scanned.
+    bool mark_is_complete(void) ;
+
+
+    /// Returns true if the object whose descriptor index is `index` has been
+    /// marked as reachable in the current mark phase.
+    bool is_marked(uintptr_t index) ;
+
+}}
+
+#endif /* LEAK_DETECTOR_MARK_H_ */
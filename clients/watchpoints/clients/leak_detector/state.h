@@ -25,13 +25,6 @@ namespace client {
     }
 
 
-#   define CLIENT_cpu_state
-    struct cpu_state {
-
-        /// List of free bounds checking objects for this CPU.
-        client::wp::leak_detector_descriptor *free_list;
-    };
-
 #   define CLIENT_thread_state
     /// Extensions to Granary's internal thread-local storage.
     struct thread_state {
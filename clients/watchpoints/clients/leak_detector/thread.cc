@@ -6,11 +6,12 @@
  *      Author: Peter Goodman, akshayk
  */
 
-#include "granary/list.h"
+#include "granary/perf.h"
 #include "granary/types.h"
 #include "granary/hash_table.h"
 #include "clients/watchpoints/clients/leak_detector/descriptor.h"
 #include "clients/watchpoints/clients/leak_detector/instrument.h"
+#include "clients/watchpoints/clients/leak_detector/mark.h"
 
 using namespace granary;
 
@@ -18,6 +19,9 @@ extern "C" {
     struct types::task_struct *kernel_get_current(void);
     struct types::thread_info *kernel_current_thread_info(void);
     void kernel_pagetable_walk(void *addr);
+    int kernel_run_on_each_cpu(int (*func)(void *), void *data);
+    unsigned kernel_num_online_cpus(void);
+    int kernel_get_cpu_id(void);
 }
 
 #define GFP_ATOMIC 0x20U
@@ -35,18 +39,10 @@ namespace client { namespace wp {
     };
 
     static static_data<locked_hash_table<app_pc, app_pc>> object_scan_list;
-    static static_data<hash_set<uintptr_t>> watchpoint_collect_list;
-    static static_data<locked_hash_table<struct thread_info*, leak_detector_thread_info*>> thread_scan_list;
-
-    static static_data<list<uintptr_t>> watchpoint_list;
-    typedef list_item_handle<uintptr_t> handle_type;
 
 
     STATIC_INITIALISE_ID(leak_detector, {
         object_scan_list.construct();
-        thread_scan_list.construct();
-        watchpoint_list.construct();
-        watchpoint_collect_list.construct();
     })
 
 #if 0
@@ -94,13 +90,6 @@ namespace client { namespace wp {
         return false;
     }
 
-    void handle_watched_address(uintptr_t addr){
-        watchpoint_list->append(addr);
-    }
-
-
-
-
 
     /// Notify the leak detector that this thread's execution has entered the
     /// code cache.
@@ -137,234 +126,221 @@ namespace client { namespace wp {
         //granary::printf("Exiting the code cache.\n");
     }
 
-    void htable_scan_object(
-        granary::app_pc key,
-        granary::app_pc value,
-        hash_set<granary::app_pc>&
-    ) {
-        typedef void (*scanner)(void *addr);
-        if(is_active_watchpoint(value)){
-            handle_watched_address(unsafe_cast<uintptr_t>(value));
-         }
-        scanner func = (scanner)value;
-        if(nullptr != func){
-            func(unsafe_cast<void*>(key));
-        }
-    }
+    /// Phases of the leak scanner.
+    enum scan_phase {
+        /// Not marking; the next scan begins a new mark phase.
+        SCAN_IDLE,
 
-    void print_collected_objects(
-        uintptr_t key,
-        bool value,
-        hash_set<granary::app_pc>&
-    ) {
-        granary::printf("key(%llx)\t", key);
-        UNUSED(value);
-    }
+        /// Marking from the root set, then from queued objects.
+        SCAN_MARK_ROOTS,
+        SCAN_MARK,
 
-    void htable_stack_scanner(
-        struct thread_info*,
-        struct leak_detector_thread_info *my_thread_info,
-        hash_set<granary::app_pc>&
-    ) {
-        bool ret;
-#if 0
-        uint64_t start = (my_thread_info->stack_current_ptr);
-        uint64_t stack_base = my_thread_info->stack_start + THREAD_SIZE;
-        while( start < stack_base){
-            uint64_t *stack_ptr = (unsafe_cast<uint64_t*>)(start);
-            ret = is_active_watchpoint((unsafe_cast<void*>)(*stack_ptr));
-            start += 8;
-        }
-#endif
-        UNUSED(my_thread_info);
-        UNUSED(ret);
+        /// Re-marking from the objects accessed while marking incrementally,
+        /// then from queued objects.
+        SCAN_REMARK_ROOTS,
+        SCAN_REMARK
+    };
+
+
+    enum : uintptr_t {
+        /// Number of descriptors in each chunk of the root set claimed by a
+        /// mark worker.
+        ROOT_CHUNK_SIZE = 1024
+    };
+
+
+    /// Current phase of the leak scanner.
+    static scan_phase SCAN_PHASE(SCAN_IDLE);
+
+
+    /// Deadline of the current mark slice, or zero if the slice is not time-
+    /// bounded.
+    static uint64_t SLICE_DEADLINE(0);
+
+
+    /// Next chunk of the descriptor table to scan for roots.
+    static std::atomic<uintptr_t> NEXT_ROOT_CHUNK(ATOMIC_VAR_INIT(0));
+
+
+    /// Whether some mark worker has claimed the page table walk.
+    static std::atomic<bool> PAGE_WALK_CLAIMED(ATOMIC_VAR_INIT(false));
+
+
+    /// Returns the mark worker of the current CPU.
+    static unsigned current_mark_worker(void) {
+        return static_cast<unsigned>(kernel_get_cpu_id())
+             % MAX_NUM_MARK_WORKERS;
     }
 
-    void scan_descriptor(uintptr_t index){
-
-        leak_detector_descriptor *desc = leak_detector_descriptor::access(index);
-        leak_object_state state;
-
-        if(is_valid_address(desc)){
-            uintptr_t base = ((desc->base_address) | 0xffff000000000000ULL);
-
-            for(unsigned offset=0; offset <= desc->size; offset = offset+8){
-                uint64_t val = *(unsafe_cast<uintptr_t*>(base));
-                if(is_watched_address(val)){
-                    uintptr_t found_index = counter_index_of(val);
-                    leak_detector_descriptor *found_desc = leak_detector_descriptor::access(found_index);
-                    if(is_valid_address(found_desc)){
-                        if(found_desc->state.is_reachable != true){
-                            state.is_reachable = true;
-                            found_desc->state.set_state(state);
-                            scan_descriptor(found_index);
-                        }
-                    }
-                }
-                base += 8;
+
+    /// Invoked by the page table walk for every watched address found in
+    /// kernel memory.
+    void watchpoint_callback(unsigned long addr) {
+        const uintptr_t index(combined_index_of(addr));
+        const leak_detector_descriptor *desc(
+            leak_detector_descriptor::access(index));
+
+        if(is_valid_address(desc)) {
+            const uintptr_t base(desc->base_address);
+            const uintptr_t limit(base + desc->size);
+            const uintptr_t watch_addr(addr & 0xffffffffffffULL);
+            if((base <= watch_addr) && (watch_addr <= limit)) {
+                mark_object(current_mark_worker(), index);
             }
         }
     }
 
-    void watchpoint_callback(unsigned long addr){
-        leak_object_state state;
-        uintptr_t index = counter_index_of(addr);
-        leak_detector_descriptor *desc = leak_detector_descriptor::access(index);
-
-        if(desc != nullptr){
-            uintptr_t base = desc->base_address;
-            uintptr_t limit = desc->base_address + desc->size;
-            uintptr_t watch_addr = (addr & 0xffffffffffffULL);
-            if((base <= watch_addr) && ( watch_addr <= limit)) {
-               // granary::printf("found index (%llx) : %llx\t", index, addr);
-                if(desc->state.is_reachable != true){
-                    state.is_reachable = true;
-                    desc->state.set_state(state);
-                    scan_descriptor(index);
+
+    /// Mark the objects that were accessed since they were last checked as
+    /// roots. Workers claim chunks of the descriptor table until none are
+    /// left.
+    static void mark_accessed_roots(unsigned worker) {
+        for(;;) {
+            const uintptr_t begin(NEXT_ROOT_CHUNK.fetch_add(ROOT_CHUNK_SIZE));
+            if(begin >= MAX_NUM_WATCHPOINTS) {
+                return;
+            }
+
+            uintptr_t end(begin + ROOT_CHUNK_SIZE);
+            if(end > MAX_NUM_WATCHPOINTS) {
+                end = MAX_NUM_WATCHPOINTS;
+            }
+
+            for(uintptr_t index(begin); index < end; ++index) {
+                leak_detector_descriptor *desc(
+                    leak_detector_descriptor::access(index));
+
+                if(is_valid_address(desc) && desc->accessed_in_last_epoch) {
+                    desc->accessed_in_last_epoch = false;
+                    mark_object(worker, index);
                 }
             }
         }
     }
 
-    void leak_policy_scan_callback(void) {
-        uintptr_t index = 0;
-        leak_object_state state;
 
-        granary::printf("%s, %llx\n", __FUNCTION__, DESCRIPTORS);
+    /// Run one mark slice on the current CPU. This is invoked on every CPU at
+    /// once, while the machine is stopped.
+    static int mark_slice(void *) {
+        const unsigned worker(current_mark_worker());
 
-        if(execution_state == false){
-            granary::printf("No allocation in the last epoch\n");
-            return;
-        }
+        if(SCAN_MARK_ROOTS == SCAN_PHASE || SCAN_REMARK_ROOTS == SCAN_PHASE) {
+            mark_accessed_roots(worker);
 
-        {
-            uint8_t old_bits;
-            uint8_t new_bits;
-            do {
-                old_bits = execution_state;
-                new_bits = 0x0;
-            } while(!__sync_bool_compare_and_swap(&execution_state, old_bits, new_bits));
+            // The page table walk is not split across workers, but the
+            // objects that it marks can be stolen by other workers.
+            if(SCAN_MARK_ROOTS == SCAN_PHASE
+            && !PAGE_WALK_CLAIMED.exchange(true)) {
+                kernel_pagetable_walk(unsafe_cast<void *>(
+                    &watchpoint_callback));
+            }
         }
 
-        for(index = 0; index < client::wp::MAX_NUM_WATCHPOINTS; index++){
-            leak_detector_descriptor *desc;
-            desc = leak_detector_descriptor::access(index);
+        drain_mark_queues(worker, SLICE_DEADLINE);
+        return 0;
+    }
 
-            if(is_valid_address(desc)){
-                if(desc->accessed_in_last_epoch){
-                    desc->accessed_in_last_epoch = false;
-                    if(desc->state.is_reachable != true){
-                        state.is_reachable = true;
-                        desc->state.set_state(state);
-                        scan_descriptor(index);
-                    }
-                  //  watchpoint_collect_list->add(index);
-                   // watchpoint_list->append(index);
-                    granary::printf("index (%llx)\t", index);
-                }
-            }
-        }
 
-        kernel_pagetable_walk(unsafe_cast<void*>(watchpoint_callback));
+    /// Report the active objects that were not marked as reachable.
+    static void report_leaks(void) {
+        leak_object_state reachable_state;
+        reachable_state.as_bits = 0;
+        reachable_state.is_reachable = true;
 
-        granary::printf("reachable \t");
-        for(index = 0; index < client::wp::MAX_NUM_WATCHPOINTS; index++){
-            leak_detector_descriptor *desc;
-            desc = leak_detector_descriptor::access(index);
+        unsigned num_reachable(0);
+        unsigned num_leaked(0);
 
-            if(is_valid_address(desc)){
-                if(desc->state.is_reachable == true){
-                    granary::printf(" (%llx)\t", index);
-                }else if(desc->state.is_active == true){
-                    granary::printf(" \nleaked (%llx)\n", index);
-                }
+        for(uintptr_t index(0); index < MAX_NUM_WATCHPOINTS; ++index) {
+            leak_detector_descriptor *desc(
+                leak_detector_descriptor::access(index));
+
+            if(!is_valid_address(desc)) {
+                continue;
             }
-        }
 
-#if 0
-        {
-            handle_type list_item = watchpoint_list->first();
-
-            while(list_item.is_valid()){
-                index = unsafe_cast<uintptr_t>(*list_item);
-                granary::printf("index2 (%llx)\n", index);
-#if 1
-                leak_detector_descriptor *desc = leak_detector_descriptor::access(index);
-                if(desc != nullptr){
-                    uintptr_t base = ((desc->base_address) | 0xffff000000000000ULL);
-
-                    for(unsigned offset=0; offset <= desc->size; offset=offset+8){
-                        uint64_t val = *(unsafe_cast<uintptr_t*>(base));
-                        if(is_watched_address(val)){
-                            uintptr_t found_index = counter_index_of(val);
-                            if(!watchpoint_collect_list->contains(found_index)){
-                                watchpoint_collect_list->add(found_index);
-                              //  watchpoint_list->append(unsafe_cast<uintptr_t>(found_index));
-                                granary::printf("found index (%llx)\t", found_index);
-                            }
-                            //watchpoint_collect_list->add(index);
-                           // watchpoint_list->append(unsafe_cast<uintptr_t>(found_index));
-                     //       granary::printf("watchpoint address %llx\n", val);
-                        }
-                        base += 8;
-                    }
+            if(is_marked(index)) {
+                desc->state.set_state(reachable_state);
+                ++num_reachable;
+            } else {
+                desc->state.unset_state(reachable_state);
+                if(desc->state.is_active) {
+                    granary::printf("leaked (%llx)\n", index);
+                    ++num_leaked;
                 }
-
-               // uintptr_t limit = desc->base_address + desc->size;
-               // granary::printf("base address : %llx\n", base);
-#endif
-                list_item = list_item.next();
             }
         }
 
-#endif
-#if 0
+        granary::printf("%u reachable objects, %u leaked objects\n",
+            num_reachable, num_leaked);
+    }
 
 
-        hash_set<granary::app_pc> collect_list;
-        watchpoint_collect_list->for_each_entry(print_collected_objects, collect_list);
-        granary::printf("\n");
-#endif
-#if 0
-        {
-            handle_type list_item = watchpoint_list->first();
-            while(list_item.is_valid()){
-                index = unsafe_cast<uintptr_t>(*list_item);
-                granary::printf("%llx\t", index);
-                list_item = list_item.next();
+    /// Scan for leaked objects. The object graph is marked in slices, in
+    /// which every CPU participates. Each slice stops the machine. When
+    /// marking incrementally, each slice is bounded by `MARK_SLICE_CYCLES`,
+    /// and the objects accessed while marking are re-marked as roots before
+    /// leaks are reported, because the machine ran in between slices.
+    ///
+    /// Returns true if another mark slice should be run soon.
+    bool leak_policy_scan_callback(void) {
+        if(SCAN_IDLE == SCAN_PHASE) {
+            if(execution_state == false){
+                granary::printf("No allocation in the last epoch\n");
+                return false;
+            }
+
+            {
+                uint8_t old_bits;
+                uint8_t new_bits;
+                do {
+                    old_bits = execution_state;
+                    new_bits = 0x0;
+                } while(!__sync_bool_compare_and_swap(
+                    &execution_state, old_bits, new_bits));
             }
 
-            granary::printf("\n");
+            begin_mark();
+            NEXT_ROOT_CHUNK.store(0);
+            PAGE_WALK_CLAIMED.store(false);
+            SCAN_PHASE = SCAN_MARK_ROOTS;
         }
+
+#if LEAK_INCREMENTAL_MARK
+        SLICE_DEADLINE = perf::timestamp() + MARK_SLICE_CYCLES;
+#else
+        SLICE_DEADLINE = 0;
 #endif
-        // scan the kernel objects passed to the module
 
-       // object_scan_list->for_each_entry(htable_scan_object, collect_list);
+        begin_mark_slice(kernel_num_online_cpus());
+        kernel_run_on_each_cpu(&mark_slice, nullptr);
 
-        // scan the kernel stack and look for the watched address;
-       // thread_scan_list->for_each_entry(htable_stack_scanner, collect_list);
+        // The root set is always fully marked by the first slice of a phase.
+        if(SCAN_MARK_ROOTS == SCAN_PHASE) {
+            SCAN_PHASE = SCAN_MARK;
+        } else if(SCAN_REMARK_ROOTS == SCAN_PHASE) {
+            SCAN_PHASE = SCAN_REMARK;
+        }
 
-    }
+        if(!mark_is_complete()) {
+            return true;
+        }
 
-    void htable_copy_task(
-        struct thread_info *info,
-        struct leak_detector_thread_info *my_thread_info,
-        hash_set<granary::app_pc>&
-    ) {
-#if 0
-        my_thread_info->stack_current_ptr = info->task->thread.sp;
-        my_thread_info->stack_start = (unsafe_cast<uint64_t>)(info->task->stack);
-        my_thread_info->tsk = info->task;
-        memcpy(my_thread_info->stack, info->task->stack, THREAD_SIZE);
+#if LEAK_INCREMENTAL_MARK
+        if(SCAN_MARK == SCAN_PHASE) {
+            NEXT_ROOT_CHUNK.store(0);
+            SCAN_PHASE = SCAN_REMARK_ROOTS;
+            return true;
+        }
 #endif
-        UNUSED(info);
-        UNUSED(my_thread_info);
+
+        report_leaks();
+        SCAN_PHASE = SCAN_IDLE;
+        return false;
     }
 
+
     void leak_policy_update_rootset(void) {
         granary::printf("%s\n", __FUNCTION__);
-        //hash_set<granary::app_pc> collect_list;
-        //thread_scan_list->for_each_entry(htable_copy_task, collect_list);
     }
 
 }}
@@ -9,7 +9,9 @@
 #include <atomic>
 
 #include "granary/client.h"
+#include "granary/perf.h"
 
+#include "clients/report.h"
 #include "clients/watchpoints/clients/rcudbg/log.h"
 
 
@@ -20,6 +22,9 @@
 
 extern "C" {
     extern int sprintf(char *buf, const char *fmt, ...);
+#if CONFIG_ENV_KERNEL
+    extern int kernel_get_cpu_id(void);
+#endif
 }
 
 using namespace granary;
@@ -27,32 +32,265 @@ using namespace granary;
 namespace client {
 
 
-    message_container MESSAGES[MAX_NUM_MESSAGES] = {{
-        ATOMIC_VAR_INIT(MESSAGE_NOT_READY), 0, {0, 0, 0, 0}
-    }};
+    /// The log.
+    log_export LOG;
 
 
-    /// A generic printer function that operates on an untypes message
-    /// container and a buffer.
-    typedef int (printer_func)(
-        char *buff,
-        const message_container *cont
-    );
+    /// The strings that have been interned into `LOG.strings`. Strings are
+    /// interned by address, as they are generally carats, and so are static.
+    static std::atomic<const char *> STRING_KEYS[NUM_LOG_STRINGS];
 
 
-    /// An "untyped" printer implementation function.
-    typedef int (untyped_printer_func)(
-        char *buff,
-        const char *format,
-        uint64_t,
-        uint64_t,
-        uint64_t,
-        uint64_t
-    );
+#if !CONFIG_ENV_KERNEL
+
+    /// Used to give each thread its own log.
+    static std::atomic<unsigned> NEXT_LOG_CPU(ATOMIC_VAR_INIT(0U));
+
+
+    /// The CPU number (plus one) of this thread.
+    static __thread unsigned LOG_CPU(0);
+#endif
+
+
+    /// Returns the current CPU (thread, in user space).
+    static inline unsigned current_cpu(void) {
+#if CONFIG_ENV_KERNEL
+        return static_cast<unsigned>(kernel_get_cpu_id());
+#else
+        if(!LOG_CPU) {
+            LOG_CPU = NEXT_LOG_CPU.fetch_add(1) + 1;
+        }
+        return LOG_CPU - 1;
+#endif
+    }
+
+
+    /// Copy `str` into an interned string.
+    static void initialise_string(log_string &interned, const char *str) {
+        uint32_t length(0);
+        for(; length < (sizeof interned.chars - 1) && str[length]; ++length) {
+            interned.chars[length] = str[length];
+        }
+        interned.chars[length] = '\0';
+        interned.length.store(length + 1, std::memory_order_release);
+    }
+
+
+    /// Copy the static info of a message into the exported log.
+    static void initialise_format(
+        log_format &format,
+        const message_info &info
+    ) {
+        unsigned i(0);
+        for(; i < (sizeof format.format - 1) && info.format[i]; ++i) {
+            format.format[i] = info.format[i];
+        }
+        format.format[i] = '\0';
+        format.level = info.level;
+    }
+
+
+    /// Initialise the exported log.
+    STATIC_INITIALISE_ID(rcudbg_log, {
+        log_export_header &header(LOG.header);
+        header.magic = LOG_EXPORT_MAGIC;
+        header.version = LOG_EXPORT_VERSION;
+        header.num_cpus = NUM_LOG_CPUS;
+        header.num_records_per_cpu = NUM_LOG_RECORDS_PER_CPU;
+        header.record_size = sizeof(log_record);
+        header.stream_size = sizeof(log_stream);
+        header.num_formats = MAX_MESSAGE_ID;
+        header.format_size = sizeof(log_format);
+        header.num_strings = NUM_LOG_STRINGS;
+        header.string_size = sizeof(log_string);
+        header.overwrite = RCUDBG_LOG_OVERWRITE;
+        header.formats_offset = offsetof(log_export, formats);
+        header.strings_offset = offsetof(log_export, strings);
+        header.streams_offset = offsetof(log_export, streams);
+        header.records_offset = offsetof(log_stream, records);
+
+        for(unsigned i(0); i < MAX_MESSAGE_ID; ++i) {
+            initialise_format(LOG.formats[i], MESSAGE_INFO[i]);
+        }
+
+        initialise_string(LOG.strings[LOG_STRING_NULL], "(null)");
+        initialise_string(LOG.strings[LOG_STRING_UNKNOWN], "(unknown)");
+    })
+
+
+    /// Returns the string table index of `str`.
+    uint64_t intern_log_string(const char *str) {
+        if(!str) {
+            return LOG_STRING_NULL;
+        }
+
+        enum {
+            FIRST_INDEX = LOG_STRING_UNKNOWN + 1,
+            NUM_INDEXES = NUM_LOG_STRINGS - FIRST_INDEX
+        };
+
+        const uintptr_t hash(reinterpret_cast<uintptr_t>(str) >> 3);
+        for(unsigned i(0); i < NUM_INDEXES; ++i) {
+            const uint64_t index(FIRST_INDEX + ((hash + i) % NUM_INDEXES));
+            std::atomic<const char *> &key(STRING_KEYS[index]);
+            const char *found(key.load(std::memory_order_acquire));
+
+            if(found == str) {
+                return index;
+            }
+
+            if(!found && key.compare_exchange_strong(found, str)) {
+                initialise_string(LOG.strings[index], str);
+                return index;
+            } else if(found == str) {
+                return index;
+            }
+        }
+
+        return LOG_STRING_UNKNOWN;
+    }
+
+
+    /// Append a record to the current CPU's log.
+    ///
+    /// Note: Records are reserved atomically because an interrupt handler
+    ///       might log a message while a record is being written, and because
+    ///       the logging task might be migrated. Neither case contends with
+    ///       other CPUs in the common case.
+    void append_log_record(
+        log_message_id id,
+        unsigned num_args,
+        unsigned string_args,
+        const uint64_t *args
+    ) {
+        const unsigned cpu(current_cpu());
+        log_stream &stream(LOG.streams[cpu % NUM_LOG_CPUS]);
+        const uint64_t index(stream.num_reserved.fetch_add(1));
+
+        if(NUM_LOG_RECORDS_PER_CPU <= index) {
+            stream.num_lost.fetch_add(1);
+#if !RCUDBG_LOG_OVERWRITE
+            return;
+#endif
+        }
+
+        log_record &record(stream.records[index % NUM_LOG_RECORDS_PER_CPU]);
+        __atomic_store_n(&(record.sequence), 0, __ATOMIC_RELAXED);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        record.timestamp = perf::timestamp();
+        record.cpu = static_cast<uint16_t>(cpu);
+        record.message_id = static_cast<uint16_t>(id);
+        record.num_args = static_cast<uint8_t>(num_args);
+        record.string_args = static_cast<uint8_t>(string_args);
+        for(unsigned i(0); i < num_args; ++i) {
+            record.args[i] = args[i];
+        }
+
+        __atomic_store_n(&(record.sequence), index + 1, __ATOMIC_RELEASE);
+    }
+
+
+    /// Get a consistent copy of the record at `index` in `stream`. Returns
+    /// false if the record is being written, or has been overwritten.
+    static bool read_record(
+        const log_stream &stream,
+        uint64_t index,
+        log_record &record
+    ) {
+        const log_record &live(
+            stream.records[index % NUM_LOG_RECORDS_PER_CPU]);
+        const uint64_t sequence(
+            __atomic_load_n(&(live.sequence), __ATOMIC_ACQUIRE));
+
+        if((index + 1) != sequence) {
+            return false;
+        }
+
+        memcpy(&record, &live, sizeof record);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return sequence == __atomic_load_n(&(live.sequence), __ATOMIC_RELAXED)
+            && MESSAGE_NOT_READY < record.message_id
+            && MAX_MESSAGE_ID > record.message_id
+            && MAX_NUM_LOG_ARGS >= record.num_args;
+    }
+
+
+    /// A position in a CPU's log stream, used to merge the streams of all
+    /// CPUs by time stamp.
+    struct log_cursor {
+        uint64_t next_index;
+        uint64_t end_index;
+        bool has_record;
+        log_record record;
+    };
+
+
+    /// Cursors for merging the streams. Only used at report time, and in
+    /// tests, so there is only ever one reader.
+    static log_cursor CURSORS[NUM_LOG_CPUS];
+
+
+    /// Move a cursor to the next readable record in its stream.
+    static void advance_cursor(log_cursor &cursor, const log_stream &stream) {
+        cursor.has_record = false;
+        while(cursor.next_index < cursor.end_index) {
+            if(read_record(stream, cursor.next_index++, cursor.record)) {
+                cursor.has_record = true;
+                return;
+            }
+        }
+    }
+
+
+    /// Position the cursors at the oldest retained record of each stream.
+    static void open_cursors(void) {
+        for(unsigned cpu(0); cpu < NUM_LOG_CPUS; ++cpu) {
+            const log_stream &stream(LOG.streams[cpu]);
+            log_cursor &cursor(CURSORS[cpu]);
+            uint64_t end(stream.num_reserved.load());
+            uint64_t begin(0);
+
+            if(NUM_LOG_RECORDS_PER_CPU < end) {
+#if RCUDBG_LOG_OVERWRITE
+                begin = end - NUM_LOG_RECORDS_PER_CPU;
+#else
+                end = NUM_LOG_RECORDS_PER_CPU;
+#endif
+            }
+
+            cursor.next_index = begin;
+            cursor.end_index = end;
+            advance_cursor(cursor, stream);
+        }
+    }
+
+
+    /// Get the next record, in time stamp order, of all streams. Returns
+    /// false if there are no more records.
+    static bool next_record(log_record &record) {
+        log_cursor *oldest(nullptr);
+        unsigned oldest_cpu(0);
+
+        for(unsigned cpu(0); cpu < NUM_LOG_CPUS; ++cpu) {
+            log_cursor &cursor(CURSORS[cpu]);
+            if(!cursor.has_record) {
+                continue;
+            }
+            if(!oldest || cursor.record.timestamp < oldest->record.timestamp) {
+                oldest = &cursor;
+                oldest_cpu = cpu;
+            }
+        }
 
+        if(!oldest) {
+            return false;
+        }
 
-    /// Next offset into the log to which we can write.
-    std::atomic<uint64_t> NEXT_LOG_OFFSET = ATOMIC_VAR_INIT(0);
+        record = oldest->record;
+        advance_cursor(*oldest, LOG.streams[oldest_cpu]);
+        return true;
+    }
 
 
     /// Puts all the static info of each message into a common place.
@@ -75,76 +313,50 @@ namespace client {
         char *, const char *, uint64_t);
     typedef int (int_func)(void);
     typedef int (generic_printer_func)(
-        char *, const message_container *, int_func *);
+        char *, const char *, const uint64_t *, int_func *);
 
 
     static int print_4(
         char *buff,
-        const message_container *cont,
+        const char *format,
+        const uint64_t *args,
         int_func *printer
     ) {
         print_4_func *print_func = (print_4_func *) printer;
-        const unsigned id(cont->message_id.load(std::memory_order_relaxed));
-
-        return print_func(
-            buff,
-            MESSAGE_INFO[id].format,
-            cont->payload[0],
-            cont->payload[1],
-            cont->payload[2],
-            cont->payload[3]
-        );
+        return print_func(buff, format, args[0], args[1], args[2], args[3]);
     }
 
 
     static int print_3(
         char *buff,
-        const message_container *cont,
+        const char *format,
+        const uint64_t *args,
         int_func *printer
     ) {
         print_3_func *print_func = (print_3_func *) printer;
-        const unsigned id(cont->message_id.load(std::memory_order_relaxed));
-
-        return print_func(
-            buff,
-            MESSAGE_INFO[id].format,
-            cont->payload[0],
-            cont->payload[1],
-            cont->payload[2]
-        );
+        return print_func(buff, format, args[0], args[1], args[2]);
     }
 
 
     static int print_2(
         char *buff,
-        const message_container *cont,
+        const char *format,
+        const uint64_t *args,
         int_func *printer
     ) {
         print_2_func *print_func = (print_2_func *) printer;
-        const unsigned id(cont->message_id.load(std::memory_order_relaxed));
-
-        return print_func(
-            buff,
-            MESSAGE_INFO[id].format,
-            cont->payload[0],
-            cont->payload[1]
-        );
+        return print_func(buff, format, args[0], args[1]);
     }
 
 
     static int print_1(
         char *buff,
-        const message_container *cont,
+        const char *format,
+        const uint64_t *args,
         int_func *printer
     ) {
         print_1_func *print_func = (print_1_func *) printer;
-        const unsigned id(cont->message_id.load(std::memory_order_relaxed));
-
-        return print_func(
-            buff,
-            MESSAGE_INFO[id].format,
-            cont->payload[0]
-        );
+        return print_func(buff, format, args[0]);
     }
 
 
@@ -181,6 +393,32 @@ namespace client {
     };
 
 
+    /// Print a log record into `buff`. String arguments are converted from
+    /// string table indexes back into strings.
+    static int print_record(char *buff, const log_record &record) {
+        uint64_t args[MAX_NUM_LOG_ARGS] = {0};
+        for(unsigned i(0); i < record.num_args; ++i) {
+            args[i] = record.args[i];
+            if(!(record.string_args & (1U << i))) {
+                continue;
+            }
+
+            const log_string *str(&(LOG.strings[LOG_STRING_UNKNOWN]));
+            if(NUM_LOG_STRINGS > args[i]
+            && LOG.strings[args[i]].length.load(std::memory_order_acquire)) {
+                str = &(LOG.strings[args[i]]);
+            }
+            args[i] = reinterpret_cast<uint64_t>(&(str->chars[0]));
+        }
+
+        return VARIADIC_PRINTERS[record.num_args](
+            buff,
+            MESSAGE_INFO[record.message_id].format,
+            &(args[0]),
+            MESSAGE_PRINTERS[record.message_id]);
+    }
+
+
     enum {
         BUFFER_SIZE = PAGE_SIZE * 4,
         BUFFER_FLUSH_SIZE = BUFFER_SIZE - (PAGE_SIZE / 4)
@@ -194,30 +432,22 @@ namespace client {
     void report(void) {
         detach();
 
-        message_container cont;
+        log_record record;
         int b(0);
-        unsigned num_messages(NEXT_LOG_OFFSET.load());
-        if(MAX_NUM_MESSAGES > num_messages) {
-            num_messages = MAX_NUM_MESSAGES;
-        }
 
-        for(unsigned i(0); i < num_messages; ++i) {
-            const message_container &cont_(MESSAGES[i]);
-            if(MESSAGE_NOT_READY == cont_.message_id.load()) {
-                continue;
+        open_cursors();
+        while(next_record(record)) {
+            if(b >= BUFFER_FLUSH_SIZE) {
+                granary::log(&(BUFFER[0]), b);
+                b = 0;
             }
 
-            // Get a consistent view of the data structure.
-            log_message_id id(MESSAGE_NOT_READY);
-            log_message_id id_check(MESSAGE_NOT_READY);
-            do {
-                id = cont_.message_id.load();
-                memcpy(&cont, &cont_, sizeof cont);
-                id_check = cont.message_id.load(std::memory_order_relaxed);
-            } while(id_check != id && MESSAGE_NOT_READY != id_check);
-
-            // Invalid message id.
-            if(MESSAGE_NOT_READY >= id && MAX_MESSAGE_ID <= id) {
+            b += print_record(&(BUFFER[b]), record);
+        }
+
+        for(unsigned cpu(0); cpu < NUM_LOG_CPUS; ++cpu) {
+            const uint64_t num_lost(LOG.streams[cpu].num_lost.load());
+            if(!num_lost) {
                 continue;
             }
 
@@ -226,26 +456,62 @@ namespace client {
                 b = 0;
             }
 
-            b += VARIADIC_PRINTERS[cont.num_args](
-                &(BUFFER[b]),
-                &cont,
-                MESSAGE_PRINTERS[id]);
+            b += sprintf(&(BUFFER[b]), "Lost %lu log records on CPU %u.\n",
+                static_cast<unsigned long>(num_lost), cpu);
         }
 
         if(b) {
             granary::log(&(BUFFER[0]), b);
         }
 
-        NEXT_LOG_OFFSET.store(0);
+        clear_log();
+    }
+
+
+    /// Discard all log records.
+    void clear_log(void) {
+        for(unsigned cpu(0); cpu < NUM_LOG_CPUS; ++cpu) {
+            log_stream &stream(LOG.streams[cpu]);
+            stream.num_reserved.store(0);
+            stream.num_lost.store(0);
+            for(unsigned i(0); i < NUM_LOG_RECORDS_PER_CPU; ++i) {
+                __atomic_store_n(
+                    &(stream.records[i].sequence), 0, __ATOMIC_RELEASE);
+            }
+        }
+    }
+
+
+    /// Returns the number of log records that are currently in the log.
+    uint64_t log_size(void) {
+        uint64_t size(0);
+        for(unsigned cpu(0); cpu < NUM_LOG_CPUS; ++cpu) {
+            const uint64_t num_reserved(LOG.streams[cpu].num_reserved.load());
+            if(NUM_LOG_RECORDS_PER_CPU < num_reserved) {
+                size += NUM_LOG_RECORDS_PER_CPU;
+            } else {
+                size += num_reserved;
+            }
+        }
+        return size;
     }
 
 
     bool log_entry_is(unsigned offset, const log_message_id expect_id) {
-        if(offset >= MAX_NUM_MESSAGES) {
-            return false;
+        log_record record;
+        open_cursors();
+        for(unsigned i(0); next_record(record); ++i) {
+            if(i == offset) {
+                return expect_id == record.message_id;
+            }
         }
+        return false;
+    }
+
 
-        message_container &cont(MESSAGES[offset]);
-        return expect_id == cont.message_id.load();
+    /// Returns the address and size of the exported log.
+    const void *exported_log(unsigned long *size) {
+        *size = sizeof LOG;
+        return &LOG;
     }
 }
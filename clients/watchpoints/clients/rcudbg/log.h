@@ -11,6 +11,12 @@
 
 #include "granary/client.h"
 
+
+/// If a CPU's log fills up, then overwrite its oldest records (1), or drop
+/// its newest records (0). Either way, the lost records are counted.
+#define RCUDBG_LOG_OVERWRITE 1
+
+
 namespace client {
     enum log_message_id : unsigned {
         MESSAGE_NOT_READY = 0,
@@ -36,133 +42,237 @@ namespace client {
     };
 
 
-    /// A generic message container for log entries from the rcudbg tool.
-    struct message_container {
-        std::atomic<log_message_id> message_id;
-        unsigned num_args;
-        uint64_t payload[4];
+    /// Records static message information.
+    extern const message_info MESSAGE_INFO[];
+
+
+    enum {
+        /// Maximum number of CPUs that have their own log. Beyond this, CPUs
+        /// share logs.
+        NUM_LOG_CPUS = 32,
+
+        /// Number of records in each CPU's log.
+        NUM_LOG_RECORDS_PER_CPU = 512,
+
+        /// Maximum number of arguments of a message.
+        MAX_NUM_LOG_ARGS = 4,
+
+        /// Number of distinct strings (e.g. carats) that can be referenced by
+        /// log records, and the maximum size of each string.
+        NUM_LOG_STRINGS = 2048,
+        LOG_STRING_SIZE = 128,
+
+        /// Maximum size of a message format string.
+        LOG_FORMAT_SIZE = 512,
+
+        /// String table index of a null string, and of a string that didn't
+        /// fit into the string table.
+        LOG_STRING_NULL = 0,
+        LOG_STRING_UNKNOWN = 1,
+
+        LOG_EXPORT_MAGIC = 0x4755434C, // "LCUG"
+        LOG_EXPORT_VERSION = 1
+    };
+
+
+    /// A single binary log record. Records are formatted offline (or at
+    /// report time) using the format string of `message_id`.
+    ///
+    /// Note: `sequence` is zero while a record is being written, and is
+    ///       otherwise one more than the index of the record within its
+    ///       CPU's stream. A reader must discard a record whose sequence
+    ///       number changes while the record is being copied.
+    struct log_record {
+        uint64_t sequence;
+        uint64_t timestamp;
+        uint16_t cpu;
+        uint16_t message_id;
+        uint8_t num_args;
+
+        /// Bit `i` is set if `args[i]` is an index into the string table.
+        uint8_t string_args;
+        uint16_t reserved;
+        uint64_t args[MAX_NUM_LOG_ARGS];
+        uint64_t padding;
     };
 
 
-    /// Records static message information.
-    extern const message_info MESSAGE_INFO[];
+    static_assert(CONFIG_ARCH_CACHE_LINE_SIZE == sizeof(log_record),
+        "Log records should be exactly one cache line.");
 
 
-    /// Next offset into the log to which we can write.
-    extern std::atomic<uint64_t> NEXT_LOG_OFFSET;
+    /// The log of one CPU. Only the owning CPU writes to the log in the common
+    /// case, so reserving a record doesn't contend with other CPUs.
+    struct log_stream {
 
+        /// Total number of records ever reserved in this stream. This might
+        /// exceed the number of records in the stream.
+        std::atomic<uint64_t> num_reserved;
 
-    /// Ring buffer for messages.
-    extern message_container MESSAGES[];
+        /// Number of records that were overwritten or dropped.
+        std::atomic<uint64_t> num_lost;
 
+        log_record records[NUM_LOG_RECORDS_PER_CPU]
+            __attribute__((aligned (CONFIG_ARCH_CACHE_LINE_SIZE)));
 
-    enum {
-        MAX_NUM_MESSAGES = 4096
+    } __attribute__((aligned (CONFIG_ARCH_CACHE_LINE_SIZE)));
+
+
+    /// An interned string. `length` is set after `chars` is filled in.
+    struct log_string {
+        std::atomic<uint32_t> length;
+        char chars[LOG_STRING_SIZE - sizeof(uint32_t)];
     };
 
 
-    template <typename A0>
-    void log(log_message_id id, A0 a0) {
+    /// Static information about a message, copied into the exported log so
+    /// that the log can be decoded without access to the tool.
+    struct log_format {
+        uint32_t level;
+        char format[LOG_FORMAT_SIZE - sizeof(uint32_t)];
+    };
 
-        if(MIN_LOG_LEVEL > MESSAGE_INFO[id].level) {
-            return;
-        }
 
-        const uint64_t index(NEXT_LOG_OFFSET.fetch_add(1));
-        message_container &cont(MESSAGES[index % MAX_NUM_MESSAGES]);
+    /// Describes the layout of the exported log.
+    struct log_export_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t num_cpus;
+        uint32_t num_records_per_cpu;
+        uint32_t record_size;
+        uint32_t stream_size;
+        uint32_t num_formats;
+        uint32_t format_size;
+        uint32_t num_strings;
+        uint32_t string_size;
+        uint32_t overwrite;
 
-        if(index >= MAX_NUM_MESSAGES) {
-            return;
-        }
+        /// Offsets (in bytes) of the sections of the exported log, and of the
+        /// records within a stream.
+        uint32_t formats_offset;
+        uint32_t strings_offset;
+        uint32_t streams_offset;
+        uint32_t records_offset;
+    } __attribute__((aligned (CONFIG_ARCH_CACHE_LINE_SIZE)));
 
-        cont.message_id.store(MESSAGE_NOT_READY);
-        cont.num_args = 1;
-        cont.payload[0] = granary::unsafe_cast<uint64_t>(a0);
-        cont.message_id.store(id);
-    }
 
+    /// The exported log. In kernel space, this is readable and mappable
+    /// through the `granary_log` file in debugfs. A decoder merges the
+    /// per-CPU streams by time stamp.
+    struct log_export {
+        log_export_header header;
+        log_format formats[MAX_MESSAGE_ID];
+        log_string strings[NUM_LOG_STRINGS];
+        log_stream streams[NUM_LOG_CPUS];
+    } __attribute__((aligned (CONFIG_ARCH_PAGE_SIZE)));
 
-    template <typename A0, typename A1>
-    void log(log_message_id id, A0 a0, A1 a1) {
 
-        if(MIN_LOG_LEVEL > MESSAGE_INFO[id].level) {
-            return;
-        }
+    /// The log.
+    extern log_export LOG;
 
-        const uint64_t index(NEXT_LOG_OFFSET.fetch_add(1));
-        message_container &cont(MESSAGES[index % MAX_NUM_MESSAGES]);
 
-        if(index >= MAX_NUM_MESSAGES) {
-            return;
-        }
+    /// Returns the string table index of `str`, adding `str` to the string
+    /// table if necessary.
+    uint64_t intern_log_string(const char *str) ;
 
-        cont.message_id.store(MESSAGE_NOT_READY);
-        cont.num_args = 2;
-        cont.payload[0] = granary::unsafe_cast<uint64_t>(a0);
-        cont.payload[1] = granary::unsafe_cast<uint64_t>(a1);
-        cont.message_id.store(id);
-    }
 
+    /// Append a record to the current CPU's log.
+    void append_log_record(
+        log_message_id id,
+        unsigned num_args,
+        unsigned string_args,
+        const uint64_t *args
+    ) ;
 
-    template <typename A0, typename A1, typename A2>
-    void log(log_message_id id, A0 a0, A1 a1, A2 a2) {
 
-        if(MIN_LOG_LEVEL > MESSAGE_INFO[id].level) {
-            return;
-        }
+    namespace detail {
 
-        const uint64_t index(NEXT_LOG_OFFSET.fetch_add(1));
-        message_container &cont(MESSAGES[index % MAX_NUM_MESSAGES]);
+        /// Converts a message argument into its log record representation.
+        template <typename T>
+        struct log_arg {
+            enum {
+                IS_STRING = 0
+            };
 
-        if(index >= MAX_NUM_MESSAGES) {
-            return;
-        }
+            static inline uint64_t encode(T val) {
+                return granary::unsafe_cast<uint64_t>(val);
+            }
+        };
+
+
+        /// Strings are recorded as indexes into the log's string table.
+        template <>
+        struct log_arg<const char *> {
+            enum {
+                IS_STRING = 1
+            };
 
-        cont.message_id.store(MESSAGE_NOT_READY);
-        cont.num_args = 3;
-        cont.payload[0] = granary::unsafe_cast<uint64_t>(a0);
-        cont.payload[1] = granary::unsafe_cast<uint64_t>(a1);
-        cont.payload[2] = granary::unsafe_cast<uint64_t>(a2);
-        cont.message_id.store(id);
+            static inline uint64_t encode(const char *val) {
+                return intern_log_string(val);
+            }
+        };
+
+
+        template <>
+        struct log_arg<char *> : public log_arg<const char *> { };
+
+
+        /// Computes the bit mask of which arguments are strings.
+        template <typename... Args>
+        struct log_string_args;
+
+
+        template <>
+        struct log_string_args<> {
+            enum : unsigned {
+                MASK = 0
+            };
+        };
+
+
+        template <typename A, typename... Args>
+        struct log_string_args<A, Args...> {
+            enum : unsigned {
+                MASK = static_cast<unsigned>(log_arg<A>::IS_STRING)
+                     | (log_string_args<Args...>::MASK << 1)
+            };
+        };
     }
 
 
-    template <typename A0, typename A1, typename A2, typename A3>
-    void log(log_message_id id, A0 a0, A1 a1, A2 a2, A3 a3) {
+    template <typename... Args>
+    void log(log_message_id id, Args... args) {
+        static_assert(
+            0 < sizeof...(Args) && MAX_NUM_LOG_ARGS >= sizeof...(Args),
+            "Invalid number of log message arguments.");
 
         if(MIN_LOG_LEVEL > MESSAGE_INFO[id].level) {
             return;
         }
 
-        const uint64_t index(NEXT_LOG_OFFSET.fetch_add(1));
-        message_container &cont(MESSAGES[index % MAX_NUM_MESSAGES]);
-
-        if(index >= MAX_NUM_MESSAGES) {
-            return;
-        }
+        const uint64_t encoded_args[] = {
+            detail::log_arg<Args>::encode(args)...
+        };
 
-        cont.message_id.store(MESSAGE_NOT_READY);
-        cont.num_args = 4;
-        cont.payload[0] = granary::unsafe_cast<uint64_t>(a0);
-        cont.payload[1] = granary::unsafe_cast<uint64_t>(a1);
-        cont.payload[2] = granary::unsafe_cast<uint64_t>(a2);
-        cont.payload[3] = granary::unsafe_cast<uint64_t>(a3);
-        cont.message_id.store(id);
+        append_log_record(
+            id,
+            sizeof...(Args),
+            detail::log_string_args<Args...>::MASK,
+            &(encoded_args[0]));
     }
 
 
-    inline void clear_log(void) {
-        NEXT_LOG_OFFSET.store(0);
-    }
+    /// Discard all log records.
+    void clear_log(void) ;
 
 
-    inline uint64_t log_size(void) {
-        return NEXT_LOG_OFFSET.load();
-    }
+    /// Returns the number of log records that are currently in the log.
+    uint64_t log_size(void) ;
 
 
     /// Used for testing. Returns true iff the log entry at offset `offset` has
-    /// the expected log message identifier, `expect_id`.
+    /// the expected log message identifier, `expect_id`. Offsets are into the
+    /// log records of all CPUs, ordered by time stamp.
     bool log_entry_is(unsigned offset, const log_message_id expect_id) ;
 }
 
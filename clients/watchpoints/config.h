@@ -29,6 +29,47 @@
 #define WP_IGNORE_FRAME_POINTER IF_USER_ELSE(0, 1)
 
 
+/// Don't check memory operands whose addresses are computed only from
+/// registers that are known not to hold watched addresses, e.g. registers
+/// derived from the stack pointer, from small constants, or (in user space)
+/// from 32-bit register writes, which clear the high-order bits. A forward
+/// pass over each straight-line region of a basic block tracks these
+/// registers until they are redefined.
+#define WP_ELIDE_UNWATCHED_CHECKS 1
+
+
+/// Let watchpoint implementations emit short inline fast paths at the labels
+/// of watched memory operands (e.g. a bounds check) when the arithmetic flags
+/// and enough registers are dead, instead of always calling out-of-line
+/// register-specific assembly routines.
+#define WP_INLINE_FAST_PATHS 1
+
+
+/// Recycle the counter indexes of freed watchpoint descriptors. Indexes are
+/// handed out from per-CPU caches that are refilled in batches from a global
+/// pool. Freed indexes are quarantined (until enough other indexes have been
+/// freed) before being reused, so that stale watched pointers continue to
+/// resolve to their own (freed) descriptors for a while.
+///
+/// Note: This is best-effort. Nothing tracks how long stale watched pointers
+///       live, so a stale pointer that outlives the quarantine resolves to the
+///       descriptor of whichever object re-uses its index. Disable this if
+///       that is unacceptable and the counter indexes are not exhausted.
+#define WP_RECYCLE_COUNTER_INDEXES 1
+
+
+/// Number of counter indexes moved between a per-CPU cache and the global
+/// pool at once.
+#define WP_COUNTER_INDEX_BATCH_SIZE 32
+
+
+/// Number of batches of freed counter indexes that are quarantined before
+/// the oldest batch is returned to the global pool. A freed index is
+/// therefore quarantined for roughly this many times the batch size frees,
+/// regardless of how much time has passed.
+#define WP_NUM_QUARANTINED_INDEX_BATCHES 32
+
+
 /// Check for user space addresses. This adds an extra two instructions to
 /// kernel-mode instrumentation and can be a useful debugging aid when trying
 /// to see if an instrumentation error might be caused by the presence of a
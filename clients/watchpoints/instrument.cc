@@ -9,11 +9,315 @@
 
 #include "clients/watchpoints/instrument.h"
 
+#if WP_RECYCLE_COUNTER_INDEXES && !CONFIG_ENV_KERNEL
+#   include <pthread.h>
+#endif
+
 using namespace granary;
 
 namespace client { namespace wp {
 
 
+#if WP_RECYCLE_COUNTER_INDEXES
+#   if CONFIG_ENV_KERNEL
+    extern "C" {
+        extern int kernel_get_cpu_id(void);
+    }
+#   endif
+
+
+    enum : unsigned {
+        /// Number of per-CPU (per-thread, in user space) counter index
+        /// caches. User space threads beyond this number share caches.
+        NUM_INDEX_CACHES            = IF_USER_ELSE(64, 256),
+
+        /// Number of counter indexes moved between a per-CPU cache and the
+        /// global pool at once.
+        INDEX_BATCH_SIZE            = WP_COUNTER_INDEX_BATCH_SIZE,
+
+        /// Number of batches of freed counter indexes that are waiting out
+        /// their grace period.
+        NUM_QUARANTINED_BATCHES     = WP_NUM_QUARANTINED_INDEX_BATCHES,
+
+        /// Total number of counter indexes.
+        NUM_COUNTER_INDEXES         = MAX_COUNTER_INDEX + 1,
+
+        /// The pool is under pressure when fewer than this many counter
+        /// indexes are left in the global pool.
+        INDEX_PRESSURE_THRESHOLD    = NUM_COUNTER_INDEXES / 16
+    };
+
+
+    static_assert(NUM_COUNTER_INDEXES <= 0x10000U,
+        "Counter indexes must fit in 16 bits.");
+
+
+    /// A batch of counter indexes.
+    struct counter_index_batch {
+        unsigned num_indexes;
+        uint16_t indexes[INDEX_BATCH_SIZE];
+    };
+
+
+    /// A per-CPU cache of counter indexes.
+    struct counter_index_cache {
+
+        /// Only contended in user space when threads share a cache.
+        atomic_spin_lock lock;
+
+        /// Indexes that can be allocated on this CPU.
+        counter_index_batch free;
+
+        /// Indexes that were freed on this CPU but not yet quarantined.
+        counter_index_batch limbo;
+
+    } __attribute__((aligned (CONFIG_ARCH_CACHE_LINE_SIZE)));
+
+
+    /// Per-CPU caches of counter indexes.
+    static counter_index_cache INDEX_CACHES[NUM_INDEX_CACHES];
+
+
+#   if !CONFIG_ENV_KERNEL
+    /// Next cache to assign to a thread, and the cache of this thread (plus
+    /// one).
+    static std::atomic<unsigned> NEXT_INDEX_CACHE(ATOMIC_VAR_INIT(0U));
+    static __thread unsigned INDEX_CACHE(0);
+
+
+    /// Thread-specific key whose destructor returns the counter indexes
+    /// cached by an exiting thread to the global pool.
+    static pthread_key_t INDEX_CACHE_KEY;
+    static pthread_once_t INDEX_CACHE_KEY_ONCE = PTHREAD_ONCE_INIT;
+#   endif
+
+
+    /// Lock protecting the global pool of counter indexes.
+    static atomic_spin_lock INDEX_POOL_LOCK;
+
+
+    /// Tracks the next never-allocated counter index.
+    static uintptr_t NEXT_COUNTER_INDEX(0);
+
+
+    /// Stack of counter indexes whose grace periods have elapsed.
+    static uint16_t FREE_COUNTER_INDEXES[NUM_COUNTER_INDEXES];
+    static unsigned NUM_FREE_COUNTER_INDEXES(0);
+
+
+    /// FIFO of batches of freed counter indexes whose grace periods have not
+    /// yet elapsed.
+    static counter_index_batch QUARANTINE[NUM_QUARANTINED_BATCHES];
+    static unsigned OLDEST_QUARANTINED_BATCH(0);
+    static unsigned NUM_QUARANTINED_INDEX_BATCHES(0);
+
+
+    /// Whether or not we have warned that the pool is under pressure.
+    static bool WARNED_OF_INDEX_PRESSURE(false);
+
+
+#   if !CONFIG_ENV_KERNEL
+    static void drain_index_cache(void *) ;
+
+
+    static void create_index_cache_key(void) {
+        pthread_key_create(&INDEX_CACHE_KEY, &drain_index_cache);
+    }
+#   endif
+
+
+    /// Returns the counter index cache of the current CPU (thread, in user
+    /// space).
+    ///
+    /// Note: In kernel space, interrupts must be disabled.
+    static counter_index_cache &current_index_cache(void) {
+#   if CONFIG_ENV_KERNEL
+        const unsigned cache(
+            static_cast<unsigned>(kernel_get_cpu_id()) % NUM_INDEX_CACHES);
+#   else
+        if(!INDEX_CACHE) {
+            INDEX_CACHE = (
+                NEXT_INDEX_CACHE.fetch_add(1) % NUM_INDEX_CACHES) + 1;
+
+            // Make sure that the cache is drained when this thread exits.
+            pthread_once(&INDEX_CACHE_KEY_ONCE, &create_index_cache_key);
+            pthread_setspecific(
+                INDEX_CACHE_KEY, &(INDEX_CACHES[INDEX_CACHE - 1]));
+        }
+        const unsigned cache(INDEX_CACHE - 1);
+#   endif
+        return INDEX_CACHES[cache];
+    }
+
+
+    /// Returns the number of counter indexes in the global pool.
+    ///
+    /// Note: `INDEX_POOL_LOCK` must be held.
+    static uintptr_t num_pooled_indexes(void) {
+        return NUM_FREE_COUNTER_INDEXES
+            + (NUM_COUNTER_INDEXES - NEXT_COUNTER_INDEX);
+    }
+
+
+    /// Refill `batch` with up to `INDEX_BATCH_SIZE` counter indexes from the
+    /// global pool. Re-used indexes are preferred over never-allocated ones
+    /// so that the descriptor tables stay dense.
+    ///
+    /// Note: `INDEX_POOL_LOCK` must be held.
+    static void refill_index_batch(counter_index_batch &batch) {
+        for(; batch.num_indexes < INDEX_BATCH_SIZE; ++batch.num_indexes) {
+            uintptr_t index(0);
+            if(NUM_FREE_COUNTER_INDEXES) {
+                index = FREE_COUNTER_INDEXES[--NUM_FREE_COUNTER_INDEXES];
+            } else if(NEXT_COUNTER_INDEX < NUM_COUNTER_INDEXES) {
+                index = NEXT_COUNTER_INDEX++;
+            } else {
+                break;
+            }
+            batch.indexes[batch.num_indexes] = static_cast<uint16_t>(index);
+        }
+
+        const uintptr_t num_left(num_pooled_indexes());
+
+        if(num_left < INDEX_PRESSURE_THRESHOLD) {
+            if(!WARNED_OF_INDEX_PRESSURE) {
+                WARNED_OF_INDEX_PRESSURE = true;
+                granary::printf(
+                    "Warning: only %u of %u watchpoint counter indexes are "
+                    "left in the global pool (%u batches quarantined).\n",
+                    static_cast<unsigned>(num_left),
+                    static_cast<unsigned>(NUM_COUNTER_INDEXES),
+                    NUM_QUARANTINED_INDEX_BATCHES);
+            }
+
+        // Warn again if the pressure is relieved and then builds up again.
+        } else if(num_left >= (2 * INDEX_PRESSURE_THRESHOLD)) {
+            WARNED_OF_INDEX_PRESSURE = false;
+        }
+    }
+
+
+    /// Quarantine a batch of freed counter indexes. If the quarantine is full
+    /// then the oldest quarantined batch is returned to the global pool. This
+    /// is a best-effort grace period: it is counted in frees, not time, so a
+    /// stale watched pointer can outlive it (see `WP_RECYCLE_COUNTER_INDEXES`).
+    ///
+    /// Note: `INDEX_POOL_LOCK` must be held.
+    static void quarantine_index_batch(counter_index_batch &batch) {
+        if(NUM_QUARANTINED_BATCHES == NUM_QUARANTINED_INDEX_BATCHES) {
+            counter_index_batch &oldest(QUARANTINE[OLDEST_QUARANTINED_BATCH]);
+            for(unsigned i(0); i < oldest.num_indexes; ++i) {
+                ASSERT(NUM_FREE_COUNTER_INDEXES < NUM_COUNTER_INDEXES);
+                FREE_COUNTER_INDEXES[NUM_FREE_COUNTER_INDEXES++] =
+                    oldest.indexes[i];
+            }
+            oldest = batch;
+            OLDEST_QUARANTINED_BATCH = (
+                OLDEST_QUARANTINED_BATCH + 1) % NUM_QUARANTINED_BATCHES;
+        } else {
+            QUARANTINE[(OLDEST_QUARANTINED_BATCH
+                + NUM_QUARANTINED_INDEX_BATCHES) % NUM_QUARANTINED_BATCHES] =
+                    batch;
+            ++NUM_QUARANTINED_INDEX_BATCHES;
+        }
+        batch.num_indexes = 0;
+    }
+
+
+    /// Return the next counter index.
+    ///
+    /// Note: Counter indexes are independent of inherited indexes.
+    uintptr_t next_counter_index(uintptr_t) {
+        uintptr_t index(NUM_COUNTER_INDEXES);
+
+        IF_KERNEL( eflags flags(granary_disable_interrupts()); )
+        counter_index_cache &cache(current_index_cache());
+        cache.lock.acquire();
+
+        // Common case: allocate from this CPU's cache; otherwise, refill the
+        // cache with a batch of indexes from the global pool.
+        if(!cache.free.num_indexes) {
+            INDEX_POOL_LOCK.acquire();
+            refill_index_batch(cache.free);
+            INDEX_POOL_LOCK.release();
+        }
+
+        if(cache.free.num_indexes) {
+            index = cache.free.indexes[--cache.free.num_indexes];
+        }
+
+        cache.lock.release();
+        IF_KERNEL( granary_store_flags(flags); )
+
+        return index;
+    }
+
+
+    /// Return a counter index to the pool of counter indexes.
+    void free_counter_index(uintptr_t counter_index) {
+        ASSERT(counter_index <= MAX_COUNTER_INDEX);
+
+        IF_KERNEL( eflags flags(granary_disable_interrupts()); )
+        counter_index_cache &cache(current_index_cache());
+        cache.lock.acquire();
+
+        cache.limbo.indexes[cache.limbo.num_indexes++] =
+            static_cast<uint16_t>(counter_index);
+
+        if(INDEX_BATCH_SIZE == cache.limbo.num_indexes) {
+            INDEX_POOL_LOCK.acquire();
+            quarantine_index_batch(cache.limbo);
+            INDEX_POOL_LOCK.release();
+        }
+
+        cache.lock.release();
+        IF_KERNEL( granary_store_flags(flags); )
+    }
+
+
+#   if !CONFIG_ENV_KERNEL
+    /// Return the counter indexes cached by an exiting thread to the global
+    /// pool. The indexes that the thread freed are quarantined as usual,
+    /// whereas the never-handed-out indexes are immediately re-usable. The
+    /// cache might be shared with other threads, which will just refill it.
+    static void drain_index_cache(void *cache_) {
+        counter_index_cache &cache(
+            *reinterpret_cast<counter_index_cache *>(cache_));
+        cache.lock.acquire();
+        INDEX_POOL_LOCK.acquire();
+
+        if(cache.limbo.num_indexes) {
+            quarantine_index_batch(cache.limbo);
+        }
+
+        for(unsigned i(0); i < cache.free.num_indexes; ++i) {
+            ASSERT(NUM_FREE_COUNTER_INDEXES < NUM_COUNTER_INDEXES);
+            FREE_COUNTER_INDEXES[NUM_FREE_COUNTER_INDEXES++] =
+                cache.free.indexes[i];
+        }
+        cache.free.num_indexes = 0;
+
+        INDEX_POOL_LOCK.release();
+        cache.lock.release();
+    }
+
+
+    /// The thread-exit hook is invoked by (instrumented) libc.
+    GRANARY_DETACH_POINT(drain_index_cache)
+#   endif
+
+
+    /// Returns the number of counter indexes in the global pool, i.e. those
+    /// that can be handed out to per-CPU caches.
+    uintptr_t num_pooled_counter_indexes(void) {
+        INDEX_POOL_LOCK.acquire();
+        const uintptr_t num_indexes(num_pooled_indexes());
+        INDEX_POOL_LOCK.release();
+        return num_indexes;
+    }
+
+#else
+
     /// Tracks the next counter index to be allocated.
     static std::atomic<uintptr_t> NEXT_COUNTER_INDEX = ATOMIC_VAR_INIT(0);
 
@@ -24,6 +328,60 @@ namespace client { namespace wp {
     }
 
 
+    /// Counter indexes are not recycled.
+    void free_counter_index(uintptr_t) { }
+
+
+    /// Returns the number of never-allocated counter indexes.
+    uintptr_t num_pooled_counter_indexes(void) {
+        const uintptr_t next_index(NEXT_COUNTER_INDEX.load());
+        return next_index < (MAX_COUNTER_INDEX + 1)
+            ? (MAX_COUNTER_INDEX + 1) - next_index
+            : 0;
+    }
+
+#endif /* WP_RECYCLE_COUNTER_INDEXES */
+
+
+#if WP_INLINE_FAST_PATHS
+    /// Inline fast paths are enabled by default.
+    bool ENABLE_INLINE_FAST_PATHS(true);
+
+
+    enum : unsigned {
+        /// Arithmetic flags, excluding the carry flag, which is clobbered by
+        /// the watched address check anyway.
+        CLOBBERED_ARITH_FLAGS = EFLAGS_READ_PF | EFLAGS_READ_AF
+                              | EFLAGS_READ_ZF | EFLAGS_READ_SF
+                              | EFLAGS_READ_OF
+    };
+
+
+    /// Try to get `num_scratch_regs` dead registers that a `Watcher` can
+    /// clobber, along with the arithmetic flags, in inline instrumentation.
+    bool watchpoint_tracker::get_inline_scratch_regs(
+        dynamorio::reg_id_t *scratch_regs,
+        unsigned num_scratch_regs
+    ) {
+        if(!ENABLE_INLINE_FAST_PATHS || (live_flags & CLOBBERED_ARITH_FLAGS)) {
+            return false;
+        }
+
+        // Only commit to using the registers if we can get all of them.
+        register_manager regs_after_scratch(live_regs);
+        for(unsigned i(0); i < num_scratch_regs; ++i) {
+            scratch_regs[i] = regs_after_scratch.get_zombie();
+            if(!scratch_regs[i]) {
+                return false;
+            }
+        }
+
+        live_regs = regs_after_scratch;
+        return true;
+    }
+#endif /* WP_INLINE_FAST_PATHS */
+
+
     /// Find memory operands that might need to be checked for watchpoints.
     /// If one is found, then num_ops is incremented, and the operand
     /// reference is stored in the passed array.
@@ -190,6 +548,206 @@ namespace client { namespace wp {
     }
 
 
+#if WP_ELIDE_UNWATCHED_CHECKS
+    /// Returns true iff the register or immediate operand `op` cannot hold a
+    /// watched address. Immediates must be non-negative 32-bit values so that
+    /// they can't contain the high-order watchpoint bits.
+    static bool is_unwatched_value(
+        const dynamorio::opnd_t &op,
+        register_manager &unwatched_regs
+    ) {
+        if(dynamorio::REG_kind == op.kind) {
+            return dynamorio::reg_is_gpr(op.value.reg)
+                && unwatched_regs.is_live(op.value.reg);
+        }
+
+        if(dynamorio::IMMED_INTEGER_kind == op.kind) {
+            return 0 <= op.value.immed_int
+                && op.value.immed_int <= 0xFFFFFFFFLL;
+        }
+
+        return false;
+    }
+
+
+    /// Returns true iff the address computed by the memory operand `op` cannot
+    /// be a watched address. This is the case for PC-relative and absolute
+    /// addresses, and for base/disp operands whose registers are all unwatched.
+    /// A scaled index might carry into the watchpoint bits, so it is treated
+    /// as potentially watched.
+    static bool is_unwatched_address(
+        const dynamorio::opnd_t &op,
+        register_manager &unwatched_regs
+    ) {
+        if(dynamorio::REL_ADDR_kind == op.kind) {
+            return true;
+        }
+
+        if(dynamorio::BASE_DISP_kind != op.kind) {
+            return false;
+        }
+
+        const dynamorio::reg_id_t base_reg(op.value.base_disp.base_reg);
+        const dynamorio::reg_id_t index_reg(op.value.base_disp.index_reg);
+
+        if(base_reg && !unwatched_regs.is_live(base_reg)) {
+            return false;
+        }
+
+        if(index_reg) {
+            return 1 >= op.value.base_disp.scale
+                && unwatched_regs.is_live(index_reg);
+        }
+
+        return true;
+    }
+
+
+    /// Update `unwatched_regs`, the registers known not to hold watched
+    /// addresses before `in`, to be those known not to hold watched addresses
+    /// after `in`. A register stays unwatched until it is redefined, and only
+    /// becomes unwatched again through a small set of address-preserving
+    /// definitions, e.g. register copies, `LEA`s, and small adjustments.
+    static void visit_unwatched_regs(
+        instruction in,
+        register_manager &unwatched_regs
+    ) {
+        dynamorio::instr_t *instr(in.instr);
+        const unsigned num_dests(dynamorio::instr_num_dsts(instr));
+        dynamorio::reg_id_t defined_reg(dynamorio::DR_REG_NULL);
+        bool defines_unwatched_reg(false);
+
+        if(1 == num_dests) {
+            const dynamorio::opnd_t dest(dynamorio::instr_get_dst(instr, 0));
+            if(dynamorio::REG_kind == dest.kind) {
+                defined_reg = dest.value.reg;
+            }
+        }
+
+        // Figure out if the (only) register defined by this instruction is
+        // derived only from unwatched values.
+        if(defined_reg) {
+            const dynamorio::opnd_t src0(dynamorio::instr_get_src(instr, 0));
+
+            switch(in.op_code()) {
+            case dynamorio::OP_mov_ld:
+            case dynamorio::OP_mov_st:
+            case dynamorio::OP_mov_imm:
+                defines_unwatched_reg = is_unwatched_value(
+                    src0, unwatched_regs);
+                break;
+
+            case dynamorio::OP_lea:
+                defines_unwatched_reg = is_unwatched_address(
+                    src0, unwatched_regs);
+                break;
+
+            // The second source is the defined register; small non-negative
+            // adjustments of unwatched addresses remain unwatched. Negative
+            // immediates are rejected, as they can borrow into the high-order
+            // watchpoint bits.
+            case dynamorio::OP_add:
+            case dynamorio::OP_sub:
+                defines_unwatched_reg = (
+                    is_unwatched_value(src0, unwatched_regs)
+                    && is_unwatched_value(
+                        dynamorio::instr_get_src(instr, 1), unwatched_regs));
+                break;
+
+            case dynamorio::OP_inc:
+            case dynamorio::OP_dec:
+                defines_unwatched_reg = is_unwatched_value(
+                    src0, unwatched_regs);
+                break;
+
+            default: break;
+            }
+        }
+
+        // Any register written by this instruction might now hold a watched
+        // address. The stack pointer is always treated as unwatched.
+        for(unsigned i(0); i < num_dests; ++i) {
+            const dynamorio::opnd_t dest(dynamorio::instr_get_dst(instr, i));
+            if(dynamorio::REG_kind != dest.kind
+            || !dynamorio::reg_is_gpr(dest.value.reg)) {
+                continue;
+            }
+
+            const dynamorio::reg_id_t dest_reg_64(
+                register_manager::scale(dest.value.reg, REG_64));
+            if(dynamorio::DR_REG_RSP == dest_reg_64) {
+                continue;
+            }
+
+#if !CONFIG_ENV_KERNEL
+            // Writes to 32-bit registers zero-extend, which clears all of the
+            // high-order watchpoint bits.
+            if(dynamorio::reg_is_32bit(dest.value.reg)) {
+                unwatched_regs.revive(dest_reg_64);
+                continue;
+            }
+#endif
+
+            unwatched_regs.kill(dest_reg_64);
+        }
+
+        // Writes to 8- and 16-bit registers keep the (possibly watched) high-
+        // order bits of the full register, so only 64-bit writes, and 32-bit
+        // writes (which zero-extend), can make a register unwatched.
+        if(defines_unwatched_reg
+        && (dynamorio::reg_is_64bit(defined_reg)
+            || dynamorio::reg_is_32bit(defined_reg))) {
+            unwatched_regs.revive(register_manager::scale(defined_reg, REG_64));
+        }
+    }
+
+
+    /// Returns the set of 64-bit general-purpose registers that are known not
+    /// to hold watched addresses immediately before `in`. This is a forward
+    /// pass from the beginning of the straight-line region containing `in`,
+    /// i.e. from just after the nearest preceding CTI or label.
+    register_manager find_unwatched_regs(instruction in) {
+        instruction first(in);
+        for(instruction prev(in.prev()); prev.is_valid(); prev = prev.prev()) {
+            if(prev.is_cti() || dynamorio::OP_LABEL == prev.op_code()) {
+                break;
+            }
+            first = prev;
+        }
+
+        // Only the stack pointer is known to be unwatched on entry.
+        register_manager unwatched_regs;
+        unwatched_regs.kill_all();
+
+        for(; first != in; first = first.next()) {
+            visit_unwatched_regs(first, unwatched_regs);
+        }
+
+        return unwatched_regs;
+    }
+
+
+    /// Remove the memory operands found by `find_memory_operand` whose
+    /// addresses are computed only from registers in `unwatched_regs`.
+    void drop_unwatched_operands(
+        watchpoint_tracker &tracker,
+        register_manager unwatched_regs
+    ) {
+        unsigned num_ops(0);
+        for(unsigned i(0); i < tracker.num_ops; ++i) {
+            if(is_unwatched_address(*(tracker.ops[i]), unwatched_regs)) {
+                continue;
+            }
+
+            tracker.ops[num_ops] = tracker.ops[i];
+            tracker.can_replace[num_ops] = tracker.can_replace[i];
+            ++num_ops;
+        }
+        tracker.num_ops = num_ops;
+    }
+#endif /* WP_ELIDE_UNWATCHED_CHECKS */
+
+
     /// Small state machine to track whether or not we can clobber the carry
     /// flag. The carry flag is relevant because we use the BT instruction to
     /// determine if the address is a watched address.
@@ -265,7 +823,7 @@ namespace client { namespace wp {
         for(instruction in(ls.last()), prev_in; in.is_valid(); in = prev_in) {
 
             if(in.is_mangled() || in.is_cti()) {
-                live_regs.visit(in);
+                visit_live_registers(in, live_regs);
                 prev_in = in.prev();
                 continue;
             }
@@ -335,7 +893,7 @@ namespace client { namespace wp {
             }
 
             if(!live_regs_visited) {
-                live_regs.visit(prev_in);
+                visit_live_registers(prev_in, live_regs);
             }
 
             // No region.
@@ -383,6 +941,38 @@ namespace client { namespace wp {
     }
 
 
+#if CONFIG_DEBUG_PERF_COUNTS
+    /// Returns the number of dead general-purpose registers in `regs`.
+    static unsigned count_dead_regs(register_manager regs) {
+        unsigned num_dead_regs(0);
+        for(; regs.get_zombie(); ++num_dead_regs) { }
+        return num_dead_regs;
+    }
+
+
+    /// Count the registers that the instrumentation of one instruction
+    /// stole, but that would have been spilled if only the liveness within
+    /// the basic block were known. Without inter-block liveness, only the
+    /// registers that are dead within the block could have been stolen, and
+    /// the rest would have been spilled.
+    void visit_removed_spills(
+        register_manager live_regs_before,
+        register_manager live_regs_after,
+        register_manager block_live_regs
+    ) {
+        const unsigned num_stolen_regs(
+            count_dead_regs(live_regs_before)
+            - count_dead_regs(live_regs_after));
+        const unsigned num_block_dead_regs(count_dead_regs(block_live_regs));
+
+        if(num_stolen_regs > num_block_dead_regs) {
+            perf::visit_removed_reg_spills(
+                num_stolen_regs - num_block_dead_regs);
+        }
+    }
+#endif /* CONFIG_DEBUG_PERF_COUNTS */
+
+
     /// Mangle something of the form `PUSH ...(...)`.
     static instruction mangle_push(
         watchpoint_tracker &tracker,
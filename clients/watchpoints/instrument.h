@@ -204,6 +204,12 @@ namespace client {
             bool restore_carry_flag_after;
 
 
+            /// `EFLAGS_READ_*` bits of the flags that are live before the
+            /// instruction. The carry flag is separately saved and restored
+            /// around the watchpoint instrumentation when necessary.
+            unsigned live_flags;
+
+
             /// Replace/update operands around the memory instruction. This will
             /// update the `labels` field of the `operand_tracker` with labels in
             /// instruction stream so that a `Watcher` can inject its own specific
@@ -238,6 +244,20 @@ namespace client {
             /// Post-process that instrumented instructions. This looks for
             /// minor peephole optimisation opportunities.
             void post_process_instructions(granary::instruction_list &ls);
+
+
+#if WP_INLINE_FAST_PATHS
+            /// Try to get `num_scratch_regs` dead registers that a `Watcher`
+            /// can clobber, along with the arithmetic flags, in inline
+            /// instrumentation added at the labels of this instruction.
+            /// Returns false, and takes no registers, if the flags are live or
+            /// if there aren't enough dead registers; in that case the
+            /// `Watcher` should fall back to an out-of-line routine.
+            bool get_inline_scratch_regs(
+                dynamorio::reg_id_t *scratch_regs,
+                unsigned num_scratch_regs
+            ) ;
+#endif /* WP_INLINE_FAST_PATHS */
         };
 
 
@@ -259,6 +279,49 @@ namespace client {
         ) ;
 
 
+#if CONFIG_DEBUG_PERF_COUNTS
+        /// Count the registers that the instrumentation of one instruction
+        /// stole, but that would have been spilled if only the liveness
+        /// within the basic block were known. `live_regs_before` and
+        /// `live_regs_after` are the tracker's live registers before and after
+        /// instrumenting the instruction, and `block_live_regs` are the
+        /// registers that are live there according to the basic block alone.
+        void visit_removed_spills(
+            granary::register_manager live_regs_before,
+            granary::register_manager live_regs_after,
+            granary::register_manager block_live_regs
+        ) ;
+#endif /* CONFIG_DEBUG_PERF_COUNTS */
+
+
+#if WP_INLINE_FAST_PATHS
+        /// True iff `watchpoint_tracker::get_inline_scratch_regs` can succeed.
+        /// This exists so that benchmarks can compare the inline and out-of-
+        /// line forms of the instrumentation; the code cache must be flushed
+        /// after changing it.
+        extern bool ENABLE_INLINE_FAST_PATHS;
+#endif /* WP_INLINE_FAST_PATHS */
+
+
+#if WP_ELIDE_UNWATCHED_CHECKS
+        /// Returns the set of 64-bit general-purpose registers that are known
+        /// not to hold watched addresses immediately before `in`. The set is
+        /// represented as the live registers of the returned manager.
+        granary::register_manager find_unwatched_regs(
+            granary::instruction in
+        ) ;
+
+
+        /// Remove the memory operands found by `find_memory_operand` whose
+        /// addresses are computed only from registers in `unwatched_regs`.
+        /// Such operands never need to be checked for watchpoints.
+        void drop_unwatched_operands(
+            watchpoint_tracker &tracker,
+            granary::register_manager unwatched_regs
+        ) ;
+#endif /* WP_ELIDE_UNWATCHED_CHECKS */
+
+
 #endif /* GRANARY_DONT_INCLUDE_CSTDLIB */
 
 
@@ -389,10 +452,22 @@ namespace client {
         }
 
 
-        /// Return the next counter index.
+        /// Return the next counter index. If no counter indexes are
+        /// available then an index greater than `MAX_COUNTER_INDEX` is
+        /// returned.
         uintptr_t next_counter_index(uintptr_t inherited_index=0) ;
 
 
+        /// Return a counter index to the pool of counter indexes. The index
+        /// is quarantined for a while before being re-used.
+        void free_counter_index(uintptr_t counter_index) ;
+
+
+        /// Returns the number of counter indexes in the global pool, which
+        /// excludes indexes cached by CPUs and quarantined indexes.
+        uintptr_t num_pooled_counter_indexes(void) ;
+
+
         /// Destructure a combined index into its counter and inherited indexes.
         inline void destructure_combined_index(
             const uintptr_t index,
@@ -425,11 +500,14 @@ namespace client {
         /// Note: This assumes that the address is watched.
         ///
         /// Note: This does not remove the association in the descriptor table.
+        ///       The counter index of the descriptor is recycled after a
+        ///       grace period.
         template <typename T>
         void free_descriptor_of(T ptr_) {
             typedef typename descriptor_type<T>::type desc_type;
             const uintptr_t index(combined_index_of(ptr_));
             desc_type::free(desc_type::access(index), index);
+            free_counter_index(counter_index_of(ptr_));
         }
 
 
@@ -637,10 +715,15 @@ namespace client {
             using namespace granary;
 
             instruction prev_in;
-            register_manager next_live_regs;
+            live_state next_live;
             wp::watchpoint_tracker tracker;
             bool next_reads_carry_flag(true);
 
+            // Live registers according to the basic block alone, i.e. if all
+            // registers are assumed live at the end of the block. Only used
+            // to count the spills removed by inter-block liveness.
+            IF_PERF( register_manager next_block_live_regs; )
+
             IF_KERNEL( const bool in_user_access_zone(
                 WP_CHECK_FOR_USER_ADDRESS || accesses_user_data()); )
 
@@ -655,8 +738,8 @@ namespace client {
                 memset(&tracker, 0, sizeof tracker);
                 tracker.in = in;
                 tracker.policy = *this;
-                tracker.live_regs = next_live_regs;
-                tracker.live_regs_after = next_live_regs;
+                tracker.live_regs = next_live.regs;
+                tracker.live_regs_after = next_live.regs;
 
                 // Makes it so that we can't overwrite any registers used in
                 // the instruction.
@@ -665,14 +748,25 @@ namespace client {
                 }
                 tracker.live_regs.revive(in);
 
+                IF_PERF( register_manager block_live_regs(
+                    next_block_live_regs);
+                block_live_regs.revive(in);
+                next_block_live_regs.visit(in); )
+
                 // Track the carry flag. The carry flag will be used to detect
                 // watched addresses.
                 tracker.track_carry_flag(next_reads_carry_flag);
 
                 // Compute live regs for next iteration based on this
                 // instruction (before it is potentially modified, which would
-                // corrupt the live reg set going forward).
-                next_live_regs.visit(in);
+                // corrupt the live reg set going forward). This looks through
+                // direct CTIs into the liveness of their targets.
+                visit_live_state(in, next_live);
+                tracker.live_flags = next_live.flags;
+                if(in.is_cti()) {
+                    next_reads_carry_flag = !!(
+                        next_live.flags & EFLAGS_READ_CF);
+                }
 
                 // Ignore two special purpose instructions which have memory-
                 // like operands but don't actually touch memory.
@@ -689,6 +783,18 @@ namespace client {
 
                 // Try to find memory operations.
                 in.for_each_operand(wp::find_memory_operand, tracker);
+
+#if WP_ELIDE_UNWATCHED_CHECKS
+                // Don't check operands whose addresses are already known not
+                // to be watched, e.g. because an earlier instruction in the
+                // block derived the address from the stack pointer.
+                register_manager unwatched_regs;
+                if(tracker.num_ops) {
+                    unwatched_regs = wp::find_unwatched_regs(in);
+                    wp::drop_unwatched_operands(tracker, unwatched_regs);
+                }
+#endif /* WP_ELIDE_UNWATCHED_CHECKS */
+
                 if(!tracker.num_ops) {
                     continue;
                 }
@@ -708,6 +814,8 @@ namespace client {
                 // and figure out what registers can never be spilled.
                 tracker.spill_regs.kill_all();
                 tracker.spill_regs.revive(in);
+                IF_PERF( const register_manager live_regs_before(
+                    tracker.live_regs); )
 
                 // Mangle the instruction. This makes it "safer" for use by
                 // later generic watchpoint instrumentation.
@@ -717,6 +825,9 @@ namespace client {
                     tracker.writes_to_rsp = false;
                     in = tracker.in;
                     in.for_each_operand(wp::find_memory_operand, tracker);
+#if WP_ELIDE_UNWATCHED_CHECKS
+                    wp::drop_unwatched_operands(tracker, unwatched_regs);
+#endif /* WP_ELIDE_UNWATCHED_CHECKS */
                 }
 
                 // Apply generic watchpoint instrumentation to the necessary
@@ -737,6 +848,9 @@ namespace client {
                         Watcher::visit_write(bb, ls, tracker, i);
                     }
                 }
+
+                IF_PERF( wp::visit_removed_spills(
+                    live_regs_before, tracker.live_regs, block_live_regs); )
             }
 
             // Apply any minor peephole optimisations to get rid of redundant
@@ -60,6 +60,7 @@ namespace client {
 
         mangled_address target(isf.instruction_pointer, policy);
         app_pc translated_target(nullptr);
+        code_cache::refresh_cpu_cache(cpu);
         if(!cpu->code_cache.load(target.as_address, translated_target)) {
             IF_PERF( perf::visit_address_lookup_cpu(false); )
             translated_target = code_cache::find(cpu, target);
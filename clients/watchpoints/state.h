@@ -9,12 +9,6 @@
 #ifndef WATCHPOINTS_STATE_H_
 #define WATCHPOINTS_STATE_H_
 
-/// Bounds checking watchpoint tool.
-#ifdef CLIENT_WATCHPOINT_BOUND
-#   include "clients/watchpoints/clients/bounds_checker/state.h"
-#endif
-
-
 /// Tool that detects when our user-access detection method would have caused
 /// an error.
 #ifdef CLIENT_WATCHPOINT_USER
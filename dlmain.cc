@@ -14,6 +14,8 @@
 #include "granary/attach.h"
 #include "granary/detach.h"
 #include "granary/perf.h"
+#include "granary/trace_log.h"
+#include "granary/persistent_cache.h"
 #include "clients/report.h"
 #include <ucontext.h>
 
@@ -100,6 +102,10 @@ extern "C" {
 #endif
 #if CONFIG_DEBUG_PERF_COUNTS
         granary::perf::report();
+#endif
+        IF_TRACE( granary::trace_log::flush(); )
+#if CONFIG_PERSISTENT_CODE_CACHE
+        granary::persistent_cache::save();
 #endif
     }
 
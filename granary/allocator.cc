@@ -14,9 +14,14 @@
 extern "C" {
     /// Mark a range of memory as being executable.
     extern void kernel_make_pages_executable(void *begin, void *end);
+
+
+    /// Returns the NUMA node of the current CPU.
+    extern int kernel_get_numa_node(void);
 }
 #else
 #   include <sys/mman.h>
+#   include <sys/syscall.h>
 #   include <unistd.h>
 #   define PROT_ALL (~0)
 #   ifndef MAP_ANONYMOUS
@@ -94,6 +99,29 @@ namespace granary { namespace detail {
     static void *FRAGMENT_SLABS[MAX_NUM_FRAGMENT_SLABS] = {NULL};
 
 
+    /// A range of freed executable memory. The descriptor of the range is
+    /// stored in the freed memory itself.
+    struct free_executable_range {
+        free_executable_range *next;
+        uintptr_t size;
+    };
+
+
+    /// Freed code cache and gencode memory, indexed by the kind of executable
+    /// memory. Freed ranges are only reused by allocations of exactly the same
+    /// size, which is the common case because all executable memory is
+    /// allocated in slabs.
+    static free_executable_range *FREE_EXECUTABLE_RANGES[EXEC_WRAPPER] = {
+        nullptr
+    };
+    static atomic_spin_lock FREE_EXECUTABLE_RANGES_LOCK;
+
+
+    /// Number of bytes of the code cache (i.e. fragment memory) that are
+    /// currently allocated.
+    static std::atomic<uintptr_t> CODE_CACHE_BYTES_IN_USE(ATOMIC_VAR_INIT(0));
+
+
     /// Given an arbitrary address into a basic block, we want to be able to find
     /// the associated basic block info / meta-data. The approach is to first find
     /// the slab to which the basic block belongs, and then from there binary search
@@ -126,9 +154,45 @@ namespace granary { namespace detail {
     }
 
 
+    /// Try to allocate some previously freed executable memory.
+    static uintptr_t allocate_free_executable(uintptr_t size, int where) {
+        if(!FREE_EXECUTABLE_RANGES[where]) {
+            return 0;
+        }
+
+        uintptr_t mem(0);
+        FREE_EXECUTABLE_RANGES_LOCK.acquire();
+        free_executable_range **prev_next(&(FREE_EXECUTABLE_RANGES[where]));
+        for(free_executable_range *range(*prev_next);
+            range;
+            prev_next = &(range->next), range = range->next) {
+
+            if(range->size == size) {
+                *prev_next = range->next;
+                mem = reinterpret_cast<uintptr_t>(range);
+                break;
+            }
+        }
+        FREE_EXECUTABLE_RANGES_LOCK.release();
+        return mem;
+    }
+
+
     void *global_allocate_executable(uintptr_t size, int where) {
 
         uintptr_t mem = 0;
+        if(EXEC_WRAPPER != where) {
+            mem = allocate_free_executable(size, where);
+        }
+
+        if(EXEC_CODE_CACHE == where) {
+            CODE_CACHE_BYTES_IN_USE.fetch_add(size);
+        }
+
+        if(mem) {
+            return memset((void *) mem, 0xCC, size);
+        }
+
         switch(where) {
 
         // Code cache pages are allocated from the beginning
@@ -166,8 +230,61 @@ namespace granary { namespace detail {
     }
 
 
-    void global_free_executable(void *, uintptr_t) {
-        // NO-OP.
+    /// Free some executable memory. Wrapper memory is never freed, as the
+    /// addresses of wrappers can leak to native code.
+    void global_free_executable(void *addr, uintptr_t size) {
+        int where(EXEC_WRAPPER);
+        if(is_code_cache_address(reinterpret_cast<app_pc>(addr))) {
+            where = EXEC_CODE_CACHE;
+            CODE_CACHE_BYTES_IN_USE.fetch_sub(size);
+        } else if(is_gencode_address(reinterpret_cast<app_pc>(addr))) {
+            where = EXEC_GEN_CODE;
+        } else {
+            return;
+        }
+
+        ASSERT(sizeof(free_executable_range) <= size);
+
+        free_executable_range *range(
+            reinterpret_cast<free_executable_range *>(addr));
+        range->size = size;
+
+        FREE_EXECUTABLE_RANGES_LOCK.acquire();
+        range->next = FREE_EXECUTABLE_RANGES[where];
+        FREE_EXECUTABLE_RANGES[where] = range;
+        FREE_EXECUTABLE_RANGES_LOCK.release();
+    }
+
+
+    /// Returns the number of bytes of the code cache that are currently
+    /// allocated.
+    uintptr_t code_cache_bytes_in_use(void) {
+        return CODE_CACHE_BYTES_IN_USE.load();
+    }
+
+
+#if !CONFIG_ENV_KERNEL
+    /// The NUMA node of the current thread, plus one. Threads rarely migrate
+    /// between nodes, so this is only computed once per thread.
+    static __thread unsigned NUMA_NODE(0);
+#endif
+
+
+    /// Returns the NUMA node of the current CPU (thread, in user space).
+    unsigned current_numa_node(void) {
+#if CONFIG_ENV_KERNEL
+        return static_cast<unsigned>(kernel_get_numa_node()) % MAX_NUMA_NODES;
+#else
+        if(unlikely(!NUMA_NODE)) {
+            unsigned cpu(0);
+            unsigned node(0);
+            if(0 != syscall(SYS_getcpu, &cpu, &node, nullptr)) {
+                node = 0;
+            }
+            NUMA_NODE = (node % MAX_NUMA_NODES) + 1;
+        }
+        return NUMA_NODE - 1;
+#endif
     }
 }}
 
@@ -232,10 +349,14 @@ namespace granary { namespace detail {
     static std::atomic<unsigned> HEAP_INDEX(ATOMIC_VAR_INIT(0));
 
 
-    /// Free lists, based on size.
+    /// Free lists for large objects, based on size.
     static free_list FREE_LISTS[NUM_FREE_LISTS];
 
 
+    /// Number of bytes taken by currently allocated large objects.
+    static std::atomic<uintptr_t> NUM_LARGE_OBJECT_BYTES(ATOMIC_VAR_INIT(0));
+
+
     /// Returns the log base 2 of a number.
     static inline uint32_t log_base_2(uintptr_t x) {
         return ((UNSIGNED_LONG_NUM_BITS - 1) - __builtin_clzl(x));
@@ -271,6 +392,9 @@ namespace granary { namespace detail {
 
 
 #if ENABLE_SPLITTING
+    static void free_large(void *addr, uintptr_t size_) ;
+
+
     /// Try to split a large heap object into a smaller heap object.
     __attribute__((hot))
     static free_object *split_large_object(unsigned scale) {
@@ -305,7 +429,7 @@ namespace granary { namespace detail {
         const unsigned object_size(allocation_size(
             1 << (scale + MIN_SCALE)));
 
-        global_free(
+        free_large(
             &(unsafe_cast<uint8_t *>(object)[object_size / 2]),
             object_size / 2
         );
@@ -315,12 +439,8 @@ namespace granary { namespace detail {
 #endif
 
 
-    /// Allocate some data from the heap.
-    __attribute__((hot))
-    void *global_allocate(uintptr_t size_) {
-
-        ASSERT(0 < size_);
-
+    /// Allocate a large object from the power-of-two free lists.
+    static void *allocate_large(uintptr_t size_) {
         const uintptr_t size(allocation_size(size_));
         const unsigned scale(log_base_2(size) - MIN_SCALE);
 
@@ -346,6 +466,7 @@ namespace granary { namespace detail {
                 FAULT_IF(next_heap_index >= HEAP_SIZE);
 #endif
 
+                NUM_LARGE_OBJECT_BYTES.fetch_add(size);
                 return &(HEAP[curr_heap_index]);
             } else {
                 free_object *object(nullptr);
@@ -362,6 +483,7 @@ namespace granary { namespace detail {
                 FREE_LISTS[scale].head.store(object->next);
                 FREE_LISTS[scale].lock.release();
 
+                NUM_LARGE_OBJECT_BYTES.fetch_add(size);
                 return object;
             }
         };
@@ -370,14 +492,8 @@ namespace granary { namespace detail {
     }
 
 
-    /// Free some memory back to the heap.
-    __attribute__((hot))
-    void global_free(void *addr, uintptr_t size_) {
-
-        if(!is_heap_address(addr)) {
-            return;
-        }
-
+    /// Free a large object back to the power-of-two free lists.
+    static void free_large(void *addr, uintptr_t size_) {
         const uintptr_t size(allocation_size(size_));
         const unsigned scale(log_base_2(size) - MIN_SCALE);
 
@@ -388,10 +504,382 @@ namespace granary { namespace detail {
         new_free->next = next_free;
         FREE_LISTS[scale].head.store(new_free);
         FREE_LISTS[scale].lock.release();
+
+        NUM_LARGE_OBJECT_BYTES.fetch_sub(size);
+    }
+
+
+
+
+
+    enum {
+        NUM_SMALL_CLASSES = NUM_HEAP_SIZE_CLASSES,
+
+        /// Number of size classes whose sizes are multiples of 8 or 16 bytes.
+        /// Above this, each power of two is split into 4 size classes.
+        NUM_LINEAR_CLASSES = 10,
+        MAX_LINEAR_CLASS_SIZE = 128,
+        LINEAR_CLASS_SCALE = 7,
+
+        /// Size of each chunk of the heap that is carved into objects of a
+        /// single size class.
+        HEAP_SLAB_SIZE = 64 * 1024,
+
+        /// Objects are moved between CPU magazines and the depot in batches.
+        /// A batch holds roughly `BATCH_SIZE_BYTES` bytes of objects.
+        BATCH_SIZE_BYTES = 4096,
+        MIN_BATCH_SIZE = 2,
+        MAX_BATCH_SIZE = 32
+    };
+
+
+    /// Maps `(size - 1) / 8` to a size class, for sizes up to
+    /// `MAX_LINEAR_CLASS_SIZE`.
+    static const uint8_t LINEAR_SIZE_CLASSES[MAX_LINEAR_CLASS_SIZE / 8] = {
+        0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9
+    };
+
+
+    /// Sizes of the linear size classes.
+    static const uint8_t LINEAR_CLASS_SIZES[NUM_LINEAR_CLASSES] = {
+        8, 16, 24, 32, 48, 64, 80, 96, 112, 128
+    };
+
+
+    static_assert(MAX_SMALL_HEAP_OBJECT_SIZE == (1 << (LINEAR_CLASS_SCALE
+        + (NUM_SMALL_CLASSES - NUM_LINEAR_CLASSES) / 4)),
+        "The number of small size classes doesn't match the maximum size.");
+
+
+    /// Returns the size class of a small object of `size` bytes.
+    __attribute__((hot))
+    static inline unsigned size_class(uintptr_t size) {
+        if(size <= MAX_LINEAR_CLASS_SIZE) {
+            return LINEAR_SIZE_CLASSES[(size - 1) / 8];
+        }
+
+        // 2^scale < size <= 2^(scale + 1)
+        const unsigned scale(log_base_2(size - 1));
+        return NUM_LINEAR_CLASSES
+             + ((scale - LINEAR_CLASS_SCALE) * 4)
+             + static_cast<unsigned>(
+                 (size - 1 - (1UL << scale)) >> (scale - 2));
+    }
+
+
+    /// Returns the size of each object in size class `cls`.
+    static inline unsigned class_size(unsigned cls) {
+        if(cls < NUM_LINEAR_CLASSES) {
+            return LINEAR_CLASS_SIZES[cls];
+        }
+
+        const unsigned index(cls - NUM_LINEAR_CLASSES);
+        const unsigned scale(LINEAR_CLASS_SCALE + (index / 4));
+        return (1U << scale) + (((index % 4) + 1) << (scale - 2));
+    }
+
+
+    /// Returns the number of objects moved at once between a magazine of
+    /// class `cls` and the depot.
+    static inline unsigned batch_size(unsigned cls) {
+        const unsigned num_objects(BATCH_SIZE_BYTES / class_size(cls));
+        if(num_objects < MIN_BATCH_SIZE) {
+            return MIN_BATCH_SIZE;
+        } else if(num_objects > MAX_BATCH_SIZE) {
+            return MAX_BATCH_SIZE;
+        }
+        return num_objects;
+    }
+
+
+    /// Shared depot of free objects of one size class. CPU magazines are
+    /// refilled from, and overflow into, the depot in batches. When the depot
+    /// is empty, new objects are carved from the class's current slab.
+    struct heap_depot {
+        atomic_spin_lock lock;
+
+        /// Free objects, chained through their first word.
+        free_object *head;
+
+        /// Unused part of the current slab of this class.
+        uint8_t *slab_next;
+        uint8_t *slab_end;
+
+        /// Number of bytes of slabs carved up for this class.
+        std::atomic<uintptr_t> num_slab_bytes;
+
+        /// Objects allocated or freed before the allocating or freeing CPU
+        /// had a magazine.
+        std::atomic<uintptr_t> num_allocs;
+        std::atomic<uintptr_t> num_frees;
+        std::atomic<uintptr_t> num_requested_bytes;
+    } __attribute__((aligned (CONFIG_ARCH_CACHE_LINE_SIZE)));
+
+
+    /// Depots for each size class.
+    static heap_depot HEAP_DEPOTS[NUM_SMALL_CLASSES];
+
+
+    /// Returns the current CPU's heap magazines, or `nullptr` if the CPU's
+    /// state hasn't yet been allocated. In kernel space, interrupts must be
+    /// disabled.
+    static inline heap_cache *current_heap_cache(void) {
+        cpu_state *cpu(current_cpu_state());
+        return cpu ? &(cpu->heap_cache) : nullptr;
+    }
+
+
+    /// Take up to `max_num_objects` objects out of a depot. The depot must be
+    /// locked. Returns the first object of a chain of `num_objects` objects.
+    static free_object *take_from_depot(
+        heap_depot &depot,
+        unsigned cls,
+        unsigned max_num_objects,
+        unsigned &num_objects
+    ) {
+        free_object *first(depot.head);
+        num_objects = 0;
+
+        // Reuse previously freed objects.
+        if(first) {
+            free_object *last(first);
+            for(num_objects = 1;
+                num_objects < max_num_objects && last->next;
+                ++num_objects) {
+                last = last->next;
+            }
+            depot.head = last->next;
+            last->next = nullptr;
+            return first;
+        }
+
+        // Carve new objects out of this class's slab.
+        const uintptr_t object_size(class_size(cls));
+        if((depot.slab_next + object_size) > depot.slab_end) {
+            const unsigned curr_heap_index(
+                HEAP_INDEX.fetch_add(HEAP_SLAB_SIZE));
+            FAULT_IF((curr_heap_index + HEAP_SLAB_SIZE) > HEAP_SIZE);
+
+            depot.slab_next = &(HEAP[curr_heap_index]);
+            depot.slab_end = depot.slab_next + HEAP_SLAB_SIZE;
+            depot.num_slab_bytes.fetch_add(HEAP_SLAB_SIZE);
+        }
+
+        const uintptr_t num_slab_objects(
+            (depot.slab_end - depot.slab_next) / object_size);
+        num_objects = max_num_objects;
+        if(num_slab_objects < num_objects) {
+            num_objects = static_cast<unsigned>(num_slab_objects);
+        }
+
+        first = unsafe_cast<free_object *>(depot.slab_next);
+        free_object *object(first);
+        for(unsigned i(1); i < num_objects; ++i) {
+            object->next = unsafe_cast<free_object *>(
+                unsafe_cast<uint8_t *>(object) + object_size);
+            object = object->next;
+        }
+        object->next = nullptr;
+        depot.slab_next += num_objects * object_size;
+        return first;
+    }
+
+
+    /// Refill an empty magazine with a batch of objects from the depot.
+    static void refill_magazine(heap_magazine &magazine, unsigned cls) {
+        heap_depot &depot(HEAP_DEPOTS[cls]);
+        unsigned num_objects(0);
+        depot.lock.acquire();
+        magazine.head = take_from_depot(
+            depot, cls, batch_size(cls), num_objects);
+        depot.lock.release();
+        magazine.num_objects = num_objects;
+    }
+
+
+    /// Return a batch of objects from an overfull magazine to the depot.
+    static void drain_magazine(heap_magazine &magazine, unsigned cls) {
+        const unsigned num_objects(batch_size(cls));
+        free_object *first(unsafe_cast<free_object *>(magazine.head));
+        free_object *last(first);
+        for(unsigned i(1); i < num_objects; ++i) {
+            last = last->next;
+        }
+
+        magazine.head = last->next;
+        magazine.num_objects -= num_objects;
+
+        heap_depot &depot(HEAP_DEPOTS[cls]);
+        depot.lock.acquire();
+        last->next = depot.head;
+        depot.head = first;
+        depot.lock.release();
+    }
+
+
+    /// Allocate some data from the heap. Small objects come from the current
+    /// CPU's magazine of the object's size class.
+    __attribute__((hot))
+    void *global_allocate(uintptr_t size) {
+
+        ASSERT(0 < size);
+
+        if(unlikely(MAX_SMALL_HEAP_OBJECT_SIZE < size)) {
+            return allocate_large(size);
+        }
+
+        const unsigned cls(size_class(size));
+        free_object *object(nullptr);
+
+        IF_KERNEL( eflags flags(granary_disable_interrupts()); )
+        heap_cache *cache(current_heap_cache());
+
+        if(likely(nullptr != cache)) {
+            heap_magazine &magazine(cache->magazines[cls]);
+            if(unlikely(!magazine.head)) {
+                refill_magazine(magazine, cls);
+            }
+
+            object = unsafe_cast<free_object *>(magazine.head);
+            magazine.head = object->next;
+            magazine.num_objects -= 1;
+            magazine.num_allocs += 1;
+            magazine.num_requested_bytes += size;
+
+        // The CPU's state, and therefore its magazines, don't yet exist.
+        } else {
+            heap_depot &depot(HEAP_DEPOTS[cls]);
+            unsigned num_objects(0);
+            depot.lock.acquire();
+            object = take_from_depot(depot, cls, 1, num_objects);
+            depot.lock.release();
+            depot.num_allocs.fetch_add(1);
+            depot.num_requested_bytes.fetch_add(size);
+        }
+
+        IF_KERNEL( granary_store_flags(flags); )
+        return object;
+    }
+
+
+    /// Free some memory back to the heap.
+    __attribute__((hot))
+    void global_free(void *addr, uintptr_t size_) {
+
+        if(!is_heap_address(addr)) {
+            return;
+        }
+
+        const uintptr_t size(size_ ? size_ : 1);
+        if(unlikely(MAX_SMALL_HEAP_OBJECT_SIZE < size)) {
+            free_large(addr, size);
+            return;
+        }
+
+        const unsigned cls(size_class(size));
+        free_object *object(unsafe_cast<free_object *>(addr));
+
+        IF_KERNEL( eflags flags(granary_disable_interrupts()); )
+        heap_cache *cache(current_heap_cache());
+
+        if(likely(nullptr != cache)) {
+            heap_magazine &magazine(cache->magazines[cls]);
+            object->next = unsafe_cast<free_object *>(magazine.head);
+            magazine.head = object;
+            magazine.num_objects += 1;
+            magazine.num_frees += 1;
+            magazine.num_requested_bytes -= size;
+
+            if(unlikely(magazine.num_objects >= (2 * batch_size(cls)))) {
+                drain_magazine(magazine, cls);
+            }
+        } else {
+            heap_depot &depot(HEAP_DEPOTS[cls]);
+            depot.lock.acquire();
+            object->next = depot.head;
+            depot.head = object;
+            depot.lock.release();
+            depot.num_frees.fetch_add(1);
+            depot.num_requested_bytes.fetch_sub(size);
+        }
+
+        IF_KERNEL( granary_store_flags(flags); )
+    }
+
+
+    /// Return the free objects in the magazines of `cache` to the depots.
+    void flush_heap_cache(heap_cache &cache) {
+        for(unsigned cls(0); cls < NUM_SMALL_CLASSES; ++cls) {
+            heap_magazine &magazine(cache.magazines[cls]);
+            free_object *first(unsafe_cast<free_object *>(magazine.head));
+            if(!first) {
+                continue;
+            }
+
+            free_object *last(first);
+            for(; last->next; last = last->next) { }
+
+            heap_depot &depot(HEAP_DEPOTS[cls]);
+            depot.lock.acquire();
+            last->next = depot.head;
+            depot.head = first;
+            depot.lock.release();
+
+            magazine.head = nullptr;
+            magazine.num_objects = 0;
+        }
+    }
+
+
+    /// Add the magazine counters of one CPU into the heap statistics.
+    static void add_heap_cache_statistics(
+        const heap_cache *cache,
+        heap_statistics &stats
+    ) {
+        for(unsigned cls(0); cls < NUM_SMALL_CLASSES; ++cls) {
+            const heap_magazine &magazine(cache->magazines[cls]);
+            heap_class_statistics &class_stats(stats.classes[cls]);
+            class_stats.num_live_objects += magazine.num_allocs;
+            class_stats.num_live_objects -= magazine.num_frees;
+            class_stats.num_requested_bytes += magazine.num_requested_bytes;
+        }
+    }
+
+
+    static void add_cpu_heap_statistics(cpu_state *cpu, void *stats) {
+        add_heap_cache_statistics(
+            &(cpu->heap_cache), *reinterpret_cast<heap_statistics *>(stats));
+    }
+
+
+    /// Get a snapshot of the heap's occupancy statistics.
+    void get_heap_statistics(heap_statistics &stats) {
+        memset(&stats, 0, sizeof stats);
+        stats.num_heap_bytes = HEAP_INDEX.load();
+        stats.num_large_object_bytes = NUM_LARGE_OBJECT_BYTES.load();
+
+        for(unsigned cls(0); cls < NUM_SMALL_CLASSES; ++cls) {
+            heap_depot &depot(HEAP_DEPOTS[cls]);
+            heap_class_statistics &class_stats(stats.classes[cls]);
+            class_stats.object_size = class_size(cls);
+            class_stats.num_slab_bytes = depot.num_slab_bytes.load();
+            class_stats.num_live_objects = depot.num_allocs.load();
+            class_stats.num_live_objects -= depot.num_frees.load();
+            class_stats.num_requested_bytes = depot.num_requested_bytes.load();
+        }
+
+        for_each_cpu_state(&add_cpu_heap_statistics, &stats);
     }
 }}
 
 
+namespace granary {
+    bool is_heap_address(const const_app_pc addr) {
+        return detail::is_heap_address(const_cast<app_pc>(addr));
+    }
+}
+
+
 /// Add some illegal detach points.
 GRANARY_DETACH_POINT_ERROR(granary::detail::global_allocate)
 GRANARY_DETACH_POINT_ERROR(granary::detail::global_free)
@@ -42,12 +42,95 @@ namespace granary {
         void global_free_executable(void *addr, unsigned long size) ;
 
 
+        /// Returns the number of bytes of the code cache that are currently
+        /// allocated.
+        unsigned long code_cache_bytes_in_use(void) ;
+
+
+        /// Returns the NUMA node on which the current CPU (thread, in user
+        /// space) is running, modulo `MAX_NUMA_NODES`. This is only a hint, as
+        /// the CPU or thread might migrate.
+        unsigned current_numa_node(void) ;
+
+
         /// Allocate some non-executable memory.
         void *global_allocate(unsigned long size) ;
 
 
         /// Free some globally allocated memory.
         void global_free(void *addr, unsigned long) ;
+
+
+        enum {
+            /// Number of size classes of small heap objects. Small objects
+            /// are at most `MAX_SMALL_HEAP_OBJECT_SIZE` bytes.
+            NUM_HEAP_SIZE_CLASSES = 30,
+            MAX_SMALL_HEAP_OBJECT_SIZE = 4096
+        };
+
+
+        /// A CPU-private cache (magazine) of free heap objects of one size
+        /// class. The objects are chained through their first word.
+        struct heap_magazine {
+            void *head;
+            unsigned num_objects;
+
+            /// Per-CPU counters; these are only ever written by the owning
+            /// CPU, and are summed up when reporting statistics.
+            unsigned long num_allocs;
+            unsigned long num_frees;
+            unsigned long num_requested_bytes;
+        };
+
+
+        /// CPU-private heap magazines for all small size classes. These live
+        /// in the CPU state, so in user space, the magazines of an exited
+        /// thread are recycled along with its state.
+        struct heap_cache {
+            heap_magazine magazines[NUM_HEAP_SIZE_CLASSES];
+        };
+
+
+        /// Return the free objects in the magazines of `cache` to the shared
+        /// depots, e.g. because the thread that owns `cache` is exiting.
+        void flush_heap_cache(heap_cache &cache) ;
+
+
+        /// Statistics about one size class of the heap.
+        struct heap_class_statistics {
+
+            /// Size of each object in this class.
+            unsigned object_size;
+
+            /// Number of currently allocated objects.
+            unsigned long num_live_objects;
+
+            /// Number of bytes that were requested by the currently allocated
+            /// objects. This is at most `num_live_objects * object_size`.
+            unsigned long num_requested_bytes;
+
+            /// Number of bytes of slab memory carved up for this class.
+            unsigned long num_slab_bytes;
+        };
+
+
+        /// Statistics about the heap.
+        struct heap_statistics {
+
+            /// Number of bytes of the heap ever taken for slabs or for large
+            /// objects.
+            unsigned long num_heap_bytes;
+
+            /// Number of bytes taken by currently allocated large objects.
+            unsigned long num_large_object_bytes;
+
+            heap_class_statistics classes[NUM_HEAP_SIZE_CLASSES];
+        };
+
+
+        /// Get a snapshot of the heap's occupancy statistics. The snapshot is
+        /// approximate if other CPUs are concurrently allocating.
+        void get_heap_statistics(heap_statistics &stats) ;
     }
 
 
@@ -15,6 +15,8 @@
 #include "granary/emit_utils.h"
 #include "granary/code_cache.h"
 #include "granary/pgo.h"
+#include "granary/persistent_cache.h"
+#include "granary/translated_ranges.h"
 
 #if CONFIG_ENV_KERNEL
 #   include "granary/kernel/linux/user_address.h"
@@ -485,7 +487,7 @@ namespace granary {
             }
 #endif
 
-            in = instruction::decode(pc);
+            in = instruction::decode_cached(pc);
 
             // TODO: curiosity.
             if(dynamorio::OP_INVALID == in.op_code()
@@ -586,6 +588,9 @@ namespace granary {
                 // Unconditional JMP; ends the block, without possibility
                 // of falling through.
                 if(in.is_jump()) {
+                    if(!dynamorio::opnd_is_pc(target)) {
+                        profile_optimise_indirect_cti(ls, in, policy, start_pc);
+                    }
                     break;
 
                 // CALL, if direct returns are supported then the basic
@@ -604,7 +609,7 @@ namespace granary {
                 } else {
                     fall_through_pc = true;
                     fall_through_cond_cti = true;
-                    *pc = profile_optimise_jcc(in, start_pc, *pc);
+                    *pc = profile_optimise_jcc(in, policy, start_pc, *pc);
                     break;
                 }
 
@@ -692,6 +697,10 @@ namespace granary {
         instrumentation_policy incoming_policy;
         instrumentation_policy outgoing_policy;
 
+#if CONFIG_OPTIMISE_ONLINE_PGO
+        block_profile *profile;
+#endif
+
         instruction start_label;
         instruction end_label;
 
@@ -732,6 +741,9 @@ namespace granary {
         , start_pc(nullptr)
         , end_pc(nullptr)
         , split_end_pc(nullptr)
+#if CONFIG_OPTIMISE_ONLINE_PGO
+        , profile(nullptr)
+#endif
         , start_label(label_())
         , end_label(label_())
         , num_decoded_instructions(0)
@@ -1089,102 +1101,21 @@ namespace granary {
     }
 
 
-    /// Decode and translate a single basic block of application/module code.
-    app_pc basic_block::translate(
-        const instrumentation_policy policy,
+    /// Emit a trace of translated basic blocks into the code cache, where the
+    /// first basic block of the trace is the block that was asked for. If
+    /// `add_internal_blocks` is true, then the other basic blocks of the trace
+    /// are added into the code cache, thus making them entry points into the
+    /// trace. Returns the address of the first basic block of the trace.
+    static app_pc emit_trace(
         cpu_state_handle cpu,
-        const app_pc start_pc,
+        block_translator * const trace_bbs,
+        instruction_list &patch_stubs,
+        const_app_pc estimator_pc,
+        const bool add_internal_blocks,
         unsigned &num_translated_bbs
     ) {
-
-        // Make sure we do a fake allocation so that next time a basic
-        // block is killed on this CPU, we don't accidentally kill anything from
-        // the previous translation.
-        cpu->block_allocator.allocate_staged<uint8_t>();
-        cpu->stub_allocator.allocate_staged<uint8_t>();
-
-        // Used in mangling to estimate whether or not a particular JMP is
-        // far away from the code cache.
-        const_app_pc estimator_pc(
-            cpu->current_fragment_allocator->allocate_staged<uint8_t>());
-
-        instruction_list patch_stubs(INSTRUCTION_LIST_GENCODE);
-
-        block_translator *trace_bbs(cpu->transient_allocator. \
-            allocate<block_translator>());
         block_translator * const trace_original_bb(trace_bbs);
 
-        app_pc trace_min_pc(start_pc);
-        app_pc trace_max_pc(nullptr);
-
-        trace_bbs->start_pc = start_pc;
-        trace_bbs->incoming_policy = policy;
-
-        unsigned num_fall_throughs(CONFIG_FOLLOW_FALL_THROUGH_BRANCHES);
-
-        for(bool changed(true); changed; ) {
-            changed = false;
-
-            // Build a trace of all successors that we can follow through
-            // conditional CTIs.
-            for(block_translator *block(trace_bbs), *next_block(nullptr);
-                nullptr != block;
-                block = next_block) {
-
-                // Record our desired split end point, so that if we don't end
-                // on exactly that place then we'll say the block can't be
-                // split. This comes up when one instruction is jumping into
-                // another, which compilers *do* generate (e.g. jumping after a
-                // LOCK prefix).
-                const app_pc old_split_end_pc(block->split_end_pc);
-                if(old_split_end_pc) {
-                    block->reinitialise_for_split();
-                    block->split_end_pc = nullptr;
-                }
-
-                next_block = block->next;
-
-                if(!block->translated) {
-                    block->translated = true;
-                    block->run(cpu);
-
-                    if(old_split_end_pc && block->end_pc != old_split_end_pc) {
-                        block->can_split = false;
-                        IF_PERF( perf::visit_unsplittable_block(); )
-                    }
-
-                    if(block->visit_branches(cpu, trace_bbs, num_fall_throughs)) {
-                        changed = true;
-                    }
-                }
-
-                if(block->start_pc < trace_min_pc) {
-                    trace_min_pc = block->start_pc;
-                }
-                if(block->end_pc > trace_max_pc) {
-                    trace_max_pc = block->end_pc;
-                }
-            }
-
-            if(changed) {
-                continue;
-            }
-
-            for(block_translator *block(trace_bbs);
-                nullptr != block;
-                block = block->next) {
-
-                const bool split_block(block->fixup_branches(
-                    trace_bbs, trace_min_pc, trace_max_pc));
-
-                if(split_block) {
-                    IF_PERF( perf::visit_split_block(); )
-                    changed = true;
-                    break;
-                }
-            }
-        }
-
         // Used to record information about this trace.
         trace_info trace;
 
@@ -1205,6 +1136,18 @@ namespace granary {
             // now that everything is fully resolved.
             block->optimise();
 
+#if CONFIG_OPTIMISE_ONLINE_PGO
+            // Only profile the first translation of a block. This excludes
+            // re-translations of hot blocks, which shouldn't be re-translated
+            // again.
+            const mangled_address block_am(
+                block->start_pc, block->incoming_policy);
+            if(!code_cache::lookup(block_am.as_address)) {
+                block->profile = profile_block(
+                    block->ls, patch_stubs, block_am);
+            }
+#endif
+
             // Add labels to bound the basic block, so that we can connect
             // blocks together in the trace, while still knowing where
             // individual blocks begin and end.
@@ -1288,8 +1231,8 @@ namespace granary {
         // Batch allocate the basic block info for all blocks in the trace.
         //
         // TODO: Block info is likely better suited to a bump-pointer
-        //       allocator to get better spatial locality when binary searching
-        //       for the block info containing a given PC.
+        //       allocator to get better spatial locality when walking the
+        //       block info of a trace to find the one containing a given PC.
         trace.info = allocate_memory<basic_block_info>(trace.num_blocks);
 
         // Calculate the size of the stubs and then encode the stubs.
@@ -1316,6 +1259,12 @@ namespace granary {
             patch_stubs.encode(stub_pc, stub_size);
         }
 
+        // Remember where the trace's native code came from, so that its
+        // translation can be invalidated if the native code changes.
+        translated_trace *native_code(allocate_translated_trace(
+            trace.start_pc, trace.start_pc + trace.num_bytes,
+            trace.num_blocks));
+
         // Create the basic block info for each trace basic block.
         unsigned i(0);
         for(block_translator *block(trace_bbs);
@@ -1337,6 +1286,17 @@ namespace granary {
             info->num_instructions = block->num_encoded_instructions;
             info->state = block->state;
             info->allocator = cpu->current_fragment_allocator;
+#if CONFIG_OPTIMISE_ONLINE_PGO
+            info->profile = block->profile;
+#endif
+
+            IF_PERF( perf::visit_block(
+                static_cast<unsigned>(block->end_pc - block->start_pc),
+                block_size); )
+
+            translated_block &native_block(native_code->blocks[i - 1]);
+            native_block.begin = block->start_pc;
+            native_block.end = block->end_pc;
 
 #if CONFIG_ENV_KERNEL
             info->user_exception_metadata = block->user_exception_metadata;
@@ -1360,7 +1320,9 @@ namespace granary {
 #endif
             // Inject all of the internal trace basic blocks into the code cache.
             if(block != trace_original_bb) {
-                code_cache::add(am.as_address, block_start_pc);
+                if(add_internal_blocks) {
+                    code_cache::add(am.as_address, block_start_pc);
+                }
                 client::commit_to_basic_block(*info->state);
             }
         }
@@ -1368,6 +1330,20 @@ namespace granary {
         // After everything is emitted, store the meta-information in a way
         // that can be later queried by interrupt handlers, GDB, etc.
         store_trace_meta_info(trace);
+        add_translated_trace(native_code);
+
+#if CONFIG_SPECULATIVE_TRANSLATION
+        // Used to charge speculative translations against their budget.
+        cpu->num_translated_bytes += trace.num_bytes;
+#endif
+
+#if CONFIG_PERSISTENT_CODE_CACHE
+        // Superblocks are re-built from each run's execution profile, so only
+        // the traces of normal translations are persisted.
+        if(add_internal_blocks) {
+            persistent_cache::record(trace, ls);
+        }
+#endif
 
 #if CONFIG_DEBUG_ASSERTIONS
         for(block_translator *block(trace_bbs);
@@ -1394,4 +1370,200 @@ namespace granary {
 
         return trace_original_bb->start_label.pc();
     }
+
+
+    /// Decode and translate a single basic block of application/module code.
+    app_pc basic_block::translate(
+        const instrumentation_policy policy,
+        cpu_state_handle cpu,
+        const app_pc start_pc,
+        unsigned &num_translated_bbs
+    ) {
+
+        // Make sure we do a fake allocation so that next time a basic
+        // block is killed on this CPU, we don't accidentally kill anything from
+        // the previous translation.
+        cpu->block_allocator.allocate_staged<uint8_t>();
+        cpu->stub_allocator.allocate_staged<uint8_t>();
+
+        // Used in mangling to estimate whether or not a particular JMP is
+        // far away from the code cache.
+        const_app_pc estimator_pc(
+            cpu->current_fragment_allocator->allocate_staged<uint8_t>());
+
+        instruction_list patch_stubs(INSTRUCTION_LIST_GENCODE);
+
+        block_translator *trace_bbs(cpu->transient_allocator. \
+            allocate<block_translator>());
+
+        app_pc trace_min_pc(start_pc);
+        app_pc trace_max_pc(nullptr);
+
+        trace_bbs->start_pc = start_pc;
+        trace_bbs->incoming_policy = policy;
+
+        unsigned num_fall_throughs(CONFIG_FOLLOW_FALL_THROUGH_BRANCHES);
+
+        for(bool changed(true); changed; ) {
+            changed = false;
+
+            // Build a trace of all successors that we can follow through
+            // conditional CTIs.
+            for(block_translator *block(trace_bbs), *next_block(nullptr);
+                nullptr != block;
+                block = next_block) {
+
+                // Record our desired split end point, so that if we don't end
+                // on exactly that place then we'll say the block can't be
+                // split. This comes up when one instruction is jumping into
+                // another, which compilers *do* generate (e.g. jumping after a
+                // LOCK prefix).
+                const app_pc old_split_end_pc(block->split_end_pc);
+                if(old_split_end_pc) {
+                    block->reinitialise_for_split();
+                    block->split_end_pc = nullptr;
+                }
+
+                next_block = block->next;
+
+                if(!block->translated) {
+                    block->translated = true;
+                    block->run(cpu);
+
+                    if(old_split_end_pc && block->end_pc != old_split_end_pc) {
+                        block->can_split = false;
+                        IF_PERF( perf::visit_unsplittable_block(); )
+                    }
+
+                    if(block->visit_branches(cpu, trace_bbs, num_fall_throughs)) {
+                        changed = true;
+                    }
+                }
+
+                if(block->start_pc < trace_min_pc) {
+                    trace_min_pc = block->start_pc;
+                }
+                if(block->end_pc > trace_max_pc) {
+                    trace_max_pc = block->end_pc;
+                }
+            }
+
+            if(changed) {
+                continue;
+            }
+
+            for(block_translator *block(trace_bbs);
+                nullptr != block;
+                block = block->next) {
+
+                const bool split_block(block->fixup_branches(
+                    trace_bbs, trace_min_pc, trace_max_pc));
+
+                if(split_block) {
+                    IF_PERF( perf::visit_split_block(); )
+                    changed = true;
+                    break;
+                }
+            }
+        }
+
+        return emit_trace(
+            cpu, trace_bbs, patch_stubs, estimator_pc, true,
+            num_translated_bbs);
+    }
+
+
+#if CONFIG_BUILD_HOT_TRACES
+    /// Translate a hot path of basic blocks, starting at `path[0]`, into a
+    /// single-entry, multi-exit superblock. The last basic block of the path
+    /// is assumed to branch back to the first. Branches that leave the path
+    /// become side exits through normal (DBL) stubs.
+    app_pc basic_block::translate_superblock(
+        const instrumentation_policy policy,
+        cpu_state_handle cpu,
+        const app_pc *path,
+        const unsigned path_length,
+        unsigned &num_translated_bbs
+    ) {
+        ASSERT(0 < path_length);
+
+        cpu->block_allocator.allocate_staged<uint8_t>();
+        cpu->stub_allocator.allocate_staged<uint8_t>();
+
+        const_app_pc estimator_pc(
+            cpu->current_fragment_allocator->allocate_staged<uint8_t>());
+
+        instruction_list patch_stubs(INSTRUCTION_LIST_GENCODE);
+
+        // Lay out the blocks in the order in which they were executed.
+        block_translator *trace_bbs(nullptr);
+        block_translator *last_block(nullptr);
+        for(unsigned i(0); i < path_length; ++i) {
+            block_translator *block(cpu->transient_allocator. \
+                allocate<block_translator>());
+            block->start_pc = path[i];
+            block->incoming_policy = policy;
+            block->translated = true;
+            block->run(cpu);
+
+            if(last_block) {
+                last_block->next = block;
+            } else {
+                trace_bbs = block;
+            }
+            last_block = block;
+        }
+
+        instrumentation_policy base_policy(policy);
+        base_policy = base_policy.base_policy();
+
+        // Connect each block to its successor on the path, and the last block
+        // back to the head. Every other branch remains a side exit.
+        for(block_translator *block(trace_bbs);
+            nullptr != block;
+            block = block->next) {
+
+            // The client switched policies; leave the block's CTIs to the
+            // mangler.
+            if(block->outgoing_policy.base_policy() != base_policy) {
+                continue;
+            }
+
+            block_translator *successor(block->next ? block->next : trace_bbs);
+            instruction_list &ls(block->ls);
+            for(instruction in(ls.first()); in.is_valid(); in = in.next()) {
+                if(in.is_mangled() || !in.is_cti()
+                || in.is_call() || in.is_return()) {
+                    continue;
+                }
+
+                instrumentation_policy target_policy(in.policy());
+                if(!target_policy) {
+                    target_policy = block->outgoing_policy;
+                }
+
+                if(target_policy.base_policy() != base_policy) {
+                    continue;
+                }
+
+                const operand target(in.cti_target());
+                if(dynamorio::PC_kind != target.kind) {
+                    continue;
+                }
+
+                if(target.value.pc == successor->start_pc) {
+                    in.set_cti_target(instr_(successor->start_label));
+                    in.set_mangled();
+                } else if(target.value.pc == trace_bbs->start_pc) {
+                    in.set_cti_target(instr_(trace_bbs->start_label));
+                    in.set_mangled();
+                }
+            }
+        }
+
+        return emit_trace(
+            cpu, trace_bbs, patch_stubs, estimator_pc, false,
+            num_translated_bbs);
+    }
+#endif
 }
@@ -25,6 +25,7 @@ namespace granary {
     struct thread_state_handle;
     struct instrumentation_policy;
     struct code_cache;
+    struct block_profile;
 
 
     /// different states of bytes in the code cache.
@@ -88,6 +89,11 @@ namespace granary {
         /// What was the allocator used to create this basic block?
         generic_fragment_allocator *allocator;
 
+#if CONFIG_OPTIMISE_ONLINE_PGO
+        /// Execution profile of this basic block, if it is being profiled.
+        block_profile *profile;
+#endif
+
     } __attribute__((packed));
 
 
@@ -201,6 +207,19 @@ namespace granary {
         ) ;
 
 
+#if CONFIG_BUILD_HOT_TRACES
+        /// Translate a hot path of basic blocks into a single-entry, multi-
+        /// exit superblock whose only entry point is `path[0]`.
+        static app_pc translate_superblock(
+            const instrumentation_policy policy,
+            cpu_state_handle cpu,
+            const app_pc *path,
+            const unsigned path_length,
+            unsigned &num_translated_bbs
+        ) ;
+#endif
+
+
     public:
 
         /// Return a pointer to the basic block state structure of this basic
@@ -16,12 +16,20 @@ namespace granary {
 
     enum {
         SLAB_SIZE = detail::fragment_allocator_config::SLAB_SIZE,
-        BB_ALIGN_ = detail::fragment_allocator_config::MIN_ALIGN,
-        BB_ALIGN = 1 == BB_ALIGN_ ? 16 : BB_ALIGN_,
-        MAX_BBS_PER_SLAB = (SLAB_SIZE / BB_ALIGN) + 1
+        BB_ALIGN = detail::fragment_allocator_config::MIN_ALIGN,
+        MAX_BBS_PER_SLAB = (SLAB_SIZE / BB_ALIGN) + 1,
+
+        /// Fragments are allocated at `BB_ALIGN`-aligned addresses, so every
+        /// fragment begins on a granule boundary.
+        GRANULE_SIZE = BB_ALIGN,
+        NUM_GRANULES = SLAB_SIZE / GRANULE_SIZE
     };
 
 
+    static_assert(1 < BB_ALIGN && 0 == (SLAB_SIZE % BB_ALIGN),
+        "Fragments must be aligned to the granules of a fragment slab.");
+
+
     /// GDB helper variable. GDB doesn't always have access to the value of
     /// the `SLAB_SIZE` symbol (either the above defined one, or the one inside
     /// the `fragment_allocator_config`), so we put this variable here to
@@ -31,6 +39,11 @@ namespace granary {
     const unsigned FRAGMENT_SLAB_SIZE = SLAB_SIZE;
 
 
+    /// GDB helper variable for the granule size of the reverse map.
+    __attribute__((used))
+    const unsigned FRAGMENT_GRANULE_SIZE = GRANULE_SIZE;
+
+
     struct generic_info_ptr {
 
         union {
@@ -42,128 +55,104 @@ namespace granary {
                 uintptr_t:63; // high
             } __attribute__((packed));
         } __attribute__((packed));
+    };
 
 
-        inline app_pc start_pc(void) const {
-            if(is_trace) {
-                generic_info_ptr untraced_ptr(*this);
-                untraced_ptr.is_trace = false;
-                return untraced_ptr.trace->start_pc;
-            } else {
-                return block->start_pc;
-            }
-        }
+    /// Meta-information about one fragment slab of the code cache. The
+    /// locator owns the meta-information of every fragment that begins in the
+    /// slab, and maps each granule of the slab to the block that contains the
+    /// granule's first byte (or, if no block does, the first block that
+    /// begins in the granule). A trace that spans several slabs is owned by
+    /// the locator of its first slab, but appears in the granule maps of all
+    /// of the slabs that it spans.
+    struct fragment_locator {
+        unsigned next_index;
+        generic_info_ptr fragments[MAX_BBS_PER_SLAB];
+        const basic_block_info *granules[NUM_GRANULES];
+    };
 
 
-        inline app_pc end_pc(void) const {
-            if(is_trace) {
-                generic_info_ptr untraced_ptr(*this);
-                untraced_ptr.is_trace = false;
-                return untraced_ptr.trace->start_pc \
-                     + untraced_ptr.trace->num_bytes;
-            } else {
-                return block->start_pc + block->num_bytes;
-            }
-        }
+    extern "C" {
+        extern fragment_locator **granary_find_fragment_slab(app_pc);
+    }
 
 
-        /// Get the basic block info from this trace data.
-        const basic_block_info *get_block(app_pc cache_pc) const {
-            if(is_trace) {
-                generic_info_ptr untraced_ptr(*this);
-                untraced_ptr.is_trace = false;
-                const trace_info *raw_trace(untraced_ptr.trace);
-                const basic_block_info *blocks(raw_trace->info);
-                for(unsigned i(0); i < raw_trace->num_blocks; ++i) {
-                    if(blocks[i].start_pc <= cache_pc
-                    && cache_pc < (blocks[i].start_pc + blocks[i].num_bytes)) {
-                        return &(blocks[i]);
-                    }
-                }
-            } else {
-                return block;
-            }
+    /// Returns the index of the granule containing `pc` within its fragment
+    /// slab.
+    static inline unsigned granule_index(uintptr_t pc) {
+        return static_cast<unsigned>((pc % SLAB_SIZE) / GRANULE_SIZE);
+    }
 
-            ASSERT(false);
-            return nullptr;
+
+    /// Get the fragment locator for the slab containing `pc`, allocating it if
+    /// it doesn't yet exist.
+    static fragment_locator *get_fragment_locator(uintptr_t pc) {
+        fragment_locator **slab_(granary_find_fragment_slab(
+            reinterpret_cast<app_pc>(pc)));
+        if(unlikely(!*slab_)) {
+            *slab_ = allocate_memory<fragment_locator>();
         }
-    };
+        return *slab_;
+    }
 
 
-    static const basic_block_info *search_basic_block_info(
-        generic_info_ptr *array,
-        const long max,
-        app_pc cache_pc
-    ) {
-        if(!max) {
-            return nullptr;
-        }
+    /// Add `block` to the granule maps of all slabs that it overlaps. Blocks
+    /// must be mapped in order of increasing addresses.
+    static void map_block(const basic_block_info *block) {
+        const uintptr_t begin(reinterpret_cast<uintptr_t>(block->start_pc));
+        const uintptr_t end(begin + block->num_bytes);
+        uintptr_t granule(begin & ~static_cast<uintptr_t>(GRANULE_SIZE - 1));
 
-        long first(0);
-        long last(max - 1);
-        long middle((first + last) / 2);
-
-        for(; first <= middle && middle <= last; ) {
-            const generic_info_ptr info_ptr(array[middle]);
-            const app_pc trace_start_pc(info_ptr.start_pc());
-            const app_pc trace_end_pc(info_ptr.end_pc());
-
-            if(trace_start_pc <= cache_pc) {
-                if(cache_pc < trace_end_pc) {
-                    return info_ptr.get_block(cache_pc);
-                } else {
-                    first = middle + 1;
-                }
-            } else {
-                last = middle - 1;
+        for(; granule < end; granule += GRANULE_SIZE) {
+            fragment_locator *slab(get_fragment_locator(granule));
+            const basic_block_info *&entry(
+                slab->granules[granule_index(granule)]);
+
+            // The first byte of this granule belongs to an earlier block of
+            // the same trace.
+            if(granule < begin && entry) {
+                continue;
             }
-            middle = (first + last) / 2;
-        }
 
-        return nullptr;
+            entry = block;
+        }
     }
 
 
-    struct fragment_locator {
-        unsigned next_index;
-        generic_info_ptr fragments[MAX_BBS_PER_SLAB];
-    };
+    /// Remove `block` from the granule maps of all slabs that it overlaps.
+    static void unmap_block(const basic_block_info *block) {
+        const uintptr_t begin(reinterpret_cast<uintptr_t>(block->start_pc));
+        const uintptr_t end(begin + block->num_bytes);
+        uintptr_t granule(begin & ~static_cast<uintptr_t>(GRANULE_SIZE - 1));
 
+        for(; granule < end; granule += GRANULE_SIZE) {
+            fragment_locator *slab(*granary_find_fragment_slab(
+                reinterpret_cast<app_pc>(granule)));
+            const basic_block_info *&entry(
+                slab->granules[granule_index(granule)]);
 
-    extern "C" {
-        extern fragment_locator **granary_find_fragment_slab(app_pc);
+            if(block == entry) {
+                entry = nullptr;
+            }
+        }
     }
 
 
     /// Commit to storing information about a trace.
     void store_trace_meta_info(const trace_info &trace) {
+        ASSERT(0 < trace.num_blocks);
 
-        // Make sure the fragment locator for this fragment slab exists.
-        fragment_locator **slab_(granary_find_fragment_slab(trace.start_pc));
-        if(unlikely(!*slab_)) {
-            *slab_ = allocate_memory<fragment_locator>();
-        }
-
-        // Handle the case of having a very large trace that spans multiple
-        // slabs. This can easily happen for heavyweight instrumentation like
-        // watchpoints and with kernel code like `copy_process`.
-        fragment_locator **end_slab_(granary_find_fragment_slab(
-            trace.start_pc + trace.num_bytes - 1));
-        if(unlikely(end_slab_ != slab_)) {
-            for(fragment_locator **next_slab_(slab_ + 1);
-                next_slab_ <= end_slab_;
-                ++next_slab_) {
-
-                ASSERT(nullptr == *next_slab_);
-
-                // Initialize using the same slab.
-                *next_slab_ = *slab_;
-            }
+        // Very large traces can span multiple slabs. This can easily happen
+        // for heavyweight instrumentation like watchpoints and with kernel
+        // code like `copy_process`. Each block is mapped into every slab
+        // that it overlaps.
+        for(unsigned i(0); i < trace.num_blocks; ++i) {
+            map_block(&(trace.info[i]));
         }
 
-        fragment_locator *slab(*slab_);
+        fragment_locator *slab(get_fragment_locator(
+            reinterpret_cast<uintptr_t>(trace.start_pc)));
 
-        ASSERT(0 < trace.num_blocks);
         ASSERT(slab->next_index < MAX_BBS_PER_SLAB);
 
         generic_info_ptr &info_ptr(slab->fragments[slab->next_index++]);
@@ -188,10 +177,18 @@ namespace granary {
 
         ASSERT(nullptr != slab);
 
-        const basic_block_info *info(search_basic_block_info(
-            &(slab->fragments[0]), slab->next_index, cache_pc));
+        const basic_block_info *info(slab->granules[
+            granule_index(reinterpret_cast<uintptr_t>(cache_pc))]);
 
         ASSERT(nullptr != info);
+
+        // Every fragment begins on a granule boundary, so any later block
+        // that begins in this granule is part of the same trace as `info`,
+        // and its info immediately follows `info`.
+        for(; (info->start_pc + info->num_bytes) <= cache_pc; ++info) {
+            ASSERT(1 < info->num_bbs_in_trace);
+        }
+
         ASSERT(info->start_pc <= cache_pc);
         ASSERT(cache_pc < (info->start_pc + info->num_bytes));
 
@@ -218,6 +215,8 @@ namespace granary {
         ASSERT(nullptr != frag.block);
         ASSERT(frag.block->start_pc <= cache_pc);
 
+        unmap_block(frag.block);
+
 #if CONFIG_ENV_KERNEL && CONFIG_FEATURE_INTERRUPT_DELAY
         if(frag.block->delay_states) {
             free_memory(
@@ -230,5 +229,45 @@ namespace granary {
         frag.block = nullptr;
         slab->next_index -= 1;
     }
-}
 
+
+    /// Free the meta-information of a fragment locator.
+    static void free_fragment_locator(fragment_locator *slab) {
+        for(unsigned i(0); i < slab->next_index; ++i) {
+            generic_info_ptr info_ptr(slab->fragments[i]);
+            if(info_ptr.is_trace) {
+                info_ptr.is_trace = false;
+                trace_info *trace(info_ptr.trace);
+                free_memory<basic_block_info>(trace->info, trace->num_blocks);
+                free_memory<trace_info>(trace);
+            } else if(info_ptr.block) {
+                free_memory<basic_block_info>(info_ptr.block);
+            }
+        }
+        free_memory<fragment_locator>(slab);
+    }
+
+
+    /// Remove the basic block info for all fragments allocated in the
+    /// fragment slab memory `[begin, begin + size)`.
+    ///
+    /// Note: Client basic block state is not freed, as clients are allowed to
+    ///       hold on to pointers to it.
+    void remove_fragment_slab_info(app_pc begin, unsigned size) {
+        ASSERT(0 == (size % SLAB_SIZE));
+
+        fragment_locator **slab_(granary_find_fragment_slab(begin));
+        fragment_locator **end_slab_(granary_find_fragment_slab(begin + size));
+
+        // Traces can span several fragment slabs; however, they never span
+        // two allocator slabs, so the owning locator of every trace in this
+        // memory is freed here.
+        for(; slab_ < end_slab_; ++slab_) {
+            fragment_locator *slab(*slab_);
+            *slab_ = nullptr;
+            if(slab) {
+                free_fragment_locator(slab);
+            }
+        }
+    }
+}
@@ -35,6 +35,11 @@ namespace granary {
     ///       these operations!
     void remove_basic_block_info(app_pc cache_pc) ;
 
+
+    /// Remove the basic block info for all fragments allocated in the
+    /// fragment slab memory `[begin, begin + size)`.
+    void remove_fragment_slab_info(app_pc begin, unsigned size) ;
+
 }
 
 #endif /* BASIC_BLOCK_INFO_H_ */
@@ -61,6 +61,12 @@ namespace granary {
     ///                     or persists indefinitely.
     ///     SHARED:         True iff this allocator is shared between cores/threads.
     ///
+    /// Shared allocators don't lock around allocations. Each NUMA node has
+    /// its own current slab, and allocations race to bump the index of their
+    /// node's slab with an atomic compare-and-swap. Only installing a new slab
+    /// into a node, once the node's slab is exhausted, takes a (per-node)
+    /// lock.
+    ///
     /// The allocator has the property that the last allocation can optionally be
     /// released (e.g. in the event that we want to back out of the most recent
     /// allocation and reclaim the memory for future allocations). Note: the
@@ -90,10 +96,26 @@ namespace granary {
             EXEC_WHERE = Config::EXEC_WHERE,
 
             // Value to default-initialize the memory with.
-            MEMSET_VALUE = IS_EXECUTABLE ? 0xCC : 0
+            MEMSET_VALUE = IS_EXECUTABLE ? 0xCC : 0,
+
+            // Number of per-node slab lists.
+            NUM_SHARED_NODES = IS_SHARED ? MAX_NUMA_NODES : 1
         };
 
 
+        /// The slabs of one NUMA node of a shared allocator.
+        struct shared_slab_list {
+
+            /// The slab from which allocations on this node are bumped. The
+            /// older slabs of this node are chained through `next`.
+            bump_pointer_slab *curr;
+
+            /// Serialises the installation of new slabs.
+            atomic_spin_lock lock;
+
+        } __attribute__((aligned (CONFIG_ARCH_CACHE_LINE_SIZE)));
+
+
         /// The next bump_pointer_slab from which we can allocate.
         bump_pointer_slab *curr;
         bump_pointer_slab *first;
@@ -103,12 +125,18 @@ namespace granary {
         bump_pointer_slab *free;
 
 
-        /// A global free list of bump_pointer_slabs.
-        static bump_pointer_slab *global_free;
-        static atomic_spin_lock global_free_lock;
+        /// Global free lists of bump_pointer_slabs. Dead slabs are only
+        /// shared between allocators on the same NUMA node.
+        static bump_pointer_slab *global_free[MAX_NUMA_NODES];
+        static atomic_spin_lock global_free_lock[MAX_NUMA_NODES];
 
 
-        /// Lock used to serialise allocations.
+        /// Per-node slabs of a shared allocator.
+        shared_slab_list shared_slabs[NUM_SHARED_NODES];
+
+
+        /// Lock used to serialise operations other than allocations on
+        /// shared allocators.
         spin_lock lock;
 
 
@@ -123,7 +151,8 @@ namespace granary {
         IF_TEST( int curr_owner_cpu_id; )
 
 
-        /// Acquire a lock on the allocator.
+        /// Acquire a lock on a shared allocator for an operation other than
+        /// an allocation.
         inline void acquire(void) {
             if(IS_SHARED) {
                 lock.acquire();
@@ -131,7 +160,7 @@ namespace granary {
         }
 
 
-        /// Release the lock on the allocator.
+        /// Release the lock on a shared allocator.
         inline void release(void) {
             if(IS_SHARED) {
                 lock.release();
@@ -183,21 +212,29 @@ namespace granary {
         bump_pointer_slab *allocate_slab(unsigned size) {
             bump_pointer_slab *found(nullptr);
 
-            // Try to find one in the free list.
-            if(free) {
+            // Try to find one in the free list. Slabs are never freed into
+            // the free list of a shared allocator (see `free_last` and
+            // `free_all`), which is why the free list can be accessed
+            // without holding `lock` while a node installs a new slab.
+            ASSERT(!IS_SHARED || !free);
+            if(!IS_SHARED && free) {
                 found = slab_search(&free, free, size);
                 if(found) {
                     goto initialise;
                 }
             }
 
-            // See if we might be able to search in the global free list.
-            if(SHARE_DEAD_SLABS
-            && global_free && global_free_lock.try_acquire()) {
-                found = slab_search(&global_free, global_free, size);
-                global_free_lock.release();
-                if(found) {
-                    goto initialise;
+            // See if we might be able to search in this node's global free
+            // list.
+            if(SHARE_DEAD_SLABS) {
+                const unsigned node(detail::current_numa_node());
+                if(global_free[node] && global_free_lock[node].try_acquire()) {
+                    found = slab_search(
+                        &(global_free[node]), global_free[node], size);
+                    global_free_lock[node].release();
+                    if(found) {
+                        goto initialise;
+                    }
                 }
             }
 
@@ -222,12 +259,96 @@ namespace granary {
         }
 
 
+        /// Install a new slab into the slab list of a node of a shared
+        /// allocator, unless another allocation has already replaced
+        /// `full_slab`. The new slab has room for `size` bytes at any
+        /// alignment up to `align`.
+        void install_shared_slab(
+            shared_slab_list &node,
+            bump_pointer_slab *full_slab,
+            const unsigned align,
+            const unsigned size
+        ) {
+            node.lock.acquire();
+            if(full_slab == node.curr) {
+                const unsigned min_size(size ? size + align - 1 : 0);
+                unsigned slab_size(min_size + ALIGN_TO(min_size, SLAB_SIZE));
+                if(!slab_size) {
+                    slab_size = SLAB_SIZE;
+                }
+
+                bump_pointer_slab *slab(allocate_slab(slab_size));
+                slab->next = full_slab;
+                __atomic_store_n(&(node.curr), slab, __ATOMIC_RELEASE);
+            }
+            node.lock.release();
+        }
+
+
+        /// Allocate `size` bytes of memory with alignment `align` from a
+        /// shared allocator.
+        uint8_t *allocate_shared(
+            const unsigned align,
+            const unsigned size
+        ) {
+            shared_slab_list &node(
+                shared_slabs[detail::current_numa_node() % NUM_SHARED_NODES]);
+
+            for(;;) {
+                bump_pointer_slab *slab(
+                    __atomic_load_n(&(node.curr), __ATOMIC_ACQUIRE));
+
+                if(slab) {
+                    unsigned index(
+                        __atomic_load_n(&(slab->index), __ATOMIC_RELAXED));
+
+                    for(;;) {
+                        uint8_t *mem(&(slab->memory[index]));
+
+                        // Handle a staged allocation.
+                        if(!size) {
+                            return mem;
+                        }
+
+                        const unsigned align_offset(ALIGN_TO(
+                            reinterpret_cast<uintptr_t>(mem), align));
+                        const unsigned next_index(index + align_offset + size);
+                        if(next_index > slab->size) {
+                            break;
+                        }
+
+                        if(__atomic_compare_exchange_n(
+                            &(slab->index), &index, next_index, true,
+                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+
+                            // Maintain `size == (index + remaining)` once
+                            // all racing allocations have finished.
+                            __atomic_fetch_sub(
+                                &(slab->remaining), next_index - index,
+                                __ATOMIC_RELAXED);
+
+                            ASSERT(0 == (reinterpret_cast<uintptr_t>(
+                                mem + align_offset) % align));
+                            return mem + align_offset;
+                        }
+                    }
+                }
+
+                install_shared_slab(node, slab, align, size);
+            }
+        }
+
+
         /// Allocate `size` bytes of memory with alignment `align`.
         uint8_t *allocate_bare(
             const unsigned align,
             const unsigned size
         ) {
 
+            if(IS_SHARED) {
+                return allocate_shared(align, size);
+            }
+
             last_allocation_size = 0;
             last_allocation = nullptr;
             last_allocation_slab = nullptr;
@@ -308,6 +429,8 @@ namespace granary {
         }
 
 
+    public:
+
         /// Free a list of bump_pointer_slabs.
         static void free_slab_list(bump_pointer_slab *list) {
             for(bump_pointer_slab *next(nullptr); list; list = next) {
@@ -326,8 +449,6 @@ namespace granary {
             }
         }
 
-    public:
-
         bump_pointer_allocator(void) 
             : curr(nullptr)
             , first(nullptr)
@@ -338,7 +459,11 @@ namespace granary {
             , last_allocation_slab(nullptr)
             _IF_TEST( last_allocator(nullptr) )
             _IF_TEST( curr_owner_cpu_id(-1) )
-        { }
+        {
+            for(unsigned i(0); i < NUM_SHARED_NODES; ++i) {
+                shared_slabs[i].curr = nullptr;
+            }
+        }
 
         ~bump_pointer_allocator(void) {
             free_slab_list(free);
@@ -348,6 +473,7 @@ namespace granary {
             last_allocation_slab = nullptr;
             free_slab_list(curr);
             curr = nullptr;
+            free_slab_list(detach_shared_slabs());
         }
 
         template <typename T, typename... Args>
@@ -359,20 +485,16 @@ namespace granary {
 
             IF_TEST( const void *allocator(__builtin_return_address(0)); )
 
-            acquire();
             IF_TEST( last_allocator = allocator; )
             T *ptr(new (allocate_bare(MIN_ALIGN_, sizeof(T))) T(args...));
-            release();
             return ptr;
         }
 
         void *allocate_untyped(unsigned align, unsigned num_bytes) {
             IF_TEST( const void *allocator(__builtin_return_address(0)); )
 
-            acquire();
             IF_TEST( last_allocator = allocator; )
             uint8_t *arena(allocate_bare(align, num_bytes));
-            release();
             ASSERT(is_valid_address(arena));
 
             return arena;
@@ -380,6 +502,25 @@ namespace granary {
 
     private:
 
+        /// Detach the per-node slabs of a shared allocator, and return them
+        /// as a single list.
+        bump_pointer_slab *detach_shared_slabs(void) {
+            bump_pointer_slab *slabs(nullptr);
+            for(unsigned i(0); IS_SHARED && i < NUM_SHARED_NODES; ++i) {
+                shared_slab_list &node(shared_slabs[i]);
+                node.lock.acquire();
+                bump_pointer_slab *node_slabs(node.curr);
+                node.curr = nullptr;
+                node.lock.release();
+
+                if(node_slabs) {
+                    *(node_slabs->connect()) = slabs;
+                    slabs = node_slabs;
+                }
+            }
+            return slabs;
+        }
+
         bool try_free_curr(bool had_slab) {
             if(!had_slab || !curr->index) {
                 bump_pointer_slab *dead_slab(curr);
@@ -392,10 +533,11 @@ namespace granary {
         }
 
         void try_share_free(void) {
-            if(free && global_free_lock.try_acquire()) {
-                *(free->connect()) = global_free;
-                global_free = free;
-                global_free_lock.release();
+            const unsigned node(detail::current_numa_node());
+            if(free && global_free_lock[node].try_acquire()) {
+                *(free->connect()) = global_free[node];
+                global_free[node] = free;
+                global_free_lock[node].release();
                 free = nullptr;
             }
         }
@@ -405,14 +547,12 @@ namespace granary {
         template <typename T>
         inline const T *allocate_staged(void) {
             IF_TEST( const void *allocator(__builtin_return_address(0)); )
-            acquire();
             IF_TEST( last_allocator = allocator; )
             bool had_slab(curr != nullptr);
             void *ret(allocate_bare(MIN_ALIGN, 0));
             if(SHARE_DEAD_SLABS && try_free_curr(had_slab)) {
                 try_share_free();
             }
-            release();
             return unsafe_cast<const T *>(ret);
         }
 
@@ -424,10 +564,8 @@ namespace granary {
             };
 
             IF_TEST( const void *allocator(__builtin_return_address(0)); )
-            acquire();
             IF_TEST( last_allocator = allocator; )
             uint8_t *arena(allocate_bare(MIN_ALIGN_, sizeof(T) * length));
-            release();
 
             // Initialise each element using placement new syntax; C++ standard
             // allows for placement new[] to introduce array length overhead.
@@ -448,6 +586,7 @@ namespace granary {
         /// follows a locking discipline that uses `lock_coarse` (coarse-grained
         /// allocator locking) then this function should be used VERY carefully.
         void free_last(free_memory_hint hint=FREE_HINT_TRY_FREE_SLAB) {
+            ASSERT(!IS_SHARED);
             IF_TEST( const void *allocator(__builtin_return_address(0)); )
             acquire();
             IF_TEST( last_allocator = allocator; )
@@ -483,6 +622,62 @@ namespace granary {
             release();
         }
 
+        /// The position of the bump pointer of a non-shared allocator. Every
+        /// allocation made after a position was taken can be freed at once
+        /// with `free_since`.
+        struct position {
+            bump_pointer_slab *slab;
+            unsigned index;
+        };
+
+
+        /// Returns the current position of the bump pointer.
+        position current_position(void) {
+            ASSERT(!IS_SHARED);
+            position pos;
+            pos.slab = curr;
+            pos.index = curr ? curr->index : 0U;
+            return pos;
+        }
+
+
+        /// Free everything allocated since the bump pointer was at `pos`.
+        /// Slabs allocated since then are moved into the free list. This
+        /// relies on slabs never being retired while they are in use, so it
+        /// can't be used by allocators that share their dead slabs.
+        void free_since(const position &pos) {
+            ASSERT(!IS_SHARED);
+            ASSERT(!SHARE_DEAD_SLABS);
+            IF_TEST( const void *allocator(__builtin_return_address(0)); )
+            acquire();
+            IF_TEST( last_allocator = allocator; )
+
+            for(; curr && curr != pos.slab; ) {
+                bump_pointer_slab *dead_slab(curr);
+                curr = curr->next;
+                dead_slab->next = free;
+                free = dead_slab;
+            }
+
+            if(curr) {
+                ASSERT(pos.index <= curr->index);
+                memset(
+                    &(curr->memory[pos.index]),
+                    MEMSET_VALUE,
+                    curr->index - pos.index);
+                curr->index = pos.index;
+                curr->remaining = curr->size - pos.index;
+            } else {
+                first = nullptr;
+            }
+
+            last_allocation_size = 0;
+            last_allocation = nullptr;
+            last_allocation_slab = nullptr;
+            release();
+        }
+
+
         /// Free all allocated objects.
         void free_all(void) {
             if(!IS_TRANSIENT || IS_SHARED) {
@@ -508,16 +703,63 @@ namespace granary {
                 curr = nullptr;
             }
 
-            if(SHARE_DEAD_SLABS
-            && free && global_free_lock.try_acquire()) {
-                *(free->connect()) = global_free;
-                global_free = free;
-                global_free_lock.release();
+            if(SHARE_DEAD_SLABS) {
+                try_share_free();
+            }
+
+            release();
+        }
 
+
+        /// Give this allocator's free slabs to the global free list of the
+        /// current NUMA node. Unlike the opportunistic sharing done by
+        /// `free_all`, this waits for the global free list's lock.
+        void share_free_slabs(void) {
+            if(!SHARE_DEAD_SLABS) {
+                return;
+            }
+
+            acquire();
+            if(free) {
+                const unsigned node(detail::current_numa_node());
+                global_free_lock[node].acquire();
+                *(free->connect()) = global_free[node];
+                global_free[node] = free;
+                global_free_lock[node].release();
                 free = nullptr;
             }
+            release();
+        }
+
+
+        /// Detach all slabs (including free slabs) from this allocator, and
+        /// return them as a single list. The allocator is left empty, and the
+        /// detached slabs can later be freed with `free_slab_list`.
+        /// The caller must ensure that no concurrent allocations are made
+        /// from a shared allocator while its slabs are detached.
+        bump_pointer_slab *detach_slabs(void) {
+            acquire();
+            bump_pointer_slab *slabs(curr);
+            if(slabs) {
+                *(slabs->connect()) = free;
+            } else {
+                slabs = free;
+            }
 
+            bump_pointer_slab *shared(detach_shared_slabs());
+            if(shared) {
+                *(shared->connect()) = slabs;
+                slabs = shared;
+            }
+
+            curr = nullptr;
+            first = nullptr;
+            free = nullptr;
+            last_allocation_size = 0;
+            last_allocation = nullptr;
+            last_allocation_slab = nullptr;
             release();
+            return slabs;
         }
 
 
@@ -543,10 +785,12 @@ namespace granary {
     };
 
     template <typename Config>
-    bump_pointer_slab *bump_pointer_allocator<Config>::global_free = nullptr;
+    bump_pointer_slab *bump_pointer_allocator<Config>::global_free[
+        MAX_NUMA_NODES] = {nullptr};
 
     template <typename Config>
-    atomic_spin_lock bump_pointer_allocator<Config>::global_free_lock;
+    atomic_spin_lock bump_pointer_allocator<Config>::global_free_lock[
+        MAX_NUMA_NODES];
 }
 
 
@@ -26,6 +26,7 @@
 #   include "granary/detach.h"
 #   include "granary/emit_utils.h"
 #   include "granary/register.h"
+#   include "granary/liveness.h"
 #   include "granary/printf.h"
 #   include "granary/dynamorio.h"
 #   include "granary/code_cache.h"
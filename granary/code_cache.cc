@@ -16,6 +16,12 @@
 #include "granary/emit_utils.h"
 #include "granary/detach.h"
 #include "granary/ibl.h"
+#include "granary/pgo.h"
+#include "granary/liveness.h"
+#include "granary/persistent_cache.h"
+#include "granary/dbl.h"
+#include "granary/speculate.h"
+#include "granary/translated_ranges.h"
 
 
 #if CONFIG_DEBUG_ASSERTIONS
@@ -51,9 +57,10 @@ namespace granary {
 
 
     /// The globally shared code cache. This maps policy-mangled code
-    /// code addresses to translated addresses.
+    /// code addresses to translated addresses. Reads from this table are
+    /// lock-free; each CPU reads using its `id`.
     static static_data<
-        locked_hash_table<app_pc, app_pc>
+        concurrent_hash_table<app_pc, app_pc>
     > CODE_CACHE;
 
 
@@ -62,11 +69,409 @@ namespace granary {
     });
 
 
+    /// The current generation of the code cache. This is incremented each
+    /// time that the code cache is flushed.
+    static std::atomic<unsigned> CODE_CACHE_GENERATION = \
+        ATOMIC_VAR_INIT(0U);
+
+
+    /// The number of times that translated code has been invalidated. CPUs
+    /// compare this against the number that they last observed to know when
+    /// to clear their private code caches.
+    static std::atomic<unsigned> CODE_CACHE_INVALIDATION = \
+        ATOMIC_VAR_INIT(0U);
+
+
+#if !CONFIG_ENV_KERNEL
+
+    /// Defined in `granary/dynamic_wrapper.cc`.
+    extern void refresh_dynamic_wrappers(cpu_state_handle cpu) ;
+
+
+    enum {
+        /// A thread whose stack references flushed code re-scans its stack
+        /// at most once per this many entries into `code_cache::find`.
+        RESCAN_PERIOD = 64,
+
+        /// Used when a thread's stack doesn't reference any flushed code.
+        NO_REFERENCED_GENERATION = ~0U
+    };
+
+
+    /// The memory of some flushed code that can't yet be reclaimed.
+    struct retired_code {
+
+        /// The generation to which the code belonged.
+        unsigned generation;
+
+        /// Memory of fragments, fragment stubs (and their DBL patch info),
+        /// and IBL exit routines.
+        bump_pointer_slab *fragments;
+        bump_pointer_slab *stubs;
+        bump_pointer_slab *ibl_exit_routines;
+
+        retired_code *next;
+
+
+        /// Returns true iff `addr` points into this retired code.
+        bool contains(uintptr_t addr) const {
+            return slabs_contain(fragments, addr)
+                || slabs_contain(stubs, addr)
+                || slabs_contain(ibl_exit_routines, addr);
+        }
+
+    private:
+
+        static bool slabs_contain(
+            const bump_pointer_slab *slab,
+            uintptr_t addr
+        ) {
+            for(; slab; slab = slab->next) {
+                const uintptr_t begin(
+                    reinterpret_cast<uintptr_t>(slab->memory));
+                if(begin <= addr && addr < (begin + slab->size)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+
+    /// Maximum number of bytes of fragment memory that the code cache can use
+    /// before it is automatically flushed.
+    static unsigned long CODE_CACHE_BUDGET = CONFIG_CODE_CACHE_BUDGET;
+
+
+    /// Is flushing the code cache enabled? If so, then entries into
+    /// `code_cache::find` are tracked so that the code cache is never flushed
+    /// in the middle of a translation.
+    static bool CAN_FLUSH = 0 != CONFIG_CODE_CACHE_BUDGET;
+
+
+    /// Threads entering `code_cache::find` increment `NUM_ACTIVE_FINDS`, and
+    /// wait while `IS_FLUSHING` is set. A flush waits for the number of
+    /// active finds to drop to zero.
+    static std::atomic<unsigned> NUM_ACTIVE_FINDS = ATOMIC_VAR_INIT(0U);
+    static std::atomic<bool> IS_FLUSHING = ATOMIC_VAR_INIT(false);
+
+
+    /// Serialises flushes.
+    static atomic_spin_lock FLUSH_LOCK;
+
+
+    /// List of flushed code whose memory hasn't yet been reclaimed. Guarded
+    /// by `RETIRED_CODE_LOCK`.
+    static std::atomic<retired_code *> RETIRED_CODE = ATOMIC_VAR_INIT(nullptr);
+    static atomic_spin_lock RETIRED_CODE_LOCK;
+
+
+    /// Incremented each time that code is retired, or each time that a way
+    /// of reaching flushed code is closed off. Every thread must re-scan
+    /// its stack in the current epoch before any flushed code is reclaimed.
+    static std::atomic<unsigned> RECLAIM_EPOCH = ATOMIC_VAR_INIT(1U);
+
+
+    /// The generation at which dynamic wrappers were last re-targeted. Code
+    /// at or after this generation can still be reached through a dynamic
+    /// wrapper.
+    static std::atomic<unsigned> WRAPPER_GENERATION = ATOMIC_VAR_INIT(0U);
+
+
+    /// Add some retired code to the list of retired code. Must be called
+    /// with `RETIRED_CODE_LOCK` held.
+    static void add_retired_code(
+        unsigned generation,
+        bump_pointer_slab *fragments,
+        bump_pointer_slab *stubs,
+        bump_pointer_slab *ibl_exit_routines
+    ) {
+        if(fragments || stubs || ibl_exit_routines) {
+            retired_code *code(allocate_memory<retired_code>());
+            code->generation = generation;
+            code->fragments = fragments;
+            code->stubs = stubs;
+            code->ibl_exit_routines = ibl_exit_routines;
+            code->next = RETIRED_CODE.load();
+            RETIRED_CODE.store(code);
+        }
+        RECLAIM_EPOCH.fetch_add(1);
+    }
+
+
+    /// Free the memory of some retired code.
+    static void free_retired_code(retired_code *code) {
+        for(bump_pointer_slab *slab(code->fragments); slab; slab = slab->next) {
+            remove_fragment_slab_info(slab->memory, slab->size);
+        }
+
+        generic_fragment_allocator::free_slab_list(code->fragments);
+        bump_pointer_allocator<detail::stub_allocator_config>:: \
+            free_slab_list(code->stubs);
+        ibl_free_exit_routines(code->ibl_exit_routines);
+        free_memory<retired_code>(code);
+    }
+
+
+    /// Retire this CPU's code if the code cache has been flushed since this
+    /// CPU last entered the code cache. Must be called within an active
+    /// find.
+    static void catch_up(cpu_state_handle cpu) {
+        const unsigned generation(CODE_CACHE_GENERATION.load());
+        if(generation == cpu->code_cache_generation) {
+            return;
+        }
+
+        bump_pointer_slab *fragments(cpu->fragment_allocator.detach_slabs());
+        bump_pointer_slab *stubs(cpu->stub_allocator.detach_slabs());
+        cpu->current_fragment_allocator = &(cpu->fragment_allocator);
+        cpu->code_cache.clear();
+
+#if CONFIG_BUILD_HOT_TRACES
+        bump_pointer_slab *hot_fragments(
+            cpu->hot_fragment_allocator.detach_slabs());
+#endif
+
+        RETIRED_CODE_LOCK.acquire();
+        add_retired_code(cpu->code_cache_generation, fragments, stubs, nullptr);
+#if CONFIG_BUILD_HOT_TRACES
+        add_retired_code(
+            cpu->code_cache_generation, hot_fragments, nullptr, nullptr);
+#endif
+        cpu->code_cache_generation = generation;
+        RETIRED_CODE_LOCK.release();
+    }
+
+
+    /// Scan the current thread's stack for return addresses into retired
+    /// code, and record the oldest generation of retired code that is
+    /// referenced. Stack slots that only look like return addresses
+    /// conservatively delay reclamation.
+    __attribute__((noinline))
+    static void scan_stack(cpu_state_handle cpu) {
+        code_cache_reclaim_state &state(cpu->code_cache_reclaim);
+        const uintptr_t *slot(reinterpret_cast<const uintptr_t *>(
+            __builtin_frame_address(0)));
+        const uintptr_t *end_slot(
+            reinterpret_cast<const uintptr_t *>(state.stack_end));
+
+        // If the stack bounds are unknown, then assume that everything is
+        // referenced.
+        unsigned oldest_generation(NO_REFERENCED_GENERATION);
+        if(reinterpret_cast<uintptr_t>(slot) < state.stack_begin
+        || reinterpret_cast<uintptr_t>(slot) >= state.stack_end) {
+            oldest_generation = 0;
+            slot = end_slot;
+        }
+
+        RETIRED_CODE_LOCK.acquire();
+        const unsigned epoch(RECLAIM_EPOCH.load());
+        for(; slot < end_slot; ++slot) {
+            const app_pc addr(reinterpret_cast<app_pc>(*slot));
+            if(!is_code_cache_address(addr) && !is_gencode_address(addr)) {
+                continue;
+            }
+
+            for(retired_code *code(RETIRED_CODE.load());
+                code;
+                code = code->next) {
+
+                if(code->generation < oldest_generation
+                && code->contains(*slot)) {
+                    oldest_generation = code->generation;
+                }
+            }
+        }
+
+        state.oldest_referenced_generation = oldest_generation;
+        state.scanned_epoch = epoch;
+        state.num_finds_since_scan = 0;
+        RETIRED_CODE_LOCK.release();
+    }
+
+
+    /// Reclaim the memory of all retired code that can no longer be executed
+    /// by any live thread. Retired code can still be executed if some thread
+    /// hasn't entered the code cache since it was flushed, if a dynamic
+    /// wrapper still targets it, or if some thread's stack contains a
+    /// return address into any code of the same generation (as that code
+    /// can directly branch to any other code of the same generation).
+    static void reclaim_retired_code(void) {
+        RETIRED_CODE_LOCK.acquire();
+        const unsigned epoch(RECLAIM_EPOCH.load());
+        unsigned min_generation(WRAPPER_GENERATION.load());
+
+        for(cpu_state *state(first_cpu_state());
+            state;
+            state = state->code_cache_reclaim.next) {
+
+            // The states of exited threads don't reference any code.
+            if(is_cpu_state_dead(state)) {
+                continue;
+            }
+
+            const code_cache_reclaim_state &reclaim(state->code_cache_reclaim);
+            if(epoch != reclaim.scanned_epoch) {
+                RETIRED_CODE_LOCK.release();
+                return;
+            }
+
+            if(state->code_cache_generation < min_generation) {
+                min_generation = state->code_cache_generation;
+            }
+
+            if(reclaim.oldest_referenced_generation < min_generation) {
+                min_generation = reclaim.oldest_referenced_generation;
+            }
+        }
+
+        retired_code *dead_code(nullptr);
+        retired_code *live_code(nullptr);
+        for(retired_code *code(RETIRED_CODE.load()), *next(nullptr);
+            code;
+            code = next) {
+
+            next = code->next;
+            if(code->generation < min_generation) {
+                code->next = dead_code;
+                dead_code = code;
+            } else {
+                code->next = live_code;
+                live_code = code;
+            }
+        }
+
+        RETIRED_CODE.store(live_code);
+        if(dead_code) {
+            RECLAIM_EPOCH.fetch_add(1);
+        }
+        RETIRED_CODE_LOCK.release();
+
+        // Forget the DBL patches of all of the dead code before freeing any
+        // of it, as a patch and the instruction that it patches can be in
+        // different retired code of the same generation.
+        for(retired_code *code(dead_code); code; code = code->next) {
+            forget_dbl_patches(code->stubs);
+        }
+
+        for(retired_code *next(nullptr); dead_code; dead_code = next) {
+            next = dead_code->next;
+            free_retired_code(dead_code);
+        }
+    }
+
+
+    /// Mark the current thread as being inside of `code_cache::find`. This
+    /// waits for any concurrent flush to finish, then catches the current
+    /// CPU up to the current generation of the code cache.
+    static void enter_find(cpu_state_handle cpu) {
+        for(;;) {
+            while(IS_FLUSHING.load()) {
+                ASM("pause;");
+            }
+            NUM_ACTIVE_FINDS.fetch_add(1);
+            if(!IS_FLUSHING.load()) {
+                break;
+            }
+            NUM_ACTIVE_FINDS.fetch_sub(1);
+        }
+
+        catch_up(cpu);
+    }
+
+
+    /// Mark the current thread as having left `code_cache::find`.
+    static void exit_find(void) {
+        NUM_ACTIVE_FINDS.fetch_sub(1);
+    }
+
+
+    /// Returns true iff the value of an entry in the global code cache points
+    /// into code that is discarded when the code cache is flushed.
+    static bool is_flushed_entry(app_pc, app_pc target) {
+        return is_code_cache_address(target) || is_gencode_address(target);
+    }
+
+
+    /// Flush the code cache on behalf of `cpu`.
+    static void flush_code_cache(cpu_state_handle cpu) {
+        ASSERT(CAN_FLUSH);
+
+        FLUSH_LOCK.acquire();
+        IS_FLUSHING.store(true);
+        while(NUM_ACTIVE_FINDS.load()) {
+            ASM("pause;");
+        }
+
+        CODE_CACHE->remove_if(is_flushed_entry);
+        bump_pointer_slab *ibl_exit_routines(ibl_flush());
+        remove_all_translated_ranges();
+
+        RETIRED_CODE_LOCK.acquire();
+        add_retired_code(
+            CODE_CACHE_GENERATION.fetch_add(1), nullptr, nullptr,
+            ibl_exit_routines);
+        RETIRED_CODE_LOCK.release();
+
+        IS_FLUSHING.store(false);
+        FLUSH_LOCK.release();
+
+        // Re-learn the native control flow along with the code cache, in case
+        // the flushed code was unloaded.
+        invalidate_live_states();
+
+        IF_PERF( perf::visit_code_cache_flush(); )
+
+        // Re-target the dynamic wrappers to newly translated code, as the
+        // wrappers themselves are never freed.
+        code_cache_reclaim_state &state(cpu->code_cache_reclaim);
+        const bool was_in_find(state.in_find);
+        state.in_find = true;
+        enter_find(cpu);
+        const unsigned generation(cpu->code_cache_generation);
+        refresh_dynamic_wrappers(cpu);
+        exit_find();
+        state.in_find = was_in_find;
+
+        RETIRED_CODE_LOCK.acquire();
+        if(WRAPPER_GENERATION.load() < generation) {
+            WRAPPER_GENERATION.store(generation);
+        }
+        RECLAIM_EPOCH.fetch_add(1);
+        RETIRED_CODE_LOCK.release();
+    }
+
+
+    /// Flush the code cache if it has exceeded its budget, and try to reclaim
+    /// the memory of previously flushed code.
+    static void collect_code_cache(cpu_state_handle cpu) {
+        if(!RETIRED_CODE.load(std::memory_order_relaxed)) {
+            if(CODE_CACHE_BUDGET
+            && CODE_CACHE_BUDGET < detail::code_cache_bytes_in_use()) {
+                flush_code_cache(cpu);
+            } else {
+                return;
+            }
+        }
+
+        code_cache_reclaim_state &state(cpu->code_cache_reclaim);
+        state.num_finds_since_scan += 1;
+        if(RECLAIM_EPOCH.load() != state.scanned_epoch
+        || (NO_REFERENCED_GENERATION != state.oldest_referenced_generation
+            && RESCAN_PERIOD <= state.num_finds_since_scan)) {
+            scan_stack(cpu);
+            reclaim_retired_code();
+        }
+    }
+#endif /* CONFIG_ENV_KERNEL */
+
+
     /// Find fast. This looks in the cpu-private cache first, and failing
     /// that, defaults to the global code cache.
     app_pc code_cache::find_on_cpu(mangled_address addr) {
         cpu_state_handle cpu;
-        app_pc ret(cpu->code_cache.find(addr.as_address));
+        refresh_cpu_cache(cpu);
+        app_pc ret(cpu->code_cache.lookup(addr.as_address));
         IF_PERF( perf::visit_address_lookup_cpu(nullptr != ret); )
         return ret;
     }
@@ -80,10 +485,22 @@ namespace granary {
     }
 
 
+    /// Clear the CPU-private code cache of `cpu` if any translations have
+    /// been invalidated since it was last cleared.
+    void code_cache::refresh_cpu_cache(cpu_state_handle cpu) {
+        const unsigned invalidation(CODE_CACHE_INVALIDATION.load());
+        if(invalidation != cpu->code_cache_invalidation) {
+            cpu->code_cache.clear();
+            cpu->code_cache_invalidation = invalidation;
+        }
+    }
+
+
     /// Look-up an entry in the code cache. This will not do translation.
     app_pc code_cache::lookup(app_pc addr) {
+        cpu_state_handle cpu;
         app_pc target_addr(nullptr);
-        if(CODE_CACHE->load(addr, target_addr)) {
+        if(CODE_CACHE->load(addr, target_addr, cpu->id)) {
             IF_PERF( perf::visit_address_lookup_hit(); )
         }
         return target_addr;
@@ -91,8 +508,8 @@ namespace granary {
 
 
     /// Perform both lookup and insertion (basic block translation) into
-    /// the code cache.
-    app_pc code_cache::find(
+    /// the current generation of the code cache.
+    app_pc code_cache::find_in_generation(
         cpu_state_handle cpu,
         const mangled_address addr,
         app_pc indirect_cache_source_addr
@@ -105,10 +522,23 @@ namespace granary {
         app_pc app_target_addr(addr.unmangled_address());
         app_pc target_addr(nullptr);
 
+#if CONFIG_OPTIMISE_ONLINE_PGO
+        // We've missed in the IBL jump table, so record the target of the
+        // indirect JMP/CALL in the profile of its basic block.
+        if(indirect_cache_source_addr && policy.is_indirect_cti_target()) {
+            profile_indirect_cti_target(
+                indirect_cache_source_addr, app_target_addr);
+        }
+#endif
+
         // Try to load the target address from the global code cache.
-        if(CODE_CACHE->load(addr.as_address, target_addr)) {
+        if(CODE_CACHE->load(addr.as_address, target_addr, cpu->id)) {
             if(policy.is_indirect_cti_target() || policy.is_return_target()) {
                 IF_PERF( perf::visit_ibl_miss(app_target_addr); )
+
+                // The target's IBL exit routine was evicted from the IBL jump
+                // table; put it back.
+                ibl_refill(addr.as_address);
             }
             IF_PERF( perf::visit_address_lookup_hit(); )
 
@@ -150,7 +580,7 @@ namespace granary {
         // app->host, indirect->direct, return->direct). Check to see if we
         // actually have the converted version in the code cache.
         if(!target_addr && base_addr.as_address != addr.as_address) {
-            CODE_CACHE->load(base_addr.as_address, target_addr);
+            CODE_CACHE->load(base_addr.as_address, target_addr, cpu->id);
         }
 
         // Can we detach to a known target?
@@ -201,8 +631,28 @@ namespace granary {
         unsigned num_translated_bbs(0);
         if(!target_addr) {
 
-            target_addr = basic_block::translate(
-                base_policy, cpu, app_target_addr, num_translated_bbs);
+            // Everything that the translation allocates from the stub
+            // allocator (DBL patches and stubs, block profiles, etc.) is
+            // freed if the translation is discarded.
+            const bump_pointer_allocator<detail::stub_allocator_config>:: \
+                position stub_position(cpu->stub_allocator.current_position());
+
+#if CONFIG_PERSISTENT_CODE_CACHE
+            // Prefer to install a translation that was persisted by an earlier
+            // run of this program.
+            target_addr = persistent_cache::install(
+                cpu, base_addr, num_translated_bbs);
+#endif
+
+            if(!target_addr) {
+                IF_PERF( const uint64_t translate_start(perf::timestamp()); )
+
+                target_addr = basic_block::translate(
+                    base_policy, cpu, app_target_addr, num_translated_bbs);
+
+                IF_PERF( perf::visit_translation(
+                    perf::timestamp() - translate_start); )
+            }
 
 #if CONFIG_DEBUG_ASSERTIONS
             // The trick here is that if we've got a particular buggy
@@ -231,17 +681,21 @@ namespace granary {
                 if(!stored_base_addr) {
                     client::discard_basic_block(*info->state);
                     remove_basic_block_info(target_addr);
+                    remove_translated_trace(app_target_addr, target_addr);
+                    IF_SPECULATE( discard_dbl_patches(cpu); )
 
                     cpu->current_fragment_allocator->free_last();
-                    cpu->stub_allocator.free_last();
+                    cpu->stub_allocator.free_since(stub_position);
                     cpu->block_allocator.free_last();
 
                     IF_TEST( target_addr = nullptr; );
-                    CODE_CACHE->load(base_addr.as_address, target_addr);
+                    CODE_CACHE->load(
+                        base_addr.as_address, target_addr, cpu->id);
                     ASSERT(target_addr);
 
                 } else {
                     client::commit_to_basic_block(*info->state);
+                    IF_SPECULATE( commit_dbl_patches(cpu); )
                 }
 
             // If we've built a trace, then we'll assume it's better than what's
@@ -258,6 +712,7 @@ namespace granary {
                 );
 
                 client::commit_to_basic_block(*info->state);
+                IF_SPECULATE( commit_dbl_patches(cpu); )
             }
         }
 
@@ -272,7 +727,7 @@ namespace granary {
                 target_addr);
 
             if(!CODE_CACHE->store(addr.as_address, target_addr, HASH_KEEP_PREV_ENTRY)) {
-                CODE_CACHE->load(addr.as_address, target_addr);
+                CODE_CACHE->load(addr.as_address, target_addr, cpu->id);
             }
             ibl_unlock();
         }
@@ -281,6 +736,215 @@ namespace granary {
     }
 
 
+    /// Perform both lookup and insertion (basic block translation) into
+    /// the code cache.
+    app_pc code_cache::find(
+        cpu_state_handle cpu,
+        const mangled_address addr,
+        app_pc indirect_cache_source_addr
+    ) {
+#if !CONFIG_ENV_KERNEL
+        code_cache_reclaim_state &state(cpu->code_cache_reclaim);
+        if(CAN_FLUSH && !state.in_find) {
+            state.in_find = true;
+            collect_code_cache(cpu);
+            enter_find(cpu);
+            app_pc target_addr(find_in_generation(
+                cpu, addr, indirect_cache_source_addr));
+            exit_find();
+            state.in_find = false;
+            return target_addr;
+        }
+#endif
+        return find_in_generation(cpu, addr, indirect_cache_source_addr);
+    }
+
+
+    /// Re-translate the code at `addr` in the current generation of the code
+    /// cache.
+    app_pc code_cache::reoptimise_in_generation(
+        cpu_state_handle cpu,
+        const mangled_address addr,
+        const app_pc *hot_path,
+        unsigned hot_path_length
+    ) {
+        instrumentation_policy policy(addr);
+        unsigned num_translated_bbs(0);
+
+#if CONFIG_BUILD_HOT_TRACES
+        // Superblocks are placed in their own region of the code cache so
+        // that the hot code is packed together.
+        generic_fragment_allocator *old_allocator(
+            cpu->current_fragment_allocator);
+        if(hot_path) {
+            cpu->current_fragment_allocator = &(cpu->hot_fragment_allocator);
+        }
+#else
+        ASSERT(!hot_path);
+        UNUSED(hot_path_length);
+#endif
+
+        cpu->current_fragment_allocator->lock_coarse(IF_TEST(cpu->id));
+
+        IF_PERF( const uint64_t translate_start(perf::timestamp()); )
+
+        app_pc target_addr(nullptr);
+#if CONFIG_BUILD_HOT_TRACES
+        if(hot_path) {
+            ASSERT(hot_path[0] == addr.unmangled_address());
+            target_addr = basic_block::translate_superblock(
+                policy, cpu, hot_path, hot_path_length, num_translated_bbs);
+            IF_PERF( perf::visit_hot_trace(); )
+        } else
+#endif
+        {
+            target_addr = basic_block::translate(
+                policy, cpu, addr.unmangled_address(), num_translated_bbs);
+        }
+
+        IF_PERF( perf::visit_translation(
+            perf::timestamp() - translate_start); )
+
+        // The re-translation is assumed to be better than whatever is already
+        // in the code cache, as with traces.
+        CODE_CACHE->store(
+            addr.as_address, target_addr, HASH_OVERWRITE_PREV_ENTRY);
+
+        const basic_block_info *info(find_basic_block_info(target_addr));
+        client::commit_to_basic_block(*info->state);
+        IF_SPECULATE( commit_dbl_patches(cpu); )
+
+        cpu->current_fragment_allocator->unlock_coarse();
+
+#if CONFIG_BUILD_HOT_TRACES
+        cpu->current_fragment_allocator = old_allocator;
+#endif
+
+        return target_addr;
+    }
+
+
+    /// Re-translate the code at `addr`, and make the re-translation the
+    /// global code cache's entry for `addr`.
+    app_pc code_cache::reoptimise(
+        cpu_state_handle cpu,
+        const mangled_address addr,
+        const app_pc *hot_path,
+        unsigned hot_path_length
+    ) {
+#if !CONFIG_ENV_KERNEL
+        code_cache_reclaim_state &state(cpu->code_cache_reclaim);
+        if(CAN_FLUSH && !state.in_find) {
+            state.in_find = true;
+            enter_find(cpu);
+            app_pc target_addr(reoptimise_in_generation(
+                cpu, addr, hot_path, hot_path_length));
+            exit_find();
+            state.in_find = false;
+            return target_addr;
+        }
+#endif
+        return reoptimise_in_generation(
+            cpu, addr, hot_path, hot_path_length);
+    }
+
+
+    /// Flush the code cache.
+    void code_cache::flush(void) {
+#if CONFIG_ENV_KERNEL
+        FAULT;
+#else
+        cpu_state_handle cpu;
+        ASSERT(!cpu->code_cache_reclaim.in_find);
+        flush_code_cache(cpu);
+#endif
+    }
+
+
+    /// Returns true iff the key of an entry in the global code cache is the
+    /// (mangled) address of native code of a `stale` trace.
+    static bool is_stale_entry(
+        app_pc key,
+        app_pc,
+        stale_traces &stale
+    ) {
+        mangled_address am;
+        am.as_address = key;
+        return is_translated_from(stale, am.unmangled_address());
+    }
+
+
+    /// Invalidate the translations of the native code in `[begin, end)`.
+    bool code_cache::invalidate(app_pc begin, app_pc end) {
+        stale_traces stale;
+        if(!remove_translated_range(begin, end, stale)) {
+            return false;
+        }
+
+        IF_PERF( perf::visit_code_cache_invalidation(); )
+        IF_SPECULATE( speculative_translation::invalidate(); )
+
+        // Make the stale traces unreachable: first from lookups, so that
+        // branches that are unlinked go on to find new translations, and
+        // then from the branches that were patched to go to them.
+        IF_KERNEL( eflags flags(granary_disable_interrupts()); )
+        CODE_CACHE->remove_if(is_stale_entry, stale);
+        ibl_invalidate(stale);
+        CODE_CACHE_INVALIDATION.fetch_add(1);
+        unlink_dbl_patches(stale);
+        IF_KERNEL( granary_store_flags(flags); )
+
+        free_stale_traces(stale);
+        return true;
+    }
+
+
+    /// Set the maximum number of bytes of fragment memory that the code
+    /// cache can use before it is automatically flushed.
+    void code_cache::set_budget(unsigned long num_bytes) {
+#if CONFIG_ENV_KERNEL
+        if(num_bytes) {
+            FAULT;
+        }
+#else
+        ASSERT(!CONFIG_ENABLE_TRACE_ALLOCATOR);
+        CODE_CACHE_BUDGET = num_bytes;
+        if(num_bytes) {
+            CAN_FLUSH = true;
+        }
+#endif
+    }
+
+
+    /// Returns the current generation of the code cache.
+    unsigned code_cache::generation(void) {
+        return CODE_CACHE_GENERATION.load();
+    }
+
+
+    /// Tell the code cache that `cpu` isn't executing any translated code.
+    void code_cache::quiesce(cpu_state_handle cpu) {
+#if CONFIG_ENV_KERNEL
+        UNUSED(cpu);
+#else
+        code_cache_reclaim_state &state(cpu->code_cache_reclaim);
+        if(!CAN_FLUSH || state.in_find) {
+            return;
+        }
+
+        state.in_find = true;
+        enter_find(cpu);
+        exit_find();
+        if(RETIRED_CODE.load(std::memory_order_relaxed)
+        && RECLAIM_EPOCH.load() != state.scanned_epoch) {
+            scan_stack(cpu);
+            reclaim_retired_code();
+        }
+        state.in_find = false;
+#endif
+    }
+
+
     /// Add some illegal detach points.
     GRANARY_DETACH_POINT_ERROR(
         (app_pc (*)(app_pc, instrumentation_policy)) code_cache::find)
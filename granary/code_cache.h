@@ -94,6 +94,96 @@ namespace granary {
 
         /// Force add an entry into the code cache.
         static void add(app_pc, app_pc) ;
+
+
+        /// Clear the CPU-private code cache of `cpu` if any translations have
+        /// been invalidated since it was last cleared. This must be invoked
+        /// before looking up an entry in the CPU-private code cache.
+        static void refresh_cpu_cache(cpu_state_handle cpu) ;
+
+
+        /// Flush the code cache. All translated code is discarded, and the
+        /// memory of the discarded code is reclaimed once no thread can be
+        /// executing it.
+        ///
+        /// Note: Flushing is only supported in user space, and must have
+        ///       been enabled, either with `CONFIG_CODE_CACHE_BUDGET`, or by
+        ///       invoking `set_budget` before any code is translated.
+        ///
+        /// Note: This must not be invoked during a translation.
+        static void flush(void) ;
+
+
+        /// Invalidate the translations of the native code in `[begin, end)`,
+        /// e.g. because the code was unmapped or modified. Later executions
+        /// of the code are re-translated. Returns true iff any of the code
+        /// had been translated.
+        ///
+        /// Every trace that was (partially) translated from the code is
+        /// removed from the global code cache, the IBL jump table, and (the
+        /// next time that they are used) the CPU-private code caches, and
+        /// the direct branches that were patched to go to those traces are
+        /// unlinked. The memory of the invalidated traces is reclaimed along
+        /// with the rest of their generation when the code cache is flushed,
+        /// and is otherwise never reclaimed.
+        ///
+        /// Note: This must not be invoked during a translation.
+        static bool invalidate(app_pc begin, app_pc end) ;
+
+
+        /// Set the maximum number of bytes of fragment memory that the code
+        /// cache can use before it is automatically flushed. A budget of `0`
+        /// disables automatic flushing. Only supported in user space; a
+        /// non-zero budget is a fault in kernel space, where the code cache
+        /// is unbounded (see `CONFIG_CODE_CACHE_BUDGET`).
+        static void set_budget(unsigned long num_bytes) ;
+
+
+        /// Returns the current generation of the code cache. The generation
+        /// is incremented each time the code cache is flushed.
+        static unsigned generation(void) ;
+
+
+        /// Tell the code cache that `cpu` isn't executing (or referencing)
+        /// any translated code. This catches `cpu` up to the current
+        /// generation, and lets flushed code be reclaimed, without `cpu`
+        /// needing to call `find`. This is used by threads of Granary that
+        /// can idle for a long time.
+        static void quiesce(cpu_state_handle cpu) ;
+
+
+        /// Re-translate the code at `addr`, and make the re-translation the
+        /// global code cache's entry for `addr`. Returns the address of the
+        /// re-translated code. This is used to re-optimise hot blocks using
+        /// their execution profiles. If `hot_path` is non-null, then the
+        /// `hot_path_length` blocks of the path, which must begin with `addr`
+        /// and loop back to it, are translated together as a superblock.
+        static app_pc reoptimise(
+            cpu_state_handle cpu,
+            const mangled_address addr,
+            const app_pc *hot_path=nullptr,
+            unsigned hot_path_length=0
+        ) ;
+
+    private:
+
+        /// Perform both lookup and insertion (basic block translation) into
+        /// the current generation of the code cache.
+        static app_pc find_in_generation(
+            cpu_state_handle cpu,
+            const mangled_address addr,
+            app_pc indirect_cache_source_addr
+        ) ;
+
+
+        /// Re-translate the code at `addr` in the current generation of the
+        /// code cache.
+        static app_pc reoptimise_in_generation(
+            cpu_state_handle cpu,
+            const mangled_address addr,
+            const app_pc *hot_path,
+            unsigned hot_path_length
+        ) ;
     };
 
 }
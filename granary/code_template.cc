@@ -0,0 +1,106 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * code_template.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/globals.h"
+#include "granary/code_template.h"
+#include "granary/emit_utils.h"
+
+namespace granary {
+
+
+    /// Encode the instructions of `ls` as this template's bytes.
+    void code_template::compile(instruction_list &ls) {
+        size = ls.encoded_size();
+        num_relocs = 0;
+
+        ASSERT(size <= MAX_CODE_TEMPLATE_SIZE);
+
+        memset(&(bytes[0]), 0xCC, size);
+        ls.encode(&(bytes[0]), size);
+    }
+
+
+    /// Mark the last `REL32` or `ABS64` field of `in` as a relocation.
+    void code_template::add_reloc(
+        instruction in,
+        code_template_reloc_kind kind
+    ) {
+        ASSERT(num_relocs < MAX_NUM_CODE_TEMPLATE_RELOCS);
+
+        const unsigned next_pc_offset(offset_of(in) + in.instr->length);
+        const unsigned field_size(
+            RELOC_ABS64 == kind ? sizeof(uint64_t) : sizeof(uint32_t));
+
+        ASSERT(next_pc_offset <= size);
+        ASSERT(field_size <= in.instr->length);
+
+        code_template_reloc &reloc(relocs[num_relocs++]);
+        reloc.offset = static_cast<uint8_t>(next_pc_offset - field_size);
+        reloc.next_pc_offset = static_cast<uint8_t>(next_pc_offset);
+        reloc.kind = kind;
+    }
+
+
+    /// Returns the offset of `in` within the template.
+    unsigned code_template::offset_of(instruction in) const {
+        const app_pc pc(in.pc_or_raw_bytes());
+        ASSERT(&(bytes[0]) <= pc && pc <= &(bytes[size]));
+        return static_cast<unsigned>(pc - &(bytes[0]));
+    }
+
+
+    /// Returns true if all `REL32` relocations can reach their values.
+    bool code_template::can_emit(app_pc pc, const uint64_t *values) const {
+        for(unsigned i(0); i < num_relocs; ++i) {
+            if(RELOC_REL32 == relocs[i].kind
+            && is_far_away(pc + relocs[i].next_pc_offset,
+                           reinterpret_cast<const void *>(values[i]))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+
+    /// Emit this template at `pc`.
+    void code_template::emit(app_pc pc, const uint64_t *values) const {
+        memcpy(pc, &(bytes[0]), size);
+
+        for(unsigned i(0); i < num_relocs; ++i) {
+            const code_template_reloc &reloc(relocs[i]);
+            if(RELOC_ABS64 == reloc.kind) {
+                *unsafe_cast<uint64_t *>(pc + reloc.offset) = values[i];
+            } else {
+                const int64_t rel(static_cast<int64_t>(
+                    values[i] - reinterpret_cast<uint64_t>(
+                        pc + reloc.next_pc_offset)));
+                *unsafe_cast<int32_t *>(pc + reloc.offset) =
+                    static_cast<int32_t>(rel);
+            }
+        }
+    }
+
+
+#if CONFIG_DEBUG_CHECK_CODE_TEMPLATES
+    /// Make sure that the template emitted at `pc` is the same as the
+    /// encoding of `ls` at `pc`.
+    void code_template::check(app_pc pc, instruction_list &ls) const {
+        uint8_t staged[MAX_CODE_TEMPLATE_SIZE];
+
+        ASSERT(size == ls.encoded_size());
+
+        // Encode twice so that forward jumps to labels are resolved.
+        ls.stage_encode(&(staged[0]), pc);
+        ls.stage_encode(&(staged[0]), pc);
+
+        for(unsigned i(0); i < size; ++i) {
+            ASSERT(staged[i] == pc[i]);
+        }
+    }
+#endif
+}
@@ -0,0 +1,97 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * code_template.h
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#ifndef GRANARY_CODE_TEMPLATE_H_
+#define GRANARY_CODE_TEMPLATE_H_
+
+#include "granary/globals.h"
+#include "granary/instruction.h"
+
+namespace granary {
+
+
+    /// Kinds of values that can be patched into a code template.
+    enum code_template_reloc_kind : uint8_t {
+
+        /// An absolute 64-bit immediate, e.g. of a `MOV r64, imm64`.
+        RELOC_ABS64,
+
+        /// A 32-bit displacement relative to the end of the instruction, e.g.
+        /// of a `JMP rel32` or of a `CALL [RIP + disp32]`.
+        RELOC_REL32
+    };
+
+
+    enum {
+        MAX_CODE_TEMPLATE_SIZE = 64,
+        MAX_NUM_CODE_TEMPLATE_RELOCS = 4
+    };
+
+
+    /// A value to be patched into a code template.
+    struct code_template_reloc {
+
+        /// Offset of the patched field within the template.
+        uint8_t offset;
+
+        /// Offset of the end of the instruction containing the field. REL32
+        /// values are relative to this.
+        uint8_t next_pc_offset;
+
+        code_template_reloc_kind kind;
+    };
+
+
+    /// A fixed sequence of instructions that is pre-encoded once, and then
+    /// emitted many times by copying its bytes and patching in the values
+    /// that differ between copies. This avoids going through the encoder for
+    /// every copy.
+    struct code_template {
+
+        uint8_t bytes[MAX_CODE_TEMPLATE_SIZE];
+        unsigned size;
+
+        unsigned num_relocs;
+        code_template_reloc relocs[MAX_NUM_CODE_TEMPLATE_RELOCS];
+
+
+        /// Encode the instructions of `ls` as this template's bytes. The
+        /// values in the instructions are placeholders; the fields that hold
+        /// them are then added in order with `add_reloc`.
+        void compile(instruction_list &ls) ;
+
+
+        /// Mark the last `REL32` or `ABS64` field of `in` as a relocation.
+        /// `in` must be an instruction of the list passed to `compile`.
+        void add_reloc(instruction in, code_template_reloc_kind kind) ;
+
+
+        /// Returns the offset of `in` within the template. `in` must be an
+        /// instruction of the list passed to `compile`.
+        unsigned offset_of(instruction in) const ;
+
+
+        /// Returns true if the template can be emitted at `pc`, i.e. if all
+        /// of the `REL32` relocations can reach their values.
+        bool can_emit(app_pc pc, const uint64_t *values) const ;
+
+
+        /// Emit this template at `pc`, patching the Nth relocation with
+        /// `values[N]`.
+        void emit(app_pc pc, const uint64_t *values) const ;
+
+
+#if CONFIG_DEBUG_CHECK_CODE_TEMPLATES
+        /// Make sure that the template emitted at `pc` is the same as the
+        /// encoding of `ls` at `pc`.
+        void check(app_pc pc, instruction_list &ls) const ;
+#endif
+    };
+}
+
+#endif /* GRANARY_CODE_TEMPLATE_H_ */
@@ -10,8 +10,16 @@
 namespace granary {
 
     enum {
-        MAX_SCAN = 8,
-        MIN_DEFAULT_ENTRIES = 128
+        NUM_WAYS = CPU_PRIVATE_CODE_CACHE_NUM_WAYS,
+
+        /// Number of consecutive buckets that are probed for a key.
+        MAX_SCAN_BUCKETS = 8,
+
+        MIN_DEFAULT_BUCKETS = 32,
+
+        /// Number of old buckets migrated per lookup or store during an
+        /// incremental resize.
+        NUM_MIGRATE_BUCKETS = 2
     };
 
     /// 64-bit mix function from murmurhash3.
@@ -26,22 +34,62 @@ namespace granary {
       return k;
     }
 
-    /// Find an entry in the CPU-private code cache.
-    app_pc cpu_private_code_cache::find(app_pc key) const {
-        if(!entries) {
-            return nullptr;
+
+    /// Allocate a zeroed, cache-line-aligned table of `num_buckets` buckets.
+    static cpu_private_code_cache_table allocate_table(uint64_t num_buckets) {
+        cpu_private_code_cache_table table;
+        table.memory = allocate_memory<uint8_t>(
+            num_buckets * sizeof(cpu_private_code_cache_bucket)
+            + CACHE_LINE_SIZE);
+
+        const uintptr_t aligned_addr(
+            (reinterpret_cast<uintptr_t>(table.memory) + CACHE_LINE_SIZE - 1)
+            & ~static_cast<uintptr_t>(CACHE_LINE_SIZE - 1));
+        table.buckets = unsafe_cast<cpu_private_code_cache_bucket *>(
+            aligned_addr);
+        table.bit_mask = num_buckets - 1;
+        return table;
+    }
+
+
+    /// Free a table and mark it as empty.
+    static void free_table(cpu_private_code_cache_table &table) {
+        if(table.memory) {
+            free_memory<uint8_t>(table.memory,
+                (table.bit_mask + 1) * sizeof(cpu_private_code_cache_bucket)
+                + CACHE_LINE_SIZE);
         }
+        table.memory = nullptr;
+        table.buckets = nullptr;
+        table.bit_mask = 0;
+    }
+
 
+    /// Find an entry in one table. All keys of a bucket are compared before
+    /// moving on to the next bucket. A bucket with a free slot ends the probe
+    /// sequence, as no key would have overflowed past it.
+    FORCE_INLINE
+    static app_pc find_in_table(
+        const cpu_private_code_cache_table &table,
+        const app_pc key
+    ) {
         uint64_t index(fmix(reinterpret_cast<uint64_t>(key)));
 
-        for(int m(0); ++m <= MAX_SCAN; ++index) {
-            index &= bit_mask;
-            cpu_private_code_cache_entry &entry(entries[index]);
-            if(!entry.source) {
-                break;
+        for(unsigned m(0); m < MAX_SCAN_BUCKETS; ++m, ++index) {
+            const cpu_private_code_cache_bucket &bucket(
+                table.buckets[index & table.bit_mask]);
+
+            bool has_free_slot(false);
+            for(unsigned i(0); i < NUM_WAYS; ++i) {
+                const app_pc source(bucket.sources[i]);
+                if(key == source) {
+                    return bucket.dests[i];
+                }
+                has_free_slot = has_free_slot || !source;
             }
-            if(key == entry.source) {
-                return entry.dest;
+
+            if(has_free_slot) {
+                break;
             }
         }
 
@@ -49,68 +97,180 @@ namespace granary {
     }
 
 
-    /// Insert an entry into the hash table. Returns true iff an element
-    /// with the key didn't previously exist in the hash table.
-    hash_store_state cpu_private_code_cache::insert(
+    /// Insert an entry into one table. Sets `full` to true iff there was no
+    /// room for the entry in any of the probed buckets.
+    static hash_store_state insert_into_table(
+        cpu_private_code_cache_table &table,
         app_pc key,
         app_pc value,
-        bool update
+        bool update,
+        bool &full
     ) {
         uint64_t index(fmix(reinterpret_cast<uint64_t>(key)));
-        unsigned scan(0);
-        hash_store_state state(HASH_ENTRY_SKIPPED);
+        full = false;
 
-        for(;; ++scan, ++index) {
-            index &= bit_mask;
+        for(unsigned m(0); m < MAX_SCAN_BUCKETS; ++m, ++index) {
+            cpu_private_code_cache_bucket &bucket(
+                table.buckets[index & table.bit_mask]);
 
-            cpu_private_code_cache_entry &entry(entries[index]);
+            for(unsigned i(0); i < NUM_WAYS; ++i) {
 
-            // insert position
-            if(nullptr == entry.source) {
-                entry.dest = value;
-                entry.source = key;
-                state = HASH_ENTRY_STORED_NEW;
-                break;
-            }
+                // insert position
+                if(!bucket.sources[i]) {
+                    bucket.dests[i] = value;
+                    bucket.sources[i] = key;
+                    return HASH_ENTRY_STORED_NEW;
+                }
 
-            // already inserted
-            if(entry.source == key) {
-                if(update) {
-                    entry.dest = value;
-                    state = HASH_ENTRY_STORED_OVERWRITE;
+                // already inserted
+                if(key == bucket.sources[i]) {
+                    if(update) {
+                        bucket.dests[i] = value;
+                        return HASH_ENTRY_STORED_OVERWRITE;
+                    }
+                    return HASH_ENTRY_SKIPPED;
                 }
-                break;
             }
         }
 
-        // resize if we needed to scan too far to insert this element.
-        if(MAX_SCAN < scan && !growing) {
-            growing = true;
-            grow();
-            growing = false;
+        full = true;
+        return HASH_ENTRY_SKIPPED;
+    }
+
+
+    /// Find an entry in the CPU-private code cache.
+    app_pc cpu_private_code_cache::find(app_pc key) const {
+        if(!table.buckets) {
+            return nullptr;
+        }
+
+        app_pc value(find_in_table(table, key));
+        if(!value && old_table.buckets) {
+            value = find_in_table(old_table, key);
         }
 
-        return state;
+        return value;
+    }
+
+
+    /// Find an entry in the CPU-private code cache, and make progress on any
+    /// in-progress resize.
+    app_pc cpu_private_code_cache::lookup(app_pc key) {
+        if(!table.buckets) {
+            return nullptr;
+        }
+
+        app_pc value(find_in_table(table, key));
+        if(old_table.buckets) {
+            if(!value) {
+                value = find_in_table(old_table, key);
+            }
+            migrate();
+        }
+
+        return value;
+    }
+
+
+    /// Migrate a few buckets from the old table into the new table. Migrated
+    /// buckets are left intact in the old table so that probe sequences of
+    /// not-yet-migrated keys remain valid.
+    void cpu_private_code_cache::migrate(void) {
+        for(unsigned m(0); m < NUM_MIGRATE_BUCKETS; ++m) {
+            if(next_migrate_index > old_table.bit_mask) {
+                free_table(old_table);
+                next_migrate_index = 0;
+                return;
+            }
+
+            cpu_private_code_cache_bucket &bucket(
+                old_table.buckets[next_migrate_index++]);
+
+            for(unsigned i(0); i < NUM_WAYS; ++i) {
+                if(!bucket.sources[i]) {
+                    continue;
+                }
+
+                // Entries already in the new table are newer than the ones
+                // in the old table.
+                bool full(false);
+                const hash_store_state state(insert_into_table(
+                    table, bucket.sources[i], bucket.dests[i], false, full));
+
+                if(full) {
+                    rebuild();
+                    return;
+                }
+
+                if(HASH_ENTRY_STORED_NEW == state) {
+                    ++num_entries;
+                }
+            }
+        }
     }
 
-    /// Grow the hash table. This increases the hash table's size by two.
+
+    /// Begin an incremental resize of the hash table.
     void cpu_private_code_cache::grow(void) {
-        cpu_private_code_cache_entry *old_entries(entries);
-        const uint64_t old_num_entries(bit_mask + 1);
-        const uint64_t new_num_entries(old_num_entries << 1);
-        entries = allocate_memory<cpu_private_code_cache_entry>(new_num_entries);
-        bit_mask = new_num_entries - 1;
-
-        growing = true;
-        for(uint64_t i(0); i < old_num_entries; ++i) {
-            if(old_entries[i].source) {
-                insert(old_entries[i].source, old_entries[i].dest, true);
+        if(old_table.buckets) {
+            rebuild();
+            return;
+        }
+
+        old_table = table;
+        table = allocate_table((old_table.bit_mask + 1) << 1);
+        next_migrate_index = 0;
+        num_entries = 0;
+    }
+
+
+    /// Synchronously move every entry of the new and old tables into a table
+    /// that is at least twice as big as the current new table.
+    void cpu_private_code_cache::rebuild(void) {
+        uint64_t num_buckets((table.bit_mask + 1) << 1);
+
+        for(;; num_buckets <<= 1) {
+            cpu_private_code_cache_table new_table(
+                allocate_table(num_buckets));
+            cpu_private_code_cache_table *sources[2] = {&table, &old_table};
+            uint64_t new_num_entries(0);
+            bool full(false);
+
+            for(unsigned t(0); t < 2 && !full; ++t) {
+                if(!sources[t]->buckets) {
+                    continue;
+                }
+
+                const uint64_t num_source_buckets(sources[t]->bit_mask + 1);
+                for(uint64_t b(0); b < num_source_buckets && !full; ++b) {
+                    cpu_private_code_cache_bucket &bucket(
+                        sources[t]->buckets[b]);
+
+                    for(unsigned i(0); i < NUM_WAYS && !full; ++i) {
+                        if(bucket.sources[i] && HASH_ENTRY_STORED_NEW ==
+                            insert_into_table(new_table, bucket.sources[i],
+                                bucket.dests[i], false, full)) {
+                            ++new_num_entries;
+                        }
+                    }
+                }
             }
+
+            if(full) {
+                free_table(new_table);
+                continue;
+            }
+
+            free_table(table);
+            free_table(old_table);
+            table = new_table;
+            next_migrate_index = 0;
+            num_entries = new_num_entries;
+            return;
         }
-        growing = false;
-        free_memory(old_entries, old_num_entries);
     }
 
+
     /// Store a value in the hash table. Returns true iff the entry was
     /// written to the hash table.
     bool cpu_private_code_cache::store(
@@ -118,19 +278,56 @@ namespace granary {
         app_pc value,
         hash_store_policy update
     ) {
-        if(!entries) {
-            entries = allocate_memory<cpu_private_code_cache_entry>(
-                MIN_DEFAULT_ENTRIES);
-            bit_mask = MIN_DEFAULT_ENTRIES - 1;
+        if(!table.buckets) {
+            table = allocate_table(MIN_DEFAULT_BUCKETS);
+            num_entries = 0;
+        }
+
+        const bool overwrite(HASH_OVERWRITE_PREV_ENTRY == update);
+
+        if(old_table.buckets) {
+            if(!overwrite
+            && !find_in_table(table, key)
+            && find_in_table(old_table, key)) {
+                return false;
+            }
+            migrate();
         }
 
-        const hash_store_state state(insert(
-            key, value, HASH_OVERWRITE_PREV_ENTRY == update));
+        bool full(false);
+        hash_store_state state(HASH_ENTRY_SKIPPED);
+        for(;;) {
+            state = insert_into_table(table, key, value, overwrite, full);
+            if(!full) {
+                break;
+            }
+            grow();
+        }
 
         if(HASH_ENTRY_STORED_NEW == state) {
+            ++num_entries;
+
+            // Start growing once the table is half full. Beyond that,
+            // clusters of full buckets quickly outgrow `MAX_SCAN_BUCKETS`.
+            const uint64_t capacity((table.bit_mask + 1) * NUM_WAYS);
+            if(!old_table.buckets && (num_entries * 2) > capacity) {
+                grow();
+            }
             return true;
         }
 
         return HASH_ENTRY_SKIPPED != state;
     }
+
+
+    /// Remove all entries from the hash table.
+    void cpu_private_code_cache::clear(void) {
+        free_table(old_table);
+        next_migrate_index = 0;
+        num_entries = 0;
+        if(table.buckets) {
+            memset(table.buckets, 0,
+                (table.bit_mask + 1) * sizeof(cpu_private_code_cache_bucket));
+        }
+    }
 }
@@ -13,33 +13,81 @@
 namespace granary {
 
 
-    /// Entry in the code cache.
-    struct cpu_private_code_cache_entry {
+    enum {
+        /// Number of (source, dest) pairs that fit into one bucket. A bucket
+        /// occupies exactly one cache line.
+        CPU_PRIVATE_CODE_CACHE_NUM_WAYS = (
+            CONFIG_ARCH_CACHE_LINE_SIZE / (2 * sizeof(app_pc)))
+    };
+
+
+    /// A cache-line-sized bucket in the code cache. The keys are grouped
+    /// together so that a probe of a bucket only compares adjacent words of
+    /// one cache line.
+    struct cpu_private_code_cache_bucket {
     public:
-        app_pc source;
-        app_pc dest;
-    } __attribute__((packed));
+        app_pc sources[CPU_PRIVATE_CODE_CACHE_NUM_WAYS];
+        app_pc dests[CPU_PRIVATE_CODE_CACHE_NUM_WAYS];
+    } __attribute__((aligned (CONFIG_ARCH_CACHE_LINE_SIZE)));
+
+
+    static_assert(
+        CONFIG_ARCH_CACHE_LINE_SIZE == sizeof(cpu_private_code_cache_bucket),
+        "A CPU-private code cache bucket must fill exactly one cache line.");
+
+
+    /// An array of buckets.
+    struct cpu_private_code_cache_table {
+    public:
+
+        /// Mask on the bucket indices.
+        uint64_t bit_mask;
+
+        /// Cache-line-aligned array of buckets.
+        cpu_private_code_cache_bucket *buckets;
+
+        /// The (possibly unaligned) memory backing `buckets`.
+        uint8_t *memory;
+    };
 
 
     /// Represents a simple hash table for a CPU-private code cache. This hash
     /// table is specific to app addresses, but maintains the same public
     /// interface as other Granary hash tables.
+    ///
+    /// The table grows incrementally: when it becomes too full, a table of
+    /// twice the size is allocated, and every subsequent operation by the
+    /// owning CPU migrates a few buckets from the old table into the new one.
+    /// While a migration is in progress, lookups check the new table first,
+    /// and then the old table.
     struct cpu_private_code_cache {
     public:
 
-        /// Mask on the entries.
-        uint64_t bit_mask;
+        /// The table into which new entries are inserted.
+        cpu_private_code_cache_table table;
+
+        /// The table being migrated into `table`. This is empty if no
+        /// migration is in progress.
+        cpu_private_code_cache_table old_table;
 
-        /// Array of (key, value) pairs.
-        cpu_private_code_cache_entry *entries;
+        /// Index of the next bucket of `old_table` to migrate.
+        uint64_t next_migrate_index;
 
-        /// Are we currently growing this hash table?
-        bool growing;
+        /// The number of entries in `table`.
+        uint64_t num_entries;
 
-        /// Find the value associated with a key in the hash table.
+        /// Find the value associated with a key in the hash table. This does
+        /// not modify the hash table, and so it is safe to use on tables that
+        /// are shared by many CPUs.
         __attribute__((hot, optimize("O3")))
         app_pc find(const app_pc key) const ;
 
+        /// Find the value associated with a key in the hash table, and migrate
+        /// a few buckets of an in-progress resize. This must only be invoked
+        /// by the CPU that owns this code cache.
+        __attribute__((hot, optimize("O3")))
+        app_pc lookup(const app_pc key) ;
+
         /// Search for an entry in the hash table.
         __attribute__((hot))
         inline bool load(const app_pc key, app_pc &value) const {
@@ -55,20 +103,25 @@ namespace granary {
             hash_store_policy update=HASH_OVERWRITE_PREV_ENTRY
         ) ;
 
+        /// Remove all entries from the hash table. This must only be invoked
+        /// by the CPU that owns this code cache.
+        void clear(void) ;
+
     private:
 
-        /// Insert an entry into the hash table. Returns true iff an element
-        /// with the key didn't previously exist in the hash table.
-        hash_store_state insert(
-            app_pc key,
-            app_pc value,
-            bool update
-        ) ;
+        /// Migrate a few buckets from the old table into the new table.
+        void migrate(void) ;
 
-        /// Grow the hash table. This increases the hash table's size by two.
+        /// Begin an incremental resize of the hash table. This doubles the
+        /// hash table's size.
         void grow(void) ;
 
-    } __attribute__((packed));
+        /// Synchronously rebuild the hash table so that it holds all entries
+        /// of both the new and old tables. This is the fallback for when an
+        /// insertion overflows during a migration.
+        void rebuild(void) ;
+
+    };
 
 }
 
@@ -13,20 +13,29 @@
 #include "granary/instruction.h"
 #include "granary/spin_lock.h"
 #include "granary/emit_utils.h"
+#include "granary/code_template.h"
 
 #include "granary/basic_block.h"
 #include "granary/basic_block_info.h"
+#include "granary/bump_allocator.h"
+#include "granary/hash_table.h"
+#include "granary/speculate.h"
+#include "granary/translated_ranges.h"
 
 namespace granary {
 
 
+    /// Sizes of the code of a DBL stub.
+    enum {
+        CALL_INDIRECT_ADDRESS_SIZE = 6, // 1-byte opcode + mod/rm + rel32
+        MAX_DBL_STUB_SIZE = 16
+    };
+
+
     /// Data structure that tracks direct control flow instructions that must
-    /// be patched, and how to patch them.
-    ///
-    /// TODO: Find a way do to garbage collection on these. Alternatively, keep
-    ///       them around as a way of re-wiring the code cache, although this
-    ///       is redundant because there is already enough information contained
-    ///       in `basic_block_info` to effectively re-wire things.
+    /// be patched, and how to patch them. These are allocated from the same
+    /// CPU-private allocator as the stubs that refer to them, so that they
+    /// are reclaimed along with those stubs when the code cache is flushed.
     struct direct_branch_patch_info {
 
         /// Always the same; the function that actually performs the patch.
@@ -51,57 +60,107 @@ namespace granary {
             DBL_FALL_THROUGH,
             DBL_UNCONDITIONAL
         } kind;
-    };
 
+#if CONFIG_SPECULATIVE_TRANSLATION
+        /// Next patch in the list of uncommitted patches of the CPU that
+        /// allocated this patch.
+        direct_branch_patch_info *next_uncommitted;
+#endif
 
-    enum {
-        CALL_INDIRECT_ADDRESS_SIZE = 6 // 1-byte opcode + mod/rm + rel32
+        /// Next patch in the list of patches whose instructions were patched
+        /// to go to the same translated target.
+        direct_branch_patch_info *next_incoming;
+
+        /// The DBL stub that the instruction to patch initially targets. The
+        /// stub calls `patcher_func`.
+        uint8_t stub[MAX_DBL_STUB_SIZE];
     };
 
 
-    /// Patch a direct control-flow instruction.
-    GRANARY_ENTRYPOINT
-    static void patch_instruction(app_pc *ret_address_addr) {
+    /// Template of DBL stubs. The only relocation is the address of the
+    /// `patcher_func` that the stub calls through.
+    static code_template DBL_STUB_TEMPLATE;
 
-        // Notify Granary that we're entering!
-        cpu_state_handle cpu;
-        granary::enter(cpu);
 
-        app_pc indirect_call(*ret_address_addr - CALL_INDIRECT_ADDRESS_SIZE);
+    /// Build the instructions of a DBL stub that calls through
+    /// `patcher_func`. Returns the call.
+    static instruction build_dbl_stub(
+        instruction_list &ls,
+        app_pc *patcher_func
+    ) {
+        // Redzone is unshifted in the RET instruction of the patcher
+        // in the case of user space.
+        IF_USER( ls.append(lea_(reg::rsp, reg::rsp[-REDZONE_SIZE])); )
+        return ls.append(call_ind_(mem_pc_(patcher_func)));
+    }
 
-        // Make sure we're coming from the right place.
-        ASSERT(is_gencode_address(indirect_call));
 
-        // The indirect call that brought us here goes through the actual
-        // `direct_branch_patch_info` structure.
-        instruction call_ind(instruction::decode(&indirect_call));
-        direct_branch_patch_info *patch(unsafe_cast<direct_branch_patch_info *>(
-            call_ind.cti_target().value.addr));
+    /// Maps the translated targets of patched instructions to the lists of
+    /// patches of those instructions, so that the instructions can be
+    /// unlinked if their targets are invalidated. Guarded by
+    /// `INCOMING_LINKS_LOCK`.
+    static static_data<
+        hash_table<app_pc, direct_branch_patch_info *>
+    > INCOMING_LINKS;
+    static spin_lock INCOMING_LINKS_LOCK;
 
-        // Start by specifying the return address as the instruction that
-        // brought us into here, i.e. infinite loop!
-        *ret_address_addr = call_ind.pc_or_raw_bytes();
 
-        // If we can't get mutual exclusion over the locking process then we'll
-        // give up and go right on back. This might re-enter again, which is
-        // fine.
-        if(!patch->lock.try_acquire()) {
-            if(patch->translated_target_address) {
-                *ret_address_addr = patch->translated_target_address;
-            }
-            return;
-        }
+    STATIC_INITIALISE_ID(dbl_incoming_links, {
+        INCOMING_LINKS.construct();
+    });
 
-        // We got ownership of the lock, but we've just realized that the
-        // instruction has already been patched!
-        //
-        // TODO: Garbage collection of patch info structures.
-        if(patch->translated_target_address) {
-            patch->lock.release();
-            *ret_address_addr = patch->translated_target_address;
-            return;
-        }
 
+    /// Add `patch` to the list of patches whose instructions go to `target`.
+    ///
+    /// Note: Must be called with `INCOMING_LINKS_LOCK` held.
+    static void add_incoming_link(
+        direct_branch_patch_info *patch,
+        app_pc target
+    ) {
+        direct_branch_patch_info *links(nullptr);
+        INCOMING_LINKS->load(target, links);
+        patch->next_incoming = links;
+        INCOMING_LINKS->store(target, patch);
+    }
+
+
+    /// Change the target of the (already encoded) direct CTI at
+    /// `patch_address` to `target_pc`.
+    static void retarget_cti(app_pc patch_address, app_pc target_pc) {
+        uint64_t staged_code(0);
+        app_pc staged_data(reinterpret_cast<app_pc>(&staged_code));
+
+        app_pc decode_address(patch_address);
+        instruction new_cti(instruction::decode(&decode_address));
+
+        IF_TEST( const unsigned old_cti_len(new_cti.encoded_size()); )
+
+        new_cti.set_cti_target(pc_(target_pc));
+        new_cti.stage_encode(staged_data, patch_address);
+        const unsigned new_cti_len(new_cti.encoded_size());
+
+        ASSERT(old_cti_len == new_cti_len);
+
+        const unsigned rel32_offset(new_cti_len - sizeof(uint32_t));
+        const uint32_t new_rel32(
+            *unsafe_cast<uint32_t *>(&(staged_data[rel32_offset])));
+        uint32_t *old_rel32(
+            unsafe_cast<uint32_t *>(&(patch_address[rel32_offset])));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        *old_rel32 = new_rel32;
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+
+    /// Translate the target of `patch`, and patch its instruction to go
+    /// directly to the translated target. Must be called with `patch->lock`
+    /// held and before `patch` has been patched; releases the lock. Returns
+    /// the translated target.
+    static app_pc patch_locked(
+        cpu_state_handle cpu,
+        direct_branch_patch_info *patch
+    ) {
         // Record performance counts that can help us evaluate tracing
         // strategies.
         IF_PERF( perf::visit_patched_dbl(); )
@@ -126,8 +185,17 @@ namespace granary {
         cpu->current_fragment_allocator = source_bb_info->allocator;
 #endif
 
+        const unsigned generation(cpu->code_cache_generation);
         app_pc target_pc(code_cache::find(cpu, patch->target_address));
 
+        // The code cache was flushed while finding the target, so the
+        // instruction to patch belongs to flushed code. Leave it alone so
+        // that future executions of it come back here.
+        if(generation != cpu->code_cache_generation) {
+            patch->lock.release();
+            return target_pc;
+        }
+
         // Tell concurrent patchers that the patch is done, even before it is!
         // This is fine because they will redirect to the destination, not back
         // to the instruction being patched.
@@ -135,35 +203,68 @@ namespace granary {
         patch->translated_target_address = target_pc;
         std::atomic_thread_fence(std::memory_order_release);
 
-        // Make sure we return to the destination of the instruction we're
-        // patching, rather than re-executing the original instruction.
-        *ret_address_addr = patch->translated_target_address;
+        retarget_cti(patch_address, target_pc);
 
-        uint64_t staged_code(0);
-        app_pc staged_data(reinterpret_cast<app_pc>(&staged_code));
+        // Remember the link, so that it can be undone if the target is
+        // invalidated.
+        if(is_code_cache_address(target_pc)) {
+            INCOMING_LINKS_LOCK.acquire();
+            add_incoming_link(patch, target_pc);
+            INCOMING_LINKS_LOCK.release();
+        }
 
-        app_pc decode_address(patch_address);
-        instruction new_cti(instruction::decode(&decode_address));
+        patch->lock.release();
+        return target_pc;
+    }
 
-        IF_TEST( const unsigned old_cti_len(new_cti.encoded_size()); )
 
-        new_cti.set_cti_target(pc_(target_pc));
-        new_cti.stage_encode(staged_data, patch_address);
-        const unsigned new_cti_len(new_cti.encoded_size());
+    /// Patch a direct control-flow instruction.
+    GRANARY_ENTRYPOINT
+    static void patch_instruction(app_pc *ret_address_addr) {
 
-        ASSERT(old_cti_len == new_cti_len);
+        // Notify Granary that we're entering!
+        cpu_state_handle cpu;
+        granary::enter(cpu);
 
-        const unsigned rel32_offset(new_cti_len - sizeof(uint32_t));
-        const uint32_t new_rel32(
-            *unsafe_cast<uint32_t *>(&(staged_data[rel32_offset])));
-        uint32_t *old_rel32(
-            unsafe_cast<uint32_t *>(&(patch_address[rel32_offset])));
+        app_pc indirect_call(*ret_address_addr - CALL_INDIRECT_ADDRESS_SIZE);
 
-        std::atomic_thread_fence(std::memory_order_acquire);
-        *old_rel32 = new_rel32;
-        std::atomic_thread_fence(std::memory_order_release);
+        // Make sure we're coming from the right place.
+        ASSERT(is_gencode_address(indirect_call));
 
-        patch->lock.release();
+        // The indirect call that brought us here goes through the actual
+        // `direct_branch_patch_info` structure.
+        instruction call_ind(instruction::decode(&indirect_call));
+        direct_branch_patch_info *patch(unsafe_cast<direct_branch_patch_info *>(
+            call_ind.cti_target().value.addr));
+
+        // Start by specifying the return address as the instruction that
+        // brought us into here, i.e. infinite loop!
+        *ret_address_addr = call_ind.pc_or_raw_bytes();
+
+        // If we can't get mutual exclusion over the locking process then we'll
+        // give up and go right on back. This might re-enter again, which is
+        // fine.
+        if(!patch->lock.try_acquire()) {
+            if(patch->translated_target_address) {
+                *ret_address_addr = patch->translated_target_address;
+            }
+            return;
+        }
+
+        // We got ownership of the lock, but we've just realized that the
+        // instruction has already been patched!
+        //
+        // The patch information can't be reclaimed here, because other
+        // threads might still be executing its stub. It is reclaimed along
+        // with its stub when the code cache is next flushed, so the number
+        // of live patches is bounded by the code cache budget.
+        if(patch->translated_target_address) {
+            patch->lock.release();
+            *ret_address_addr = patch->translated_target_address;
+            return;
+        }
+
+        *ret_address_addr = patch_locked(cpu, patch);
     }
 
 
@@ -243,21 +344,73 @@ namespace granary {
     });
 
 
+    STATIC_INITIALISE_ID(dbl_stub_template, {
+        static app_pc placeholder_patcher_func(nullptr);
+
+        instruction_list ls(INSTRUCTION_LIST_GENCODE);
+        instruction patch_entry(build_dbl_stub(ls, &placeholder_patcher_func));
+
+        DBL_STUB_TEMPLATE.compile(ls);
+        DBL_STUB_TEMPLATE.add_reloc(patch_entry, RELOC_REL32);
+
+        ASSERT(CALL_INDIRECT_ADDRESS_SIZE == patch_entry.encoded_size());
+        ASSERT(MAX_DBL_STUB_SIZE >= DBL_STUB_TEMPLATE.size);
+    });
+
+
+#if CONFIG_SPECULATIVE_TRANSLATION
+    /// Remember that `patch` belongs to code that `cpu` is translating. Its
+    /// target is only speculatively translated once that code is committed
+    /// to the code cache.
+    static void add_uncommitted_patch(
+        cpu_state_handle cpu,
+        direct_branch_patch_info *patch
+    ) {
+        patch->next_uncommitted = cpu->uncommitted_patches;
+        cpu->uncommitted_patches = patch;
+    }
+#endif
+
+
+    /// Emit the DBL stub of `patch` from its template. Returns the address of
+    /// the stub.
+    static app_pc emit_dbl_stub(direct_branch_patch_info *patch) {
+        patch->patcher_func = PATCH_INSTRUCTION;
+
+        const app_pc stub(&(patch->stub[0]));
+        const uint64_t relocs[] = {
+            reinterpret_cast<uint64_t>(&(patch->patcher_func))
+        };
+
+        ASSERT(DBL_STUB_TEMPLATE.can_emit(stub, relocs));
+        DBL_STUB_TEMPLATE.emit(stub, relocs);
+
+#if CONFIG_DEBUG_CHECK_CODE_TEMPLATES
+        instruction_list check_ls(INSTRUCTION_LIST_GENCODE);
+        build_dbl_stub(check_ls, &(patch->patcher_func));
+        DBL_STUB_TEMPLATE.check(stub, check_ls);
+#endif
+
+        return stub;
+    }
+
+
     /// Replace `cti` with a new instruction that jumps to the DBL entry routine
-    /// for instruction patching and replacing.
+    /// for instruction patching and replacing. The stub that the new
+    /// instruction jumps to is allocated alongside its patch information.
     void insert_dbl_lookup_stub(
         instruction_list &ls,
-        instruction_list &stub_ls,
         instruction cti,
         mangled_address target_address
     ) {
         IF_PERF( perf::visit_dbl_stub(); )
 
-        // TODO: If the basic block is not committed then this is a memory leak.
-        // TODO: These are already a memory leak! Find a way to reclaim them in
-        //       the common case.
+        // If the basic block is not committed then the patch is freed by
+        // `code_cache::find`, along with everything else that the block
+        // allocated from the stub allocator.
+        cpu_state_handle cpu;
         direct_branch_patch_info *patch(
-            allocate_memory<direct_branch_patch_info>());
+            cpu->stub_allocator.allocate<direct_branch_patch_info>());
 
         // Copy the patch instruction verbatim. At patch time, the actual
         // sources and destination operands are invalid, so MUST not be
@@ -290,29 +443,244 @@ namespace granary {
             IF_PERF( perf::visit_conditional_dbl(); )
         }
 
+        patch->target_address = target_address;
+        const app_pc stub(emit_dbl_stub(patch));
+        IF_SPECULATE( add_uncommitted_patch(cpu, patch); )
+
         // Modify the instruction to patch in place.
         instruction patch_cti(&(patch->in_to_patch));
-        patch_cti.set_cti_target(instr_(stub_ls.append(label_())));
+        patch_cti.set_cti_target(pc_(stub));
         patch_cti.set_mangled();
         patch_cti.set_patchable();
 
-        IF_USER( stub_ls.append(lea_(reg::rsp, reg::rsp[-REDZONE_SIZE])); )
+        // Replace the CTI.
+        ls.insert_before(cti, instruction(&(patch->in_to_patch)));
+    }
 
-        instruction patch_entry(call_ind_(mem_pc_(&(patch->patcher_func))));
-        stub_ls.append(patch_entry);
 
-        ASSERT(CALL_INDIRECT_ADDRESS_SIZE == patch_entry.encoded_size());
+    /// Returns true iff `cti` was inserted by `insert_dbl_lookup_stub`.
+    bool is_dbl_lookup_cti(instruction cti, mangled_address &target_address) {
+        if(!cti.is_valid() || !cti.is_cti()) {
+            return false;
+        }
 
-        // Redzone is unshifted in the RET instruction of the patcher
-        // in the case of user space.
+        const operand target(cti.cti_target());
+        if(!dynamorio::opnd_is_pc(target)) {
+            return false;
+        }
+
+        // Patch information isn't standard layout, so use the addresses of
+        // the fields of an uninitialised instance as their offsets.
+        static uint64_t layout_storage[
+            (sizeof(direct_branch_patch_info) + 7) / 8];
+        const direct_branch_patch_info *layout(
+            unsafe_cast<direct_branch_patch_info *>(&(layout_storage[0])));
+        const uintptr_t layout_addr(reinterpret_cast<uintptr_t>(layout));
+
+        // An inserted CTI *is* the `in_to_patch` of its patch information,
+        // and targets the stub of that same patch information. Only compare
+        // addresses until we know that `cti` is one of ours.
+        const uintptr_t patch_addr(reinterpret_cast<uintptr_t>(cti.instr)
+            - (reinterpret_cast<uintptr_t>(&(layout->in_to_patch))
+                - layout_addr));
+        const uintptr_t stub_addr(patch_addr
+            + (reinterpret_cast<uintptr_t>(&(layout->stub[0])) - layout_addr));
+
+        if(stub_addr != reinterpret_cast<uintptr_t>(target.value.pc)) {
+            return false;
+        }
+
+        const direct_branch_patch_info *patch(
+            reinterpret_cast<const direct_branch_patch_info *>(patch_addr));
+        target_address = patch->target_address;
+        return true;
+    }
+
+
+    /// Emit a DBL stub for the already encoded direct CTI at `cti_pc`.
+    app_pc emit_dbl_lookup_stub(
+        app_pc cti_pc,
+        mangled_address target_address,
+        bool is_conditional
+    ) {
+        IF_PERF( perf::visit_dbl_stub(); )
+
+        cpu_state_handle cpu;
+        direct_branch_patch_info *patch(
+            cpu->stub_allocator.allocate<direct_branch_patch_info>());
+
+        // Only the location of the instruction to patch is used when
+        // patching.
+        memset(&(patch->in_to_patch), 0, sizeof patch->in_to_patch);
+        patch->in_to_patch.translation = cti_pc;
+
+        if(is_conditional) {
+            patch->kind = direct_branch_patch_info::DBL_CONDITIONAL;
+            IF_PERF( perf::visit_conditional_dbl(); )
+        } else {
+            patch->kind = direct_branch_patch_info::DBL_UNCONDITIONAL;
+        }
 
-        // Fill in the rest of the information.
         patch->target_address = target_address;
-        patch->patcher_func = PATCH_INSTRUCTION;
+        IF_SPECULATE( add_uncommitted_patch(cpu, patch); )
+        return emit_dbl_stub(patch);
+    }
 
-        // Replace the CTI.
-        ls.insert_before(cti, instruction(&(patch->in_to_patch)));
+
+    /// Unlink the patched instructions in `links` if they go to `target`,
+    /// and `target` is in the code of a `stale` trace.
+    static bool unlink_stale_links(
+        app_pc target,
+        direct_branch_patch_info *links,
+        const stale_traces &stale
+    ) {
+        if(!is_translated_into(stale, target)) {
+            return false;
+        }
+
+        for(direct_branch_patch_info *next(nullptr); links; links = next) {
+            next = links->next_incoming;
+            links->next_incoming = nullptr;
+
+            // The patch is only re-linked once its translated target is
+            // reset.
+            links->lock.acquire();
+            retarget_cti(links->in_to_patch.translation, &(links->stub[0]));
+            links->translated_target_address = nullptr;
+            links->lock.release();
+        }
+        return true;
+    }
+
+
+    /// Unlink the patched instructions that go to the code of `stale` traces
+    /// by pointing them back at their DBL stubs.
+    ///
+    /// Note: The patches are unlinked with `INCOMING_LINKS_LOCK` held, so
+    ///       that they can't be freed (see `forget_dbl_patches`) while they
+    ///       are being unlinked. This can't deadlock with `patch_locked`,
+    ///       which only takes the lock for a patch that isn't yet linked.
+    void unlink_dbl_patches(const stale_traces &stale) {
+        INCOMING_LINKS_LOCK.acquire();
+        INCOMING_LINKS->remove_if(unlink_stale_links, stale);
+        INCOMING_LINKS_LOCK.release();
     }
-}
 
 
+    /// Returns true iff `addr` is in the memory of any of `slabs`.
+    static bool is_slab_address(
+        const bump_pointer_slab *slabs,
+        const void *addr
+    ) {
+        const uint8_t *byte(reinterpret_cast<const uint8_t *>(addr));
+        for(; slabs; slabs = slabs->next) {
+            if(slabs->memory <= byte && byte < (slabs->memory + slabs->size)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    /// Remove the patches in `stubs` from the list of patches that link to
+    /// `target`. The remaining patches are moved onto the list of
+    /// `survivors`, and are re-added once all lists have been visited.
+    static bool take_freed_links(
+        app_pc,
+        direct_branch_patch_info *links,
+        const bump_pointer_slab *&stubs,
+        direct_branch_patch_info *&survivors
+    ) {
+        bool has_freed_links(false);
+        for(direct_branch_patch_info *link(links);
+            link;
+            link = link->next_incoming) {
+
+            if(is_slab_address(stubs, link)) {
+                has_freed_links = true;
+                break;
+            }
+        }
+
+        if(!has_freed_links) {
+            return false;
+        }
+
+        for(direct_branch_patch_info *next(nullptr); links; links = next) {
+            next = links->next_incoming;
+            if(!is_slab_address(stubs, links)) {
+                links->next_incoming = survivors;
+                survivors = links;
+            }
+        }
+        return true;
+    }
+
+
+    /// Forget the links of the patches in the stub memory `stubs`, which is
+    /// about to be freed.
+    void forget_dbl_patches(const bump_pointer_slab *stubs) {
+        direct_branch_patch_info *survivors(nullptr);
+        INCOMING_LINKS_LOCK.acquire();
+        INCOMING_LINKS->remove_if(take_freed_links, stubs, survivors);
+        for(direct_branch_patch_info *next(nullptr);
+            survivors;
+            survivors = next) {
+
+            next = survivors->next_incoming;
+            add_incoming_link(survivors, survivors->translated_target_address);
+        }
+        INCOMING_LINKS_LOCK.release();
+    }
+
+
+#if CONFIG_SPECULATIVE_TRANSLATION
+    /// Make the targets of the DBL patches of the code that `cpu` has just
+    /// committed to the code cache candidates for speculative translation.
+    void commit_dbl_patches(cpu_state_handle cpu) {
+        direct_branch_patch_info *next(nullptr);
+        for(direct_branch_patch_info *patch(cpu->uncommitted_patches);
+            patch;
+            patch = next) {
+
+            next = patch->next_uncommitted;
+            patch->next_uncommitted = nullptr;
+            speculative_translation::enqueue(
+                patch, cpu->code_cache_generation);
+        }
+        cpu->uncommitted_patches = nullptr;
+    }
+
+
+    /// Forget the DBL patches of the code that `cpu` has just discarded.
+    void discard_dbl_patches(cpu_state_handle cpu) {
+        cpu->uncommitted_patches = nullptr;
+    }
+
+
+    /// Translate the target of `patch` and patch its instruction, unless the
+    /// instruction is being, or has already been, patched. Returns true iff
+    /// the instruction was patched.
+    bool speculate_dbl_patch(
+        cpu_state_handle cpu,
+        direct_branch_patch_info *patch
+    ) {
+        // Keep a reference to the patch on the stack so that it isn't
+        // reclaimed if the code cache is flushed while finding its target.
+        direct_branch_patch_info * volatile stack_patch(patch);
+
+        if(!stack_patch->lock.try_acquire()) {
+            return false;
+        }
+
+        if(stack_patch->translated_target_address) {
+            stack_patch->lock.release();
+            return false;
+        }
+
+        const unsigned generation(cpu->code_cache_generation);
+        patch_locked(cpu, stack_patch);
+        return generation == cpu->code_cache_generation;
+    }
+#endif
+}
@@ -15,11 +15,64 @@ namespace granary {
     /// for instruction patching and replacing.
     void insert_dbl_lookup_stub(
         instruction_list &ls,
-        instruction_list &stub_ls,
         instruction cti,
         mangled_address target_address
     ) ;
 
+
+    /// Returns true iff `cti` was inserted by `insert_dbl_lookup_stub`. If so,
+    /// then `target_address` is set to the target of the replaced CTI.
+    bool is_dbl_lookup_cti(instruction cti, mangled_address &target_address) ;
+
+
+    /// Emit a DBL stub for the already encoded direct CTI at `cti_pc`, which
+    /// should go to `target_address`. Returns the address of the stub, which
+    /// the CTI must be made to target.
+    app_pc emit_dbl_lookup_stub(
+        app_pc cti_pc,
+        mangled_address target_address,
+        bool is_conditional
+    ) ;
+
+
+    /// Forward declarations.
+    struct stale_traces;
+    struct bump_pointer_slab;
+
+
+    /// Unlink the patched instructions that go to the code of `stale` traces
+    /// by pointing them back at their DBL stubs. The instructions are
+    /// patched again when they are next executed.
+    void unlink_dbl_patches(const stale_traces &stale) ;
+
+
+    /// Forget the links of the patches in the stub memory `stubs`, which is
+    /// about to be freed.
+    void forget_dbl_patches(const bump_pointer_slab *stubs) ;
+
+
+#if CONFIG_SPECULATIVE_TRANSLATION
+    /// Forward declaration.
+    struct direct_branch_patch_info;
+
+
+    /// Make the targets of the DBL patches of the code that `cpu` has just
+    /// committed to the code cache candidates for speculative translation.
+    void commit_dbl_patches(cpu_state_handle cpu) ;
+
+
+    /// Forget the DBL patches of the code that `cpu` has just discarded.
+    void discard_dbl_patches(cpu_state_handle cpu) ;
+
+
+    /// Translate the target of `patch` and patch its instruction, unless the
+    /// instruction is being, or has already been, patched. Returns true iff
+    /// the instruction was patched.
+    bool speculate_dbl_patch(
+        cpu_state_handle cpu,
+        direct_branch_patch_info *patch
+    ) ;
+#endif
 }
 
 #endif /* GRANARY_DBL_H_ */
@@ -0,0 +1,160 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * decode_cache.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/globals.h"
+#include "granary/decode_cache.h"
+#include "granary/spin_lock.h"
+
+namespace granary {
+
+
+    enum {
+        /// Number of entries in the decode cache. This is a power of two.
+        DECODE_CACHE_ENTRY_BITS = 12,
+        NUM_DECODE_CACHE_ENTRIES = 1 << DECODE_CACHE_ENTRY_BITS,
+
+        /// Maximum number of destination and extra source operands (i.e. all
+        /// sources except the first) of a cached instruction.
+        MAX_NUM_CACHED_OPERANDS = 8,
+
+        /// Maximum length of an x86 instruction.
+        MAX_CACHED_INSTRUCTION_LENGTH = 16
+    };
+
+
+    /// A decoded instruction. The operand arrays of `instr` are not valid;
+    /// instead, the destination operands, followed by the extra source
+    /// operands, are stored in `operands`.
+    struct decoded_instruction {
+        app_pc pc;
+        dynamorio::instr_t instr;
+        uint8_t bytes[MAX_CACHED_INSTRUCTION_LENGTH];
+        dynamorio::opnd_t operands[MAX_NUM_CACHED_OPERANDS];
+    };
+
+
+    /// An entry in the decode cache.
+    ///
+    /// Note: The lock is only ever tried, never spun on, so that a decode that
+    ///       interrupts another decode of the same entry (e.g. in an interrupt
+    ///       handler) just misses.
+    struct decode_cache_entry {
+        atomic_spin_lock lock;
+        decoded_instruction decoded;
+    };
+
+
+    /// The decode cache. This is direct-mapped; a newly decoded instruction
+    /// replaces whatever was in its entry.
+    static decode_cache_entry DECODE_CACHE[NUM_DECODE_CACHE_ENTRIES];
+
+
+    /// Returns the decode cache entry for an application address.
+    static inline decode_cache_entry &entry_for(app_pc pc) {
+        const uint64_t hash(
+            reinterpret_cast<uint64_t>(pc) * 0x9E3779B97F4A7C15ULL);
+        return DECODE_CACHE[hash >> (64 - DECODE_CACHE_ENTRY_BITS)];
+    }
+
+
+    /// Returns the number of extra (i.e. not the first) source operands of an
+    /// instruction.
+    static inline unsigned num_extra_srcs(const dynamorio::instr_t *instr) {
+        return 1 < instr->num_srcs ? (instr->num_srcs - 1U) : 0U;
+    }
+
+
+    /// Fill in `instr` with a copy of the decoded instruction at `pc`.
+    app_pc decode_cache::find(app_pc pc, dynamorio::instr_t *instr) {
+        decode_cache_entry &entry(entry_for(pc));
+        decoded_instruction decoded;
+
+        if(!entry.lock.try_acquire()) {
+            return nullptr;
+        }
+
+        const bool hit(pc == entry.decoded.pc);
+        if(hit) {
+            memcpy(&decoded, &(entry.decoded), sizeof decoded);
+        }
+        entry.lock.release();
+
+        // Make sure that the code hasn't changed since it was decoded.
+        if(!hit || memcmp(&(decoded.bytes[0]), pc, decoded.instr.length)) {
+            return nullptr;
+        }
+
+        // Copy the operands into their own arrays, as `instr_clone` would.
+        const unsigned num_dsts(decoded.instr.num_dsts);
+        const unsigned num_srcs(num_extra_srcs(&(decoded.instr)));
+        dynamorio::opnd_t *dsts(nullptr);
+        dynamorio::opnd_t *srcs(nullptr);
+
+        if(num_dsts) {
+            dsts = reinterpret_cast<dynamorio::opnd_t *>(granary_heap_alloc(
+                nullptr, num_dsts * sizeof(dynamorio::opnd_t)));
+            memcpy(dsts, &(decoded.operands[0]),
+                num_dsts * sizeof(dynamorio::opnd_t));
+        }
+
+        if(num_srcs) {
+            srcs = reinterpret_cast<dynamorio::opnd_t *>(granary_heap_alloc(
+                nullptr, num_srcs * sizeof(dynamorio::opnd_t)));
+            memcpy(srcs, &(decoded.operands[num_dsts]),
+                num_srcs * sizeof(dynamorio::opnd_t));
+        }
+
+        memcpy(instr, &(decoded.instr), sizeof *instr);
+        instr->u.o.dsts = dsts;
+        instr->u.o.srcs = srcs;
+        return pc + decoded.instr.length;
+    }
+
+
+    /// Remember the decoded instruction `instr` from `pc`.
+    void decode_cache::add(app_pc pc, const dynamorio::instr_t *instr) {
+        const unsigned num_dsts(instr->num_dsts);
+        const unsigned num_srcs(num_extra_srcs(instr));
+
+        if(MAX_CACHED_INSTRUCTION_LENGTH < instr->length
+        || MAX_NUM_CACHED_OPERANDS < (num_dsts + num_srcs)
+        || dynamorio::OP_INVALID == instr->opcode
+        || dynamorio::OP_UNDECODED == instr->opcode
+        || (instr->flags & dynamorio::INSTR_RAW_BITS_ALLOCATED)
+        || !(instr->flags & dynamorio::INSTR_OPERANDS_VALID)) {
+            return;
+        }
+
+        decode_cache_entry &entry(entry_for(pc));
+        if(!entry.lock.try_acquire()) {
+            return;
+        }
+
+        decoded_instruction &decoded(entry.decoded);
+        decoded.pc = pc;
+        memcpy(&(decoded.instr), instr, sizeof *instr);
+        decoded.instr.u.o.dsts = nullptr;
+        decoded.instr.u.o.srcs = nullptr;
+        decoded.instr.prev = nullptr;
+        decoded.instr.next = nullptr;
+        decoded.instr.note = nullptr;
+        memcpy(&(decoded.bytes[0]), pc, instr->length);
+
+        if(num_dsts) {
+            memcpy(&(decoded.operands[0]), instr->u.o.dsts,
+                num_dsts * sizeof(dynamorio::opnd_t));
+        }
+
+        if(num_srcs) {
+            memcpy(&(decoded.operands[num_dsts]), instr->u.o.srcs,
+                num_srcs * sizeof(dynamorio::opnd_t));
+        }
+
+        entry.lock.release();
+    }
+}
@@ -0,0 +1,42 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * decode_cache.h
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#ifndef DECODE_CACHE_H_
+#define DECODE_CACHE_H_
+
+#include "granary/globals.h"
+#include "granary/instruction.h"
+
+namespace granary {
+
+
+    /// A cache of decoded native instructions, keyed by their application
+    /// addresses. The same native code is decoded many times: once for each
+    /// policy that it is translated under, once for each indirect/return
+    /// target version of a block, and again whenever a block is split. The
+    /// cache lets all of these decodes share the result of the first one.
+    ///
+    /// Note: Entries remember the bytes of the instruction that they decoded,
+    ///       and a lookup only hits if those bytes are unchanged. This means
+    ///       that the cache never needs to be invalidated, e.g. when a module
+    ///       is unloaded and another is loaded in its place.
+    struct decode_cache {
+
+        /// Fill in `instr` with a copy of the decoded instruction at `pc`.
+        /// Returns the address of the next instruction on a hit, and
+        /// `nullptr` on a miss, in which case `instr` is unchanged.
+        static app_pc find(app_pc pc, dynamorio::instr_t *instr) ;
+
+
+        /// Remember the decoded instruction `instr` from `pc`. Instructions
+        /// that don't fit into a cache entry are not remembered.
+        static void add(app_pc pc, const dynamorio::instr_t *instr) ;
+    };
+}
+
+#endif /* DECODE_CACHE_H_ */
@@ -24,6 +24,41 @@ namespace granary {
     })
 
 
+    /// A dynamic wrapper that targets code in the code cache.
+    struct code_cache_wrapper {
+
+        /// The wrapped code.
+        mangled_address wrappee;
+
+        /// The immediate operand of the wrapper's `MOV r10, imm64`, which
+        /// holds the address of the translated `wrappee`.
+        std::atomic<uint64_t> *target_code_cache;
+
+        code_cache_wrapper *next;
+    };
+
+
+    /// List of all dynamic wrappers that target code in the code cache. These
+    /// are re-targeted when the code cache is flushed. Entries are never
+    /// removed from this list.
+    static std::atomic<code_cache_wrapper *> CODE_CACHE_WRAPPERS = \
+        ATOMIC_VAR_INIT(nullptr);
+
+
+    /// Re-target all dynamic wrappers that target code in the code cache to
+    /// code in the current generation of the code cache.
+    void refresh_dynamic_wrappers(cpu_state_handle cpu) {
+        for(code_cache_wrapper *wrapper(CODE_CACHE_WRAPPERS.load());
+            wrapper;
+            wrapper = wrapper->next) {
+
+            app_pc target_code_cache(code_cache::find(cpu, wrapper->wrappee));
+            wrapper->target_code_cache->store(
+                reinterpret_cast<uint64_t>(target_code_cache));
+        }
+    }
+
+
     /// Return the dynamic wrapper address for something to be wrapped.
     ///
     /// This function is partially implemented in x86/dynamic_wrapper.asm,
@@ -54,6 +89,7 @@ namespace granary {
         policy.return_address_in_code_cache(true);
 
         app_pc target_code_cache(nullptr);
+        mangled_address am;
 
         // In order to avoid checks for whether this function is wrapped or
         // not, we will just pretend that `wrappee` is a code cache target.
@@ -67,7 +103,7 @@ namespace granary {
                 return target_code_cache;
             }
 
-            mangled_address am(wrappee, policy);
+            am = mangled_address(wrappee, policy);
             target_code_cache = code_cache::find(cpu, am);
         }
 
@@ -89,6 +125,20 @@ namespace granary {
             allocate_array<uint8_t>(size));
         ls.encode(target_wrapper, size);
 
+        // Remember where the code cache target is, so that the wrapper can
+        // be re-targeted if the code cache is flushed.
+        if(am.as_address) {
+            code_cache_wrapper *record(allocate_memory<code_cache_wrapper>());
+            record->wrappee = am;
+            record->target_code_cache = unsafe_cast<std::atomic<uint64_t> *>(
+                in.pc() + in.encoded_size() - sizeof(uint64_t));
+
+            code_cache_wrapper *next(CODE_CACHE_WRAPPERS.load());
+            do {
+                record->next = next;
+            } while(!CODE_CACHE_WRAPPERS.compare_exchange_weak(next, record));
+        }
+
         // Store it for later and return.
         wrappers->store(wrappee, target_wrapper);
 
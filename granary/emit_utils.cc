@@ -8,12 +8,19 @@
 
 #include "granary/emit_utils.h"
 #include "granary/hash_table.h"
+#include "granary/liveness.h"
 #include "granary/list.h"
 #include "granary/state.h"
 
 namespace granary {
 
 
+    enum : unsigned {
+        ARITH_FLAGS = EFLAGS_READ_CF | EFLAGS_READ_PF | EFLAGS_READ_AF
+                    | EFLAGS_READ_ZF | EFLAGS_READ_SF | EFLAGS_READ_OF
+    };
+
+
     /// Find a safe place to insert instructions into an instruction list where
     /// the arithmetic flags can be safely clobbered.
     ///
@@ -48,7 +55,7 @@ namespace granary {
 
             // Never walk past a conditional branch.
             if(dynamorio::instr_is_cbr(in_)) {
-                return false;
+                break;
             }
 
             eflags = dynamorio::instr_get_eflags(in_);
@@ -60,7 +67,30 @@ namespace granary {
             return true;
         }
 
-        return false;
+        // Fall back on the liveness of the flags across basic blocks, which
+        // can find that the flags are dead at the end of the block.
+        live_state state;
+        instruction dead_in;
+        for(instruction in_(ls.last()); in_.is_valid(); in_ = in_.prev()) {
+            visit_live_state(in_, state);
+            if(!(state.flags & ARITH_FLAGS)) {
+                dead_in = in_;
+            }
+        }
+
+        if(!dead_in.is_valid()) {
+            return false;
+        }
+
+        if(dead_in.is_call() || dead_in.is_return()) {
+            IF_USER( redzone_safe = true; )
+        }
+
+        // The flags would otherwise have to be saved around `in`.
+        IF_PERF( perf::visit_removed_flags_spill(); )
+
+        in = dead_in;
+        return true;
     }
 
 
@@ -94,6 +94,13 @@
 #define CONFIG_DEBUG_CHECK_INSTRUCTION_ENCODE 0
 
 
+/// Should Granary double check the code emitted from code templates? DBL stubs
+/// and IBL exit routines are emitted by copying pre-encoded byte templates and
+/// patching their relocations. If enabled, each emitted copy is compared
+/// against what the encoder produces for the equivalent instructions.
+#define CONFIG_DEBUG_CHECK_CODE_TEMPLATES 0
+
+
 /// Should Granary double check that any time CPU private data is accessed, that
 /// interrupts are disabled?
 #define CONFIG_DEBUG_CHECK_CPU_ACCESS_SAFE 0
@@ -120,13 +127,46 @@
 #endif
 
 
+/// Should Granary profile the code cache while it runs, and re-translate hot
+/// basic blocks using the collected profile? Unlike `CONFIG_OPTIMISE_PGO`,
+/// this doesn't need a profile file or a rebuild of Granary. Each block is
+/// re-translated at most once, after it has executed
+/// `CONFIG_OPTIMISE_ONLINE_PGO_THRESHOLD` times.
+#define CONFIG_OPTIMISE_ONLINE_PGO 0
+#define CONFIG_OPTIMISE_ONLINE_PGO_THRESHOLD 4096
+
+
+/// Should the liveness of registers and flags be propagated across basic
+/// blocks? If enabled, then the registers and flags that are live at the end
+/// of a basic block are computed from the native code reachable through its
+/// direct branches, instead of assuming that everything is live. This lets
+/// instrumentation avoid spilling state that is dead in the native code.
+#define CONFIG_OPTIMISE_INTER_BLOCK_LIVENESS 1
+
+
+/// Should decoded native instructions be cached? The same native code is
+/// decoded once per policy, once per indirect/return target version of a
+/// block, and again when a block is split. If enabled, these decodes share
+/// a cache of decoded instructions, keyed by application address.
+#define CONFIG_OPTIMISE_DECODE_CACHE 1
+
+
 /// Should execution be traced? This is a debugging option, not to be confused
 /// with the trace allocator or trace building, where we record the entry PCs
-/// of basic blocks as they execute for later inspection by gdb.
+/// of basic blocks as they execute into per-CPU ring buffers. In user space,
+/// the buffers are streamed to `/tmp/granary-trace.<pid>`; in kernel space,
+/// they are drained by reading the `granary_trace` file in debugfs.
+///
+/// If registers are recorded, then a snapshot of the registers is recorded
+/// every `CONFIG_DEBUG_TRACE_REGS_INTERVAL` entries. The default size (in
+/// bytes) of each CPU's buffer can be overridden with the
+/// `GRANARY_TRACE_BUFFER_SIZE` environment variable in user space, or with
+/// the `trace_buffer_size` module parameter in kernel space.
 #define CONFIG_DEBUG_TRACE_EXECUTION 0
 #define CONFIG_DEBUG_TRACE_PRINT_LOG 0
 #define CONFIG_DEBUG_TRACE_RECORD_REGS 1
-#define CONFIG_DEBUG_NUM_TRACE_LOG_ENTRIES 1024
+#define CONFIG_DEBUG_TRACE_REGS_INTERVAL 64
+#define CONFIG_DEBUG_TRACE_BUFFER_SIZE 65536
 
 
 /// Do pre-mangling of instructions with the REP prefix?
@@ -171,6 +211,75 @@
 #define CONFIG_TRACE_ALLOCATE_ENTRY_CPU 0
 
 
+/// Maximum number of bytes of fragment memory that the code cache should use
+/// before it is flushed. A value of `0` means that the code cache is never
+/// flushed. Flushing is only supported in user space: kernel code can hold
+/// translated addresses in places that Granary cannot find (e.g. directly
+/// returned-to addresses, the shadow syscall table, and the saved state of
+/// preempted tasks).
+///
+/// Note: This option is user-space only. Nothing bounds the memory of the
+///       code cache in kernel space: translated code, DBL stubs, their patch
+///       records, and IBL exit routines are never reclaimed, so the memory
+///       use of long-running kernel instrumentation only grows. This is a
+///       known, open problem.
+#define CONFIG_CODE_CACHE_BUDGET 0
+#if CONFIG_ENV_KERNEL && CONFIG_CODE_CACHE_BUDGET
+#   error "Code cache flushing is not supported in kernel space."
+#endif
+
+
+/// Should translated code be persisted to disk so that later runs of the same
+/// program can install it instead of re-translating it? Persisted code is
+/// keyed by the identities (ELF build IDs, or hashes of their code) of the
+/// program and of Granary itself, and so of the client and its policies.
+/// Only supported in user space.
+///
+/// Note: The `GRANARY_PERSISTENT_CACHE` environment variable names the
+///       directory of the persisted code (`/tmp/granary-<uid>` by default),
+///       or disables persistence if it is `0`. The directory and its cache
+///       files are only used if they belong to the user, and if no one else
+///       can write to them.
+///
+/// Note: Instrumentation that embeds the addresses of heap-allocated data
+///       into the code cache (e.g. online PGO's execution counters) can't be
+///       persisted.
+#define CONFIG_PERSISTENT_CODE_CACHE 0
+#if CONFIG_ENV_KERNEL && CONFIG_PERSISTENT_CODE_CACHE
+#   error "Persisting the code cache is not supported in kernel space."
+#endif
+#if CONFIG_PERSISTENT_CODE_CACHE && CONFIG_OPTIMISE_ONLINE_PGO
+#   error "Profiled code cannot be persisted."
+#endif
+
+
+/// Should the targets of direct branches be translated (and the branches
+/// patched) in the background, before the branches are first executed? If
+/// so, then this is the number of translation worker threads (kernel threads
+/// in kernel space, and pthreads in user space).
+///
+/// Note: Speculative translation stops once the workers have emitted
+///       `CONFIG_SPECULATIVE_TRANSLATION_BUDGET` bytes of code.
+#define CONFIG_SPECULATIVE_TRANSLATION 0
+#define CONFIG_SPECULATIVE_TRANSLATION_BUDGET (4UL << 20)
+
+
+/// Should writes to translated code be detected? If so, then writable pages
+/// are write-protected when their code is first translated. A write to one
+/// of them restores the page's protection, and the page's translations are
+/// invalidated (see `code_cache::invalidate`) the next time that any thread
+/// enters Granary. Only supported in user space.
+///
+/// Note: Writes are detected with a `SIGSEGV` handler, which must not be
+///       replaced by the program. Code that is modified and then reached
+///       without entering Granary (e.g. through an already patched direct
+///       branch) runs its stale translation until Granary is next entered.
+#define CONFIG_DETECT_SELF_MODIFYING_CODE 0
+#if CONFIG_ENV_KERNEL && CONFIG_DETECT_SELF_MODIFYING_CODE
+#   error "Detecting self-modifying code is not supported in kernel space."
+#endif
+
+
 /// Should we do a delayed takeover of the kernel table? This is only relevant
 /// for whole-kernel instrumentation.
 ///
@@ -200,6 +309,21 @@
 #define CONFIG_FOLLOW_CONDITIONAL_BRANCHES 0
 
 
+/// Should we build hot traces (superblocks) from the paths that execute at
+/// run time? When a loop head becomes hot, the hottest path around its loop
+/// is emitted as a single-entry, multi-exit superblock into a CPU-private hot
+/// region of the code cache. At most `CONFIG_HOT_TRACE_MAX_BLOCKS` basic
+/// blocks are put into a superblock.
+///
+/// Note: This uses the execution counters of online profile-guided
+///       optimisation to find hot loop heads and paths.
+#define CONFIG_BUILD_HOT_TRACES 0
+#define CONFIG_HOT_TRACE_MAX_BLOCKS 16
+#if CONFIG_BUILD_HOT_TRACES && !CONFIG_OPTIMISE_ONLINE_PGO
+#   error "Hot traces need `CONFIG_OPTIMISE_ONLINE_PGO`."
+#endif
+
+
 /// Enable performance counters and reporting. Performance counters measure
 /// things like number of translated bytes, number of code cache bytes, etc.
 /// These counters allow us to get a sense of how (in)efficient Granary is with
@@ -263,6 +387,13 @@
 #endif
 
 
+/// Set to 1 iff the benchmarks should be run along with the test cases.
+/// Benchmarks compare Granary's data structures against the ones that they
+/// replaced, from 1 to 8 threads, and print the number of cycles that each
+/// took. They take much longer than the rest of the test cases.
+#define CONFIG_DEBUG_RUN_BENCHMARKS 0
+
+
 /// Lower bound on the cache line size.
 ///
 /// If running on a relatively recent kernel version, then one should be able
@@ -283,6 +414,15 @@
 #endif
 
 
+/// Upper bound on the number of NUMA nodes. Shared bump-pointer allocators
+/// bump from one slab per node, and dead slabs are only shared between
+/// allocators running on the same node. Nodes beyond this bound share the
+/// slabs of lower-numbered nodes.
+#ifndef CONFIG_ARCH_MAX_NUMA_NODES
+#   define CONFIG_ARCH_MAX_NUMA_NODES 4
+#endif
+
+
 // Size of per-cpu/thread-local private stack (currently 6 pages).
 #ifndef CONFIG_PRIVATE_STACK_SIZE
 #   define CONFIG_PRIVATE_STACK_SIZE 24576
@@ -310,6 +450,10 @@ namespace granary {
         CACHE_LINE_SIZE = CONFIG_ARCH_CACHE_LINE_SIZE,
 
 
+        /// Upper bound on the number of NUMA nodes.
+        MAX_NUMA_NODES = CONFIG_ARCH_MAX_NUMA_NODES,
+
+
         /// Number of interrupt vectors
         NUM_INTERRUPT_VECTORS = 256,
         INTERRUPT_DELAY_CODE_SIZE = 2048,
@@ -427,6 +571,7 @@ namespace granary {
     extern bool is_code_cache_address(const const_app_pc) ;
     extern bool is_wrapper_address(const const_app_pc) ;
     extern bool is_gencode_address(const const_app_pc) ;
+    extern bool is_heap_address(const const_app_pc) ;
 
 
 #if CONFIG_ENV_KERNEL
@@ -48,11 +48,12 @@ namespace granary {
         struct hash_table_entry;
 
 
-        /// Shared version of a hash table entry.
+        /// Shared version of a hash table entry. An entry is published by
+        /// first writing its value, and then releasing its key; readers
+        /// acquire the key before reading the value.
         template <typename K, typename V>
         struct hash_table_entry<K, V, true> {
         public:
-            std::atomic<bool> is_valid;
             std::atomic<K> key;
             std::atomic<V> value;
         };
@@ -122,11 +123,29 @@ namespace granary {
             uint32_t scaling_factor;
 
             /// The entry slots represent the thing that can change when shared.
-            slot_type *entry_slots;
+            /// Readers load this without holding any locks.
+            std::atomic<slot_type *> entry_slots;
+        };
 
-            /// Should the table be grown?
-            bool should_grow;
+
+        /// Represents a set of entry slots that have been replaced by a
+        /// larger set of slots, but which might still be read by a
+        /// concurrent reader.
+        template <typename K, typename V>
+        struct retired_hash_table_slots {
+        public:
+            hash_table_entry_slots<K, V, true> *slots;
+            uint64_t epoch;
+            retired_hash_table_slots *next;
         };
+
+
+        /// The most recent epoch observed by a reader of a concurrent hash
+        /// table. Padded to a cache line so that readers don't false-share.
+        struct hash_table_reader_epoch {
+        public:
+            std::atomic<uint64_t> epoch;
+        } __attribute__((aligned (CONFIG_ARCH_CACHE_LINE_SIZE)));
     }
 
 
@@ -336,6 +355,30 @@ namespace granary {
                 callback(entry.key, entry.value, args...);
             }
         }
+
+        /// Remove every entry for which `pred` returns true. As with the
+        /// concurrent hash table, removing an entry resets its value to the
+        /// default value.
+        template <typename... Args>
+        void remove_if(
+            bool (*pred)(K, V, Args&...),
+            Args&... args
+        ) {
+            slots_type *slots(table_.entry_slots);
+            const uint32_t num_slots(slots->mask + 1U);
+            entry_type *entries(&(slots->entries[0]));
+
+            for(uint32_t i(0); i < num_slots; ++i) {
+                entry_type &entry(entries[i]);
+                if(default_key_ == entry.key || V() == entry.value) {
+                    continue;
+                }
+
+                if(pred(entry.key, entry.value, args...)) {
+                    entry.value = V();
+                }
+            }
+        }
     };
 
 
@@ -424,6 +467,376 @@ namespace granary {
             lock.release();
         }
     };
+
+
+    /// Represents a hash table that is safe to concurrently read from without
+    /// acquiring any locks. Writers serialise on a lock and publish new
+    /// entries by atomically releasing their keys. Growing the table copies
+    /// the entries into a new set of slots, swaps the slots pointer, and then
+    /// retires the old slots. Retired slots are reclaimed once every reader
+    /// has observed an epoch that is newer than the epoch at which the slots
+    /// were retired.
+    ///
+    /// Readers identify themselves with a small integer (e.g. a CPU id).
+    /// Each reader has its own cache-line-sized epoch record, which the
+    /// reader only writes to when the global epoch has changed since its
+    /// last read. Thus, in the common case, a read does not write to any
+    /// memory at all.
+    ///
+    /// Removing an entry resets its value to the default value, but leaves
+    /// its key in place so that concurrent probe sequences aren't broken.
+    /// Removed entries are reused if their key is stored again, and are
+    /// purged when the table grows.
+    template <
+        typename K,
+        typename V,
+        typename meta_type=hash_table_meta<K,V>
+    >
+    struct concurrent_hash_table {
+    public:
+
+        enum {
+            MAX_NUM_READERS = 256U,
+
+            /// Epoch `0` is reserved for readers that have never read from the
+            /// table.
+            FIRST_EPOCH = 1U
+        };
+
+    private:
+
+        typedef detail::hash_table_impl<K, V, true> table_type;
+        typedef detail::hash_table_entry_slots<K, V, true> slots_type;
+        typedef detail::hash_table_entry<K, V, true> entry_type;
+        typedef detail::retired_hash_table_slots<K, V> retired_type;
+
+        /// Serialises writers.
+        spin_lock lock;
+
+        table_type table_;
+        K default_key_;
+
+        /// Global epoch; incremented each time a set of slots is retired.
+        std::atomic<uint64_t> epoch;
+
+        /// Slots that have been replaced but not yet reclaimed. Only accessed
+        /// by writers.
+        retired_type *retired_slots;
+
+        /// Set if a reader with an out-of-range id has read from this table.
+        /// When this happens, we can't track that reader, and so we never
+        /// reclaim retired slots while the table is alive.
+        std::atomic<bool> untracked_reader;
+
+        /// Per-reader epoch records. Each record is on its own cache line so
+        /// that readers never write to a shared cache line.
+        detail::hash_table_reader_epoch reader_epochs[MAX_NUM_READERS];
+
+
+        /// Note that the reader `reader_id` is about to read from the table.
+        /// This makes any slots retired at or after the current epoch
+        /// unreclaimable until this reader's next read.
+        inline void enter_read(unsigned reader_id) {
+            if(unlikely(MAX_NUM_READERS <= reader_id)) {
+                if(!untracked_reader.load(std::memory_order_relaxed)) {
+                    untracked_reader.store(true);
+                }
+                return;
+            }
+
+            std::atomic<uint64_t> &reader_epoch(reader_epochs[reader_id].epoch);
+            const uint64_t curr_epoch(epoch.load(std::memory_order_acquire));
+            if(unlikely(curr_epoch != reader_epoch.load(
+                std::memory_order_relaxed))) {
+
+                // Sequentially consistent store so that the store to the
+                // reader's epoch is ordered before the load of the slots.
+                reader_epoch.store(curr_epoch);
+            }
+        }
+
+
+        /// Insert an entry into the hash table. Must be called with `lock`
+        /// held.
+        hash_store_state insert(
+            slots_type *slots,
+            K key,
+            V value,
+            bool update,
+            unsigned &scan
+        ) {
+            entry_type *entries(&(slots->entries[0]));
+            const uint32_t mask(slots->mask);
+            uint32_t entry_base(meta_type::hash(key));
+
+            for(scan = 0; ; ++scan, entry_base += 1) {
+                entry_base &= mask;
+                entry_type &entry(entries[entry_base]);
+                const K entry_key(entry.key.load(std::memory_order_relaxed));
+
+                // Insert position; publish the value before the key.
+                if(default_key_ == entry_key) {
+                    entry.value.store(value, std::memory_order_relaxed);
+                    entry.key.store(key, std::memory_order_release);
+                    return HASH_ENTRY_STORED_NEW;
+                }
+
+                // Already inserted.
+                if(entry_key == key) {
+                    if(update || V() == entry.value.load(
+                        std::memory_order_relaxed)) {
+                        entry.value.store(value, std::memory_order_release);
+                        return HASH_ENTRY_STORED_OVERWRITE;
+                    }
+                    return HASH_ENTRY_SKIPPED;
+                }
+            }
+        }
+
+
+        /// Grow the hash table by copying the entries into a new set of slots
+        /// that is double the size of the current slots, and then swapping
+        /// the new slots in. Must be called with `lock` held.
+        void grow(void) {
+            slots_type *old_slots(
+                table_.entry_slots.load(std::memory_order_relaxed));
+            const uint32_t num_old_slots(old_slots->mask + 1U);
+            const uint32_t num_new_slots(num_old_slots * 2);
+
+            slots_type *new_slots(
+                new_trailing_vla<slots_type, entry_type>(num_new_slots));
+            new_slots->mask = num_new_slots - 1U;
+
+            // Transfer the elements to the new slots before the new slots
+            // are visible to readers.
+            entry_type *old_entries(&(old_slots->entries[0]));
+            unsigned scan(0);
+            for(uint32_t i(0); i < num_old_slots; ++i) {
+                entry_type &entry_old(old_entries[i]);
+                const K key(entry_old.key.load(std::memory_order_relaxed));
+                const V value(entry_old.value.load(std::memory_order_relaxed));
+                if(default_key_ == key || V() == value) {
+                    continue;
+                }
+
+                insert(new_slots, key, value, true, scan);
+            }
+
+            table_.scaling_factor += 1;
+            table_.entry_slots.store(new_slots, std::memory_order_release);
+
+            // Retire the old slots.
+            retired_type *retired(allocate_memory<retired_type>());
+            retired->slots = old_slots;
+            retired->epoch = epoch.fetch_add(1);
+            retired->next = retired_slots;
+            retired_slots = retired;
+
+            reclaim();
+        }
+
+
+        /// Reclaim any retired slots that can no longer be observed by any
+        /// reader. Must be called with `lock` held.
+        void reclaim(void) {
+            if(untracked_reader.load()) {
+                return;
+            }
+
+            uint64_t min_epoch(epoch.load());
+            for(unsigned i(0); i < MAX_NUM_READERS; ++i) {
+                const uint64_t reader_epoch(reader_epochs[i].epoch.load());
+                if(reader_epoch && reader_epoch < min_epoch) {
+                    min_epoch = reader_epoch;
+                }
+            }
+
+            retired_type **prev_next(&retired_slots);
+            for(retired_type *retired(retired_slots); retired; ) {
+                retired_type *next(retired->next);
+                if(retired->epoch < min_epoch) {
+                    *prev_next = next;
+                    free_slots(retired->slots);
+                    free_memory<retired_type>(retired);
+                } else {
+                    prev_next = &(retired->next);
+                }
+                retired = next;
+            }
+        }
+
+
+        /// Free a set of slots.
+        static void free_slots(slots_type *slots) {
+            const uint32_t num_slots(slots->mask + 1U);
+            free_trailing_vla<slots_type, entry_type>(slots, num_slots);
+        }
+
+    public:
+
+        /// Constructor, default-initialise the slots.
+        concurrent_hash_table(void)
+            : epoch(ATOMIC_VAR_INIT(FIRST_EPOCH))
+            , retired_slots(nullptr)
+            , untracked_reader(ATOMIC_VAR_INIT(false))
+        {
+            const uint32_t capacity(1U << meta_type::DEFAULT_SCALE_FACTOR);
+            slots_type *slots(
+                new_trailing_vla<slots_type, entry_type>(capacity));
+            slots->mask = capacity - 1;
+
+            table_.num_entries = 0;
+            table_.scaling_factor = meta_type::DEFAULT_SCALE_FACTOR;
+            table_.entry_slots.store(slots);
+
+            for(unsigned i(0); i < MAX_NUM_READERS; ++i) {
+                reader_epochs[i].epoch.store(0);
+            }
+
+            memset(&default_key_, 0, sizeof(K));
+        }
+
+
+        /// Destructor, free the current and the retired slots.
+        ~concurrent_hash_table(void) {
+            for(retired_type *retired(retired_slots); retired; ) {
+                retired_type *next(retired->next);
+                free_slots(retired->slots);
+                free_memory<retired_type>(retired);
+                retired = next;
+            }
+            retired_slots = nullptr;
+
+            slots_type *slots(table_.entry_slots.exchange(nullptr));
+            if(slots) {
+                free_slots(slots);
+            }
+        }
+
+
+        /// Find the value associated with a key in the hash table. This does
+        /// not acquire any locks.
+        V find(const K key, unsigned reader_id) {
+            enter_read(reader_id);
+
+            const slots_type * const slots(
+                table_.entry_slots.load(std::memory_order_acquire));
+            const uint32_t mask(slots->mask);
+            const entry_type * const entries(&(slots->entries[0]));
+            uint32_t entry_base(meta_type::hash(key));
+
+            for(;; entry_base += 1) {
+                entry_base &= mask;
+                const entry_type &entry(entries[entry_base]);
+                const K entry_key(entry.key.load(std::memory_order_acquire));
+
+                // default value; nothing there.
+                if(default_key_ == entry_key) {
+                    break;
+
+                // found it.
+                } else if(entry_key == key) {
+                    return entry.value.load(std::memory_order_acquire);
+                }
+            }
+
+            return V();
+        }
+
+
+        /// Search for an entry in the hash table.
+        inline bool load(const K key, V &value, unsigned reader_id) {
+            value = find(key, reader_id);
+            return (V() != value);
+        }
+
+
+        /// Store a value in the hash table. Returns true iff the entry was
+        /// written to the hash table.
+        bool store(
+            K key,
+            V value,
+            hash_store_policy update=HASH_OVERWRITE_PREV_ENTRY
+        ) {
+            lock.acquire();
+
+            const uint32_t max_num_entries(
+                HASH_TABLE_MAX_SIZES[table_.scaling_factor]);
+
+            if(table_.num_entries > max_num_entries) {
+                grow();
+            }
+
+            unsigned scan(0);
+            const hash_store_state state(insert(
+                table_.entry_slots.load(std::memory_order_relaxed),
+                key, value, HASH_OVERWRITE_PREV_ENTRY == update, scan));
+
+            if(HASH_ENTRY_STORED_NEW == state) {
+                table_.num_entries += 1;
+            }
+
+            // resize if we needed to scan too far to insert this element.
+            if(meta_type::MAX_SCAN_SCALE_FACTOR < scan) {
+                grow();
+            }
+
+            lock.release();
+            return HASH_ENTRY_SKIPPED != state;
+        }
+
+
+        template <typename... Args>
+        inline void for_each_entry(
+            void (*callback)(K, V, Args&...),
+            Args&... args
+        ) {
+            lock.acquire();
+            slots_type *slots(table_.entry_slots.load());
+            const uint32_t num_slots(slots->mask + 1U);
+            entry_type *entries(&(slots->entries[0]));
+
+            for(uint32_t i(0); i < num_slots; ++i) {
+                entry_type &entry(entries[i]);
+                const K key(entry.key.load());
+                const V value(entry.value.load());
+                if(default_key_ == key || V() == value) {
+                    continue;
+                }
+
+                callback(key, value, args...);
+            }
+            lock.release();
+        }
+
+
+        /// Remove every entry for which `pred` returns true. Concurrent
+        /// readers will either see the old value or no value.
+        template <typename... Args>
+        void remove_if(
+            bool (*pred)(K, V, Args&...),
+            Args&... args
+        ) {
+            lock.acquire();
+            slots_type *slots(table_.entry_slots.load());
+            const uint32_t num_slots(slots->mask + 1U);
+            entry_type *entries(&(slots->entries[0]));
+
+            for(uint32_t i(0); i < num_slots; ++i) {
+                entry_type &entry(entries[i]);
+                const K key(entry.key.load());
+                const V value(entry.value.load());
+                if(default_key_ == key || V() == value) {
+                    continue;
+                }
+
+                if(pred(key, value, args...)) {
+                    entry.value.store(V(), std::memory_order_release);
+                }
+            }
+            lock.release();
+        }
+    };
 }
 
 
@@ -10,7 +10,10 @@
 #include "granary/instruction.h"
 #include "granary/code_cache.h"
 #include "granary/emit_utils.h"
+#include "granary/code_template.h"
 #include "granary/spin_lock.h"
+#include "granary/hash_table.h"
+#include "granary/translated_ranges.h"
 
 
 extern "C" {
@@ -21,15 +24,65 @@ extern "C" {
 namespace granary {
 
 
-    // Make sure this is consistent with `granary_ibl_hash` in
-    // `granary/x86/utils.h` and with
     enum {
-        IBL_JUMP_TABLE_ALIGN = NUM_IBL_JUMP_TABLE_ENTRIES * sizeof(app_pc)
+        /// Low-order bits of the mangled target that are ignored by the IBL
+        /// hash function.
+        IBL_HASH_SHIFT = 5,
+
+        /// log2 of the size of an IBL bucket.
+        IBL_BUCKET_SIZE_SHIFT = 7
     };
 
 
-    __attribute__((aligned (16)))
-    static uint8_t IBL_JUMP_TABLE_IMPL[IBL_JUMP_TABLE_ALIGN * 2] = {0};
+    /// An entry in a bucket of the IBL jump table. The `routine` is the IBL
+    /// exit routine for `target`. The exit routine double checks `target`,
+    /// so readers that observe a partially updated entry safely fall back
+    /// to the global code cache lookup routine.
+    struct ibl_bucket_entry {
+        std::atomic<app_pc> target;
+        std::atomic<app_pc> routine;
+    };
+
+
+    /// A set-associative bucket of the IBL jump table. The entries are on
+    /// the first cache line, and the replacement and statistics meta-data is
+    /// on the second cache line.
+    struct ibl_bucket {
+        ibl_bucket_entry entries[NUM_IBL_BUCKET_WAYS];
+
+        /// Clock replacement bits. Set by the lookup stubs on a hit (only if
+        /// not already set) and cleared by the clock hand on insertion.
+        uint8_t referenced[NUM_IBL_BUCKET_WAYS];
+        uint8_t hand;
+
+        std::atomic<uint64_t> num_hits;
+        std::atomic<uint64_t> num_misses;
+        std::atomic<uint64_t> num_conflicts;
+    } __attribute__((aligned (CONFIG_ARCH_CACHE_LINE_SIZE)));
+
+
+    static_assert(
+        (1U << IBL_BUCKET_SIZE_SHIFT) == sizeof(ibl_bucket)
+        && (2 * CACHE_LINE_SIZE) == sizeof(ibl_bucket),
+        "IBL buckets are expected to occupy exactly two cache lines.");
+
+
+    /// Describes the current IBL jump table. The lookup stubs read `mask`
+    /// before `buckets`; growing the table writes `buckets` before `mask`,
+    /// so a stub never indexes beyond the end of the buckets it reads.
+    struct ibl_table {
+        std::atomic<uint64_t> mask;
+        std::atomic<ibl_bucket *> buckets;
+
+        /// Jumped through by the lookup stubs when a target is not found in
+        /// its bucket.
+        app_pc miss_routine;
+    };
+
+
+    /// The IBL jump table.
+    static ibl_table IBL_JUMP_TABLE;
+    static dynamorio::instr_t IBL_JUMP_TABLE_INSTR;
 
 
     /// Coarse grained lock around creating and adding new entries to the IBL.
@@ -39,9 +92,36 @@ namespace granary {
     static spin_lock IBL_JUMP_TABLE_LOCK;
 
 
-    /// Aligned beginning of the jump table.
-    static app_pc *IBL_JUMP_TABLE = nullptr;
-    static dynamorio::instr_t IBL_JUMP_TABLE_INSTR;
+    /// Maps mangled target addresses to their IBL exit routines. This is used
+    /// to re-add evicted targets, as well as to rehash all targets when the
+    /// jump table grows. Guarded by `IBL_JUMP_TABLE_LOCK`.
+    static static_data<hash_table<app_pc, app_pc>> IBL_EXIT_ROUTINES;
+
+
+    /// Number of insertions into, and evictions from the IBL jump table since
+    /// the last time the table was grown. Guarded by `IBL_JUMP_TABLE_LOCK`.
+    static unsigned NUM_INSERTS_SINCE_GROW = 0;
+    static unsigned NUM_EVICTIONS_SINCE_GROW = 0;
+
+
+    /// Allocator for IBL exit routines. The exit routines are freed when the
+    /// code cache is flushed. Guarded by `IBL_JUMP_TABLE_LOCK`.
+    static static_data<
+        bump_pointer_allocator<detail::global_fragment_allocator_config>
+    > IBL_EXIT_ROUTINE_ALLOCATOR;
+
+
+    /// A set of buckets that was allocated for the IBL jump table.
+    struct ibl_bucket_array {
+        ibl_bucket *buckets;
+        unsigned num_buckets;
+        ibl_bucket_array *next;
+    };
+
+
+    /// All sets of buckets that have ever been allocated. Guarded by
+    /// `IBL_JUMP_TABLE_LOCK`.
+    static ibl_bucket_array *IBL_BUCKET_ARRAYS = nullptr;
 
 
     /// Address of the global code cache lookup function.
@@ -51,9 +131,141 @@ namespace granary {
     static app_pc GLOBAL_CODE_CACHE_ROUTINE = nullptr;
 
 
-    /// The routine that indirectly jumps to either an IBL exit stub (that
-    /// checks if it's the correct exit stub) or jumps to the slow path (full
-    /// code cache lookup).
+    /// Returns the bucket index of a mangled target address.
+    static inline unsigned ibl_bucket_index(app_pc target, uint64_t mask) {
+        return static_cast<unsigned>(
+            (reinterpret_cast<uintptr_t>(target) >> IBL_HASH_SHIFT) & mask);
+    }
+
+
+    /// Allocate a new, empty set of buckets. Buckets are never freed because
+    /// an IBL lookup stub might still be probing an old set of buckets.
+    static ibl_bucket *allocate_buckets(unsigned num_buckets) {
+        const unsigned size(num_buckets * sizeof(ibl_bucket));
+        uintptr_t addr(reinterpret_cast<uintptr_t>(
+            allocate_memory<uint8_t>(size + CACHE_LINE_SIZE)));
+        addr += ALIGN_TO(addr, CACHE_LINE_SIZE);
+        memset(reinterpret_cast<void *>(addr), 0, size);
+
+        ibl_bucket_array *array(allocate_memory<ibl_bucket_array>());
+        array->buckets = reinterpret_cast<ibl_bucket *>(addr);
+        array->num_buckets = num_buckets;
+        array->next = IBL_BUCKET_ARRAYS;
+        IBL_BUCKET_ARRAYS = array;
+
+        return array->buckets;
+    }
+
+
+    /// Add an entry to a bucket. If the bucket is full then an entry is
+    /// evicted using the clock algorithm. Returns true iff a live entry was
+    /// evicted.
+    static bool bucket_insert(
+        ibl_bucket *bucket,
+        app_pc target,
+        app_pc routine
+    ) {
+        unsigned way(NUM_IBL_BUCKET_WAYS);
+        for(unsigned i(0); i < NUM_IBL_BUCKET_WAYS; ++i) {
+            const app_pc way_target(bucket->entries[i].target.load());
+            if(target == way_target) {
+                return false;
+            } else if(!way_target && NUM_IBL_BUCKET_WAYS == way) {
+                way = i;
+            }
+        }
+
+        const bool evicted(NUM_IBL_BUCKET_WAYS == way);
+        IF_PERF( unsigned num_probes(evicted ? way : way + 1); )
+        if(evicted) {
+            for(;;) {
+                way = bucket->hand;
+                bucket->hand = (way + 1) % NUM_IBL_BUCKET_WAYS;
+                IF_PERF( ++num_probes; )
+                if(!bucket->referenced[way]) {
+                    break;
+                }
+                bucket->referenced[way] = 0;
+            }
+        }
+        IF_PERF( perf::visit_ibl_probe(num_probes); )
+
+        // Invalidate the entry before changing its routine. Readers that race
+        // with this update will jump to the wrong exit routine, which will
+        // then redirect them to the global code cache lookup routine.
+        ibl_bucket_entry &entry(bucket->entries[way]);
+        entry.target.store(nullptr);
+        entry.routine.store(routine);
+        entry.target.store(target);
+        bucket->referenced[way] = 0;
+
+        return evicted;
+    }
+
+
+    /// Re-add an existing entry into a new set of buckets.
+    static void rehash_entry(
+        app_pc target,
+        app_pc routine,
+        ibl_bucket *&buckets,
+        uint64_t &mask
+    ) {
+        if(!routine) {
+            return; // Invalidated.
+        }
+        bucket_insert(&(buckets[ibl_bucket_index(target, mask)]),
+            target, routine);
+    }
+
+
+    /// Grow the IBL jump table if the rate of conflicts since the last growth
+    /// has exceeded its threshold. Must be called with the IBL lock held.
+    static void grow_if_conflicted(void) {
+        if(MIN_IBL_GROW_SAMPLE > NUM_INSERTS_SINCE_GROW) {
+            return;
+        }
+
+        const uint64_t old_mask(IBL_JUMP_TABLE.mask.load());
+        const unsigned num_buckets(static_cast<unsigned>(old_mask + 1) * 2);
+        if(num_buckets > MAX_NUM_IBL_BUCKETS
+        || (NUM_EVICTIONS_SINCE_GROW * 100) <=
+           (NUM_INSERTS_SINCE_GROW * IBL_GROW_CONFLICT_PERCENT)) {
+            return;
+        }
+
+        ibl_bucket *buckets(allocate_buckets(num_buckets));
+        uint64_t mask(num_buckets - 1);
+        IBL_EXIT_ROUTINES->for_each_entry(rehash_entry, buckets, mask);
+
+        // Order matters: see `ibl_table`.
+        IBL_JUMP_TABLE.buckets.store(buckets);
+        IBL_JUMP_TABLE.mask.store(mask);
+
+        NUM_INSERTS_SINCE_GROW = 0;
+        NUM_EVICTIONS_SINCE_GROW = 0;
+    }
+
+
+    /// Add an entry into the IBL jump table. Must be called with the IBL lock
+    /// held.
+    static void table_insert(app_pc target, app_pc routine) {
+        const uint64_t mask(IBL_JUMP_TABLE.mask.load());
+        ibl_bucket *bucket(&(IBL_JUMP_TABLE.buckets.load()[
+            ibl_bucket_index(target, mask)]));
+
+        NUM_INSERTS_SINCE_GROW += 1;
+        if(bucket_insert(bucket, target, routine)) {
+            NUM_EVICTIONS_SINCE_GROW += 1;
+            bucket->num_conflicts.fetch_add(1);
+            IF_PERF( perf::visit_ibl_conflict(target); )
+            grow_if_conflicted();
+        }
+    }
+
+
+    /// The routine that probes the bucket of the IBL jump table associated
+    /// with a target, and either indirectly jumps to the target's IBL exit
+    /// routine, or jumps to the slow path (full code cache lookup).
     void ibl_lookup_stub(
         instruction_list &ibl,
         instruction in,
@@ -73,20 +285,79 @@ namespace granary {
             int16_((int64_t) (int16_t) granary_bswap16(policy.encode()))));
         ibl.insert_before(in, bswap_(reg::indirect_target_addr));
 
-        // Get the base of the table into `reg_source_addr`.
+        // Get the table descriptor into `reg_source_addr`.
         ibl.insert_before(in,
             lea_(reg::indirect_source_addr, mem_instr_(&IBL_JUMP_TABLE_INSTR)));
 
-        // Hash the target in `indirect_clobber_reg`.
+        // Hash the target in `indirect_clobber_reg`, and turn it into the
+        // address of the target's bucket. The mask must be read before the
+        // buckets.
         ibl.insert_before(in, mov_ld_(
             reg::indirect_clobber_reg, reg::indirect_target_addr));
+        ibl.insert_before(in, shr_(
+            reg::indirect_clobber_reg, int8_(IBL_HASH_SHIFT)));
+        ibl.insert_before(in, and_(
+            reg::indirect_clobber_reg,
+            reg::indirect_source_addr[
+                static_cast<int>(offsetof(ibl_table, mask))]));
+        ibl.insert_before(in, shl_(
+            reg::indirect_clobber_reg, int8_(IBL_BUCKET_SIZE_SHIFT)));
+        ibl.insert_before(in, add_(
+            reg::indirect_clobber_reg,
+            reg::indirect_source_addr[
+                static_cast<int>(offsetof(ibl_table, buckets))]));
+
+        // Probe each way of the bucket. On a hit, `indirect_clobber_reg` is
+        // left pointing to the exit routine slot of the matching entry.
+        instruction found(label_());
+        for(unsigned way(0); way < NUM_IBL_BUCKET_WAYS; ++way) {
+            const int entry_offset(
+                static_cast<int>(way * sizeof(ibl_bucket_entry)));
+            const int referenced_offset(static_cast<int>(
+                offsetof(ibl_bucket, referenced) + way));
+
+            instruction next_way(label_());
+            instruction already_referenced(label_());
+
+            ibl.insert_before(in, cmp_(
+                reg::indirect_clobber_reg[entry_offset],
+                reg::indirect_target_addr));
+            ibl.insert_before(in, mangled(jnz_(instr_(next_way))));
+
+            IF_PERF( ibl.insert_before(in, atomic(inc_(
+                reg::indirect_clobber_reg[
+                    static_cast<int>(offsetof(ibl_bucket, num_hits))]))); )
+
+            // Only write to the referenced bit if it isn't already set, so
+            // that hot targets don't bounce the bucket's cache line.
+            ibl.insert_before(in, cmp_(
+                mem8_(reg::indirect_clobber_reg, referenced_offset),
+                int8_(0)));
+            ibl.insert_before(in,
+                mangled(jnz_(instr_(already_referenced))));
+            ibl.insert_before(in, mov_st_(
+                mem8_(reg::indirect_clobber_reg, referenced_offset),
+                int8_(1)));
+            ibl.insert_before(in, already_referenced);
+
+            ibl.insert_before(in, lea_(
+                reg::indirect_clobber_reg,
+                reg::indirect_clobber_reg[entry_offset + static_cast<int>(
+                    offsetof(ibl_bucket_entry, routine))]));
+            ibl.insert_before(in, mangled(jmp_(instr_(found))));
+            ibl.insert_before(in, next_way);
+        }
 
-        ibl.insert_before(in, shl_(reg::indirect_clobber_reg, int8_(48)));
-        ibl.insert_before(in, shr_(reg::indirect_clobber_reg, int8_(48 + 5)));
-
+        // Miss; go to the global code cache lookup routine.
+        IF_PERF( ibl.insert_before(in, atomic(inc_(
+            reg::indirect_clobber_reg[
+                static_cast<int>(offsetof(ibl_bucket, num_misses))]))); )
         ibl.insert_before(in, lea_(
             reg::indirect_clobber_reg,
-            reg::indirect_source_addr + reg::indirect_clobber_reg * 8));
+            reg::indirect_source_addr[
+                static_cast<int>(offsetof(ibl_table, miss_routine))]));
+
+        ibl.insert_before(in, found);
 
         // Get a source address into the basic block for trace allocator
         // propagation.
@@ -115,19 +386,35 @@ namespace granary {
     }
 
 
-    /// Return or generate the IBL exit routine for a particular jump target.
-    /// The target can either be code cache or native code.
-    app_pc ibl_exit_routine(
+    /// Template of IBL exit routines whose targets are both reachable with
+    /// `JMP rel32`s. The relocations are the mangled target, the instrumented
+    /// target, and the global code cache lookup routine.
+    static code_template IBL_EXIT_TEMPLATE;
+
+
+    /// Offset of the entrypoint used by the global code cache lookup routine
+    /// within `IBL_EXIT_TEMPLATE`.
+    static unsigned IBL_EXIT_TEMPLATE_HIT_OFFSET(0);
+
+
+    /// Number of instructions in `IBL_EXIT_TEMPLATE`.
+    static unsigned IBL_EXIT_TEMPLATE_NUM_INSTRUCTIONS(0);
+
+
+    /// Build the instructions of the IBL exit routine for a particular jump
+    /// target. If `direct_jmps` is true, then the targets are jumped to with
+    /// `JMP rel32`s regardless of how far away they are. Returns the entrypoint
+    /// used by the global code cache lookup routine.
+    static instruction build_ibl_exit_routine(
+        instruction_list &ibl,
         app_pc mangled_target_pc,
-        app_pc instrumented_target_pc
+        app_pc instrumented_target_pc,
+        bool direct_jmps
     ) {
-
-        instruction_list ibl;
         instruction ibl_hit_from_code_cache_find(label_());
         instruction ibl_miss(label_());
 
-        // CASE1 : We're coming in through the IBL jump table, or through
-        //         a chained exit routine that was part of the IBL jump table.
+        // CASE1 : We're coming in through a bucket of the IBL jump table.
         //
         // On the stack:
         //      indirect_target_addr    (saved: arg1, mangled target address)
@@ -153,40 +440,207 @@ namespace granary {
         ibl.append(pop_(reg::indirect_target_addr));
 
         ASSERT(nullptr != instrumented_target_pc);
-        insert_cti_after(
-            ibl, ibl.last(), instrumented_target_pc,
-            CTI_DONT_STEAL_REGISTER, operand(),
-            CTI_JMP);
+        if(direct_jmps) {
+            ibl.append(jmp_(pc_(instrumented_target_pc)));
+        } else {
+            insert_cti_after(
+                ibl, ibl.last(), instrumented_target_pc,
+                CTI_DONT_STEAL_REGISTER, operand(),
+                CTI_JMP);
+        }
 
         ibl.append(ibl_miss);
 
-        const unsigned index(granary_ibl_hash(mangled_target_pc));
-        ASSERT(index < NUM_IBL_JUMP_TABLE_ENTRIES);
-
-        app_pc prev_target(IBL_JUMP_TABLE[index]);
-        ASSERT(nullptr != prev_target);
-        if(prev_target != GLOBAL_CODE_CACHE_ROUTINE) {
-            IF_PERF( perf::visit_ibl_conflict(mangled_target_pc); )
+        // The target doesn't match, e.g. because this routine was reached
+        // through a partially updated bucket entry.
+        if(direct_jmps) {
+            ibl.append(jmp_(pc_(GLOBAL_CODE_CACHE_ROUTINE)));
+        } else {
+            insert_cti_after(
+                ibl, ibl.last(), GLOBAL_CODE_CACHE_ROUTINE,
+                CTI_DONT_STEAL_REGISTER, operand(),
+                CTI_JMP);
         }
 
-        // Only allow one thread/core to update the IBL jump table at a time.
-        insert_cti_after(
-            ibl, ibl.last(), prev_target,
-            CTI_DONT_STEAL_REGISTER, operand(),
-            CTI_JMP);
-        IF_PERF( perf::visit_ibl_exit(ibl); )
+        return ibl_hit_from_code_cache_find;
+    }
+
 
-        // Encode the IBL exit routine.
-        const unsigned size(ibl.encoded_size());
-        app_pc routine(global_state::FRAGMENT_ALLOCATOR-> \
-            allocate_array<uint8_t>(size));
-        ibl.encode(routine, size);
-        IBL_JUMP_TABLE[index] = routine;
+    /// Return or generate the IBL exit routine for a particular jump target.
+    /// The target can either be code cache or native code.
+    app_pc ibl_exit_routine(
+        app_pc mangled_target_pc,
+        app_pc instrumented_target_pc
+    ) {
+        app_pc routine(nullptr);
+        app_pc ibl_hit_from_code_cache_find(nullptr);
+
+        const uint64_t relocs[] = {
+            reinterpret_cast<uint64_t>(mangled_target_pc),
+            reinterpret_cast<uint64_t>(instrumented_target_pc),
+            reinterpret_cast<uint64_t>(GLOBAL_CODE_CACHE_ROUTINE)
+        };
+
+        // Decide how to emit the routine before allocating it, as the shared
+        // allocator can't take back an allocation of the wrong size. As with
+        // `insert_cti_after`, a staged allocation should be close enough.
+        const app_pc staged_routine(const_cast<app_pc>(
+            IBL_EXIT_ROUTINE_ALLOCATOR->allocate_staged<uint8_t>()));
+
+        // Common case: Both targets are close enough to the routine, so copy
+        // the routine from its template.
+        if(IBL_EXIT_TEMPLATE.can_emit(staged_routine, relocs)) {
+            routine = IBL_EXIT_ROUTINE_ALLOCATOR-> \
+                allocate_array<uint8_t>(IBL_EXIT_TEMPLATE.size);
+
+            ASSERT(IBL_EXIT_TEMPLATE.can_emit(routine, relocs));
+            IBL_EXIT_TEMPLATE.emit(routine, relocs);
+            ibl_hit_from_code_cache_find =
+                routine + IBL_EXIT_TEMPLATE_HIT_OFFSET;
+
+            IF_PERF( perf::visit_ibl_exit(IBL_EXIT_TEMPLATE_NUM_INSTRUCTIONS); )
+
+#if CONFIG_DEBUG_CHECK_CODE_TEMPLATES
+            instruction_list check_ibl;
+            build_ibl_exit_routine(
+                check_ibl, mangled_target_pc, instrumented_target_pc, true);
+            IBL_EXIT_TEMPLATE.check(routine, check_ibl);
+#endif
+
+        // Otherwise, encode the routine, using indirect JMPs where needed.
+        } else {
+            instruction_list ibl;
+            instruction hit(build_ibl_exit_routine(
+                ibl, mangled_target_pc, instrumented_target_pc, false));
+
+            const unsigned size(ibl.encoded_size());
+            routine = IBL_EXIT_ROUTINE_ALLOCATOR-> \
+                allocate_array<uint8_t>(size);
+            ibl.encode(routine, size);
+
+            IF_PERF( perf::visit_ibl_exit(ibl.length()); )
+
+            // The value stored in code cache find isn't the full value!!
+            ibl_hit_from_code_cache_find = hit.pc_or_raw_bytes();
+        }
+
+        IBL_EXIT_ROUTINES->store(mangled_target_pc, routine);
+        table_insert(mangled_target_pc, routine);
 
         IF_PERF( perf::visit_ibl_add_entry(mangled_target_pc); )
 
-        // The value stored in code cache find isn't the full value!!
-        return ibl_hit_from_code_cache_find.pc_or_raw_bytes();
+        return ibl_hit_from_code_cache_find;
+    }
+
+
+    /// Re-add the existing IBL exit routine for a particular jump target to
+    /// the IBL jump table.
+    void ibl_refill(app_pc mangled_target_pc) {
+        ibl_lock();
+        app_pc routine(nullptr);
+        if(IBL_EXIT_ROUTINES->load(mangled_target_pc, routine)) {
+            table_insert(mangled_target_pc, routine);
+        }
+        ibl_unlock();
+    }
+
+
+    /// Remove all entries from the IBL jump table and forget about all IBL
+    /// exit routines.
+    bump_pointer_slab *ibl_flush(void) {
+        ibl_lock();
+
+        // Clear out every set of buckets, as a lookup stub might still be
+        // probing an old set of buckets.
+        for(ibl_bucket_array *array(IBL_BUCKET_ARRAYS);
+            array;
+            array = array->next) {
+
+            for(unsigned i(0); i < array->num_buckets; ++i) {
+                ibl_bucket &bucket(array->buckets[i]);
+                for(unsigned j(0); j < NUM_IBL_BUCKET_WAYS; ++j) {
+                    bucket.entries[j].target.store(nullptr);
+                    bucket.referenced[j] = 0;
+                }
+            }
+        }
+
+        IBL_EXIT_ROUTINES->~hash_table();
+        IBL_EXIT_ROUTINES.construct();
+        NUM_INSERTS_SINCE_GROW = 0;
+        NUM_EVICTIONS_SINCE_GROW = 0;
+
+        bump_pointer_slab *routines(IBL_EXIT_ROUTINE_ALLOCATOR->detach_slabs());
+        ibl_unlock();
+
+        return routines;
+    }
+
+
+    /// Returns true iff the mangled target address `target` targets native
+    /// code of a `stale` trace.
+    static bool is_stale_target(
+        app_pc target,
+        app_pc,
+        const stale_traces &stale
+    ) {
+        mangled_address am;
+        am.as_address = target;
+        return is_translated_from(stale, am.unmangled_address());
+    }
+
+
+    /// Remove the IBL jump table entries and exit routines of all jump
+    /// targets in the native code of the `stale` traces.
+    void ibl_invalidate(const stale_traces &stale) {
+        ibl_lock();
+
+        for(ibl_bucket_array *array(IBL_BUCKET_ARRAYS);
+            array;
+            array = array->next) {
+
+            for(unsigned i(0); i < array->num_buckets; ++i) {
+                ibl_bucket &bucket(array->buckets[i]);
+                for(unsigned j(0); j < NUM_IBL_BUCKET_WAYS; ++j) {
+                    const app_pc target(bucket.entries[j].target.load());
+                    if(target && is_stale_target(target, nullptr, stale)) {
+                        bucket.entries[j].target.store(nullptr);
+                        bucket.referenced[j] = 0;
+                    }
+                }
+            }
+        }
+
+        IBL_EXIT_ROUTINES->remove_if(is_stale_target, stale);
+        ibl_unlock();
+    }
+
+
+    /// Free the IBL exit routines returned by `ibl_flush`.
+    void ibl_free_exit_routines(bump_pointer_slab *routines) {
+        bump_pointer_allocator<detail::global_fragment_allocator_config>:: \
+            free_slab_list(routines);
+    }
+
+
+    /// Returns the current number of buckets in the IBL jump table.
+    unsigned ibl_num_buckets(void) {
+        return static_cast<unsigned>(IBL_JUMP_TABLE.mask.load() + 1);
+    }
+
+
+    /// Get the statistics for the `index`th bucket of the IBL jump table.
+    bool ibl_get_bucket_stats(unsigned index, ibl_bucket_stats &stats) {
+        ibl_lock();
+        const bool in_range(index <= IBL_JUMP_TABLE.mask.load());
+        if(in_range) {
+            const ibl_bucket &bucket(IBL_JUMP_TABLE.buckets.load()[index]);
+            stats.num_hits = bucket.num_hits.load();
+            stats.num_misses = bucket.num_misses.load();
+            stats.num_conflicts = bucket.num_conflicts.load();
+        }
+        ibl_unlock();
+        return in_range;
     }
 
 
@@ -298,31 +752,12 @@ namespace granary {
         global_code_cache_find = unsafe_cast<app_pc>(
             (app_pc (*)(mangled_address, app_pc)) code_cache::find);
 
-        // Double check that our hash function is valid.
-        app_pc i_ptr(nullptr);
-        unsigned min_index(0x10000U);
-        unsigned max_index(0);
-        for(unsigned i(0); i <= 0xFFFFU; ++i) {
-            const unsigned index(granary_ibl_hash(i_ptr + i));
-            ASSERT(NUM_IBL_JUMP_TABLE_ENTRIES > index);
-            min_index = index < min_index ? index : min_index;
-            max_index = index > max_index ? index : max_index;
-        }
-
-        // Sanity checking on the range of the hash table function.
-        ASSERT((NUM_IBL_JUMP_TABLE_ENTRIES - 1) == max_index);
-        ASSERT(0 == min_index);
-
-        // Create a properly-aligned jump table base.
-        uintptr_t jump_table_base(
-            reinterpret_cast<uintptr_t>(&(IBL_JUMP_TABLE_IMPL[0])));
-        jump_table_base += ALIGN_TO(jump_table_base, IBL_JUMP_TABLE_ALIGN);
-        const app_pc jump_table_addr(
-            reinterpret_cast<app_pc>(jump_table_base));
-
-        IBL_JUMP_TABLE = reinterpret_cast<app_pc *>(jump_table_base);
+        IBL_EXIT_ROUTINES.construct();
+        IBL_EXIT_ROUTINE_ALLOCATOR.construct();
 
         memset(&IBL_JUMP_TABLE_INSTR, 0, sizeof IBL_JUMP_TABLE_INSTR);
+        const app_pc jump_table_addr(
+            reinterpret_cast<app_pc>(&IBL_JUMP_TABLE));
         IBL_JUMP_TABLE_INSTR.opcode = dynamorio::OP_LABEL;
         IBL_JUMP_TABLE_INSTR.translation = jump_table_addr;
         IBL_JUMP_TABLE_INSTR.bytes = jump_table_addr;
@@ -331,9 +766,31 @@ namespace granary {
 
         // Initialise the jump table.
         GLOBAL_CODE_CACHE_ROUTINE = global_code_cache_lookup_routine();
-        for(unsigned i(0); i < NUM_IBL_JUMP_TABLE_ENTRIES; ++i) {
-            IBL_JUMP_TABLE[i] = GLOBAL_CODE_CACHE_ROUTINE;
-        }
+        IBL_JUMP_TABLE.miss_routine = GLOBAL_CODE_CACHE_ROUTINE;
+        IBL_JUMP_TABLE.buckets.store(allocate_buckets(MIN_NUM_IBL_BUCKETS));
+        IBL_JUMP_TABLE.mask.store(MIN_NUM_IBL_BUCKETS - 1);
+
+        // Compile the IBL exit routine template. The placeholder targets are
+        // within the template itself, so that the JMPs are encoded as rel32s,
+        // and the mangled target placeholder doesn't fit in 32 bits, so that
+        // its MOV is encoded with an imm64.
+        instruction_list ibl;
+        const app_pc placeholder_pc(&(IBL_EXIT_TEMPLATE.bytes[0]));
+        const app_pc placeholder_mangled_pc(
+            reinterpret_cast<app_pc>(0xFEEDFACEDEADBEEFULL));
+        const app_pc global_code_cache_routine(GLOBAL_CODE_CACHE_ROUTINE);
+
+        GLOBAL_CODE_CACHE_ROUTINE = placeholder_pc;
+        instruction hit(build_ibl_exit_routine(
+            ibl, placeholder_mangled_pc, placeholder_pc, true));
+        GLOBAL_CODE_CACHE_ROUTINE = global_code_cache_routine;
+
+        IBL_EXIT_TEMPLATE.compile(ibl);
+        IBL_EXIT_TEMPLATE.add_reloc(ibl.first(), RELOC_ABS64);
+        IBL_EXIT_TEMPLATE.add_reloc(hit.next().next(), RELOC_REL32);
+        IBL_EXIT_TEMPLATE.add_reloc(ibl.last(), RELOC_REL32);
+        IBL_EXIT_TEMPLATE_HIT_OFFSET = IBL_EXIT_TEMPLATE.offset_of(hit);
+        IBL_EXIT_TEMPLATE_NUM_INSTRUCTIONS = ibl.length();
     });
 
 }
@@ -16,7 +16,31 @@ namespace granary {
 
 
     enum {
-        NUM_IBL_JUMP_TABLE_ENTRIES = 2048
+        NUM_IBL_JUMP_TABLE_ENTRIES = 2048,
+
+        /// Number of (target, exit routine) pairs in each bucket of the IBL
+        /// jump table. The pairs of a bucket fill exactly one cache line.
+        NUM_IBL_BUCKET_WAYS = 4,
+
+        /// Initial and maximum number of buckets in the IBL jump table.
+        MIN_NUM_IBL_BUCKETS = NUM_IBL_JUMP_TABLE_ENTRIES / NUM_IBL_BUCKET_WAYS,
+        MAX_NUM_IBL_BUCKETS = 1 << 16,
+
+        /// The IBL jump table is grown when more than this percentage of
+        /// insertions (since the last growth) evict a live entry. At least
+        /// `MIN_IBL_GROW_SAMPLE` insertions must happen between growths.
+        IBL_GROW_CONFLICT_PERCENT = 25,
+        MIN_IBL_GROW_SAMPLE = 256
+    };
+
+
+    /// Statistics for a single bucket of the IBL jump table. Hit and miss
+    /// counts are only maintained if `CONFIG_DEBUG_PERF_COUNTS` is enabled,
+    /// as they are counted by the inline lookup stubs.
+    struct ibl_bucket_stats {
+        uint64_t num_hits;
+        uint64_t num_misses;
+        uint64_t num_conflicts;
     };
 
 
@@ -54,6 +78,53 @@ namespace granary {
         app_pc mangled_target_pc,
         app_pc instrumented_target_pc
     ) ;
+
+
+    /// Re-add the existing IBL exit routine for a particular jump target to
+    /// the IBL jump table. This is used when the target was evicted from its
+    /// bucket, and so the target was found by a slow-path lookup.
+    void ibl_refill(app_pc mangled_target_pc) ;
+
+
+    /// Forward declaration.
+    struct bump_pointer_slab;
+
+
+    /// Remove all entries from the IBL jump table, and forget about all IBL
+    /// exit routines. Returns the slabs of memory containing the forgotten
+    /// exit routines. These slabs must be freed with `ibl_free_exit_routines`
+    /// once no CPU can be executing any of the routines.
+    ///
+    /// Note: The caller is responsible for removing the forgotten exit
+    ///       routines from the global code cache.
+    bump_pointer_slab *ibl_flush(void) ;
+
+
+    /// Forward declaration.
+    struct stale_traces;
+
+
+    /// Remove the IBL jump table entries and exit routines of all jump
+    /// targets in the native code of the `stale` traces, so that later jumps
+    /// to those targets are looked up in the global code cache. The exit
+    /// routines themselves are not freed until the next `ibl_flush`.
+    ///
+    /// Note: The caller is responsible for removing the forgotten exit
+    ///       routines from the global code cache.
+    void ibl_invalidate(const stale_traces &stale) ;
+
+
+    /// Free the IBL exit routines returned by `ibl_flush`.
+    void ibl_free_exit_routines(bump_pointer_slab *routines) ;
+
+
+    /// Returns the current number of buckets in the IBL jump table.
+    unsigned ibl_num_buckets(void) ;
+
+
+    /// Get the statistics for the `index`th bucket of the IBL jump table.
+    /// Returns false if `index` is out of range.
+    bool ibl_get_bucket_stats(unsigned index, ibl_bucket_stats &stats) ;
 }
 
 #endif /* GRANARY_IBL_H_ */
@@ -9,6 +9,7 @@
 #include "granary/state.h"
 #include "granary/instruction.h"
 #include "granary/emit_utils.h"
+#include "granary/decode_cache.h"
 #include "granary/gen/instruction.h"
 
 namespace granary {
@@ -717,6 +718,20 @@ namespace granary {
 #endif
 
 
+    /// Decode the native instruction at `byte_pc` into `instr`. Returns the
+    /// address of the next instruction.
+    static app_pc decode_native(dynamorio::instr_t *instr, uint8_t *byte_pc) {
+        app_pc next_pc(dynamorio::decode_raw(
+            instruction::DCONTEXT, byte_pc, instr));
+        dynamorio::decode(instruction::DCONTEXT, byte_pc, instr);
+
+        // Keep these associations around.
+        instr->translation = byte_pc;
+        instr->bytes = byte_pc;
+        return next_pc;
+    }
+
+
     /// Decodes a raw byte, pointed to by *pc, and updated *pc to be the
     /// following byte. The decoded instruction is returned by value. If
     /// the instruction cannot be decoded, then *pc is set to NULL.
@@ -725,15 +740,7 @@ namespace granary {
         instruction_decode_constraint constraint
     ) {
         instr = make_instr();
-
-        uint8_t *byte_pc(*pc_);
-
-        *pc_ = dynamorio::decode_raw(DCONTEXT, byte_pc, instr);
-        dynamorio::decode(DCONTEXT, byte_pc, instr);
-
-        // Keep these associations around.
-        instr->translation = byte_pc;
-        instr->bytes = byte_pc;
+        *pc_ = decode_native(instr, *pc_);
 
         IF_PERF( perf::visit_decoded(*this); )
 
@@ -758,6 +765,38 @@ namespace granary {
     }
 
 
+    /// Decodes an instruction, sharing the decoding with other decodes of
+    /// the same native code through the decode cache.
+    instruction instruction::decode_cached(app_pc *pc) {
+#if CONFIG_OPTIMISE_DECODE_CACHE
+        instruction self(nullptr);
+        const app_pc byte_pc(*pc);
+        IF_PERF( const uint64_t start_time(perf::timestamp()); )
+
+        self.instr = make_instr();
+        *pc = decode_cache::find(byte_pc, self.instr);
+
+        if(*pc) {
+            IF_PERF( perf::visit_decode_cache_hit(
+                perf::timestamp() - start_time); )
+        } else {
+            *pc = decode_native(self.instr, byte_pc);
+            decode_cache::add(byte_pc, self.instr);
+            IF_PERF( perf::visit_decode_cache_miss(
+                perf::timestamp() - start_time); )
+        }
+
+        IF_PERF( perf::visit_decoded(self); )
+
+        self.widen_if_cti();
+        self.add_flag(NATIVE_INSTRUCTION);
+        return self;
+#else
+        return decode(pc);
+#endif
+    }
+
+
     /// The encoded size of the instruction list.
     unsigned instruction_list::encoded_size(void) {
         auto in = first();
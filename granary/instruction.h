@@ -576,6 +576,12 @@ namespace granary {
         ) ;
 
 
+        /// Decodes an instruction like `decode`, but shares the decoding
+        /// with other decodes of the same native code through the decode
+        /// cache. This is used to decode the native code of basic blocks.
+        static instruction decode_cached(app_pc *pc);
+
+
         /// Encodes an instruction into a sequence of bytes.
         app_pc encode(app_pc pc) ;
 
@@ -547,6 +547,7 @@ namespace granary {
         mangled_address target(isf->instruction_pointer, policy);
         app_pc translated_target(nullptr);
 
+        code_cache::refresh_cpu_cache(cpu);
         if(!cpu->code_cache.load(target.as_address, translated_target)) {
             granary::enter(cpu);
             translated_target = code_cache::find(cpu, target);
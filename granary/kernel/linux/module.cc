@@ -14,6 +14,7 @@
 #include "granary/attach.h"
 #include "granary/detach.h"
 #include "granary/perf.h"
+#include "granary/trace_log.h"
 #include "granary/test.h"
 #include "granary/wrapper.h"
 #include "granary/types.h"
@@ -138,6 +139,10 @@ extern "C" {
         case kernel_module::STATE_GOING:
             printf("[granary] Notified about module (%s) state change: GOING.\n",
                 module->name);
+
+            // The module's memory is about to be freed, and might later be
+            // re-used by another module.
+            code_cache::invalidate(module->text_begin, module->max_text_end);
             break;
         }
     }
@@ -169,6 +174,40 @@ extern "C" {
         client::report();
 #endif
     }
+
+
+    /// Returns the address and size of the exported performance counters.
+    const void *granary_perf_counters(unsigned long *size) {
+#if CONFIG_DEBUG_PERF_COUNTS
+        *size = sizeof(perf_export);
+        return perf::exported();
+#else
+        *size = 0;
+        return nullptr;
+#endif
+    }
+
+
+    /// Returns the address and size of the client's exported log.
+    const void *granary_client_log(unsigned long *size) {
+#ifdef CLIENT_exported_log
+        return client::exported_log(size);
+#else
+        *size = 0;
+        return nullptr;
+#endif
+    }
+
+
+    /// Drain the per-CPU execution trace buffers into `buff`.
+    unsigned long granary_trace_drain(
+        char *buff,
+        unsigned long size,
+        int with_info
+    ) {
+        return trace_log::drain(
+            unsafe_cast<uint8_t *>(buff), size, !!with_info);
+    }
 }
 
 extern "C" {
@@ -178,4 +217,6 @@ extern "C" {
 GRANARY_DETACH_POINT(notify_module_state_change);
 GRANARY_DETACH_POINT(module_load_notifier);
 GRANARY_DETACH_POINT(granary_report);
+GRANARY_DETACH_POINT(granary_perf_counters);
+GRANARY_DETACH_POINT(granary_client_log);
 
@@ -90,6 +90,22 @@ namespace granary {
     { }
 
 
+    /// Returns the current CPU's state, if it has been allocated.
+    cpu_state *current_cpu_state(void) {
+        return *kernel_get_cpu_state(CPU_STATES);
+    }
+
+
+    /// Invoke `func` on the state of every CPU.
+    void for_each_cpu_state(void (*func)(cpu_state *, void *), void *data) {
+        for(unsigned i(0); i < MAX_NUM_CPUS; ++i) {
+            if(CPU_STATES[i]) {
+                func(CPU_STATES[i], data);
+            }
+        }
+    }
+
+
     /// Represents CPU state that is actually allocated and has two poisoned
     /// pages around it.
     struct poison {
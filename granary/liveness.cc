@@ -0,0 +1,478 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * liveness.cc
+ *
+ *  Created on: 2026-10-17
+ *      Author: Peter Goodman
+ */
+
+#include "granary/liveness.h"
+#include "granary/hash_table.h"
+#include "granary/detach.h"
+
+namespace granary {
+
+
+    enum : unsigned {
+
+        /// Arithmetic flags, which are assumed to be dead before CALLs, RETs,
+        /// and indirect JMPs.
+        ARITH_FLAGS = EFLAGS_READ_CF | EFLAGS_READ_PF | EFLAGS_READ_AF
+                    | EFLAGS_READ_ZF | EFLAGS_READ_SF | EFLAGS_READ_OF,
+
+        /// Shift that converts `EFLAGS_WRITE_*` bits into `EFLAGS_READ_*`
+        /// bits.
+        EFLAGS_WRITE_TO_READ_SHIFT = 11,
+
+        /// Maximum number of native basic blocks whose liveness is solved
+        /// together. Successors outside of this region have all of their
+        /// registers and flags assumed to be live.
+        MAX_REGION_BLOCKS = 32,
+
+        /// Maximum number of instructions decoded for a single native basic
+        /// block. Longer blocks are treated as falling through.
+        MAX_BLOCK_INSTRUCTIONS = 128,
+
+        /// All registers (in the `register_manager::encode` format) and all
+        /// flags are live.
+        ALL_REGS = ~0U,
+        ALL_FLAGS = EFLAGS_READ_ALL,
+
+        /// Number of bits of the generation number that are stored along with
+        /// cached liveness information.
+        GENERATION_BITS = 21,
+        GENERATION_MASK = (1U << GENERATION_BITS) - 1
+    };
+
+
+    /// Summary of how a native basic block uses registers and flags.
+    struct block_summary {
+
+        /// Registers and flags that are read before they are written in the
+        /// block.
+        uint32_t used_regs;
+        unsigned used_flags;
+
+        /// Registers and flags that are written (and not first read) in the
+        /// block.
+        uint32_t defined_regs;
+        unsigned defined_flags;
+
+        /// Registers and flags that are live at the end of the block,
+        /// regardless of its successors (e.g. because the block ends in a
+        /// RET).
+        uint32_t exit_regs;
+        unsigned exit_flags;
+
+        /// Native successors of the block, reached by direct JMPs, by
+        /// conditional branches, or by falling through.
+        app_pc successors[2];
+        unsigned num_successors;
+    };
+
+
+    /// Cached registers and flags live on entry to native code. Entries are
+    /// packed as: registers (32 bits), flags (11 bits), generation (21 bits).
+    static static_data<locked_hash_table<app_pc, uint64_t>> LIVE_STATES;
+
+
+    /// Entries of `LIVE_STATES` that don't belong to this generation are
+    /// ignored.
+    static std::atomic<unsigned> LIVE_STATES_GENERATION = ATOMIC_VAR_INIT(1U);
+
+
+    STATIC_INITIALISE_ID(live_states, {
+        LIVE_STATES.construct();
+    })
+
+
+    /// Initialise the state so that every register and flag is live.
+    live_state::live_state(void)
+        : regs()
+        , flags(ALL_FLAGS)
+    { }
+
+
+    /// Returns true iff the registers and flags live on entry to the native
+    /// code at `pc` are cached.
+    static bool load_live_state(
+        app_pc pc,
+        uint32_t &regs,
+        unsigned &flags
+    ) {
+        uint64_t entry(0);
+        if(!LIVE_STATES->load(pc, entry)) {
+            return false;
+        }
+
+        const unsigned generation(
+            LIVE_STATES_GENERATION.load() & GENERATION_MASK);
+        if(generation != (entry >> 43)) {
+            return false;
+        }
+
+        regs = static_cast<uint32_t>(entry);
+        flags = static_cast<unsigned>(entry >> 32) & ALL_FLAGS;
+        return true;
+    }
+
+
+    /// Cache the registers and flags live on entry to the native code at `pc`.
+    static void store_live_state(app_pc pc, uint32_t regs, unsigned flags) {
+        const uint64_t generation(
+            LIVE_STATES_GENERATION.load() & GENERATION_MASK);
+        LIVE_STATES->store(pc,
+            (generation << 43)
+            | (static_cast<uint64_t>(flags & ALL_FLAGS) << 32)
+            | regs);
+    }
+
+
+    /// Convert a register and flags bitmask into a live state.
+    static live_state make_live_state(uint32_t regs, unsigned flags) {
+        live_state state;
+        state.regs.decode(regs);
+        state.flags = flags;
+        return state;
+    }
+
+
+    /// Returns true iff the instruction `in` transfers control in a way that
+    /// the liveness analysis can't see through, but isn't a CTI.
+    static bool is_opaque_instruction(instruction in) {
+        switch(in.op_code()) {
+        case dynamorio::OP_INVALID:
+        case dynamorio::OP_UNDECODED:
+        case dynamorio::OP_ud2a:
+        case dynamorio::OP_ud2b:
+        case dynamorio::OP_int:
+        case dynamorio::OP_int1:
+        case dynamorio::OP_int3:
+        case dynamorio::OP_into:
+        case dynamorio::OP_hlt:
+        case dynamorio::OP_syscall:
+        case dynamorio::OP_sysenter:
+        case dynamorio::OP_sysexit:
+        case dynamorio::OP_sysret:
+        case dynamorio::OP_swapgs:
+        case dynamorio::OP_iret:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+
+    /// Returns true iff the liveness of the code at `target_pc` can be
+    /// computed from its native code.
+    static bool is_analysable_target(app_pc target_pc) {
+        return target_pc
+            && unsafe_cast<app_pc>(&detach) != target_pc
+            && !is_code_cache_address(target_pc)
+            && !is_wrapper_address(target_pc)
+            && !find_detach_target(target_pc, RUNNING_AS_APP)
+            && !find_detach_target(target_pc, RUNNING_AS_HOST);
+    }
+
+
+    /// Returns the registers, in the format of `register_manager::encode`,
+    /// that `in` reads (`used_regs`) or writes without reading
+    /// (`defined_regs`).
+    static void find_used_regs(
+        instruction in,
+        uint32_t &used_regs,
+        uint32_t &defined_regs
+    ) {
+
+        // `register_manager::visit` conservatively revives everything at a
+        // CTI; here, the successors of CTIs are handled separately.
+        if(in.is_cti()) {
+            register_manager used;
+            used.kill_all();
+            used.revive_sources(in);
+            used_regs = used.encode();
+            defined_regs = 0;
+            return;
+        }
+
+        register_manager used;
+        used.kill_all();
+        used.visit(in);
+        used_regs = used.encode();
+
+        register_manager defined;
+        defined.revive_all();
+        defined.visit(in);
+        defined_regs = ~defined.encode();
+    }
+
+
+    /// Decode and summarise the native basic block beginning at `start_pc`.
+    static void summarise_block(app_pc start_pc, block_summary &block) {
+        memset(&block, 0, sizeof block);
+
+        app_pc pc(start_pc);
+        for(unsigned i(0); i < MAX_BLOCK_INSTRUCTIONS; ++i) {
+            instruction in(instruction::decode(&pc));
+
+            if(!pc || is_opaque_instruction(in)) {
+                block.exit_regs = ALL_REGS;
+                block.exit_flags = ALL_FLAGS;
+                return;
+            }
+
+            uint32_t used_regs(0);
+            uint32_t defined_regs(0);
+            find_used_regs(in, used_regs, defined_regs);
+
+            const unsigned eflags(dynamorio::instr_get_eflags(in));
+            const unsigned used_flags(eflags & EFLAGS_READ_ALL);
+            const unsigned defined_flags(
+                (eflags & EFLAGS_WRITE_ALL) >> EFLAGS_WRITE_TO_READ_SHIFT);
+
+            block.used_regs |= used_regs & ~block.defined_regs;
+            block.defined_regs |= defined_regs;
+            block.used_flags |= used_flags & ~block.defined_flags;
+            block.defined_flags |= defined_flags;
+
+            if(!in.is_cti()) {
+                continue;
+            }
+
+            const operand target(in.cti_target());
+
+            // Everything but the arithmetic flags is assumed to be live across
+            // CALLs, RETs, and indirect JMPs.
+            if(in.is_call() || in.is_return()
+            || dynamorio::PC_kind != target.kind) {
+                block.exit_regs = ALL_REGS;
+                block.exit_flags = ALL_FLAGS & ~ARITH_FLAGS;
+                return;
+            }
+
+            if(is_analysable_target(target.value.pc)) {
+                block.successors[block.num_successors++] = target.value.pc;
+            } else {
+                block.exit_regs = ALL_REGS;
+                block.exit_flags = ALL_FLAGS;
+            }
+
+            if(dynamorio::instr_is_cbr(in)) {
+                block.successors[block.num_successors++] = pc;
+            }
+
+            return;
+        }
+
+        // Long block; treat it as falling through to the next instruction.
+        block.successors[block.num_successors++] = pc;
+    }
+
+
+    /// Returns the index of the block beginning at `pc` in a region, or `-1`
+    /// if the block isn't in the region.
+    static int find_region_block(
+        const app_pc *region_pcs,
+        unsigned num_blocks,
+        app_pc pc
+    ) {
+        for(unsigned i(0); i < num_blocks; ++i) {
+            if(region_pcs[i] == pc) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+
+    /// Solve the liveness of the native basic blocks reachable from `pc`, and
+    /// cache the registers and flags live on entry to each of them.
+    static void analyse_region(app_pc pc, uint32_t &regs, unsigned &flags) {
+        app_pc region_pcs[MAX_REGION_BLOCKS];
+        block_summary blocks[MAX_REGION_BLOCKS];
+        uint32_t live_regs[MAX_REGION_BLOCKS];
+        unsigned live_flags[MAX_REGION_BLOCKS];
+
+        // Index of each successor's block in the region, or `-1` if the
+        // successor is outside of the region, in which case its live
+        // registers and flags are in `successor_regs` and `successor_flags`.
+        int successor_blocks[MAX_REGION_BLOCKS][2];
+        uint32_t successor_regs[MAX_REGION_BLOCKS][2];
+        unsigned successor_flags[MAX_REGION_BLOCKS][2];
+
+        // Discover the region in breadth-first order, stopping at blocks
+        // whose liveness is already known.
+        unsigned num_blocks(1);
+        region_pcs[0] = pc;
+        summarise_block(pc, blocks[0]);
+
+        for(unsigned i(0); i < num_blocks; ++i) {
+            for(unsigned s(0); s < blocks[i].num_successors; ++s) {
+                const app_pc succ_pc(blocks[i].successors[s]);
+                int succ_block(find_region_block(
+                    region_pcs, num_blocks, succ_pc));
+
+                successor_regs[i][s] = ALL_REGS;
+                successor_flags[i][s] = ALL_FLAGS;
+
+                if(0 > succ_block
+                && !load_live_state(
+                    succ_pc, successor_regs[i][s], successor_flags[i][s])
+                && num_blocks < MAX_REGION_BLOCKS) {
+                    succ_block = static_cast<int>(num_blocks);
+                    region_pcs[num_blocks] = succ_pc;
+                    summarise_block(succ_pc, blocks[num_blocks++]);
+                }
+
+                successor_blocks[i][s] = succ_block;
+            }
+        }
+
+        for(unsigned i(0); i < num_blocks; ++i) {
+            live_regs[i] = 0;
+            live_flags[i] = 0;
+        }
+
+        // Iterate to a fixed point. Live sets only grow, so this terminates.
+        for(bool changed(true); changed; ) {
+            changed = false;
+            for(unsigned i(num_blocks); i--; ) {
+                const block_summary &block(blocks[i]);
+                uint32_t out_regs(block.exit_regs);
+                unsigned out_flags(block.exit_flags);
+
+                for(unsigned s(0); s < block.num_successors; ++s) {
+                    const int succ_block(successor_blocks[i][s]);
+                    if(0 <= succ_block) {
+                        out_regs |= live_regs[succ_block];
+                        out_flags |= live_flags[succ_block];
+                    } else {
+                        out_regs |= successor_regs[i][s];
+                        out_flags |= successor_flags[i][s];
+                    }
+                }
+
+                const uint32_t in_regs(
+                    block.used_regs | (out_regs & ~block.defined_regs));
+                const unsigned in_flags(
+                    block.used_flags | (out_flags & ~block.defined_flags));
+
+                if(in_regs != live_regs[i] || in_flags != live_flags[i]) {
+                    live_regs[i] = in_regs;
+                    live_flags[i] = in_flags;
+                    changed = true;
+                }
+            }
+        }
+
+        for(unsigned i(0); i < num_blocks; ++i) {
+            store_live_state(region_pcs[i], live_regs[i], live_flags[i]);
+        }
+
+        regs = live_regs[0];
+        flags = live_flags[0];
+    }
+
+
+    /// Returns the registers and flags that are live on entry to the native
+    /// code at `pc`.
+    live_state find_live_state_before(app_pc pc) {
+#if CONFIG_OPTIMISE_INTER_BLOCK_LIVENESS
+        if(!is_analysable_target(pc)) {
+            return live_state();
+        }
+
+        uint32_t regs(ALL_REGS);
+        unsigned flags(ALL_FLAGS);
+        if(!load_live_state(pc, regs, flags)) {
+            analyse_region(pc, regs, flags);
+        }
+        return make_live_state(regs, flags);
+#else
+        UNUSED(pc);
+        return live_state();
+#endif
+    }
+
+
+    /// Returns the registers and flags that are live at the end of the native
+    /// basic block beginning at `start_pc`.
+    live_state find_live_state_after_block(app_pc start_pc) {
+#if CONFIG_OPTIMISE_INTER_BLOCK_LIVENESS
+        block_summary block;
+        summarise_block(start_pc, block);
+
+        live_state state;
+        if(ALL_REGS == block.exit_regs && ALL_FLAGS == block.exit_flags) {
+            return state;
+        }
+
+        state.regs.decode(block.exit_regs);
+        state.flags = block.exit_flags;
+
+        for(unsigned s(0); s < block.num_successors; ++s) {
+            const live_state succ_state(
+                find_live_state_before(block.successors[s]));
+            state.regs.revive_all(succ_state.regs);
+            state.flags |= succ_state.flags;
+        }
+        return state;
+#else
+        UNUSED(start_pc);
+        return live_state();
+#endif
+    }
+
+
+    /// Given `state`, the registers and flags that are live after `in`, update
+    /// `state` to be the registers and flags that are live before `in`.
+    void visit_live_state(instruction in, live_state &state) {
+        if(!in.is_cti()) {
+            if(is_opaque_instruction(in)) {
+                state = live_state();
+                return;
+            }
+
+            const unsigned eflags(dynamorio::instr_get_eflags(in));
+            state.regs.visit(in);
+            state.flags &= ~((eflags & EFLAGS_WRITE_ALL)
+                             >> EFLAGS_WRITE_TO_READ_SHIFT);
+            state.flags |= eflags & EFLAGS_READ_ALL;
+            return;
+        }
+
+        const operand target(in.cti_target());
+
+        // Jumps to labels, e.g. those introduced when translating LOOPs.
+        if(dynamorio::INSTR_kind == target.kind) {
+            state = live_state();
+            return;
+        }
+
+        if(in.is_call() || in.is_return()
+        || dynamorio::PC_kind != target.kind) {
+            state.regs.revive_all();
+            state.flags = ALL_FLAGS & ~ARITH_FLAGS;
+            return;
+        }
+
+        const live_state target_state(
+            find_live_state_before(target.value.pc));
+
+        if(dynamorio::instr_is_cbr(in)) {
+            state.regs.revive_all(target_state.regs);
+            state.flags |= target_state.flags;
+        } else {
+            state = target_state;
+        }
+
+        state.regs.revive_sources(in);
+        state.flags |= dynamorio::instr_get_eflags(in) & EFLAGS_READ_ALL;
+    }
+
+
+    /// Forget all cached liveness information.
+    void invalidate_live_states(void) {
+        LIVE_STATES_GENERATION.fetch_add(1);
+    }
+}
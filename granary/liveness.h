@@ -0,0 +1,68 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * liveness.h
+ *
+ *  Created on: 2026-10-17
+ *      Author: Peter Goodman
+ */
+
+#ifndef GRANARY_LIVENESS_H_
+#define GRANARY_LIVENESS_H_
+
+#include "granary/globals.h"
+#include "granary/instruction.h"
+#include "granary/register.h"
+
+namespace granary {
+
+
+    /// The registers and flags that are live at some point in the native code.
+    struct live_state {
+
+        /// Live general-purpose and XMM registers.
+        register_manager regs;
+
+        /// `EFLAGS_READ_*` bits of the live flags.
+        unsigned flags;
+
+        /// Initialise the state so that every register and flag is live.
+        live_state(void) ;
+    };
+
+
+    /// Returns the registers and flags that are live on entry to the native
+    /// code at `pc`. The liveness of the native basic blocks reachable from
+    /// `pc` through direct jumps and conditional branches is computed lazily
+    /// and cached.
+    live_state find_live_state_before(app_pc pc) ;
+
+
+    /// Returns the registers and flags that are live at the end of the native
+    /// basic block beginning at `start_pc`.
+    live_state find_live_state_after_block(app_pc start_pc) ;
+
+
+    /// Given `state`, the registers and flags that are live after `in`, update
+    /// `state` to be the registers and flags that are live before `in`.
+    /// Unlike `register_manager::visit`, this looks through direct CTIs into
+    /// the liveness of their native targets.
+    void visit_live_state(instruction in, live_state &state) ;
+
+
+    /// Given `regs`, the registers that are live after `in`, update `regs` to
+    /// be the registers that are live before `in`. This is a drop-in
+    /// replacement for `register_manager::visit` in backward passes over a
+    /// basic block.
+    inline void visit_live_registers(instruction in, register_manager &regs) {
+        live_state state;
+        state.regs = regs;
+        visit_live_state(in, state);
+        regs = state.regs;
+    }
+
+
+    /// Forget all cached liveness information.
+    void invalidate_live_states(void) ;
+}
+
+#endif /* GRANARY_LIVENESS_H_ */
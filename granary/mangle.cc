@@ -84,10 +84,16 @@ namespace granary {
             ibl.append(push_(reg::indirect_target_addr));
             stack_offset += sizeof(uintptr_t);
 
-        // Atomic swap, unfortunately, but we only expect this in user space,
-        // and it hits the stack so it should be free of contention.
+        // Swap the return address with `indirect_target_addr`. An `XCHG`
+        // with memory is implicitly locked, so swap through the stack
+        // instead. This is safe because the stack is thread-private, and
+        // because `POP` computes the address of `[RSP]` after incrementing
+        // `RSP`, so it overwrites the return address.
         } else {
-            ls.insert_before(cti, xchg_(*reg::rsp, reg::indirect_target_addr));
+            ls.insert_before(cti, push_(reg::indirect_target_addr));
+            ls.insert_before(cti, mov_ld_(
+                reg::indirect_target_addr, reg::rsp[sizeof(uintptr_t)]));
+            ls.insert_before(cti, pop_(*reg::rsp));
             target = reg::indirect_target_addr;
         }
 
@@ -285,7 +291,7 @@ namespace granary {
 
         } else {
             // Replace `in` with a DBL lookup stub.
-            insert_dbl_lookup_stub(ls, stub_ls, in, am);
+            insert_dbl_lookup_stub(ls, in, am);
             ls.remove(in);
         }
     }
@@ -313,6 +319,7 @@ namespace granary {
                 // TODO: handle RETn/RETf with a byte count.
                 ASSERT(dynamorio::IMMED_INTEGER_kind != in.instr->u.o.src0.kind);
 
+                IF_PERF( perf::visit_mangle_ibl_return(); )
                 mangle_ibl_lookup(in, target_policy, IBL_ENTRY_RETURN);
             }
 #endif
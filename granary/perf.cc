@@ -20,6 +20,14 @@
 #include "granary/detach.h"
 #include "granary/ibl.h"
 
+#if !CONFIG_ENV_KERNEL
+#   include "granary/user/posix/output_file.h"
+#   include <fcntl.h>
+#   include <stdlib.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#endif
+
 extern "C" {
     int sprintf(char *, const char *, ...);
 }
@@ -27,160 +35,311 @@ extern "C" {
 namespace granary {
 
 
-    /// Performance counters for tracking decoded instructions.
-    static std::atomic<unsigned> NUM_DECODED_INSTRUCTIONS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_DECODED_BYTES(ATOMIC_VAR_INIT(0U));
+    /// Statically allocated counters. In user space, these are replaced by a
+    /// shared memory mapping when Granary is initialised.
+    static perf_export STATIC_PERF_EXPORT;
 
 
-    /// Performance counters for tracking encoded instructions.
-    static std::atomic<unsigned> NUM_ENCODED_INSTRUCTIONS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_ENCODED_BYTES(ATOMIC_VAR_INIT(0U));
+    /// The exported counters.
+    static perf_export *PERF_EXPORT(&STATIC_PERF_EXPORT);
 
 
-    /// Performance counter for tracking basic blocks and their instructions.
-    static std::atomic<unsigned> NUM_TRACES(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_UNSPLITTABLE_BBS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_SPLIT_BBS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_TRACE_BBS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_BBS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_BB_INSTRUCTION_BYTES(ATOMIC_VAR_INIT(0U));
+    /// Describe the layout of the exported counters.
+    static void initialise_header(perf_export_header &header) {
+        header.magic = PERF_EXPORT_MAGIC;
+        header.version = PERF_EXPORT_VERSION;
+        header.num_counters = NUM_PERF_COUNTERS;
+        header.num_histograms = NUM_PERF_HISTOGRAMS;
+        header.num_histogram_buckets = NUM_PERF_HISTOGRAM_BUCKETS;
+        header.cpu_record_size = sizeof(perf_cpu_counters);
+        header.num_cpus = NUM_PERF_CPUS;
+    }
 
 
-    /// Performance counters for tracking different types of indirect CTIs.
-    static std::atomic<unsigned> NUM_INDIRECT_JMPS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_INDIRECT_CALLS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_RETURNS(ATOMIC_VAR_INIT(0U));
+#if !CONFIG_ENV_KERNEL
 
+    /// Used to give each thread its own counters.
+    static std::atomic<unsigned> NEXT_PERF_CPU(ATOMIC_VAR_INIT(0U));
 
-    /// Performance counters for tracking IBL, and DBL instruction counts.
-    static std::atomic<unsigned> NUM_IBL_INSTRUCTIONS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_IBL_ENTRY_INSTRUCTIONS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_IBL_EXIT_INSTRUCTIONS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_IBL_HTABLE_ENTRIES(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_IBL_MISSES(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_IBL_CONFLICTS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_DBL_STUBS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_FALL_THROUGH_DBL_STUBS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_COND_DBL_STUBS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_PATCHED_DBL_STUBS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_PATCHED_FALL_THROUGH_DBL_STUBS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_PATCHED_COND_DBL_STUBS(ATOMIC_VAR_INIT(0U));
 
+    /// The index (plus one) of this thread's counters.
+    static __thread unsigned PERF_CPU(0);
 
-    /// Track the number of functional units (as determined by the temporary
-    /// policy property). This can influence the trace allocator, if it's
-    /// enabled.
-    static std::atomic<unsigned> NUM_FUNCTIONAL_UNITS(ATOMIC_VAR_INIT(0U));
 
+    /// Path of the shared memory file of the exported counters.
+    static char PERF_EXPORT_PATH[MAX_OUTPUT_FILE_PATH_LENGTH] = {'\0'};
 
-    /// Performance counters for tracking instructions added in order to mangle
-    /// memory references.
-    static std::atomic<unsigned> NUM_MEM_REF_INSTRUCTIONS(ATOMIC_VAR_INIT(0U));
 
+    /// Remove the shared memory file when the process exits. Processes that
+    /// have already mapped the file can still read the final counters.
+    static void remove_perf_export(void) {
+        unlink(&(PERF_EXPORT_PATH[0]));
+    }
 
-    /// NOPs added to get specific alignments.
-    static std::atomic<unsigned> NUM_ALIGN_NOP_INSTRUCTIONS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_ALIGN_PREFIXES(ATOMIC_VAR_INIT(0U));
 
+    /// The exit hook is invoked by (instrumented) libc.
+    GRANARY_DETACH_POINT(remove_perf_export)
 
-    /// Tracking the number if code cache address lookups.
-    static std::atomic<unsigned> NUM_ADDRESS_LOOKUPS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_ADDRESS_LOOKUP_HITS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_ADDRESS_LOOKUPS_CPU_HIT(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_ADDRESS_LOOKUPS_CPU_MISS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned> NUM_ADDRESS_LOOKUPS_CPU_MISPREDICT(ATOMIC_VAR_INIT(0U));
 
+    /// Map the counters into a shared memory file so that they can be polled
+    /// by other processes. If this fails then the counters remain private to
+    /// this process.
+    STATIC_INITIALISE_ID(perf_export, {
+        const int fd(create_output_file(
+            PERF_EXPORT_PATH, "/dev/shm/granary-perf.", O_RDWR));
+        if(-1 == fd) {
+            return;
+        }
 
-#if CONFIG_ENV_KERNEL
-    static std::atomic<unsigned long> NUM_INTERRUPTS(ATOMIC_VAR_INIT(0UL));
-    static std::atomic<unsigned> NUM_RECURSIVE_INTERRUPTS(ATOMIC_VAR_INIT(0U));
-    static std::atomic<unsigned long> NUM_DELAYED_INTERRUPTS(ATOMIC_VAR_INIT(0UL));
-    static std::atomic<unsigned long> NUM_BAD_MODULE_EXECS(ATOMIC_VAR_INIT(0UL));
+        void *mem(MAP_FAILED);
+        if(0 == ftruncate(fd, sizeof(perf_export))) {
+            mem = mmap(nullptr, sizeof(perf_export), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+        }
+        close(fd);
 
-    static std::atomic<unsigned> NUM_CONTROLLED_INTERRUPTS(ATOMIC_VAR_INIT(0UL));
+        if(MAP_FAILED == mem) {
+            remove_perf_export();
+            return;
+        }
+
+        perf_export *shared_export(reinterpret_cast<perf_export *>(mem));
+        memcpy(shared_export, PERF_EXPORT, sizeof(perf_export));
+        initialise_header(shared_export->header);
+        PERF_EXPORT = shared_export;
+        atexit(&remove_perf_export);
+    });
+#else
+    extern "C" {
+        extern int kernel_get_cpu_id(void);
+    }
 #endif
 
 
+    /// Returns the counters of the current CPU (thread, in user space).
+    ///
+    /// Note: The counters are incremented atomically: in kernel space, the
+    ///       incrementing task might be preempted and migrated, and in user
+    ///       space, many threads might share counters. The increments don't
+    ///       contend in the common case, as each CPU has its own cache lines.
+    static inline perf_cpu_counters &cpu_counters(void) {
+#if CONFIG_ENV_KERNEL
+        const unsigned cpu(
+            static_cast<unsigned>(kernel_get_cpu_id()) % NUM_PERF_CPUS);
+#else
+        if(!PERF_CPU) {
+            PERF_CPU = (NEXT_PERF_CPU.fetch_add(1) % NUM_PERF_CPUS) + 1;
+        }
+        const unsigned cpu(PERF_CPU - 1);
+#endif
+        return PERF_EXPORT->cpus[cpu];
+    }
+
+
+    /// Add to a counter of the current CPU.
+    static inline void count(perf_counter counter, uint64_t num=1) {
+        __atomic_fetch_add(
+            &(cpu_counters().counters[counter]), num, __ATOMIC_RELAXED);
+    }
+
+
+    /// Add a sample to a histogram of the current CPU.
+    static void sample(perf_histogram histogram, uint64_t value) {
+        unsigned bucket(0);
+        if(value) {
+            bucket = 64 - __builtin_clzll(value);
+            if(NUM_PERF_HISTOGRAM_BUCKETS <= bucket) {
+                bucket = NUM_PERF_HISTOGRAM_BUCKETS - 1;
+            }
+        }
+        __atomic_fetch_add(
+            &(cpu_counters().histograms[histogram][bucket]), 1,
+            __ATOMIC_RELAXED);
+    }
+
+
+    /// Take a snapshot of the counters of all CPUs.
+    void perf::snapshot(perf_snapshot &snap) {
+        memset(&snap, 0, sizeof snap);
+        for(unsigned cpu(0); cpu < NUM_PERF_CPUS; ++cpu) {
+            const perf_cpu_counters &counters(PERF_EXPORT->cpus[cpu]);
+            for(unsigned i(0); i < NUM_PERF_COUNTERS; ++i) {
+                snap.counters[i] += __atomic_load_n(
+                    &(counters.counters[i]), __ATOMIC_RELAXED);
+            }
+            for(unsigned h(0); h < NUM_PERF_HISTOGRAMS; ++h) {
+                for(unsigned b(0); b < NUM_PERF_HISTOGRAM_BUCKETS; ++b) {
+                    snap.histograms[h][b] += __atomic_load_n(
+                        &(counters.histograms[h][b]), __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+
+
+    /// Returns the exported counters.
+    const perf_export *perf::exported(void) {
+        initialise_header(PERF_EXPORT->header);
+        return PERF_EXPORT;
+    }
+
+
     void perf::visit_address_lookup(void) {
-        NUM_ADDRESS_LOOKUPS.fetch_add(1);
+        count(PERF_ADDRESS_LOOKUPS);
     }
 
     void perf::visit_address_lookup_cpu(bool hit) {
         if(hit) {
-            NUM_ADDRESS_LOOKUPS_CPU_HIT.fetch_add(1);
+            count(PERF_ADDRESS_LOOKUPS_CPU_HIT);
         } else {
-            NUM_ADDRESS_LOOKUPS_CPU_MISS.fetch_add(1);
+            count(PERF_ADDRESS_LOOKUPS_CPU_MISS);
         }
     }
 
 
     void perf::visit_address_lookup_hit(void) {
-        NUM_ADDRESS_LOOKUP_HITS.fetch_add(1);
+        count(PERF_ADDRESS_LOOKUP_HITS);
+    }
+
+
+    void perf::visit_code_cache_flush(void) {
+        count(PERF_CODE_CACHE_FLUSHES);
+    }
+
+
+    void perf::visit_code_cache_invalidation(void) {
+        count(PERF_CODE_CACHE_INVALIDATIONS);
+    }
+
+
+    void perf::visit_reoptimised_block(void) {
+        count(PERF_REOPTIMISED_BLOCKS);
+    }
+
+
+    void perf::visit_hot_trace(void) {
+        count(PERF_HOT_TRACES);
+    }
+
+
+    void perf::visit_removed_reg_spills(unsigned num_regs) {
+        count(PERF_REMOVED_REG_SPILLS, num_regs);
+    }
+
+
+    void perf::visit_removed_flags_spill(void) {
+        count(PERF_REMOVED_FLAGS_SPILLS);
     }
 
 
     void perf::visit_decoded(const instruction in) {
         if(in.is_valid()) {
-            NUM_DECODED_INSTRUCTIONS.fetch_add(1);
-            NUM_DECODED_BYTES.fetch_add(in.instr->length);
+            count(PERF_DECODED_INSTRUCTIONS);
+            count(PERF_DECODED_BYTES, in.instr->length);
         }
     }
 
 
+    void perf::visit_decode_cache_hit(uint64_t num_cycles) {
+        count(PERF_DECODE_CACHE_HITS);
+        count(PERF_DECODE_CACHE_HIT_CYCLES, num_cycles);
+    }
+
+
+    void perf::visit_decode_cache_miss(uint64_t num_cycles) {
+        count(PERF_DECODE_CACHE_MISSES);
+        count(PERF_DECODE_CACHE_MISS_CYCLES, num_cycles);
+    }
+
+
     void perf::visit_encoded(const instruction in) {
         if(in.is_valid()) {
-            NUM_ENCODED_INSTRUCTIONS.fetch_add(1);
-            NUM_ENCODED_BYTES.fetch_add(in.instr->length);
+            count(PERF_ENCODED_INSTRUCTIONS);
+            count(PERF_ENCODED_BYTES, in.instr->length);
         }
     }
 
     void perf::visit_trace(unsigned num_bbs) {
-        NUM_BBS.fetch_add(num_bbs);
+        count(PERF_BBS, num_bbs);
 
         if(num_bbs > 1) {
-            NUM_TRACES.fetch_add(1);
-            NUM_TRACE_BBS.fetch_add(num_bbs);
+            count(PERF_TRACES);
+            count(PERF_TRACE_BBS, num_bbs);
         }
     }
 
 
+    void perf::visit_block(unsigned num_app_bytes, unsigned num_bytes) {
+        count(PERF_BB_INSTRUCTION_BYTES, num_app_bytes);
+        sample(PERF_HISTOGRAM_BLOCK_SIZE, num_bytes);
+    }
+
+
+    void perf::visit_translation(uint64_t num_cycles) {
+        count(PERF_TRANSLATIONS);
+        count(PERF_TRANSLATION_CYCLES, num_cycles);
+        sample(PERF_HISTOGRAM_TRANSLATION_CYCLES, num_cycles);
+    }
+
+
+    void perf::visit_persisted_install(uint64_t num_cycles) {
+        count(PERF_PERSISTED_INSTALLS);
+        count(PERF_PERSISTED_INSTALL_CYCLES, num_cycles);
+    }
+
+
+    void perf::visit_persisted_record(void) {
+        count(PERF_PERSISTED_RECORDS);
+    }
+
+
+    void perf::visit_persisted_reject(void) {
+        count(PERF_PERSISTED_REJECTS);
+    }
+
+
     void perf::visit_split_block(void) {
-        NUM_SPLIT_BBS.fetch_add(1);
+        count(PERF_SPLIT_BBS);
     }
 
 
     void perf::visit_unsplittable_block(void) {
-        NUM_UNSPLITTABLE_BBS.fetch_add(1);
+        count(PERF_UNSPLITTABLE_BBS);
     }
 
 
     void perf::visit_mangle_indirect_jmp(void) {
-        NUM_INDIRECT_JMPS.fetch_add(1);
+        count(PERF_INDIRECT_JMPS);
     }
 
 
     void perf::visit_mangle_indirect_call(void) {
-        NUM_INDIRECT_CALLS.fetch_add(1);
+        count(PERF_INDIRECT_CALLS);
     }
 
 
     void perf::visit_mangle_return(void) {
-        NUM_RETURNS.fetch_add(1);
+        count(PERF_RETURNS);
+    }
+
+
+    void perf::visit_mangle_ibl_return(void) {
+        count(PERF_IBL_RETURNS);
     }
 
 
     void perf::visit_ibl(const instruction_list &ls) {
-        NUM_IBL_INSTRUCTIONS.fetch_add(ls.length());
+        count(PERF_IBL_INSTRUCTIONS, ls.length());
     }
 
 
     void perf::visit_ibl_stub(unsigned num_instructions) {
-        NUM_IBL_ENTRY_INSTRUCTIONS.fetch_add(num_instructions);
+        count(PERF_IBL_ENTRY_INSTRUCTIONS, num_instructions);
     }
 
 
-    void perf::visit_ibl_exit(const instruction_list &ls) {
-        NUM_IBL_EXIT_INSTRUCTIONS.fetch_add(ls.length());
+    void perf::visit_ibl_exit(unsigned num_instructions) {
+        count(PERF_IBL_EXIT_INSTRUCTIONS, num_instructions);
     }
 
     struct ibl_entry {
@@ -195,14 +354,17 @@ namespace granary {
         {nullptr}
     };
 
+    static std::atomic<unsigned> NEXT_IBL_TARGET(ATOMIC_VAR_INIT(0U));
+
     static std::atomic<uint8_t> IB_USE_COUNT[
         NUM_IBL_JUMP_TABLE_ENTRIES
     ] = {ATOMIC_VAR_INIT(0)};
 
 
     void perf::visit_ibl_add_entry(app_pc pc) {
-        const unsigned i(NUM_IBL_HTABLE_ENTRIES.fetch_add(1));
+        count(PERF_IBL_HTABLE_ENTRIES);
 
+        const unsigned i(NEXT_IBL_TARGET.fetch_add(1));
         if(i < NUM_IBL_PROFILE_ENTRIES) {
             IBL_TARGETS[i].target = pc;
         }
@@ -211,93 +373,130 @@ namespace granary {
 
 
     void perf::visit_ibl_miss(app_pc) {
-        NUM_IBL_MISSES.fetch_add(1);
+        count(PERF_IBL_MISSES);
     }
 
 
     void perf::visit_ibl_conflict(app_pc) {
-        NUM_IBL_CONFLICTS.fetch_add(1);
+        count(PERF_IBL_CONFLICTS);
+    }
+
+
+    void perf::visit_ibl_probe(unsigned num_probes) {
+        sample(PERF_HISTOGRAM_IBL_PROBE_LENGTH, num_probes);
     }
 
 
     void perf::visit_dbl_stub(void) {
-        NUM_DBL_STUBS.fetch_add(1);
+        count(PERF_DBL_STUBS);
     }
 
 
     void perf::visit_fall_through_dbl(void) {
-        NUM_FALL_THROUGH_DBL_STUBS.fetch_add(1);
+        count(PERF_FALL_THROUGH_DBL_STUBS);
     }
 
 
     void perf::visit_conditional_dbl(void) {
-        NUM_COND_DBL_STUBS.fetch_add(1);
+        count(PERF_COND_DBL_STUBS);
     }
 
 
     void perf::visit_patched_dbl(void) {
-        NUM_PATCHED_DBL_STUBS.fetch_add(1);
+        count(PERF_PATCHED_DBL_STUBS);
     }
 
 
     void perf::visit_patched_fall_through_dbl(void) {
-        NUM_PATCHED_FALL_THROUGH_DBL_STUBS.fetch_add(1);
+        count(PERF_PATCHED_FALL_THROUGH_DBL_STUBS);
     }
 
 
     void perf::visit_patched_conditional_dbl(void) {
-        NUM_PATCHED_COND_DBL_STUBS.fetch_add(1);
+        count(PERF_PATCHED_COND_DBL_STUBS);
+    }
+
+
+    void perf::visit_speculated_dbl(unsigned num_bytes) {
+        count(PERF_SPECULATED_DBLS);
+        count(PERF_SPECULATED_BYTES, num_bytes);
+    }
+
+
+    void perf::visit_dropped_speculation(void) {
+        count(PERF_DROPPED_SPECULATIONS);
+    }
+
+
+    void perf::visit_allocated_thread_state(void) {
+        count(PERF_ALLOCATED_THREAD_STATES);
+    }
+
+
+    void perf::visit_adopted_thread_state(void) {
+        count(PERF_ADOPTED_THREAD_STATES);
+    }
+
+
+    void perf::visit_parked_thread_state(void) {
+        count(PERF_PARKED_THREAD_STATES);
     }
 
 
 
     void perf::visit_mem_ref(unsigned num) {
-        NUM_MEM_REF_INSTRUCTIONS.fetch_add(num);
+        count(PERF_MEM_REF_INSTRUCTIONS, num);
     }
 
 
     void perf::visit_align_nop(unsigned num) {
-        NUM_ALIGN_NOP_INSTRUCTIONS.fetch_add(num);
+        count(PERF_ALIGN_NOP_INSTRUCTIONS, num);
     }
 
 
     void perf::visit_align_prefix(void) {
-        NUM_ALIGN_PREFIXES.fetch_add(1);
+        count(PERF_ALIGN_PREFIXES);
     }
 
 
     void perf::visit_functional_unit(void) {
-        NUM_FUNCTIONAL_UNITS.fetch_add(1);
+        count(PERF_FUNCTIONAL_UNITS);
     }
 
 
 #if CONFIG_ENV_KERNEL
 
     void perf::visit_takeover_interrupt(void) {
-        NUM_CONTROLLED_INTERRUPTS.fetch_add(1);
+        count(PERF_CONTROLLED_INTERRUPTS);
     }
 
 
     void perf::visit_interrupt(void) {
-        NUM_INTERRUPTS.fetch_add(1);
+        count(PERF_INTERRUPTS);
     }
 
     void perf::visit_delayed_interrupt(void) {
-        NUM_DELAYED_INTERRUPTS.fetch_add(1);
+        count(PERF_DELAYED_INTERRUPTS);
     }
 
 
     void perf::visit_recursive_interrupt(void) {
-        NUM_RECURSIVE_INTERRUPTS.fetch_add(1);
+        count(PERF_RECURSIVE_INTERRUPTS);
     }
 
 
     unsigned long perf::num_delayed_interrupts(void) {
-        return NUM_DELAYED_INTERRUPTS.load();
+        unsigned long num(0);
+        for(unsigned cpu(0); cpu < NUM_PERF_CPUS; ++cpu) {
+            num += __atomic_load_n(
+                &(PERF_EXPORT->cpus[cpu].counters[PERF_DELAYED_INTERRUPTS]),
+                __ATOMIC_RELAXED);
+        }
+        return num;
     }
 
     void perf::visit_protected_module(void) {
-        NUM_BAD_MODULE_EXECS.fetch_add(1);
+        count(PERF_BAD_MODULE_EXECS);
     }
 #endif
 
@@ -309,97 +508,246 @@ namespace granary {
 #   define printf printk
 #endif
 
+    /// Print the non-empty buckets of a histogram.
+    static void report_histogram(const char *name, const uint64_t *buckets) {
+        printf("%s:\n", name);
+        for(unsigned b(0); b < NUM_PERF_HISTOGRAM_BUCKETS; ++b) {
+            if(!buckets[b]) {
+                continue;
+            }
+            const uint64_t low(b ? (1UL << (b - 1)) : 0UL);
+            const uint64_t high(b ? ((1UL << b) - 1) : 0UL);
+            printf("    [%lu, %lu]: %lu\n", low, high, buckets[b]);
+        }
+    }
+
     void perf::report(void) {
+        static perf_snapshot snap;
+        snapshot(snap);
+
+        printf("Number of decoded instructions: %lu\n",
+            snap.counters[PERF_DECODED_INSTRUCTIONS]);
+        printf("Number of decoded instruction bytes: %lu\n",
+            snap.counters[PERF_DECODED_BYTES]);
+
+        // Estimate the time saved by the decode cache as the time that the
+        // hits would have taken had they been misses, less the time that
+        // they actually took.
+        const uint64_t num_decode_hits(snap.counters[PERF_DECODE_CACHE_HITS]);
+        const uint64_t num_decode_misses(
+            snap.counters[PERF_DECODE_CACHE_MISSES]);
+        const uint64_t hit_cycles(snap.counters[PERF_DECODE_CACHE_HIT_CYCLES]);
+        const uint64_t miss_cycles(
+            snap.counters[PERF_DECODE_CACHE_MISS_CYCLES]);
+        uint64_t saved_cycles(0);
+        if(num_decode_misses) {
+            const uint64_t hits_as_misses(
+                (miss_cycles / num_decode_misses) * num_decode_hits);
+            if(hits_as_misses > hit_cycles) {
+                saved_cycles = hits_as_misses - hit_cycles;
+            }
+        }
+        printf("Number of decode cache hits/misses: %lu/%lu\n",
+            num_decode_hits, num_decode_misses);
+        printf("Average cycles per decode cache hit/miss: %lu/%lu\n",
+            num_decode_hits ? (hit_cycles / num_decode_hits) : 0UL,
+            num_decode_misses ? (miss_cycles / num_decode_misses) : 0UL);
+        printf("Estimated cycles saved by the decode cache: %lu\n\n",
+            saved_cycles);
+
+        printf("Number of encoded instructions: %lu\n",
+            snap.counters[PERF_ENCODED_INSTRUCTIONS]);
+        printf("Number of encoded instruction bytes: %lu\n\n",
+            snap.counters[PERF_ENCODED_BYTES]);
+
+        printf("Number of traces: %lu\n",
+            snap.counters[PERF_TRACES]);
+        printf("Number of basics blocks in traces: %lu\n",
+            snap.counters[PERF_TRACE_BBS]);
+        printf("Number of basic blocks: %lu\n",
+            snap.counters[PERF_BBS]);
+        printf("Number of split basic blocks: %lu\n",
+            snap.counters[PERF_SPLIT_BBS]);
+        printf("Number of non-splittable basic blocks: %lu\n",
+            snap.counters[PERF_UNSPLITTABLE_BBS]);
+        printf("Number of functional units: %lu\n",
+            snap.counters[PERF_FUNCTIONAL_UNITS]);
+        printf("Number of application instruction bytes: %lu\n\n",
+            snap.counters[PERF_BB_INSTRUCTION_BYTES]);
+
+        const uint64_t num_translations(snap.counters[PERF_TRANSLATIONS]);
+        const uint64_t num_installs(snap.counters[PERF_PERSISTED_INSTALLS]);
+        printf("Number of translated/installed traces: %lu/%lu\n",
+            num_translations, num_installs);
+        printf("Average cycles per trace translation/install: %lu/%lu\n",
+            num_translations ?
+                (snap.counters[PERF_TRANSLATION_CYCLES] / num_translations) :
+                0UL,
+            num_installs ?
+                (snap.counters[PERF_PERSISTED_INSTALL_CYCLES] / num_installs) :
+                0UL);
+        printf("Number of persisted/rejected traces: %lu/%lu\n\n",
+            snap.counters[PERF_PERSISTED_RECORDS],
+            snap.counters[PERF_PERSISTED_REJECTS]);
+
+        printf("Number of indirect JMPs: %lu\n",
+            snap.counters[PERF_INDIRECT_JMPS]);
+        printf("Number of indirect CALLs: %lu\n",
+            snap.counters[PERF_INDIRECT_CALLS]);
+        printf("Number of RETs: %lu\n",
+            snap.counters[PERF_RETURNS]);
+        printf("Number of RETs that go through the IBL: %lu\n\n",
+            snap.counters[PERF_IBL_RETURNS]);
+
+        printf("Number of entries in the global IBL hash table: %lu\n",
+            snap.counters[PERF_IBL_HTABLE_ENTRIES]);
+        printf("Number of misses in the IBL hash/jump table: %lu\n",
+            snap.counters[PERF_IBL_MISSES]);
+        printf("Number of conflicts in the IBL hash/jump table: %lu\n",
+            snap.counters[PERF_IBL_CONFLICTS]);
+
+        ibl_bucket_stats total_stats = {0, 0, 0};
+        ibl_bucket_stats max_stats = {0, 0, 0};
+        unsigned max_conflict_bucket(0);
+        const unsigned num_buckets(ibl_num_buckets());
+        for(unsigned i(0); i < num_buckets; ++i) {
+            ibl_bucket_stats stats;
+            if(!ibl_get_bucket_stats(i, stats)) {
+                break;
+            }
+            total_stats.num_hits += stats.num_hits;
+            total_stats.num_misses += stats.num_misses;
+            total_stats.num_conflicts += stats.num_conflicts;
+            if(stats.num_conflicts > max_stats.num_conflicts) {
+                max_stats = stats;
+                max_conflict_bucket = i;
+            }
+        }
 
-        printf("Number of decoded instructions: %u\n",
-            NUM_DECODED_INSTRUCTIONS.load());
-        printf("Number of decoded instruction bytes: %u\n\n",
-            NUM_DECODED_BYTES.load());
-
-        printf("Number of encoded instructions: %u\n",
-            NUM_ENCODED_INSTRUCTIONS.load());
-        printf("Number of encoded instruction bytes: %u\n\n",
-            NUM_ENCODED_BYTES.load());
-
-        printf("Number of traces: %u\n",
-            NUM_TRACES.load());
-        printf("Number of basics blocks in traces: %u\n",
-            NUM_TRACE_BBS.load());
-        printf("Number of basic blocks: %u\n",
-            NUM_BBS.load());
-        printf("Number of split basic blocks: %u\n",
-            NUM_SPLIT_BBS.load());
-        printf("Number of non-splittable basic blocks: %u\n",
-            NUM_UNSPLITTABLE_BBS.load());
-        printf("Number of functional units: %u\n",
-            NUM_FUNCTIONAL_UNITS.load());
-        printf("Number of application instruction bytes: %u\n\n",
-            NUM_BB_INSTRUCTION_BYTES.load());
-
-        printf("Number of indirect JMPs: %u\n",
-            NUM_INDIRECT_JMPS.load());
-        printf("Number of indirect CALLs: %u\n",
-            NUM_INDIRECT_CALLS.load());
-        printf("Number of RETs: %u\n\n",
-            NUM_RETURNS.load());
-
-        printf("Number of entries in the global IBL hash table: %u\n",
-            NUM_IBL_HTABLE_ENTRIES.load());
-        printf("Number of misses in the IBL hash/jump table: %u\n",
-            NUM_IBL_MISSES.load());
-        printf("Number of conflicts in the IBL hash/jump table: %u\n\n",
-            NUM_IBL_CONFLICTS.load());
-
-        printf("Number of IBL entry instructions: %u\n",
-            NUM_IBL_ENTRY_INSTRUCTIONS.load());
-        printf("Number of IBL instructions: %u\n",
-            NUM_IBL_INSTRUCTIONS.load());
-        printf("Number of IBL exit instructions: %u\n\n",
-            NUM_IBL_EXIT_INSTRUCTIONS.load());
+        printf("Number of buckets in the IBL jump table: %u\n", num_buckets);
+        printf("Number of IBL bucket hits/misses/conflicts: %lu/%lu/%lu\n",
+            total_stats.num_hits,
+            total_stats.num_misses,
+            total_stats.num_conflicts);
+        printf("Most conflicted IBL bucket: %u (%lu/%lu/%lu)\n\n",
+            max_conflict_bucket,
+            max_stats.num_hits,
+            max_stats.num_misses,
+            max_stats.num_conflicts);
+
+        printf("Number of IBL entry instructions: %lu\n",
+            snap.counters[PERF_IBL_ENTRY_INSTRUCTIONS]);
+        printf("Number of IBL instructions: %lu\n",
+            snap.counters[PERF_IBL_INSTRUCTIONS]);
+        printf("Number of IBL exit instructions: %lu\n\n",
+            snap.counters[PERF_IBL_EXIT_INSTRUCTIONS]);
 
         // TODO!
 
-        printf("Number of DBL stubs: %u\n",
-            NUM_DBL_STUBS.load());
-        printf("Number of fall-through DBL stubs: %u\n",
-            NUM_FALL_THROUGH_DBL_STUBS.load());
-        printf("Number of conditional branches: %u\n",
-            NUM_COND_DBL_STUBS.load());
-        printf("Number of patched branches: %u\n",
-            NUM_PATCHED_DBL_STUBS.load());
-        printf("Number of patched conditional branches: %u\n",
-            NUM_PATCHED_COND_DBL_STUBS.load());
-        printf("Number of patched fall-through branches: %u\n\n",
-            NUM_PATCHED_FALL_THROUGH_DBL_STUBS.load());
-
-        printf("Number of extra instructions to mangle memory refs: %u\n\n",
-            NUM_MEM_REF_INSTRUCTIONS.load());
-
-        printf("Number of alignment NOPs: %u\n",
-            NUM_ALIGN_NOP_INSTRUCTIONS.load());
-        printf("Number of alignment prefixes: %u\n\n",
-            NUM_ALIGN_PREFIXES.load());
-
-        printf("Number of global code cache address lookups: %u\n",
-            NUM_ADDRESS_LOOKUPS.load());
-        printf("Number hits in the global code cache: %u\n",
-            NUM_ADDRESS_LOOKUP_HITS.load());
-        printf("Number hits in the cpu private code cache(s): %u\n",
-            NUM_ADDRESS_LOOKUPS_CPU_HIT.load());
-        printf("Number misses in the cpu code cache(s): %u\n\n",
-            NUM_ADDRESS_LOOKUPS_CPU_MISS.load());
+        printf("Number of DBL stubs: %lu\n",
+            snap.counters[PERF_DBL_STUBS]);
+        printf("Number of fall-through DBL stubs: %lu\n",
+            snap.counters[PERF_FALL_THROUGH_DBL_STUBS]);
+        printf("Number of conditional branches: %lu\n",
+            snap.counters[PERF_COND_DBL_STUBS]);
+        printf("Number of patched branches: %lu\n",
+            snap.counters[PERF_PATCHED_DBL_STUBS]);
+        printf("Number of patched conditional branches: %lu\n",
+            snap.counters[PERF_PATCHED_COND_DBL_STUBS]);
+        printf("Number of patched fall-through branches: %lu\n",
+            snap.counters[PERF_PATCHED_FALL_THROUGH_DBL_STUBS]);
+        printf("Number of speculatively patched/dropped branches: %lu/%lu\n",
+            snap.counters[PERF_SPECULATED_DBLS],
+            snap.counters[PERF_DROPPED_SPECULATIONS]);
+        printf("Number of speculatively translated bytes: %lu\n\n",
+            snap.counters[PERF_SPECULATED_BYTES]);
+
+        printf("Number of extra instructions to mangle memory refs: %lu\n\n",
+            snap.counters[PERF_MEM_REF_INSTRUCTIONS]);
+
+        printf("Number of alignment NOPs: %lu\n",
+            snap.counters[PERF_ALIGN_NOP_INSTRUCTIONS]);
+        printf("Number of alignment prefixes: %lu\n\n",
+            snap.counters[PERF_ALIGN_PREFIXES]);
+
+        printf("Number of global code cache address lookups: %lu\n",
+            snap.counters[PERF_ADDRESS_LOOKUPS]);
+        printf("Number hits in the global code cache: %lu\n",
+            snap.counters[PERF_ADDRESS_LOOKUP_HITS]);
+        printf("Number hits in the cpu private code cache(s): %lu\n",
+            snap.counters[PERF_ADDRESS_LOOKUPS_CPU_HIT]);
+        printf("Number misses in the cpu code cache(s): %lu\n",
+            snap.counters[PERF_ADDRESS_LOOKUPS_CPU_MISS]);
+        printf("Number of code cache flushes: %lu\n",
+            snap.counters[PERF_CODE_CACHE_FLUSHES]);
+        printf("Number of invalidated ranges of translated code: %lu\n",
+            snap.counters[PERF_CODE_CACHE_INVALIDATIONS]);
+        printf("Number of re-optimised hot blocks: %lu\n",
+            snap.counters[PERF_REOPTIMISED_BLOCKS]);
+        printf("Number of hot traces: %lu\n",
+            snap.counters[PERF_HOT_TRACES]);
+        printf("Number of register spills removed by liveness: %lu\n",
+            snap.counters[PERF_REMOVED_REG_SPILLS]);
+        printf("Number of flags spills removed by liveness: %lu\n",
+            snap.counters[PERF_REMOVED_FLAGS_SPILLS]);
+        printf("Number of code cache bytes in use: %lu\n\n",
+            detail::code_cache_bytes_in_use());
+
+#if !CONFIG_ENV_KERNEL
+        const uint64_t num_allocated_states(
+            snap.counters[PERF_ALLOCATED_THREAD_STATES]);
+        const uint64_t num_adopted_states(
+            snap.counters[PERF_ADOPTED_THREAD_STATES]);
+        const uint64_t num_parked_states(
+            snap.counters[PERF_PARKED_THREAD_STATES]);
+        printf("Number of allocated/adopted/parked thread states: "
+            "%lu/%lu/%lu\n",
+            num_allocated_states, num_adopted_states, num_parked_states);
+        printf("Number of live/recycled thread states: %lu/%lu\n\n",
+            num_allocated_states + num_adopted_states - num_parked_states,
+            num_parked_states - num_adopted_states);
+#endif
+
+        static detail::heap_statistics heap_stats;
+        detail::get_heap_statistics(heap_stats);
+        uint64_t num_slab_bytes(0);
+        uint64_t num_live_bytes(0);
+        uint64_t num_requested_bytes(0);
+        for(unsigned i(0); i < detail::NUM_HEAP_SIZE_CLASSES; ++i) {
+            const detail::heap_class_statistics &class_stats(
+                heap_stats.classes[i]);
+            num_slab_bytes += class_stats.num_slab_bytes;
+            num_live_bytes += class_stats.num_live_objects
+                            * class_stats.object_size;
+            num_requested_bytes += class_stats.num_requested_bytes;
+        }
+        printf("Number of heap bytes used: %lu\n",
+            heap_stats.num_heap_bytes);
+        printf("Number of heap slab bytes: %lu\n", num_slab_bytes);
+        printf("Number of live small heap object bytes: %lu (%lu requested)\n",
+            num_live_bytes, num_requested_bytes);
+        printf("Number of live large heap object bytes: %lu\n\n",
+            heap_stats.num_large_object_bytes);
+
+        report_histogram("Code cache bytes per basic block",
+            snap.histograms[PERF_HISTOGRAM_BLOCK_SIZE]);
+        report_histogram("IBL jump table ways probed per entry",
+            snap.histograms[PERF_HISTOGRAM_IBL_PROBE_LENGTH]);
+        report_histogram("Cycles per trace translation",
+            snap.histograms[PERF_HISTOGRAM_TRANSLATION_CYCLES]);
+        printf("\n");
 
 #if CONFIG_ENV_KERNEL
         printf("Number of interrupts: %lu\n",
-            NUM_INTERRUPTS.load());
+            snap.counters[PERF_INTERRUPTS]);
         printf("Number of taken over interrupt vectors: %lu\n",
-            NUM_CONTROLLED_INTERRUPTS.load());
+            snap.counters[PERF_CONTROLLED_INTERRUPTS]);
         printf("Number of delayed interrupts: %lu\n",
-            NUM_DELAYED_INTERRUPTS.load());
-        printf("Number of recursive interrupts (these are bad): %u\n",
-            NUM_RECURSIVE_INTERRUPTS.load());
+            snap.counters[PERF_DELAYED_INTERRUPTS]);
+        printf("Number of recursive interrupts (these are bad): %lu\n",
+            snap.counters[PERF_RECURSIVE_INTERRUPTS]);
         printf("Number of interrupts due to insufficient wrapping: %lu\n\n",
-            NUM_BAD_MODULE_EXECS.load());
+            snap.counters[PERF_BAD_MODULE_EXECS]);
 #endif
     }
 }
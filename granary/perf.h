@@ -21,26 +21,189 @@ namespace granary {
     struct instruction_list;
     struct basic_block;
 
+
+    /// Performance counters.
+    enum perf_counter {
+        PERF_DECODED_INSTRUCTIONS,
+        PERF_DECODED_BYTES,
+        PERF_DECODE_CACHE_HITS,
+        PERF_DECODE_CACHE_MISSES,
+        PERF_DECODE_CACHE_HIT_CYCLES,
+        PERF_DECODE_CACHE_MISS_CYCLES,
+        PERF_ENCODED_INSTRUCTIONS,
+        PERF_ENCODED_BYTES,
+        PERF_TRACES,
+        PERF_UNSPLITTABLE_BBS,
+        PERF_SPLIT_BBS,
+        PERF_TRACE_BBS,
+        PERF_BBS,
+        PERF_BB_INSTRUCTION_BYTES,
+        PERF_INDIRECT_JMPS,
+        PERF_INDIRECT_CALLS,
+        PERF_RETURNS,
+        PERF_IBL_RETURNS,
+        PERF_IBL_INSTRUCTIONS,
+        PERF_IBL_ENTRY_INSTRUCTIONS,
+        PERF_IBL_EXIT_INSTRUCTIONS,
+        PERF_IBL_HTABLE_ENTRIES,
+        PERF_IBL_MISSES,
+        PERF_IBL_CONFLICTS,
+        PERF_DBL_STUBS,
+        PERF_FALL_THROUGH_DBL_STUBS,
+        PERF_COND_DBL_STUBS,
+        PERF_PATCHED_DBL_STUBS,
+        PERF_PATCHED_FALL_THROUGH_DBL_STUBS,
+        PERF_PATCHED_COND_DBL_STUBS,
+        PERF_FUNCTIONAL_UNITS,
+        PERF_MEM_REF_INSTRUCTIONS,
+        PERF_ALIGN_NOP_INSTRUCTIONS,
+        PERF_ALIGN_PREFIXES,
+        PERF_ADDRESS_LOOKUPS,
+        PERF_ADDRESS_LOOKUP_HITS,
+        PERF_ADDRESS_LOOKUPS_CPU_HIT,
+        PERF_ADDRESS_LOOKUPS_CPU_MISS,
+        PERF_CODE_CACHE_FLUSHES,
+        PERF_CODE_CACHE_INVALIDATIONS,
+        PERF_REOPTIMISED_BLOCKS,
+        PERF_HOT_TRACES,
+        PERF_REMOVED_REG_SPILLS,
+        PERF_REMOVED_FLAGS_SPILLS,
+        PERF_INTERRUPTS,
+        PERF_RECURSIVE_INTERRUPTS,
+        PERF_DELAYED_INTERRUPTS,
+        PERF_BAD_MODULE_EXECS,
+        PERF_CONTROLLED_INTERRUPTS,
+        PERF_TRANSLATIONS,
+        PERF_TRANSLATION_CYCLES,
+        PERF_PERSISTED_INSTALLS,
+        PERF_PERSISTED_INSTALL_CYCLES,
+        PERF_PERSISTED_RECORDS,
+        PERF_PERSISTED_REJECTS,
+        PERF_SPECULATED_DBLS,
+        PERF_SPECULATED_BYTES,
+        PERF_DROPPED_SPECULATIONS,
+        PERF_ALLOCATED_THREAD_STATES,
+        PERF_ADOPTED_THREAD_STATES,
+        PERF_PARKED_THREAD_STATES,
+
+        NUM_PERF_COUNTERS
+    };
+
+
+    /// Performance histograms. Bucket `0` counts zero-valued samples, and
+    /// bucket `i > 0` counts samples in the range `[2^(i-1), 2^i)`.
+    enum perf_histogram {
+
+        /// Number of code cache bytes of each translated basic block.
+        PERF_HISTOGRAM_BLOCK_SIZE,
+
+        /// Number of ways of an IBL jump table bucket that are probed when
+        /// adding an entry, including the clock hand's steps on eviction.
+        PERF_HISTOGRAM_IBL_PROBE_LENGTH,
+
+        /// Number of cycles taken to translate a trace.
+        PERF_HISTOGRAM_TRANSLATION_CYCLES,
+
+        NUM_PERF_HISTOGRAMS
+    };
+
+
+    enum {
+        NUM_PERF_HISTOGRAM_BUCKETS = 32,
+
+        /// Maximum number of CPUs (threads, in user space) that have their own
+        /// counters. Beyond this, threads share counters.
+        NUM_PERF_CPUS = IF_USER_ELSE(64, 256),
+
+        PERF_EXPORT_MAGIC = 0x46525047, // "GPRF"
+        PERF_EXPORT_VERSION = 10
+    };
+
+
+    /// The counters of one CPU. These are only ever incremented by the CPU
+    /// that owns them, so that incrementing a counter never bounces a cache
+    /// line between CPUs. The counters of all CPUs are summed when read.
+    struct perf_cpu_counters {
+        uint64_t counters[NUM_PERF_COUNTERS];
+        uint64_t histograms[NUM_PERF_HISTOGRAMS][NUM_PERF_HISTOGRAM_BUCKETS];
+    } __attribute__((aligned (CONFIG_ARCH_CACHE_LINE_SIZE)));
+
+
+    /// Describes the layout of exported counters.
+    struct perf_export_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t num_counters;
+        uint32_t num_histograms;
+        uint32_t num_histogram_buckets;
+        uint32_t cpu_record_size;
+
+        /// Number of per-CPU records that follow the header.
+        uint32_t num_cpus;
+    } __attribute__((aligned (CONFIG_ARCH_CACHE_LINE_SIZE)));
+
+
+    /// Exported counters. In kernel space, these are readable through the
+    /// `granary_perf` file in debugfs. In user space, these live in the shared
+    /// memory file `/dev/shm/granary-perf.<pid>` (with the PID zero-padded to
+    /// ten digits), which another process of the same user can map and poll
+    /// while Granary runs. The file is removed when the process exits, and
+    /// the counters aren't exported if the file already exists. Readers sum
+    /// the per-CPU records themselves.
+    struct perf_export {
+        perf_export_header header;
+        perf_cpu_counters cpus[NUM_PERF_CPUS];
+    };
+
+
+    /// A snapshot of the performance counters, summed across all CPUs.
+    typedef perf_cpu_counters perf_snapshot;
+
+
     struct perf {
 
+        /// Take a snapshot of the performance counters. The snapshot is
+        /// approximate if other CPUs are concurrently updating counters.
+        static void snapshot(perf_snapshot &) ;
+
+        /// Returns the exported counters.
+        static const perf_export *exported(void) ;
+
+        /// Returns the current time stamp counter, for timing operations.
+        static inline uint64_t timestamp(void) {
+            uint32_t lo(0);
+            uint32_t hi(0);
+            ASM("rdtsc;" : "=a"(lo), "=d"(hi));
+            return (static_cast<uint64_t>(hi) << 32) | lo;
+        }
+
         static void visit_trace(unsigned num_bbs) ;
+        static void visit_block(unsigned num_app_bytes, unsigned num_bytes) ;
+        static void visit_translation(uint64_t num_cycles) ;
+        static void visit_persisted_install(uint64_t num_cycles) ;
+        static void visit_persisted_record(void) ;
+        static void visit_persisted_reject(void) ;
         static void visit_split_block(void) ;
         static void visit_unsplittable_block(void) ;
 
         static void visit_decoded(const instruction ) ;
+        static void visit_decode_cache_hit(uint64_t num_cycles) ;
+        static void visit_decode_cache_miss(uint64_t num_cycles) ;
         static void visit_encoded(const instruction ) ;
 
         static void visit_mangle_indirect_jmp(void) ;
         static void visit_mangle_indirect_call(void) ;
         static void visit_mangle_return(void) ;
+        static void visit_mangle_ibl_return(void) ;
 
         static void visit_ibl_stub(unsigned) ;
         static void visit_ibl(const instruction_list &) ;
-        static void visit_ibl_exit(const instruction_list &) ;
+        static void visit_ibl_exit(unsigned num_instructions) ;
 
         static void visit_ibl_add_entry(app_pc) ;
         static void visit_ibl_miss(app_pc) ;
         static void visit_ibl_conflict(app_pc) ;
+        static void visit_ibl_probe(unsigned num_probes) ;
 
         static void visit_dbl_stub(void) ;
         static void visit_fall_through_dbl(void) ;
@@ -48,6 +211,11 @@ namespace granary {
         static void visit_patched_dbl(void) ;
         static void visit_patched_fall_through_dbl(void) ;
         static void visit_patched_conditional_dbl(void) ;
+        static void visit_speculated_dbl(unsigned num_bytes) ;
+        static void visit_dropped_speculation(void) ;
+        static void visit_allocated_thread_state(void) ;
+        static void visit_adopted_thread_state(void) ;
+        static void visit_parked_thread_state(void) ;
 
         static void visit_mem_ref(unsigned) ;
 
@@ -60,6 +228,15 @@ namespace granary {
         static void visit_address_lookup_hit(void) ;
         static void visit_address_lookup_cpu(bool) ;
 
+        static void visit_code_cache_flush(void) ;
+        static void visit_code_cache_invalidation(void) ;
+
+        static void visit_reoptimised_block(void) ;
+        static void visit_hot_trace(void) ;
+
+        static void visit_removed_reg_spills(unsigned num_regs) ;
+        static void visit_removed_flags_spill(void) ;
+
 #if CONFIG_ENV_KERNEL
         static void visit_takeover_interrupt(void) ;
         static void visit_interrupt(void) ;
@@ -0,0 +1,64 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * persistent_cache.h
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#ifndef GRANARY_PERSISTENT_CACHE_H_
+#define GRANARY_PERSISTENT_CACHE_H_
+
+#include "granary/globals.h"
+#include "granary/state.h"
+#include "granary/instruction.h"
+
+namespace granary {
+
+
+    /// Forward declaration.
+    struct trace_info;
+
+
+    /// An on-disk cache of translated code, which lets short-lived programs
+    /// skip most of their translation on later runs. Translated traces are
+    /// recorded along with relocations for everything that they reference
+    /// outside of themselves: native code and data (relative to the module
+    /// that contains them), and other basic blocks (as DBL links). When the
+    /// program next runs, the cache file is mapped in, and traces are copied
+    /// into the code cache and relocated as they are first needed.
+    ///
+    /// Note: Traces that reference anything else, e.g. heap-allocated data,
+    ///       are not persisted.
+    struct persistent_cache {
+
+        /// Install the persisted translation of `addr` into the code cache of
+        /// `cpu`. Returns the installed address of `addr`'s basic block, and
+        /// updates `num_translated_bbs` with the number of installed basic
+        /// blocks. Returns `nullptr` if there is no usable translation.
+        static app_pc install(
+            cpu_state_handle cpu,
+            mangled_address addr,
+            unsigned &num_translated_bbs
+        ) ;
+
+
+        /// Remember the just-emitted trace `trace`, whose instructions are
+        /// `ls`, so that it can be persisted.
+        static void record(const trace_info &trace, instruction_list &ls) ;
+
+
+        /// Write the persisted translations to disk.
+        static void save(void) ;
+
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+        /// Forget every persisted translation, and then re-read the ones on
+        /// disk, as if the program was run again. Returns the number of
+        /// traces that were re-read.
+        static unsigned reload(void) ;
+#endif
+    };
+}
+
+#endif /* GRANARY_PERSISTENT_CACHE_H_ */
@@ -8,6 +8,15 @@
 
 #include "granary/pgo.h"
 
+#if CONFIG_OPTIMISE_ONLINE_PGO
+#   include "granary/state.h"
+#   include "granary/code_cache.h"
+#   include "granary/spin_lock.h"
+#   include "granary/emit_utils.h"
+#   include "granary/basic_block.h"
+#   include "granary/basic_block_info.h"
+#endif
+
 
 /// Turn off profile-guided optimisation when using the `cfg` tool, or when
 /// not doing kernel instrumentation.
@@ -66,8 +75,10 @@ namespace granary {
     enum : uintptr_t {
         LINUX_KERNEL_BASE = 0xffffffff80000000ULL
     };
+#endif
 
 
+#if CONFIG_OPTIMISE_PGO || CONFIG_OPTIMISE_ONLINE_PGO
     const int REVERSE_OPCODES[] = {
         dynamorio::OP_jno,
         dynamorio::OP_jo,
@@ -106,6 +117,563 @@ namespace granary {
         dynamorio::OP_jnle_short,
         dynamorio::OP_jle_short
     };
+
+
+    /// Negate the condition of a Jcc, and change its target to be `next_pc`,
+    /// its old fall-through.
+    static void reverse_jcc(instruction in, app_pc next_pc) {
+        operand target(in.cti_target());
+
+        // Change the target to be the old fall-through.
+        target.value.pc = next_pc;
+        in.set_cti_target(target);
+
+        // Reverse the opcode.
+        if(in.instr->opcode >= dynamorio::OP_jo
+        && in.instr->opcode <= dynamorio::OP_jnle) {
+            in.instr->opcode = REVERSE_OPCODES[
+                in.instr->opcode - dynamorio::OP_jo];
+        } else {
+            in.instr->opcode = REVERSE_OPCODES_SHORT[
+                in.instr->opcode - dynamorio::OP_jo_short];
+        }
+    }
+#endif
+
+
+#if CONFIG_OPTIMISE_ONLINE_PGO
+
+    enum {
+        CALL_INDIRECT_ADDRESS_SIZE = 6, // 1-byte opcode + mod/rm + rel32
+
+        /// Maximum number of distinct targets recorded for the indirect CTI
+        /// that ends a basic block.
+        NUM_INDIRECT_TARGETS = 4,
+
+        /// Arithmetic flags that must all be written (and none read) by an
+        /// instruction before which the execution counter is placed.
+        ARITH_FLAGS_WRITTEN = EFLAGS_WRITE_CF | EFLAGS_WRITE_PF
+                            | EFLAGS_WRITE_AF | EFLAGS_WRITE_ZF
+                            | EFLAGS_WRITE_SF | EFLAGS_WRITE_OF,
+        ARITH_FLAGS_READ = EFLAGS_READ_CF | EFLAGS_READ_PF
+                         | EFLAGS_READ_AF | EFLAGS_READ_ZF
+                         | EFLAGS_READ_SF | EFLAGS_READ_OF
+    };
+
+
+    /// Execution profile of a single basic block. Profiles are allocated
+    /// from the same CPU-private allocator as the stubs that refer to them,
+    /// so that they are reclaimed along with those stubs when the code cache
+    /// is flushed.
+    struct block_profile {
+
+        /// Always the same; the function that re-translates hot blocks.
+        app_pc optimiser_func;
+
+        /// Number of executions of the block remaining until it is hot.
+        /// This is decremented without a LOCK prefix; lost decrements only
+        /// make the block appear a bit colder than it is.
+        int64_t countdown;
+
+        /// JMP at the beginning of the block. This initially jumps to the
+        /// next instruction, and is patched to jump to the re-translated
+        /// block. This way, every existing entry point into the block (e.g.
+        /// patched DBLs, IBL exit routines, CPU-private code cache entries)
+        /// reaches the re-translated block.
+        persistent_instruction redirect;
+
+        /// Number of times that the block fell through its ending Jcc (if
+        /// any). Together with `countdown`, this gives the counts of both
+        /// edges out of the block. Like `countdown`, this is updated without
+        /// a LOCK prefix.
+        int64_t num_fall_throughs;
+
+        /// The policy-mangled address of the block.
+        mangled_address block_address;
+
+        /// The re-translated block.
+        app_pc optimised_address;
+
+        /// Native targets of the indirect CTI that ends this block, and how
+        /// often each of them missed in the IBL jump table.
+        std::atomic<app_pc> indirect_targets[NUM_INDIRECT_TARGETS];
+        std::atomic<unsigned> num_indirect_target_misses[NUM_INDIRECT_TARGETS];
+
+        /// Only one CPU re-translates the block.
+        spin_lock lock;
+    };
+
+
+    /// Returns true iff `in` is a Jcc that can be reversed.
+    static bool is_reversible_jcc(instruction in) {
+        const int opcode(in.op_code());
+        return (dynamorio::OP_jo <= opcode && opcode <= dynamorio::OP_jnle)
+            || (dynamorio::OP_jo_short <= opcode
+                && opcode <= dynamorio::OP_jnle_short);
+    }
+
+
+    /// Returns the profile of the block beginning at `cache_pc`, if any.
+    static block_profile *find_profile(app_pc cache_pc) {
+        if(!cache_pc || !is_code_cache_address(cache_pc)) {
+            return nullptr;
+        }
+
+        const basic_block_info *info(find_basic_block_info(cache_pc));
+        if(!info || info->start_pc != cache_pc) {
+            return nullptr;
+        }
+
+        return info->profile;
+    }
+
+
+    /// Returns the profile of the translated basic block for `start_pc`
+    /// under `policy`, if that block exists and is being profiled.
+    static block_profile *find_profile(
+        app_pc start_pc,
+        instrumentation_policy policy
+    ) {
+        const mangled_address am(start_pc, policy.base_policy());
+        return find_profile(code_cache::lookup(am.as_address));
+    }
+
+
+    /// Returns the number of times that the translated basic block for
+    /// `start_pc` under `policy` has executed, or `-1` if unknown.
+    static int64_t find_execution_count(
+        app_pc start_pc,
+        instrumentation_policy policy
+    ) {
+        const block_profile *profile(find_profile(start_pc, policy));
+        if(!profile) {
+            return -1;
+        }
+
+        const int64_t countdown(*unsafe_cast<volatile int64_t *>(
+            &(profile->countdown)));
+        return CONFIG_OPTIMISE_ONLINE_PGO_THRESHOLD - countdown;
+    }
+
+
+    /// Returns the number of times that the translated basic block for
+    /// `start_pc` under `policy` fell through its ending Jcc, or `-1` if
+    /// unknown.
+    static int64_t find_fall_through_count(
+        app_pc start_pc,
+        instrumentation_policy policy
+    ) {
+        const block_profile *profile(find_profile(start_pc, policy));
+        if(!profile) {
+            return -1;
+        }
+
+        return *unsafe_cast<volatile int64_t *>(
+            &(profile->num_fall_throughs));
+    }
+
+
+#if CONFIG_BUILD_HOT_TRACES
+    enum {
+        /// Minimum number of executions of a successor block for it to be
+        /// considered part of the hot path.
+        MIN_HOT_SUCCESSOR_COUNT = CONFIG_OPTIMISE_ONLINE_PGO_THRESHOLD / 2
+    };
+
+
+    /// Find the native successors of the translated basic block for
+    /// `start_pc` under `policy`. This re-decodes the native instructions of
+    /// the block. Returns the number of successors (0, 1, or 2) stored into
+    /// `successors`, where the taken target of a Jcc comes before its fall-
+    /// through. Blocks ending in indirect CTIs or returns have no successors.
+    static unsigned find_successors(
+        app_pc start_pc,
+        instrumentation_policy policy,
+        app_pc *successors
+    ) {
+        const mangled_address am(start_pc, policy.base_policy());
+        const app_pc cache_pc(code_cache::lookup(am.as_address));
+        if(!cache_pc || !is_code_cache_address(cache_pc)) {
+            return 0;
+        }
+
+        const basic_block_info *info(find_basic_block_info(cache_pc));
+        if(!info || !info->generating_num_instructions) {
+            return 0;
+        }
+
+        app_pc pc(start_pc);
+        instruction in(nullptr);
+        for(unsigned i(0); i < info->generating_num_instructions; ++i) {
+            in = instruction::decode(&pc);
+            if(!pc) {
+                return 0;
+            }
+        }
+
+        if(!in.is_cti()) {
+            successors[0] = pc;
+            return 1;
+        }
+
+        if(in.is_call() || in.is_return()) {
+            return 0;
+        }
+
+        const operand target(in.cti_target());
+        if(dynamorio::PC_kind != target.kind) {
+            return 0;
+        }
+
+        successors[0] = target.value.pc;
+        if(dynamorio::instr_is_cbr(in)) {
+            successors[1] = pc;
+            return 2;
+        }
+
+        return 1;
+    }
+
+
+    /// Reconstruct the hot path through the blocks beginning at the hot block
+    /// `head` from the execution counts of the blocks, by repeatedly following
+    /// the most executed successor. Ties go to the fall-through, as with
+    /// `profile_optimise_jcc`. Returns the length of the path stored into
+    /// `path` if it loops back to `head`, otherwise returns 0.
+    static unsigned find_hot_path(
+        app_pc head,
+        instrumentation_policy policy,
+        app_pc *path
+    ) {
+        unsigned path_length(1);
+        path[0] = head;
+
+        for(app_pc pc(head); path_length < CONFIG_HOT_TRACE_MAX_BLOCKS; ) {
+            app_pc successors[2] = {nullptr, nullptr};
+            app_pc next_pc(nullptr);
+            int64_t next_count(-1);
+
+            for(unsigned i(find_successors(pc, policy, successors)); i--; ) {
+                const int64_t count(
+                    find_execution_count(successors[i], policy));
+                if(count > next_count) {
+                    next_pc = successors[i];
+                    next_count = count;
+                }
+            }
+
+            if(!next_pc || MIN_HOT_SUCCESSOR_COUNT > next_count) {
+                return 0;
+            }
+
+            if(head == next_pc) {
+                return path_length;
+            }
+
+            // Inner loop that doesn't go through the head.
+            for(unsigned i(1); i < path_length; ++i) {
+                if(path[i] == next_pc) {
+                    return 0;
+                }
+            }
+
+            path[path_length++] = next_pc;
+            pc = next_pc;
+        }
+
+        return 0;
+    }
+#endif
+
+
+    /// Re-translate a hot basic block, and patch the beginning of the old
+    /// block to jump to the re-translated block.
+    GRANARY_ENTRYPOINT
+    static void optimise_hot_block(app_pc *ret_address_addr) {
+
+        // Notify Granary that we're entering!
+        cpu_state_handle cpu;
+        granary::enter(cpu);
+
+        app_pc indirect_call(*ret_address_addr - CALL_INDIRECT_ADDRESS_SIZE);
+
+        // Make sure we're coming from the right place.
+        ASSERT(is_gencode_address(indirect_call));
+
+        // The indirect call that brought us here goes through the actual
+        // `block_profile` structure. We return to the instruction after it,
+        // which jumps back into the unoptimised block.
+        instruction call_ind(instruction::decode(&indirect_call));
+        block_profile *profile(unsafe_cast<block_profile *>(
+            call_ind.cti_target().value.addr));
+
+        // Another CPU is re-translating this block; keep executing the old
+        // block.
+        if(!profile->lock.try_acquire()) {
+            return;
+        }
+
+        if(profile->optimised_address) {
+            profile->lock.release();
+            return;
+        }
+
+        // If the block heads a hot loop, then re-translate the whole loop
+        // as a superblock.
+        const app_pc *hot_path(nullptr);
+        unsigned hot_path_length(0);
+#if CONFIG_BUILD_HOT_TRACES
+        app_pc path[CONFIG_HOT_TRACE_MAX_BLOCKS];
+        hot_path_length = find_hot_path(
+            profile->block_address.unmangled_address(),
+            instrumentation_policy(profile->block_address),
+            path);
+        if(hot_path_length) {
+            hot_path = path;
+        }
+#endif
+
+        const unsigned generation(cpu->code_cache_generation);
+        app_pc target_pc(code_cache::reoptimise(
+            cpu, profile->block_address, hot_path, hot_path_length));
+
+        // The code cache was flushed while re-translating, so the block to
+        // patch belongs to flushed code.
+        if(generation != cpu->code_cache_generation) {
+            profile->lock.release();
+            return;
+        }
+
+        profile->optimised_address = target_pc;
+        IF_PERF( perf::visit_reoptimised_block(); )
+
+        app_pc patch_address(profile->redirect.translation);
+        ASSERT(is_code_cache_address(patch_address));
+
+        uint64_t staged_code(0);
+        app_pc staged_data(reinterpret_cast<app_pc>(&staged_code));
+
+        app_pc decode_address(patch_address);
+        instruction new_jmp(instruction::decode(&decode_address));
+
+        IF_TEST( const unsigned old_jmp_len(new_jmp.encoded_size()); )
+
+        new_jmp.set_cti_target(pc_(target_pc));
+        new_jmp.stage_encode(staged_data, patch_address);
+        const unsigned new_jmp_len(new_jmp.encoded_size());
+
+        ASSERT(old_jmp_len == new_jmp_len);
+
+        const unsigned rel32_offset(new_jmp_len - sizeof(uint32_t));
+        const uint32_t new_rel32(
+            *unsafe_cast<uint32_t *>(&(staged_data[rel32_offset])));
+        uint32_t *old_rel32(
+            unsafe_cast<uint32_t *>(&(patch_address[rel32_offset])));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        *old_rel32 = new_rel32;
+        std::atomic_thread_fence(std::memory_order_release);
+
+        profile->lock.release();
+    }
+
+
+    static app_pc OPTIMISE_HOT_BLOCK = nullptr;
+
+
+    STATIC_INITIALISE_ID(optimise_hot_block_entrypoint, {
+
+        instruction_list ls(INSTRUCTION_LIST_GENCODE);
+
+        register_manager rm;
+        rm.kill_all();
+        rm.revive(reg::arg1);
+        rm.revive(reg::arg2);
+        rm.revive(reg::ret);
+
+        // Restore callee-saved registers, because `handle_interrupt` will
+        // save them for us (because it respects the ABI).
+        IF_NOT_TEST(
+            rm.revive(reg::rbx);
+            rm.revive(reg::rbp);
+            rm.revive(reg::r12);
+            rm.revive(reg::r13);
+            rm.revive(reg::r14);
+            rm.revive(reg::r15);
+        )
+
+        // Move the address of the return address into ARG1.
+        ls.append(push_(reg::arg1));
+        ls.append(lea_(reg::arg1, reg::rsp[8]));
+        ls.append(pushf_());
+        IF_KERNEL( ls.append(cli_()); )
+        ls.append(push_(reg::arg2));
+        ls.append(push_(reg::ret));
+
+        // Switch to the private stack.
+        IF_KERNEL( insert_cti_after(
+            ls, ls.last(),
+            unsafe_cast<app_pc>(granary_enter_private_stack),
+            CTI_STEAL_REGISTER, reg::ret,
+            CTI_CALL); )
+
+        instruction enter_granary(
+            save_and_restore_registers(rm, ls, ls.append(label_())));
+
+        insert_cti_after(
+            ls, enter_granary,
+            unsafe_cast<app_pc>(optimise_hot_block),
+            CTI_STEAL_REGISTER, reg::ret,
+            CTI_CALL);
+
+        IF_KERNEL( insert_cti_after(
+            ls, ls.last(), unsafe_cast<app_pc>(granary_exit_private_stack),
+            CTI_STEAL_REGISTER, reg::ret,
+            CTI_CALL); )
+
+        ls.append(pop_(reg::ret));
+        ls.append(pop_(reg::arg2));
+        ls.append(popf_());
+        ls.append(pop_(reg::arg1));
+
+        IF_KERNEL( ls.append(ret_()); )
+        IF_USER( ls.append(ret_imm_(int16_(REDZONE_SIZE))); )
+
+        const unsigned size(ls.encoded_size());
+        OPTIMISE_HOT_BLOCK = reinterpret_cast<app_pc>(
+            global_state::FRAGMENT_ALLOCATOR-> \
+                allocate_untyped(CACHE_LINE_SIZE, size));
+
+        ls.encode(OPTIMISE_HOT_BLOCK, size);
+    });
+
+
+    /// Find the first instruction of a block before which the arithmetic
+    /// flags are dead, without passing any CTI. Unlike
+    /// `find_arith_flags_dead_after`, this doesn't assume anything about the
+    /// flags at CTIs, because the block isn't mangled yet, and so its CTIs
+    /// might later become fall-through JMPs to other blocks in the trace.
+    static bool find_counter_location(instruction_list &ls, instruction &in) {
+        for(instruction in_(ls.first()); in_.is_valid(); in_ = in_.next()) {
+            if(in_.is_cti()) {
+                return false;
+            }
+
+            const unsigned eflags(dynamorio::instr_get_eflags(in_));
+            if(ARITH_FLAGS_WRITTEN == (eflags & ARITH_FLAGS_WRITTEN)
+            && !(eflags & ARITH_FLAGS_READ)) {
+                in = in_;
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    /// Add instructions to the beginning of the (not yet mangled) basic block
+    /// `ls` that count its executions. Once the block is hot, it is re-
+    /// translated using its profile (and the profiles of its successors), and
+    /// the block is patched to jump to its re-translation. Returns the profile
+    /// of the block, or `nullptr` if the block can't be profiled.
+    block_profile *profile_block(
+        instruction_list &ls,
+        instruction_list &stub_ls,
+        mangled_address block_address
+    ) {
+        instruction count_before;
+        if(!find_counter_location(ls, count_before)) {
+            return nullptr;
+        }
+
+        // If the basic block is not committed then the profile is freed along
+        // with the block's other stubs by `code_cache::find`.
+        cpu_state_handle cpu;
+        block_profile *profile(cpu->stub_allocator.allocate<block_profile>());
+        profile->optimiser_func = OPTIMISE_HOT_BLOCK;
+        profile->countdown = CONFIG_OPTIMISE_ONLINE_PGO_THRESHOLD;
+        profile->num_fall_throughs = 0;
+        profile->block_address = block_address;
+
+        // Count the fall-throughs of the block's Jcc, if any. The flags might
+        // be read by the fall-through block, so they are saved around the
+        // counter.
+        for(instruction in(ls.first()); in.is_valid(); in = in.next()) {
+            if(!in.has_flag(instruction::COND_CTI_FALL_THROUGH)) {
+                continue;
+            }
+
+            IF_USER( ls.insert_before(in,
+                lea_(reg::rsp, reg::rsp[-REDZONE_SIZE])); )
+            ls.insert_before(in, pushf_());
+            ls.insert_before(in, add_(absmem_(
+                &(profile->num_fall_throughs), dynamorio::OPSZ_8), int8_(1)));
+            ls.insert_before(in, popf_());
+            IF_USER( ls.insert_before(in,
+                lea_(reg::rsp, reg::rsp[REDZONE_SIZE])); )
+            break;
+        }
+
+        // Count the execution, and go re-translate the block when it becomes
+        // hot. The stub returns back into the (unoptimised) block.
+        instruction stub(stub_ls.append(label_()));
+        instruction resume(label_());
+        ls.insert_before(count_before, sub_(
+            absmem_(&(profile->countdown), dynamorio::OPSZ_8), int8_(1)));
+        ls.insert_before(count_before, mangled(jz_(instr_(stub))));
+        ls.insert_before(count_before, resume);
+
+        IF_USER( stub_ls.append(lea_(reg::rsp, reg::rsp[-REDZONE_SIZE])); )
+
+        instruction optimise_entry(
+            call_ind_(mem_pc_(&(profile->optimiser_func))));
+        stub_ls.append(optimise_entry);
+        stub_ls.append(mangled(jmp_(instr_(resume))));
+
+        ASSERT(CALL_INDIRECT_ADDRESS_SIZE == optimise_entry.encoded_size());
+
+        // Add in the (initially no-op) redirection JMP. This is pretty evil:
+        // as with DBLs, we put a non CPU-private allocated instruction
+        // directly into the instruction stream so that we know where it was
+        // encoded.
+        instruction entry(ls.prepend(label_()));
+        instruction redirect(jmp_(instr_(entry)));
+        memcpy(&(profile->redirect), redirect.instr, sizeof *(redirect.instr));
+        profile->redirect.next = nullptr;
+        profile->redirect.prev = nullptr;
+
+        redirect = instruction(&(profile->redirect));
+        redirect.set_mangled();
+        redirect.set_patchable();
+        ls.insert_before(entry, redirect);
+
+        return profile;
+    }
+
+
+    /// Record that the indirect CTI of the basic block containing the code
+    /// cache address `source_pc` went to the native address `target_pc`.
+    void profile_indirect_cti_target(app_pc source_pc, app_pc target_pc) {
+        if(!is_code_cache_address(source_pc)) {
+            return;
+        }
+
+        const basic_block_info *info(find_basic_block_info(source_pc));
+        if(!info || !info->profile) {
+            return;
+        }
+
+        block_profile *profile(info->profile);
+        for(unsigned i(0); i < NUM_INDIRECT_TARGETS; ++i) {
+            app_pc recorded_pc(nullptr);
+            if(profile->indirect_targets[i].compare_exchange_strong(
+                recorded_pc, target_pc)
+            || recorded_pc == target_pc) {
+                profile->num_indirect_target_misses[i].fetch_add(
+                    1, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
 #endif
 
 
@@ -114,10 +682,52 @@ namespace granary {
     /// against a known target, and if they match, then jump to that target.
     void profile_optimise_indirect_cti(
         instruction_list &ls,
-        instruction in
+        instruction in,
+        instrumentation_policy policy,
+        app_pc block_start_pc
     ) {
+#if CONFIG_OPTIMISE_ONLINE_PGO
+
+        // Only indirect JMPs; inlining the check for an indirect CALL would
+        // also need to push the return address.
+        if(dynamorio::OP_jmp_ind != in.op_code()) {
+            return;
+        }
+
+        const block_profile *profile(find_profile(block_start_pc, policy));
+        if(!profile) {
+            return;
+        }
+
+        app_pc hot_target_pc(nullptr);
+        unsigned max_num_misses(0);
+        for(unsigned i(0); i < NUM_INDIRECT_TARGETS; ++i) {
+            const unsigned num_misses(
+                profile->num_indirect_target_misses[i].load());
+            if(num_misses > max_num_misses) {
+                max_num_misses = num_misses;
+                hot_target_pc = profile->indirect_targets[i].load();
+            }
+        }
+
+        // The target must be comparable against a sign-extended 32-bit
+        // immediate.
+        if(!hot_target_pc || !addr_is_32bit(hot_target_pc)) {
+            return;
+        }
+
+        // Assumes that the flags are dead before an indirect JMP, as does
+        // `find_arith_flags_dead_after`.
+        ls.insert_before(in, cmp_(
+            in.cti_target(),
+            int32_(reinterpret_cast<uint64_t>(hot_target_pc))));
+        ls.insert_before(in, jz_(pc_(hot_target_pc)));
+#else
         UNUSED(ls);
         UNUSED(in);
+        UNUSED(policy);
+        UNUSED(block_start_pc);
+#endif
     }
 
 
@@ -128,10 +738,13 @@ namespace granary {
     /// tie in nicely with Granary's ahead-of-time tracing infrastructure.
     app_pc profile_optimise_jcc(
         instruction in,
+        instrumentation_policy policy,
         app_pc block_start_pc,
         app_pc next_pc
     ) {
 #if CONFIG_OPTIMISE_PGO
+        UNUSED(policy);
+
         const uintptr_t block_start_offset(
             reinterpret_cast<uintptr_t>(block_start_pc) - LINUX_KERNEL_BASE);
 
@@ -154,34 +767,41 @@ namespace granary {
         // The Jcc is most often taken. Need to negate the Jcc and sanity check
         // the target.
         } else {
-            operand target(in.cti_target());
+            ASSERT(in.cti_target().value.pc == jcc_target);
+            reverse_jcc(in, next_pc);
 
-            ASSERT(target.value.pc == jcc_target);
+            // Return the new fall-through as the old target.
+            return jcc_target;
+        }
 
-            // Change the target to be the old fall-through.
-            target.value.pc = next_pc;
-            in.set_cti_target(target);
+#elif CONFIG_OPTIMISE_ONLINE_PGO
+        if(!is_reversible_jcc(in)) {
+            return next_pc;
+        }
 
-            // Reverse the opcode.
-            if(in.instr->opcode >= dynamorio::OP_jo
-            && in.instr->opcode <= dynamorio::OP_jnle) {
-                in.instr->opcode = REVERSE_OPCODES[
-                    in.instr->opcode - dynamorio::OP_jo];
-            } else {
-                in.instr->opcode = REVERSE_OPCODES_SHORT[
-                    in.instr->opcode - dynamorio::OP_jo_short];
-            }
+        // The Jcc is taken whenever the block executes without falling
+        // through. Ties go to the fall-through.
+        const int64_t num_executions(
+            find_execution_count(block_start_pc, policy));
+        const int64_t num_not_taken(
+            find_fall_through_count(block_start_pc, policy));
 
-            // Return the new fall-through as the old target.
-            return jcc_target;
+        if(0 > num_executions || 0 > num_not_taken
+        || (num_executions - num_not_taken) <= num_not_taken) {
+            return next_pc;
         }
 
+        const app_pc jcc_target(in.cti_target().value.pc);
+
+        reverse_jcc(in, next_pc);
+        return jcc_target;
+
 #else
         UNUSED(block_start_pc);
+        UNUSED(policy);
         UNUSED(in);
         return next_pc;
 #endif
     }
 
 }
-
@@ -11,9 +11,15 @@
 
 #include "granary/globals.h"
 #include "granary/instruction.h"
+#include "granary/policy.h"
 
 namespace granary {
 
+
+    /// Forward declarations.
+    struct block_profile;
+
+
     /// Optimise a conditional branch using profile-guided optimisation. This
     /// function either returns `next_pc` if the fall-through of the Jcc is the
     /// most likely target, or switches the Jcc instruction in place, and
@@ -21,6 +27,7 @@ namespace granary {
     /// tie in nicely with Granary's ahead-of-time tracing infrastructure.
     app_pc profile_optimise_jcc(
         instruction in,
+        instrumentation_policy policy,
         app_pc block_start_pc,
         app_pc next_pc
     ) ;
@@ -31,8 +38,29 @@ namespace granary {
     /// against a known target, and if they match, then jump to that target.
     void profile_optimise_indirect_cti(
         instruction_list &ls,
-        instruction in
+        instruction in,
+        instrumentation_policy policy,
+        app_pc block_start_pc
+    ) ;
+
+
+#if CONFIG_OPTIMISE_ONLINE_PGO
+    /// Add instructions to the beginning of the (not yet mangled) basic block
+    /// `ls` that count its executions. Once the block is hot, it is re-
+    /// translated using its profile (and the profiles of its successors), and
+    /// the block is patched to jump to its re-translation. Returns the profile
+    /// of the block, or `nullptr` if the block can't be profiled.
+    block_profile *profile_block(
+        instruction_list &ls,
+        instruction_list &stub_ls,
+        mangled_address block_address
     ) ;
+
+
+    /// Record that the indirect CTI of the basic block containing the code
+    /// cache address `source_pc` went to the native address `target_pc`.
+    void profile_indirect_cti_target(app_pc source_pc, app_pc target_pc) ;
+#endif
 }
 
 #endif /* PGO_H_ */
@@ -98,6 +98,13 @@
 #endif
 
 
+#if CONFIG_SPECULATIVE_TRANSLATION
+#   define IF_SPECULATE(...) __VA_ARGS__
+#else
+#   define IF_SPECULATE(...)
+#endif
+
+
 #define FAULT (granary_break_on_fault(), granary_fault())
 #define FAULT_IF(...) if(__VA_ARGS__) { FAULT; }
 #define BARRIER ASM("" : : : "memory")
@@ -10,6 +10,7 @@
 
 #include "granary/register.h"
 #include "granary/instruction.h"
+#include "granary/liveness.h"
 
 namespace granary {
 
@@ -840,12 +841,13 @@ namespace granary {
     /// If we already know about the basic block by having computed the
     /// (conservative) sets of live registers at the ends of basic blocks
     /// in advance (e.g. with the CFG tool) then we use that information.
+    /// Otherwise, the live registers are computed from the native code.
     ///
     /// Note: This function is meant to be "ignored" due to weak linking if an
     ///       auto-generated version exists.
-    /*register_manager WEAK_SYMBOL
-    get_live_registers(const app_pc) {
-        return register_manager();
-    }*/
+    register_manager WEAK_SYMBOL
+    get_live_registers(const app_pc bb_start_addr) {
+        return find_live_state_after_block(bb_start_addr).regs;
+    }
 }
 
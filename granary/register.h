@@ -253,9 +253,9 @@ namespace granary {
         inline void decode(uint32_t bitmask) {
             undead = 0;
             undead_xmm = 0;
-            live = bitmask & 0xFF;
+            live = bitmask & 0xFFFF;
             live |= FORCE_LIVE;
-            live_xmm = (bitmask >> 16) & 0xFF;
+            live_xmm = (bitmask >> 16) & 0xFFFF;
         }
 
     private:
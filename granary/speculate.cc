@@ -0,0 +1,284 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * speculate.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/globals.h"
+#include "granary/speculate.h"
+
+#if CONFIG_SPECULATIVE_TRANSLATION
+#   include "granary/state.h"
+#   include "granary/code_cache.h"
+#   include "granary/instruction.h"
+#   include "granary/dbl.h"
+#   include "granary/perf.h"
+#   if CONFIG_ENV_KERNEL
+#       include "granary/x86/asm_defines.asm"
+#       include "granary/x86/asm_helpers.asm"
+#   else
+#       include <pthread.h>
+#       include <unistd.h>
+#   endif
+#endif
+
+
+namespace granary {
+
+#if CONFIG_SPECULATIVE_TRANSLATION
+
+    enum {
+        /// Number of queued targets. This is a power of two.
+        QUEUE_SIZE = 4096,
+
+        /// Number of microseconds that a worker sleeps for when there is
+        /// nothing to translate.
+        IDLE_SLEEP_US = 1000
+    };
+
+
+    /// A queued target of a direct branch.
+    struct speculation_slot {
+
+        /// Dequeuers wait for this to be one more than the slot's position,
+        /// and enqueuers wait for it to be equal to the slot's position.
+        std::atomic<uintptr_t> sequence;
+
+        /// The patch information of the branch, the generation of the code
+        /// cache that contains the branch, and the invalidation epoch in
+        /// which the branch was queued.
+        direct_branch_patch_info *patch;
+        unsigned generation;
+        unsigned epoch;
+    };
+
+
+    /// Bounded, lock-free, multi-producer, multi-consumer queue of the
+    /// targets to translate. Every CPU enqueues targets as it commits code,
+    /// and every worker dequeues them.
+    static speculation_slot QUEUE[QUEUE_SIZE];
+    static std::atomic<uintptr_t> QUEUE_HEAD(ATOMIC_VAR_INIT(0));
+    static std::atomic<uintptr_t> QUEUE_TAIL(ATOMIC_VAR_INIT(0));
+
+
+    /// Incremented each time that some native code is invalidated. Targets
+    /// that were queued in an earlier epoch are dropped.
+    static std::atomic<unsigned> INVALIDATION_EPOCH(ATOMIC_VAR_INIT(0U));
+
+
+    /// Number of bytes of code translated by the workers.
+    static std::atomic<unsigned long> NUM_SPECULATED_BYTES(ATOMIC_VAR_INIT(0));
+
+
+    /// Returns true iff the workers have used up their budget.
+    static bool is_over_budget(void) {
+        return CONFIG_SPECULATIVE_TRANSLATION_BUDGET
+            <= NUM_SPECULATED_BYTES.load(std::memory_order_relaxed);
+    }
+
+
+    /// Queue the target of `patch` for speculative translation.
+    void speculative_translation::enqueue(
+        direct_branch_patch_info *patch,
+        unsigned generation
+    ) {
+        if(is_over_budget()) {
+            return;
+        }
+
+        uintptr_t pos(QUEUE_TAIL.load(std::memory_order_relaxed));
+        for(;;) {
+            speculation_slot &slot(QUEUE[pos % QUEUE_SIZE]);
+            const intptr_t diff(static_cast<intptr_t>(
+                slot.sequence.load(std::memory_order_acquire) - pos));
+
+            // The queue is full; the DBL patcher will translate the target if
+            // the branch is ever executed.
+            if(diff < 0) {
+                return;
+
+            } else if(diff > 0) {
+                pos = QUEUE_TAIL.load(std::memory_order_relaxed);
+
+            } else if(QUEUE_TAIL.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed)) {
+                slot.patch = patch;
+                slot.generation = generation;
+                slot.epoch = INVALIDATION_EPOCH.load();
+                slot.sequence.store(pos + 1, std::memory_order_release);
+                return;
+            }
+        }
+    }
+
+
+    /// Drop all queued targets.
+    void speculative_translation::invalidate(void) {
+        INVALIDATION_EPOCH.fetch_add(1);
+    }
+
+
+    /// Dequeue the target of a direct branch. Returns false if the queue is
+    /// empty.
+    static bool dequeue(
+        direct_branch_patch_info *&patch,
+        unsigned &generation,
+        unsigned &epoch
+    ) {
+        uintptr_t pos(QUEUE_HEAD.load(std::memory_order_relaxed));
+        for(;;) {
+            speculation_slot &slot(QUEUE[pos % QUEUE_SIZE]);
+            const intptr_t diff(static_cast<intptr_t>(
+                slot.sequence.load(std::memory_order_acquire) - (pos + 1)));
+
+            if(diff < 0) {
+                return false;
+
+            } else if(diff > 0) {
+                pos = QUEUE_HEAD.load(std::memory_order_relaxed);
+
+            } else if(QUEUE_HEAD.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed)) {
+                patch = slot.patch;
+                generation = slot.generation;
+                epoch = slot.epoch;
+                slot.sequence.store(
+                    pos + QUEUE_SIZE, std::memory_order_release);
+                return true;
+            }
+        }
+    }
+
+
+    /// Result of one step of a worker.
+    enum speculation_status {
+        SPECULATION_IDLE,
+        SPECULATION_BUSY
+    };
+
+
+    /// Translate the target of one queued direct branch, and patch the branch.
+    static speculation_status speculate_once(void) {
+        cpu_state_handle cpu;
+        granary::enter(cpu);
+
+        // Catch up to the current generation of the code cache, so that the
+        // generations of queued branches can be compared against ours. This
+        // also keeps idle workers from holding back the reclamation of
+        // flushed code.
+        code_cache::quiesce(cpu);
+
+        direct_branch_patch_info *patch(nullptr);
+        unsigned generation(0);
+        unsigned epoch(0);
+        if(is_over_budget() || !dequeue(patch, generation, epoch)) {
+            return SPECULATION_IDLE;
+        }
+
+        // The branch belongs to flushed code, whose memory (including the
+        // patch information) might already have been reclaimed, or the
+        // branch's target might have been invalidated (e.g. unmapped).
+        if(generation != cpu->code_cache_generation
+        || epoch != INVALIDATION_EPOCH.load()) {
+            IF_PERF( perf::visit_dropped_speculation(); )
+            return SPECULATION_BUSY;
+        }
+
+        const unsigned long num_translated_bytes(cpu->num_translated_bytes);
+        if(speculate_dbl_patch(cpu, patch)) {
+            const unsigned long num_bytes(
+                cpu->num_translated_bytes - num_translated_bytes);
+            NUM_SPECULATED_BYTES.fetch_add(num_bytes);
+            IF_PERF( perf::visit_speculated_dbl(num_bytes); )
+        } else {
+            IF_PERF( perf::visit_dropped_speculation(); )
+        }
+
+        return SPECULATION_BUSY;
+    }
+
+
+#   if CONFIG_ENV_KERNEL
+    extern "C" {
+
+        /// Defined in `module.c`.
+        extern int kernel_start_thread(
+            int (*func)(void *), void *data, const char *name);
+        extern int kernel_thread_should_stop(void);
+        extern void kernel_sleep_us(unsigned long num_us);
+
+
+        /// Kernel stacks are small, so workers translate on Granary's private
+        /// stacks.
+        void granary_speculate_on_private_stack(speculation_status *status) {
+            *status = speculate_once();
+        }
+    }
+
+
+    /// Main loop of a worker kernel thread.
+    static int speculate_in_kernel(void *) {
+        while(!kernel_thread_should_stop()) {
+            speculation_status status(SPECULATION_IDLE);
+            speculation_status *status_ptr(&status);
+
+            eflags flags = granary_disable_interrupts();
+            ASM(
+                "movq %0, %%" TO_STRING(ARG1) ";"
+                TO_STRING(PUSHA_ASM_ARG)
+                "callq " TO_STRING(SHARED_SYMBOL(granary_enter_private_stack)) ";"
+                "callq " TO_STRING(SHARED_SYMBOL(granary_speculate_on_private_stack)) ";"
+                "callq " TO_STRING(SHARED_SYMBOL(granary_exit_private_stack)) ";"
+                TO_STRING(POPA_ASM_ARG)
+                :
+                : "m"(status_ptr)
+                : "%" TO_STRING(ARG1)
+            );
+            granary_store_flags(flags);
+
+            if(SPECULATION_IDLE == status) {
+                kernel_sleep_us(IDLE_SLEEP_US);
+            }
+        }
+        return 0;
+    }
+#   else
+
+    /// Main loop of a worker thread. Workers never exit, as their states
+    /// must keep being caught up to the code cache's generation.
+    static void *speculate_in_user(void *) {
+        for(;;) {
+            if(SPECULATION_IDLE == speculate_once()) {
+                usleep(IDLE_SLEEP_US);
+            }
+        }
+        return nullptr;
+    }
+#   endif
+
+
+    /// Start the workers.
+    STATIC_INITIALISE_ID(speculative_translation_workers, {
+        for(uintptr_t i(0); i < QUEUE_SIZE; ++i) {
+            QUEUE[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        for(unsigned i(0); i < CONFIG_SPECULATIVE_TRANSLATION; ++i) {
+#   if CONFIG_ENV_KERNEL
+            kernel_start_thread(
+                speculate_in_kernel, nullptr, "granary_speculate");
+#   else
+            pthread_t thread;
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            pthread_create(&thread, &attr, speculate_in_user, nullptr);
+            pthread_attr_destroy(&attr);
+#   endif
+        }
+    });
+
+#endif /* CONFIG_SPECULATIVE_TRANSLATION */
+}
@@ -0,0 +1,48 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * speculate.h
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#ifndef GRANARY_SPECULATE_H_
+#define GRANARY_SPECULATE_H_
+
+#include "granary/globals.h"
+
+namespace granary {
+
+
+    /// Forward declaration.
+    struct direct_branch_patch_info;
+
+
+    /// A pool of worker threads that translate the targets of direct branches
+    /// before the branches are first executed, and then patch the branches,
+    /// so that translation isn't on the critical path of the first traversal
+    /// of each edge. The targets of the direct branches of committed code are
+    /// queued, and the workers translate them with the same policies (and so
+    /// with the same DBL patches) as the DBL patcher.
+    ///
+    /// Note: Speculative translations are charged against a global budget
+    ///       (`CONFIG_SPECULATIVE_TRANSLATION_BUDGET`), after which only the
+    ///       DBL patcher translates code.
+    struct speculative_translation {
+
+        /// Queue the target of `patch`, whose code was committed to the code
+        /// cache in generation `generation`, for speculative translation.
+        /// The target is not translated if the queue is full.
+        static void enqueue(
+            direct_branch_patch_info *patch,
+            unsigned generation
+        ) ;
+
+
+        /// Drop all queued targets, as some of them might be in native code
+        /// that is being invalidated (see `code_cache::invalidate`).
+        static void invalidate(void) ;
+    };
+}
+
+#endif /* GRANARY_SPECULATE_H_ */
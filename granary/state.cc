@@ -7,6 +7,7 @@
  */
 
 #include "granary/state.h"
+#include "granary/translated_ranges.h"
 
 namespace granary {
 
@@ -17,6 +18,12 @@ namespace granary {
         cpu.free_transient_allocators();
         cpu->current_fragment_allocator = &(cpu->fragment_allocator);
         IF_TEST( cpu->in_granary = true; )
+
+#if CONFIG_DETECT_SELF_MODIFYING_CODE
+        // Writes to translated code are detected by a signal handler, which
+        // leaves invalidating the code to the next entry into Granary.
+        invalidate_modified_code();
+#endif
     }
 
 
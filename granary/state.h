@@ -16,6 +16,8 @@
 
 #if CONFIG_ENV_KERNEL
 #   include "deps/drk/segment_descriptor.h"
+#else
+#   include <pthread.h>
 #endif
 
 namespace granary {
@@ -31,6 +33,7 @@ namespace granary {
     struct thread_state_handle;
     struct instruction_list_mangler;
     struct interrupt_stack_frame;
+    struct direct_branch_patch_info;
 
 
     /// Notify that we're entering granary. This is responsible for clearing out
@@ -192,6 +195,76 @@ namespace granary {
             generic_fragment_allocator;
 
 
+#if !CONFIG_ENV_KERNEL
+    /// Per-thread state used to decide when the memory of a flushed code
+    /// cache generation can be reclaimed.
+    struct code_cache_reclaim_state {
+
+        /// Is this thread currently inside of `code_cache::find`?
+        bool in_find;
+
+        /// Is the thread that owns this state exiting (or has it exited)?
+        /// If so, then this state is in the pool of states that new threads
+        /// adopt.
+        bool is_parked;
+
+        /// Robust mutex that the thread that owns this state holds until it
+        /// exits. When the thread exits, the kernel marks the mutex's futex
+        /// word as having a dead owner, which, unlike the thread's ID, can't
+        /// be confused with a later thread.
+        ///
+        /// Note: Checking for a dead owner reads glibc's private futex word
+        ///       of the mutex (see `granary/user/state.cc`), and so user
+        ///       space Granary must be built against glibc.
+        pthread_mutex_t owner_lock;
+
+        /// The reclamation epoch in which this thread last scanned its stack
+        /// for return addresses into flushed code.
+        unsigned scanned_epoch;
+
+        /// The oldest flushed generation that was referenced by this
+        /// thread's stack the last time that it was scanned.
+        unsigned oldest_referenced_generation;
+
+        /// Number of entries into `code_cache::find` since the last scan.
+        unsigned num_finds_since_scan;
+
+        /// Bounds of this thread's stack. These are found when the thread
+        /// is given this state.
+        uintptr_t stack_begin;
+        uintptr_t stack_end;
+
+        /// Next thread state in the list of all thread states.
+        cpu_state *next;
+
+        /// Next state in the pool of parked states.
+        cpu_state *next_parked;
+    };
+
+
+    /// Returns the first thread state in the list of all thread states.
+    /// Thread states are never removed from this list; the states of exited
+    /// threads are parked, and later adopted by new threads.
+    cpu_state *first_cpu_state(void) ;
+
+
+    /// Returns true iff `state` is parked, and the thread that last owned it
+    /// has finished exiting. Such a state can't be executing, or referencing,
+    /// any code in the code cache.
+    bool is_cpu_state_dead(const cpu_state *state) ;
+#endif
+
+
+    /// Returns the state of the current CPU (thread, in user space) if it
+    /// has been allocated, and `nullptr` otherwise. Unlike `cpu_state_handle`,
+    /// this never allocates. In kernel space, interrupts must be disabled.
+    cpu_state *current_cpu_state(void) ;
+
+
+    /// Invoke `func` on the state of every CPU (thread, in user space).
+    void for_each_cpu_state(void (*func)(cpu_state *, void *), void *data) ;
+
+
     /// Information maintained by granary about each CPU.
     ///
     /// Note: when in kernel space, we assume that this state
@@ -258,6 +331,12 @@ namespace granary {
         generic_fragment_allocator *current_fragment_allocator;
 
 
+#if CONFIG_BUILD_HOT_TRACES
+        /// The code cache allocator for hot traces (superblocks) on this CPU.
+        generic_fragment_allocator hot_fragment_allocator;
+#endif
+
+
         /// The stub allocator for this CPU.
         bump_pointer_allocator<detail::stub_allocator_config>
             stub_allocator;
@@ -285,6 +364,39 @@ namespace granary {
         cpu_private_code_cache code_cache;
 
 
+        /// The generation of the code cache that this CPU last observed. If
+        /// this lags behind the global generation then the code cache has
+        /// been flushed, and this CPU must retire its fragment and stub
+        /// allocators, and its private code cache.
+        unsigned code_cache_generation;
+
+
+        /// The number of invalidations of translated code that this CPU has
+        /// observed. If this lags behind the global number then this CPU's
+        /// private code cache might map to invalidated code, and so it must
+        /// be cleared before it is used.
+        unsigned code_cache_invalidation;
+
+
+#if CONFIG_SPECULATIVE_TRANSLATION
+        /// DBL patch information of translated code that hasn't yet been
+        /// committed to the code cache. See `granary/dbl.cc`.
+        direct_branch_patch_info *uncommitted_patches;
+
+        /// Number of bytes of code translated by this CPU.
+        unsigned long num_translated_bytes;
+#endif
+
+
+        /// Book-keeping for reclaiming the memory of flushed code cache
+        /// generations. See `granary/code_cache.cc`.
+        IF_USER( code_cache_reclaim_state code_cache_reclaim; )
+
+
+        /// Magazines of free heap objects. See `granary/allocator.cc`.
+        detail::heap_cache heap_cache;
+
+
         /// A buffer, allocated from the global fragment allocator, that
         /// is used by DynamoRIO for privately encoding instructions.
         app_pc temp_instr_buffer;
@@ -11,6 +11,10 @@
 #include "granary/register.h"
 #include "granary/x86/asm_helpers.asm"
 
+#if CONFIG_DEBUG_RUN_TEST_CASES && !CONFIG_ENV_KERNEL
+#   include <pthread.h>
+#endif
+
 extern "C" {
 
 
@@ -105,6 +109,10 @@ namespace granary {
 
     extern "C" {
 
+        /// The registers pushed before calling this function don't preserve
+        /// the stack's alignment, so realign it for the benefit of tests
+        /// that call into libc (e.g. `pthread_create`).
+        __attribute__((force_align_arg_pointer))
         void granary_do_test_on_private_stack(static_test_list *test) {
             test->func();
         }
@@ -118,6 +126,45 @@ namespace granary {
     instrumentation_policy TEST_POLICY;
 
 
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+    enum {
+        MAX_NUM_TEST_THREADS = 16
+    };
+
+
+    /// Run `func` on `num_threads` concurrent threads, where the `i`th thread
+    /// is passed the `i`th `thread_size`-byte element of `threads`, and wait
+    /// for them all to finish.
+    void run_test_threads(
+        void *(*func)(void *),
+        void *threads,
+        unsigned thread_size,
+        unsigned num_threads
+    ) {
+        uint8_t *thread(reinterpret_cast<uint8_t *>(threads));
+
+#if CONFIG_ENV_KERNEL
+        for(unsigned i(0); i < num_threads; ++i) {
+            func(thread + (i * thread_size));
+        }
+#else
+        ASSERT(num_threads <= MAX_NUM_TEST_THREADS);
+
+        pthread_t thread_ids[MAX_NUM_TEST_THREADS];
+        for(unsigned i(0); i < num_threads; ++i) {
+            pthread_create(
+                &(thread_ids[i]), nullptr, func, thread + (i * thread_size));
+        }
+        for(unsigned i(0); i < num_threads; ++i) {
+            pthread_join(thread_ids[i], nullptr);
+        }
+#endif
+    }
+
+#endif /* CONFIG_DEBUG_RUN_TEST_CASES */
+
+
     void run_tests(void) {
 
         TEST_POLICY = granary::policy_for<granary::test_policy>();
@@ -77,6 +77,55 @@ namespace granary {
 
     void run_tests(void) ;
 
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+    /// Returns the current time stamp counter, for timing benchmarks.
+    inline uint64_t test_timestamp(void) {
+        uint32_t lo(0);
+        uint32_t hi(0);
+        ASM("rdtsc;" : "=a"(lo), "=d"(hi));
+        return (static_cast<uint64_t>(hi) << 32) | lo;
+    }
+
+
+    /// Run `func` on `num_threads` concurrent threads, where the `i`th thread
+    /// is passed the `i`th `thread_size`-byte element of `threads`, and wait
+    /// for them all to finish. In kernel space, the threads are run one after
+    /// the other on the current CPU.
+    void run_test_threads(
+        void *(*func)(void *),
+        void *threads,
+        unsigned thread_size,
+        unsigned num_threads
+    ) ;
+
+
+    /// Run `func` on each of `threads`.
+    template <typename T>
+    inline void run_test_threads(
+        void *(*func)(void *),
+        T *threads,
+        unsigned num_threads
+    ) {
+        run_test_threads(func, threads, sizeof(T), num_threads);
+    }
+
+
+    /// Returns the number of cycles taken by the slowest of `threads`, each
+    /// of which records the number of cycles that it took in `num_cycles`.
+    template <typename T>
+    uint64_t max_num_cycles(const T *threads, unsigned num_threads) {
+        uint64_t max_cycles(1);
+        for(unsigned i(0); i < num_threads; ++i) {
+            if(threads[i].num_cycles > max_cycles) {
+                max_cycles = threads[i].num_cycles;
+            }
+        }
+        return max_cycles;
+    }
+
+#endif /* CONFIG_DEBUG_RUN_TEST_CASES */
 }
 
 
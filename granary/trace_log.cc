@@ -13,40 +13,304 @@
 #   include "granary/instruction.h"
 #   include "granary/emit_utils.h"
 #   include "granary/state.h"
+#   include "granary/spin_lock.h"
+#   include "granary/perf.h"
+#   if !CONFIG_ENV_KERNEL
+#       include "granary/user/posix/output_file.h"
+#       include <fcntl.h>
+#       include <stdlib.h>
+#       include <unistd.h>
+#   endif
 #endif
 
 
 namespace granary {
 
 
-#if CONFIG_DEBUG_TRACE_EXECUTION
-#   if !CONFIG_DEBUG_TRACE_PRINT_LOG
-
-    /// An item in the trace log.
-    struct trace_log_item {
+#if CONFIG_DEBUG_TRACE_EXECUTION && !CONFIG_DEBUG_TRACE_PRINT_LOG
 
-        /// Previous log item in this thread.
-        trace_log_item *prev;
+    enum {
+        /// Maximum number of CPUs (threads, in user space) that have their own
+        /// trace buffer. Beyond this, threads share buffers.
+        NUM_TRACE_BUFFERS = IF_USER_ELSE(64, 256),
 
-        /// A code cache address into a basic block.
-        void *code_cache_addr;
+        /// Upper bound on the size of a single trace record.
+        MAX_TRACE_RECORD_SIZE = 1 + (3 * sizeof(uint64_t))
+                              + sizeof(simple_machine_state),
 
-#       if CONFIG_DEBUG_TRACE_RECORD_REGS
-        /// State of the general purpose registers on entry to this basic block.
-        simple_machine_state state;
-#       endif /* CONFIG_DEBUG_TRACE_RECORD_REGS */
+        MIN_TRACE_BUFFER_SIZE = 4096
     };
 
 
-    /// Head of the log.
-    static std::atomic<trace_log_item *> TRACE = ATOMIC_VAR_INIT(nullptr);
-    static std::atomic<uint64_t> NUM_TRACE_ENTRIES = ATOMIC_VAR_INIT(0);
+    /// The trace buffer of a single CPU. The buffer is a ring of bytes, where
+    /// the bytes in `[tail, head)` (modulo the buffer size) haven't yet been
+    /// drained.
+    ///
+    /// Note: Only the owning CPU adds entries in the common case, so the lock
+    ///       is only contended while the buffer is being drained, or when
+    ///       threads share buffers.
+    struct trace_buffer {
+        atomic_spin_lock lock;
 
+        uint8_t *bytes;
+        uint64_t head;
+        uint64_t tail;
 
-    /// A ring buffer representing the trace log.
-    static trace_log_item LOGS[CONFIG_DEBUG_NUM_TRACE_LOG_ENTRIES];
-#   endif /* CONFIG_DEBUG_TRACE_PRINT_LOG */
-#endif /* CONFIG_DEBUG_TRACE_EXECUTION */
+        /// Number of entries that were dropped because the buffer was full.
+        uint64_t num_dropped;
+
+        /// Code cache address of the last entry. Deltas are relative to this.
+        uintptr_t last_pc;
+
+        /// Number of entries since the last register snapshot.
+        unsigned num_since_regs;
+
+        /// Should the next record be a sync record? This is true initially,
+        /// and after an entry is dropped.
+        bool needs_sync;
+
+    } __attribute__((aligned (CONFIG_ARCH_CACHE_LINE_SIZE)));
+
+
+    /// Per-CPU trace buffers. The memory of a buffer is allocated the first
+    /// time that its CPU adds an entry.
+    static trace_buffer TRACE_BUFFERS[NUM_TRACE_BUFFERS];
+
+
+    /// Size, in bytes, of each trace buffer. This is a power of two.
+    static uint64_t TRACE_BUFFER_SIZE(CONFIG_DEBUG_TRACE_BUFFER_SIZE);
+
+
+#   if CONFIG_ENV_KERNEL
+    extern "C" {
+        extern int kernel_get_cpu_id(void);
+
+        /// Returns the `trace_buffer_size` module parameter, or 0 if it wasn't
+        /// given.
+        extern unsigned long kernel_trace_buffer_size(void);
+    }
+#   else
+
+    /// Used to give each thread its own trace buffer.
+    static std::atomic<unsigned> NEXT_TRACE_CPU(ATOMIC_VAR_INIT(0U));
+
+
+    /// The index (plus one) of this thread's trace buffer.
+    static __thread unsigned TRACE_CPU(0);
+
+
+    /// File to which traces are streamed, and a lock that keeps the chunks of
+    /// different threads from interleaving.
+    static int TRACE_FD(-1);
+    static atomic_spin_lock TRACE_FD_LOCK;
+#   endif
+
+
+    /// Returns the index of the current CPU's (thread's) trace buffer.
+    static inline unsigned current_trace_cpu(void) {
+#   if CONFIG_ENV_KERNEL
+        return static_cast<unsigned>(kernel_get_cpu_id()) % NUM_TRACE_BUFFERS;
+#   else
+        if(!TRACE_CPU) {
+            TRACE_CPU = (NEXT_TRACE_CPU.fetch_add(1) % NUM_TRACE_BUFFERS) + 1;
+        }
+        return TRACE_CPU - 1;
+#   endif
+    }
+
+
+    /// Copy `[tail, head)` of a trace buffer into `buff` as a single data
+    /// chunk, copying at most `size` bytes in total. Returns the number of
+    /// bytes copied. The buffer's lock must be held.
+    static unsigned long drain_buffer(
+        unsigned cpu,
+        trace_buffer &buffer,
+        uint8_t *buff,
+        unsigned long size
+    ) {
+        if(buffer.head == buffer.tail || sizeof(trace_chunk_header) >= size) {
+            return 0;
+        }
+
+        uint64_t num_bytes(buffer.head - buffer.tail);
+        if(num_bytes > (size - sizeof(trace_chunk_header))) {
+            num_bytes = size - sizeof(trace_chunk_header);
+        }
+
+        trace_chunk_header header;
+        header.cpu = static_cast<uint16_t>(cpu);
+        header.kind = TRACE_CHUNK_DATA;
+        header.size = static_cast<uint32_t>(num_bytes);
+        memcpy(buff, &header, sizeof header);
+        buff += sizeof header;
+
+        const uint64_t mask(TRACE_BUFFER_SIZE - 1);
+        for(uint64_t i(0); i < num_bytes; ++i) {
+            buff[i] = buffer.bytes[(buffer.tail + i) & mask];
+        }
+
+        buffer.tail += num_bytes;
+        return sizeof header + num_bytes;
+    }
+
+
+    /// Fill in an info chunk.
+    static unsigned long fill_info(uint8_t *buff) {
+        trace_chunk_header header;
+        header.cpu = 0;
+        header.kind = TRACE_CHUNK_INFO;
+        header.size = sizeof(trace_stream_info);
+
+        trace_stream_info info;
+        info.magic = TRACE_STREAM_MAGIC;
+        info.version = TRACE_STREAM_VERSION;
+        info.regs_size = sizeof(simple_machine_state);
+        info.buffer_size = static_cast<uint32_t>(TRACE_BUFFER_SIZE);
+
+        memcpy(buff, &header, sizeof header);
+        memcpy(buff + sizeof header, &info, sizeof info);
+        return sizeof header + sizeof info;
+    }
+
+
+#   if !CONFIG_ENV_KERNEL
+
+    /// Write a trace buffer's undrained data to the trace file. The buffer's
+    /// lock must be held.
+    static void flush_buffer(unsigned cpu, trace_buffer &buffer) {
+        enum {
+            FLUSH_CHUNK_SIZE = 4096
+        };
+
+        uint8_t chunk[FLUSH_CHUNK_SIZE];
+        for(;;) {
+            const unsigned long size(
+                drain_buffer(cpu, buffer, &(chunk[0]), FLUSH_CHUNK_SIZE));
+            if(!size) {
+                break;
+            }
+
+            if(-1 != TRACE_FD) {
+                TRACE_FD_LOCK.acquire();
+                UNUSED(write(TRACE_FD, &(chunk[0]), size));
+                TRACE_FD_LOCK.release();
+            }
+        }
+    }
+#   endif
+
+
+    /// Size the trace buffers, and in user space, open the file to which
+    /// traces are streamed.
+    STATIC_INITIALISE_ID(trace_log, {
+        uint64_t size(0);
+
+#   if CONFIG_ENV_KERNEL
+        size = kernel_trace_buffer_size();
+#   else
+        const char *size_str(getenv("GRANARY_TRACE_BUFFER_SIZE"));
+        for(; size_str && '0' <= *size_str && *size_str <= '9'; ++size_str) {
+            size = (size * 10) + static_cast<uint64_t>(*size_str - '0');
+        }
+#   endif
+
+        if(size) {
+            if(size < MIN_TRACE_BUFFER_SIZE) {
+                size = MIN_TRACE_BUFFER_SIZE;
+            }
+            TRACE_BUFFER_SIZE = 1;
+            while(TRACE_BUFFER_SIZE < size) {
+                TRACE_BUFFER_SIZE <<= 1;
+            }
+        }
+
+        for(unsigned i(0); i < NUM_TRACE_BUFFERS; ++i) {
+            TRACE_BUFFERS[i].needs_sync = true;
+        }
+
+#   if !CONFIG_ENV_KERNEL
+        char path[MAX_OUTPUT_FILE_PATH_LENGTH];
+        TRACE_FD = create_output_file(path, "/tmp/granary-trace.", O_WRONLY);
+        if(-1 != TRACE_FD) {
+            uint8_t info[
+                sizeof(trace_chunk_header) + sizeof(trace_stream_info)];
+            UNUSED(write(TRACE_FD, &(info[0]), fill_info(&(info[0]))));
+        }
+#   endif
+    })
+
+
+    /// Append an unsigned variable-length integer to `record`. Returns the
+    /// number of bytes appended.
+    static inline unsigned append_varint(uint8_t *record, uint64_t val) {
+        unsigned size(0);
+        for(; val >= 0x80; val >>= 7) {
+            record[size++] = static_cast<uint8_t>(val | 0x80);
+        }
+        record[size++] = static_cast<uint8_t>(val);
+        return size;
+    }
+
+
+    /// Append a trace record to a buffer. The buffer's lock must be held, and
+    /// the buffer must have space for the record.
+    static void append_record(
+        trace_buffer &buffer,
+        uintptr_t pc,
+        simple_machine_state *state
+    ) {
+        uint8_t record[MAX_TRACE_RECORD_SIZE];
+        unsigned size(0);
+
+        const uint64_t delta(static_cast<uint64_t>(pc - buffer.last_pc));
+        const uint64_t zig_zag((delta << 1) ^ static_cast<uint64_t>(
+            static_cast<int64_t>(delta) >> 63));
+        bool sync(buffer.needs_sync || zig_zag >= (1ULL << 61));
+
+#       if CONFIG_DEBUG_TRACE_RECORD_REGS
+        const bool snapshot(sync || CONFIG_DEBUG_TRACE_REGS_INTERVAL
+            <= ++(buffer.num_since_regs));
+#       else
+        const bool snapshot(false);
+        UNUSED(state);
+#       endif
+
+        if(sync || snapshot) {
+            const uint64_t fields[3] = {
+                pc, perf::timestamp(), buffer.num_dropped
+            };
+            record[size++] = snapshot ? TRACE_RECORD_REGS : TRACE_RECORD_SYNC;
+            memcpy(&(record[size]), &(fields[0]), sizeof fields);
+            size += sizeof fields;
+
+#       if CONFIG_DEBUG_TRACE_RECORD_REGS
+            if(snapshot) {
+
+                // Have to use our internal `memcpy`, because even when telling
+                // the compiler not to use xmm registers, it will sometimes
+                // optimize a structure assignment into a libc `memcpy`.
+                simple_machine_state *regs(
+                    unsafe_cast<simple_machine_state *>(&(record[size])));
+                memcpy(regs, state, sizeof *state);
+                regs->rsp.value_64 += IF_USER_ELSE(REDZONE_SIZE + 8, 8);
+                size += sizeof *state;
+                buffer.num_since_regs = 0;
+            }
+#       endif
+            buffer.needs_sync = false;
+        } else {
+            size = append_varint(
+                &(record[0]), (zig_zag << 2) | TRACE_RECORD_DELTA);
+        }
+
+        const uint64_t mask(TRACE_BUFFER_SIZE - 1);
+        for(unsigned i(0); i < size; ++i) {
+            buffer.bytes[(buffer.head + i) & mask] = record[i];
+        }
+        buffer.head += size;
+        buffer.last_pc = pc;
+    }
+#endif /* CONFIG_DEBUG_TRACE_EXECUTION && !CONFIG_DEBUG_TRACE_PRINT_LOG */
 
 
     /// Log a lookup in the code cache.
@@ -56,34 +320,90 @@ namespace granary {
     ) {
 #if CONFIG_DEBUG_TRACE_EXECUTION
 #   if CONFIG_DEBUG_TRACE_PRINT_LOG
-        printf("app=%p cache=%p\n", app_addr, target_addr);
-        (void) kind;
+        printf("cache=%p\n", code_cache_addr);
+        (void) state;
 #   else
-        trace_log_item *prev(nullptr);
-        trace_log_item *item(&(LOGS[
-            NUM_TRACE_ENTRIES.fetch_add(1) % CONFIG_DEBUG_NUM_TRACE_LOG_ENTRIES]));
-        item->code_cache_addr = code_cache_addr;
+        IF_KERNEL( eflags flags(granary_disable_interrupts()); )
 
-#       if CONFIG_DEBUG_TRACE_RECORD_REGS
+        const unsigned cpu(current_trace_cpu());
+        trace_buffer &buffer(TRACE_BUFFERS[cpu]);
+        buffer.lock.acquire();
 
-        // Have to use our internal `memcpy`, because even when telling the
-        // compiler not to use xmm registers, it will sometimes optimize an
-        // assignment of `item->state = *state` into a libc `memcpy`.
-        memcpy(&(item->state), state, sizeof *state);
-        item->state.rsp.value_64 += IF_USER_ELSE(REDZONE_SIZE + 8, 8);
+        if(!buffer.bytes) {
+            buffer.bytes = allocate_memory<uint8_t>(
+                static_cast<unsigned>(TRACE_BUFFER_SIZE));
+        }
 
-#       else
-        (void) state;
-#       endif /* CONFIG_DEBUG_TRACE_RECORD_REGS */
+        // In user space, the writer streams its own buffer to the trace file
+        // once it's half full. In kernel space, buffers are drained by reading
+        // the `granary_trace` file in debugfs.
+        IF_USER( if((buffer.head - buffer.tail) >= (TRACE_BUFFER_SIZE / 2)) {
+            flush_buffer(cpu, buffer);
+        } )
+
+        if((TRACE_BUFFER_SIZE - (buffer.head - buffer.tail))
+                < MAX_TRACE_RECORD_SIZE) {
+            ++(buffer.num_dropped);
+            buffer.needs_sync = true;
+        } else {
+            append_record(
+                buffer, reinterpret_cast<uintptr_t>(code_cache_addr), state);
+        }
 
-        do {
-            prev = TRACE.load();
-            item->prev = prev;
-        } while(!TRACE.compare_exchange_weak(prev, item));
+        buffer.lock.release();
+        IF_KERNEL( granary_store_flags(flags); )
 #   endif /* CONFIG_DEBUG_TRACE_PRINT_LOG */
 #endif
     }
 
+
+    /// Drain the trace buffers of all CPUs into `buff`.
+    unsigned long trace_log::drain(
+        uint8_t *IF_TRACE(buff),
+        unsigned long IF_TRACE(size),
+        bool IF_TRACE(with_info)
+    ) {
+#if CONFIG_DEBUG_TRACE_EXECUTION && !CONFIG_DEBUG_TRACE_PRINT_LOG
+        unsigned long drained(0);
+        if(with_info) {
+            if(size < (sizeof(trace_chunk_header)
+                       + sizeof(trace_stream_info))) {
+                return 0;
+            }
+            drained += fill_info(buff);
+        }
+
+        for(unsigned cpu(0); cpu < NUM_TRACE_BUFFERS; ++cpu) {
+            trace_buffer &buffer(TRACE_BUFFERS[cpu]);
+            IF_KERNEL( eflags flags(granary_disable_interrupts()); )
+            buffer.lock.acquire();
+            drained += drain_buffer(
+                cpu, buffer, buff + drained, size - drained);
+            buffer.lock.release();
+            IF_KERNEL( granary_store_flags(flags); )
+        }
+        return drained;
+#else
+        return 0;
+#endif
+    }
+
+
+    /// Write out any trace data that hasn't yet been drained.
+    void trace_log::flush(void) {
+#if CONFIG_DEBUG_TRACE_EXECUTION && !CONFIG_DEBUG_TRACE_PRINT_LOG
+#   if !CONFIG_ENV_KERNEL
+        for(unsigned cpu(0); cpu < NUM_TRACE_BUFFERS; ++cpu) {
+            trace_buffer &buffer(TRACE_BUFFERS[cpu]);
+            buffer.lock.acquire();
+            flush_buffer(cpu, buffer);
+            buffer.lock.release();
+        }
+#   endif
+#endif
+    }
+
+
     extern "C" void **kernel_get_cpu_state(void *ptr[]);
 
 
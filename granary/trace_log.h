@@ -18,6 +18,59 @@ namespace granary {
     union simple_machine_state;
     struct instrumentation_policy;
 
+
+    /// A drained trace is a sequence of chunks. Each chunk begins with a
+    /// `trace_chunk_header`. The payloads of the data chunks of each CPU
+    /// (thread, in user space), when concatenated in order, form a stream of
+    /// trace records. A record begins with a variable-length integer whose
+    /// low two bits are the `trace_record_kind`:
+    ///
+    ///     TRACE_RECORD_DELTA: The remaining bits are the zig-zag encoded
+    ///                         difference between this entry's code cache
+    ///                         address and the previous entry's.
+    ///     TRACE_RECORD_SYNC:  Followed by the 64-bit code cache address, the
+    ///                         time stamp counter, and the number of entries
+    ///                         that were dropped on this CPU so far.
+    ///     TRACE_RECORD_REGS:  A sync record that is also followed by the
+    ///                         `simple_machine_state` on entry to the block.
+    ///
+    /// All values are little-endian. `scripts/decode_trace.py` decodes traces.
+    enum {
+        TRACE_STREAM_MAGIC = 0x43525447, // "GTRC"
+        TRACE_STREAM_VERSION = 1
+    };
+
+
+    enum trace_chunk_kind : uint16_t {
+        TRACE_CHUNK_DATA = 0,
+
+        /// The payload of an info chunk is a `trace_stream_info`.
+        TRACE_CHUNK_INFO = 1
+    };
+
+
+    enum trace_record_kind : uint8_t {
+        TRACE_RECORD_DELTA = 0,
+        TRACE_RECORD_SYNC = 1,
+        TRACE_RECORD_REGS = 2
+    };
+
+
+    struct trace_chunk_header {
+        uint16_t cpu;
+        uint16_t kind;
+        uint32_t size;
+    };
+
+
+    struct trace_stream_info {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t regs_size;
+        uint32_t buffer_size;
+    };
+
+
     struct trace_log {
 
         /// Log a lookup in the code cache.
@@ -32,8 +85,19 @@ namespace granary {
         static void log_execution(instruction_list &) ;
 
 
-        /// A generic reverse-execution debugger.
-        static void debug(app_pc pc) ;
+        /// Drain the trace buffers of all CPUs into `buff`, which can hold
+        /// `size` bytes. If `with_info` is true, then the drained data begins
+        /// with an info chunk. Returns the number of bytes drained.
+        static unsigned long drain(
+            uint8_t *buff,
+            unsigned long size,
+            bool with_info
+        ) ;
+
+
+        /// Write out any trace data that hasn't yet been drained. This only
+        /// does something in user space, where traces are streamed to a file.
+        static void flush(void) ;
     };
 }
 
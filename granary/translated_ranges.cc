@@ -0,0 +1,432 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * translated_ranges.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/globals.h"
+#include "granary/translated_ranges.h"
+#include "granary/hash_table.h"
+#include "granary/spin_lock.h"
+
+namespace granary {
+
+
+    /// An entry in the list of traces that were translated from the native
+    /// code of some page.
+    struct translated_page_entry {
+        translated_trace *trace;
+        translated_page_entry *next;
+    };
+
+
+    /// Maps page numbers to the lists of traces that were translated from
+    /// native code on those pages. Guarded by `TRANSLATED_PAGES_LOCK`.
+    static static_data<
+        hash_table<uintptr_t, translated_page_entry *>
+    > TRANSLATED_PAGES;
+    static spin_lock TRANSLATED_PAGES_LOCK;
+
+
+    /// The number of pages that have at least one trace in their lists.
+    /// Guarded by `TRANSLATED_PAGES_LOCK`.
+    static uintptr_t NUM_TRANSLATED_PAGES(0);
+
+
+    /// Bounds on the addresses of all translated code. These let most ranges
+    /// of data (e.g. unmapped heap memory) be skipped without probing the
+    /// index. Guarded by `TRANSLATED_PAGES_LOCK`.
+    static uintptr_t MIN_TRANSLATED_ADDRESS(~0UL);
+    static uintptr_t MAX_TRANSLATED_ADDRESS(0UL);
+
+
+    STATIC_INITIALISE_ID(translated_ranges, {
+        TRANSLATED_PAGES.construct();
+    });
+
+
+    /// Returns the number of the page containing `addr`.
+    inline static uintptr_t page_of(app_pc addr) {
+        return reinterpret_cast<uintptr_t>(addr) / PAGE_SIZE;
+    }
+
+
+    /// Allocate a record of the trace at `[cache_begin, cache_end)`.
+    translated_trace *allocate_translated_trace(
+        app_pc cache_begin,
+        app_pc cache_end,
+        unsigned num_blocks
+    ) {
+        translated_trace *trace(allocate_memory<translated_trace>());
+        trace->cache_begin = cache_begin;
+        trace->cache_end = cache_end;
+        trace->blocks = allocate_memory<translated_block>(num_blocks);
+        trace->num_blocks = num_blocks;
+        trace->num_pages = 0;
+        trace->is_stale = false;
+        trace->next = nullptr;
+        return trace;
+    }
+
+
+    /// Add `trace` to the list of traces of `page` in `pages`, unless it's
+    /// already in the list. Returns true iff `trace` was added.
+    static bool add_page_entry(
+        hash_table<uintptr_t, translated_page_entry *> &pages,
+        uintptr_t page,
+        translated_trace *trace
+    ) {
+        translated_page_entry *entries(nullptr);
+        pages.load(page, entries);
+        for(translated_page_entry *entry(entries); entry; entry = entry->next) {
+            if(trace == entry->trace) {
+                return false;
+            }
+        }
+
+        translated_page_entry *entry(
+            allocate_memory<translated_page_entry>());
+        entry->trace = trace;
+        entry->next = entries;
+        pages.store(page, entry);
+        return true;
+    }
+
+
+    /// Add `trace` to the list of traces of `page`, unless it's already in
+    /// the list.
+    static void index_page(uintptr_t page, translated_trace *trace) {
+        if(!add_page_entry(*(TRANSLATED_PAGES.self), page, trace)) {
+            return;
+        }
+
+        trace->num_pages += 1;
+
+        translated_page_entry *entries(nullptr);
+        TRANSLATED_PAGES->load(page, entries);
+        if(!entries->next) {
+            NUM_TRANSLATED_PAGES += 1;
+#if CONFIG_DETECT_SELF_MODIFYING_CODE
+            protect_translated_page(reinterpret_cast<app_pc>(
+                page * PAGE_SIZE));
+#endif
+        }
+    }
+
+
+    /// Remove `trace` from the list of traces of `page`.
+    static void unindex_page(uintptr_t page, translated_trace *trace) {
+        translated_page_entry *entries(nullptr);
+        if(!TRANSLATED_PAGES->load(page, entries)) {
+            return;
+        }
+
+        for(translated_page_entry **next_ptr(&entries);
+            *next_ptr;
+            next_ptr = &((*next_ptr)->next)) {
+
+            translated_page_entry *entry(*next_ptr);
+            if(trace == entry->trace) {
+                *next_ptr = entry->next;
+                free_memory<translated_page_entry>(entry);
+                trace->num_pages -= 1;
+                break;
+            }
+        }
+
+        // Storing an empty list removes the page from the index.
+        TRANSLATED_PAGES->store(page, entries);
+        if(!entries) {
+            NUM_TRANSLATED_PAGES -= 1;
+        }
+    }
+
+
+    /// Remove `trace` from the lists of all pages of its native code.
+    static void unindex_trace(translated_trace *trace) {
+        for(unsigned i(0); i < trace->num_blocks; ++i) {
+            const translated_block &block(trace->blocks[i]);
+            if(block.begin >= block.end) {
+                continue;
+            }
+
+            const uintptr_t last_page(page_of(block.end - 1));
+            for(uintptr_t page(page_of(block.begin));
+                page <= last_page;
+                ++page) {
+                unindex_page(page, trace);
+            }
+        }
+    }
+
+
+    /// Add `trace` to the index of translated code.
+    void add_translated_trace(translated_trace *trace) {
+        TRANSLATED_PAGES_LOCK.acquire();
+        for(unsigned i(0); i < trace->num_blocks; ++i) {
+            const translated_block &block(trace->blocks[i]);
+            const uintptr_t begin_addr(reinterpret_cast<uintptr_t>(
+                block.begin));
+            const uintptr_t end_addr(reinterpret_cast<uintptr_t>(block.end));
+            if(begin_addr >= end_addr) {
+                continue;
+            }
+
+            const uintptr_t last_page(page_of(block.end - 1));
+            for(uintptr_t page(page_of(block.begin));
+                page <= last_page;
+                ++page) {
+                index_page(page, trace);
+            }
+
+            if(begin_addr < MIN_TRANSLATED_ADDRESS) {
+                MIN_TRANSLATED_ADDRESS = begin_addr;
+            }
+            if(end_addr > MAX_TRANSLATED_ADDRESS) {
+                MAX_TRANSLATED_ADDRESS = end_addr;
+            }
+        }
+        TRANSLATED_PAGES_LOCK.release();
+    }
+
+
+    /// Free a list of traces.
+    static void free_translated_traces(translated_trace *traces) {
+        for(translated_trace *next(nullptr); traces; traces = next) {
+            next = traces->next;
+            ASSERT(!traces->num_pages);
+            free_memory<translated_block>(traces->blocks, traces->num_blocks);
+            free_memory<translated_trace>(traces);
+        }
+    }
+
+
+    /// Remove the discarded trace whose code contains `cache_pc`.
+    void remove_translated_trace(app_pc native_pc, app_pc cache_pc) {
+        translated_trace *trace(nullptr);
+
+        TRANSLATED_PAGES_LOCK.acquire();
+        translated_page_entry *entries(nullptr);
+        TRANSLATED_PAGES->load(page_of(native_pc), entries);
+        for(translated_page_entry *entry(entries); entry; entry = entry->next) {
+            if(entry->trace->cache_begin <= cache_pc
+            && cache_pc < entry->trace->cache_end) {
+                trace = entry->trace;
+                unindex_trace(trace);
+                break;
+            }
+        }
+        TRANSLATED_PAGES_LOCK.release();
+
+        if(trace) {
+            trace->next = nullptr;
+            free_translated_traces(trace);
+        }
+    }
+
+
+    /// Returns true iff any block of `trace` was translated from native code
+    /// that overlaps `[begin, end)`.
+    static bool overlaps(
+        const translated_trace *trace,
+        app_pc begin,
+        app_pc end
+    ) {
+        for(unsigned i(0); i < trace->num_blocks; ++i) {
+            const translated_block &block(trace->blocks[i]);
+            if(block.begin < end && begin < block.end) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    /// Add the traces of `page` that overlap `[begin, end)` to the list of
+    /// `stale` traces.
+    static void find_stale_traces(
+        uintptr_t page,
+        translated_page_entry *entries,
+        app_pc &begin,
+        app_pc &end,
+        translated_trace *&stale
+    ) {
+        if(page < page_of(begin) || page > page_of(end - 1)) {
+            return;
+        }
+
+        for(translated_page_entry *entry(entries); entry; entry = entry->next) {
+            translated_trace *trace(entry->trace);
+            if(trace->is_stale || !overlaps(trace, begin, end)) {
+                continue;
+            }
+
+            trace->is_stale = true;
+            trace->next = stale;
+            stale = trace;
+        }
+    }
+
+
+    /// Add `trace` to the indexes of the `stale` traces.
+    static void index_stale_trace(
+        stale_traces &stale,
+        translated_trace *trace
+    ) {
+        for(unsigned i(0); i < trace->num_blocks; ++i) {
+            const translated_block &block(trace->blocks[i]);
+            if(block.begin >= block.end) {
+                continue;
+            }
+
+            const uintptr_t last_page(page_of(block.end - 1));
+            for(uintptr_t page(page_of(block.begin));
+                page <= last_page;
+                ++page) {
+                add_page_entry(stale.native_pages, page, trace);
+            }
+        }
+
+        const uintptr_t last_page(page_of(trace->cache_end - 1));
+        for(uintptr_t page(page_of(trace->cache_begin));
+            page <= last_page;
+            ++page) {
+            add_page_entry(stale.cache_pages, page, trace);
+        }
+    }
+
+
+    /// Remove every trace that was translated from `[begin, end)`.
+    bool remove_translated_range(
+        app_pc begin,
+        app_pc end,
+        stale_traces &stale
+    ) {
+        translated_trace *traces(nullptr);
+
+        TRANSLATED_PAGES_LOCK.acquire();
+        if(reinterpret_cast<uintptr_t>(begin) < MIN_TRANSLATED_ADDRESS) {
+            begin = reinterpret_cast<app_pc>(MIN_TRANSLATED_ADDRESS);
+        }
+        if(reinterpret_cast<uintptr_t>(end) > MAX_TRANSLATED_ADDRESS) {
+            end = reinterpret_cast<app_pc>(MAX_TRANSLATED_ADDRESS);
+        }
+
+        if(begin < end) {
+            const uintptr_t first_page(page_of(begin));
+            const uintptr_t last_page(page_of(end - 1));
+
+            // Large ranges (e.g. all of the address space) are found by
+            // visiting the translated pages, rather than every page of the
+            // range.
+            if((last_page - first_page) >= NUM_TRANSLATED_PAGES) {
+                TRANSLATED_PAGES->for_each_entry(
+                    find_stale_traces, begin, end, traces);
+
+            } else {
+                for(uintptr_t page(first_page); page <= last_page; ++page) {
+                    translated_page_entry *entries(nullptr);
+                    if(TRANSLATED_PAGES->load(page, entries)) {
+                        find_stale_traces(page, entries, begin, end, traces);
+                    }
+                }
+            }
+
+            for(translated_trace *trace(traces); trace; trace = trace->next) {
+                unindex_trace(trace);
+            }
+        }
+        TRANSLATED_PAGES_LOCK.release();
+
+        if(!traces) {
+            return false;
+        }
+
+        for(translated_trace *trace(traces), *next(nullptr);
+            trace;
+            trace = next) {
+            next = trace->next;
+            index_stale_trace(stale, trace);
+            trace->next = stale.traces;
+            stale.traces = trace;
+        }
+        return true;
+    }
+
+
+    /// Free the entries of the list of traces of a page.
+    static void free_stale_entries(uintptr_t, translated_page_entry *entries) {
+        for(translated_page_entry *next(nullptr); entries; entries = next) {
+            next = entries->next;
+            free_memory<translated_page_entry>(entries);
+        }
+    }
+
+
+    /// Free the traces removed by `remove_translated_range`.
+    void free_stale_traces(stale_traces &stale) {
+        stale.native_pages.for_each_entry(free_stale_entries);
+        stale.cache_pages.for_each_entry(free_stale_entries);
+        free_translated_traces(stale.traces);
+        stale.traces = nullptr;
+    }
+
+
+    /// Returns true iff any block of the `stale` traces was translated from
+    /// `native_pc`.
+    bool is_translated_from(const stale_traces &stale, app_pc native_pc) {
+        translated_page_entry *entries(nullptr);
+        stale.native_pages.load(page_of(native_pc), entries);
+        for(; entries; entries = entries->next) {
+            if(overlaps(entries->trace, native_pc, native_pc + 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    /// Returns true iff `cache_pc` is in the code of any `stale` trace.
+    bool is_translated_into(const stale_traces &stale, app_pc cache_pc) {
+        translated_page_entry *entries(nullptr);
+        stale.cache_pages.load(page_of(cache_pc), entries);
+        for(; entries; entries = entries->next) {
+            const translated_trace *trace(entries->trace);
+            if(trace->cache_begin <= cache_pc && cache_pc < trace->cache_end) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    /// Free the list of traces of a page, and every trace that is no longer
+    /// in any list.
+    static void free_page_entries(uintptr_t, translated_page_entry *entries) {
+        for(translated_page_entry *next(nullptr); entries; entries = next) {
+            next = entries->next;
+            translated_trace *trace(entries->trace);
+            trace->num_pages -= 1;
+            if(!trace->num_pages) {
+                trace->next = nullptr;
+                free_translated_traces(trace);
+            }
+            free_memory<translated_page_entry>(entries);
+        }
+    }
+
+
+    /// Forget about all translated native code.
+    void remove_all_translated_ranges(void) {
+        TRANSLATED_PAGES_LOCK.acquire();
+        TRANSLATED_PAGES->for_each_entry(free_page_entries);
+        TRANSLATED_PAGES->~hash_table();
+        TRANSLATED_PAGES.construct();
+        NUM_TRANSLATED_PAGES = 0;
+        MIN_TRANSLATED_ADDRESS = ~0UL;
+        MAX_TRANSLATED_ADDRESS = 0UL;
+        TRANSLATED_PAGES_LOCK.release();
+    }
+}
@@ -0,0 +1,136 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * translated_ranges.h
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#ifndef GRANARY_TRANSLATED_RANGES_H_
+#define GRANARY_TRANSLATED_RANGES_H_
+
+#include "granary/globals.h"
+#include "granary/hash_table.h"
+
+namespace granary {
+
+
+    /// The native code of one basic block of a translated trace.
+    struct translated_block {
+        app_pc begin;
+        app_pc end;
+    };
+
+
+    /// Records where a trace in the code cache came from. Traces are indexed
+    /// by every page of native code that any of their blocks was translated
+    /// from, so that all code derived from a range of native code can be
+    /// found when that native code changes.
+    struct translated_trace {
+
+        /// The code cache memory of the trace.
+        app_pc cache_begin;
+        app_pc cache_end;
+
+        /// The native code of each of the trace's blocks.
+        translated_block *blocks;
+        unsigned num_blocks;
+
+        /// Number of index entries (one per page) that refer to this trace.
+        unsigned num_pages;
+
+        /// Has this trace been found to be translated from invalidated native
+        /// code?
+        bool is_stale;
+
+        /// Next trace in a list of invalidated traces.
+        translated_trace *next;
+    };
+
+
+    /// An entry in a list of traces that are indexed by a page.
+    struct translated_page_entry;
+
+
+    /// The traces that were removed from the index by
+    /// `remove_translated_range`. The traces are indexed by the pages of
+    /// their native code, and by the pages of their code cache code, so that
+    /// checking whether some code belongs to a stale trace only looks at the
+    /// few traces that share that code's page.
+    struct stale_traces {
+        translated_trace *traces;
+        hash_table<uintptr_t, translated_page_entry *> native_pages;
+        hash_table<uintptr_t, translated_page_entry *> cache_pages;
+
+        inline stale_traces(void)
+            : traces(nullptr)
+        { }
+    };
+
+
+    /// Allocate a record of the trace at `[cache_begin, cache_end)` in the
+    /// code cache, which has `num_blocks` blocks. The native code of each
+    /// block must be filled in before the trace is added to the index.
+    translated_trace *allocate_translated_trace(
+        app_pc cache_begin,
+        app_pc cache_end,
+        unsigned num_blocks
+    ) ;
+
+
+    /// Add `trace` to the index of translated code.
+    void add_translated_trace(translated_trace *trace) ;
+
+
+    /// Remove the trace whose code contains `cache_pc`, and whose first block
+    /// was translated from `native_pc`, from the index. This is used when a
+    /// translation is discarded before it is committed to the code cache.
+    void remove_translated_trace(app_pc native_pc, app_pc cache_pc) ;
+
+
+    /// Remove every trace that was (partially) translated from native code
+    /// in `[begin, end)` from the index, and add them to `stale`, which must
+    /// then be freed with `free_stale_traces`. Returns true iff any trace
+    /// was removed.
+    bool remove_translated_range(
+        app_pc begin,
+        app_pc end,
+        stale_traces &stale
+    ) ;
+
+
+    /// Free the traces removed by `remove_translated_range`.
+    void free_stale_traces(stale_traces &stale) ;
+
+
+    /// Returns true iff any block of the `stale` traces was translated from
+    /// native code that contains `native_pc`.
+    bool is_translated_from(const stale_traces &stale, app_pc native_pc) ;
+
+
+    /// Returns true iff `cache_pc` is in the code of any `stale` trace.
+    bool is_translated_into(const stale_traces &stale, app_pc cache_pc) ;
+
+
+    /// Forget about all translated native code. This is used when the whole
+    /// code cache is flushed.
+    void remove_all_translated_ranges(void) ;
+
+
+#if CONFIG_DETECT_SELF_MODIFYING_CODE
+    /// Write-protect `page` if it's writable, so that writes to its code can
+    /// be detected. Invoked when code on `page` is first translated. Defined
+    /// in `granary/user/posix/invalidate.cc`.
+    void protect_translated_page(app_pc page) ;
+
+
+    /// Invalidate the translations of the pages that have been written to
+    /// since the last time that this was invoked. Writes are detected in a
+    /// signal handler, which can't safely invalidate anything, so this is
+    /// invoked on each entry into Granary instead. Defined in
+    /// `granary/user/posix/invalidate.cc`.
+    void invalidate_modified_code(void) ;
+#endif
+}
+
+#endif /* GRANARY_TRANSLATED_RANGES_H_ */
@@ -0,0 +1,472 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * invalidate.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/globals.h"
+#include "granary/code_cache.h"
+#include "granary/translated_ranges.h"
+#include "granary/user/posix/invalidate.h"
+
+#if CONFIG_DETECT_SELF_MODIFYING_CODE
+#   include "granary/state.h"
+#   include "granary/spin_lock.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#   define _GNU_SOURCE
+#endif
+
+#include <link.h>
+#include <sys/mman.h>
+
+#if CONFIG_DETECT_SELF_MODIFYING_CODE
+#   include <atomic>
+#   include <csignal>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+
+
+namespace granary {
+
+#if CONFIG_DETECT_SELF_MODIFYING_CODE
+
+    enum {
+        /// Maximum number of pages that can be write-protected. Writes to
+        /// the translated code of any more pages aren't detected.
+        MAX_NUM_PROTECTED_PAGES = 1 << 14,
+
+        /// Added to the original protection of a write-protected page once
+        /// the page has been written to, until its translations have been
+        /// invalidated.
+        PAGE_MODIFIED = 1 << 30
+    };
+
+
+    /// A page that was write-protected because its code was translated.
+    struct protected_page {
+
+        /// The address of the page, or `0` if this slot is unused. Once set,
+        /// this never changes.
+        std::atomic<uintptr_t> page;
+
+        /// The original protection of the page, or `PROT_NONE` if the page
+        /// isn't (or is no longer) write-protected. `PAGE_MODIFIED` is added
+        /// if the page was written to and its translations haven't yet been
+        /// invalidated.
+        std::atomic<int> prot;
+    };
+
+
+    /// Open-addressed hash table of the write-protected pages. The signal
+    /// handler looks up pages in this table without taking any locks.
+    /// Insertions are guarded by `PROTECTED_PAGES_LOCK`.
+    static protected_page PROTECTED_PAGES[MAX_NUM_PROTECTED_PAGES];
+    static spin_lock PROTECTED_PAGES_LOCK;
+
+
+    /// Set by the signal handler when a page is marked as `PAGE_MODIFIED`.
+    static std::atomic<bool> HAS_MODIFIED_PAGES = ATOMIC_VAR_INIT(false);
+
+
+    /// The program's `SIGSEGV` handler, at the time that ours was installed.
+    static struct sigaction NATIVE_SIGSEGV;
+
+
+    /// Returns the value of a hexadecimal digit.
+    static uintptr_t hex_value(char ch) {
+        if('0' <= ch && ch <= '9') {
+            return static_cast<uintptr_t>(ch - '0');
+        } else if('a' <= ch && ch <= 'f') {
+            return static_cast<uintptr_t>(ch - 'a' + 10);
+        }
+        return 0;
+    }
+
+
+    /// Returns the protection of the mapping that contains `page`, according
+    /// to `/proc/self/maps`, or `PROT_NONE` if the page isn't mapped.
+    static int page_protection(uintptr_t page) {
+        const int fd(open("/proc/self/maps", O_RDONLY));
+        if(-1 == fd) {
+            return PROT_NONE;
+        }
+
+        // Each line begins with `begin-end perms`, e.g. `400000-401000 r-xp`.
+        enum {
+            PARSE_BEGIN,
+            PARSE_END,
+            PARSE_PERMS,
+            PARSE_SKIP
+        } state(PARSE_BEGIN);
+
+        uintptr_t begin(0);
+        uintptr_t end(0);
+        unsigned perm_index(0);
+        int prot(PROT_NONE);
+        int page_prot(PROT_NONE);
+        bool found(false);
+
+        char buff[512];
+        for(ssize_t num_read(0);
+            !found && 0 < (num_read = read(fd, &(buff[0]), sizeof buff));) {
+
+            for(ssize_t i(0); i < num_read; ++i) {
+                const char ch(buff[i]);
+                if('\n' == ch) {
+                    if(begin <= page && page < end) {
+                        page_prot = prot;
+                        found = true;
+                        break;
+                    }
+                    state = PARSE_BEGIN;
+                    begin = 0;
+                    end = 0;
+                    perm_index = 0;
+                    prot = PROT_NONE;
+                    continue;
+                }
+
+                switch(state) {
+                case PARSE_BEGIN:
+                    if('-' == ch) {
+                        state = PARSE_END;
+                    } else {
+                        begin = (begin << 4) | hex_value(ch);
+                    }
+                    break;
+                case PARSE_END:
+                    if(' ' == ch) {
+                        state = PARSE_PERMS;
+                    } else {
+                        end = (end << 4) | hex_value(ch);
+                    }
+                    break;
+                case PARSE_PERMS:
+                    if('r' == ch) {
+                        prot |= PROT_READ;
+                    } else if('w' == ch) {
+                        prot |= PROT_WRITE;
+                    } else if('x' == ch) {
+                        prot |= PROT_EXEC;
+                    }
+                    if(3 == perm_index++) {
+                        state = PARSE_SKIP;
+                    }
+                    break;
+                case PARSE_SKIP:
+                    break;
+                }
+            }
+        }
+
+        close(fd);
+        return page_prot;
+    }
+
+
+    /// Returns true iff `page` is part of the stack of a thread that has
+    /// entered Granary. Stack pages are never write-protected, as signals
+    /// are delivered on them.
+    ///
+    /// Note: The stacks of threads that have never entered Granary aren't
+    ///       known, so code that runs on the stack of such a thread can
+    ///       still be write-protected.
+    static bool is_stack_page(uintptr_t page) {
+        for(const cpu_state *state(first_cpu_state());
+            state;
+            state = state->code_cache_reclaim.next) {
+
+            const code_cache_reclaim_state &reclaim(state->code_cache_reclaim);
+            if(reclaim.stack_begin <= page && page < reclaim.stack_end
+            && !is_cpu_state_dead(state)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    /// Returns the slot of `page` in the table of protected pages. If `page`
+    /// isn't in the table, then returns an unused slot for it if `add` is
+    /// true (and there is room), and `nullptr` otherwise.
+    ///
+    /// Note: This is invoked by the signal handler, and so must be
+    ///       async-signal-safe.
+    static protected_page *find_protected_page(uintptr_t page, bool add) {
+        const uintptr_t index(page / PAGE_SIZE);
+        for(unsigned i(0); i < MAX_NUM_PROTECTED_PAGES; ++i) {
+            protected_page &slot(
+                PROTECTED_PAGES[(index + i) % MAX_NUM_PROTECTED_PAGES]);
+            const uintptr_t slot_page(slot.page.load());
+            if(page == slot_page) {
+                return &slot;
+            } else if(!slot_page) {
+                if(!add) {
+                    return nullptr;
+                }
+                slot.page.store(page);
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+
+    /// Write-protect `page` if it's writable.
+    void protect_translated_page(app_pc page) {
+        const uintptr_t page_addr(reinterpret_cast<uintptr_t>(page));
+        if(is_stack_page(page_addr)) {
+            return;
+        }
+
+        // Pages that were modified are protected again once their stale
+        // translations are invalidated and their code is re-translated.
+        PROTECTED_PAGES_LOCK.acquire();
+        protected_page *slot(find_protected_page(page_addr, false));
+        if(!slot || PROT_NONE == slot->prot.load()) {
+            const int prot(page_protection(page_addr));
+            if(prot & PROT_WRITE) {
+                slot = find_protected_page(page_addr, true);
+            } else {
+                slot = nullptr;
+            }
+
+            // The protection is recorded before the page is protected, so
+            // that the signal handler can always find it.
+            if(slot) {
+                slot->prot.store(prot);
+                if(mprotect(page, PAGE_SIZE, prot & ~PROT_WRITE)) {
+                    slot->prot.store(PROT_NONE);
+                }
+            }
+        }
+        PROTECTED_PAGES_LOCK.release();
+    }
+
+
+    /// Forget that the page of `slot` was write-protected. If the page was
+    /// modified, then its translations are still invalidated.
+    static void forget_protected_page(protected_page &slot) {
+        slot.prot.fetch_and(PAGE_MODIFIED);
+    }
+
+
+    /// Forget that the pages of `[begin, end)` were write-protected, as the
+    /// program has changed their protections itself.
+    static void forget_protected_pages(uintptr_t begin, uintptr_t end) {
+        begin &= ~(PAGE_SIZE - 1);
+
+        PROTECTED_PAGES_LOCK.acquire();
+        if(((end - begin) / PAGE_SIZE) < MAX_NUM_PROTECTED_PAGES) {
+            for(uintptr_t page(begin); page < end; page += PAGE_SIZE) {
+                protected_page *slot(find_protected_page(page, false));
+                if(slot) {
+                    forget_protected_page(*slot);
+                }
+            }
+        } else {
+            for(unsigned i(0); i < MAX_NUM_PROTECTED_PAGES; ++i) {
+                protected_page &slot(PROTECTED_PAGES[i]);
+                const uintptr_t page(slot.page.load());
+                if(begin <= page && page < end) {
+                    forget_protected_page(slot);
+                }
+            }
+        }
+        PROTECTED_PAGES_LOCK.release();
+    }
+
+
+    /// Invalidate the translations of the pages that were written to.
+    void invalidate_modified_code(void) {
+        if(!HAS_MODIFIED_PAGES.load(std::memory_order_relaxed)
+        || !HAS_MODIFIED_PAGES.exchange(false)) {
+            return;
+        }
+
+        for(unsigned i(0); i < MAX_NUM_PROTECTED_PAGES; ++i) {
+            protected_page &slot(PROTECTED_PAGES[i]);
+            int prot(slot.prot.load());
+            if(!(prot & PAGE_MODIFIED)
+            || !slot.prot.compare_exchange_strong(prot, PROT_NONE)) {
+                continue;
+            }
+
+            const app_pc page(reinterpret_cast<app_pc>(slot.page.load()));
+            code_cache::invalidate(page, page + PAGE_SIZE);
+        }
+    }
+
+
+    /// Handle a write to a write-protected page by restoring the page's
+    /// protection, so that the faulting write can be retried. Other faults
+    /// are passed along to the program's handler.
+    ///
+    /// Note: Nothing is invalidated here, as the write can happen while
+    ///       the faulting thread holds Granary's locks (e.g. when Granary
+    ///       itself writes to the page). The page is instead marked as
+    ///       modified, and its translations are invalidated the next time
+    ///       that any thread enters Granary (`invalidate_modified_code`).
+    static void handle_write_fault(int sig, siginfo_t *info, void *context) {
+        const uintptr_t page(
+            reinterpret_cast<uintptr_t>(info->si_addr) & ~(PAGE_SIZE - 1));
+
+        protected_page *slot(nullptr);
+        if(SEGV_ACCERR == info->si_code) {
+            slot = find_protected_page(page, false);
+        }
+
+        int prot(slot ? slot->prot.load() : PROT_NONE);
+        while(PROT_NONE != prot && !(prot & PAGE_MODIFIED)) {
+            if(slot->prot.compare_exchange_weak(prot, prot | PAGE_MODIFIED)) {
+                mprotect(reinterpret_cast<void *>(page), PAGE_SIZE, prot);
+                HAS_MODIFIED_PAGES.store(true);
+                return;
+            }
+        }
+
+        // Another thread is restoring the page's protection; retry the write
+        // until it has.
+        if((prot & PAGE_MODIFIED) && (prot & ~PAGE_MODIFIED)) {
+            return;
+        }
+
+        if(NATIVE_SIGSEGV.sa_flags & SA_SIGINFO) {
+            NATIVE_SIGSEGV.sa_sigaction(sig, info, context);
+
+        // Restore the default action, which is taken when the faulting
+        // instruction is retried.
+        } else if(SIG_DFL == NATIVE_SIGSEGV.sa_handler) {
+            sigaction(SIGSEGV, &NATIVE_SIGSEGV, nullptr);
+
+        } else if(SIG_IGN != NATIVE_SIGSEGV.sa_handler) {
+            NATIVE_SIGSEGV.sa_handler(sig);
+        }
+    }
+
+
+    /// Install the handler of writes to write-protected pages.
+    STATIC_INITIALISE_ID(detect_self_modifying_code, {
+        struct sigaction action;
+        memset(&action, 0, sizeof action);
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        action.sa_sigaction = &handle_write_fault;
+        sigaction(SIGSEGV, &action, &NATIVE_SIGSEGV);
+    });
+#endif /* CONFIG_DETECT_SELF_MODIFYING_CODE */
+
+
+    /// Invalidate the translations of any code in unmapped memory.
+    void invalidate_unmapped_code(void *addr, unsigned long len) {
+        const app_pc begin(reinterpret_cast<app_pc>(addr));
+
+#if CONFIG_DETECT_SELF_MODIFYING_CODE
+        forget_protected_pages(
+            reinterpret_cast<uintptr_t>(begin),
+            reinterpret_cast<uintptr_t>(begin + len));
+#endif
+
+        code_cache::invalidate(begin, begin + len);
+    }
+
+
+    /// Invalidate the translations of any code in memory whose protection
+    /// has changed.
+    void invalidate_protected_code(void *addr, unsigned long len, int prot) {
+        const app_pc begin(reinterpret_cast<app_pc>(addr));
+
+#if CONFIG_DETECT_SELF_MODIFYING_CODE
+        forget_protected_pages(
+            reinterpret_cast<uintptr_t>(begin),
+            reinterpret_cast<uintptr_t>(begin + len));
+#endif
+
+        if(!(prot & PROT_EXEC) || (prot & PROT_WRITE)) {
+            code_cache::invalidate(begin, begin + len);
+        }
+    }
+
+
+    /// Remember an executable segment of a loaded library.
+    static int remember_segments(
+        struct dl_phdr_info *info,
+        size_t,
+        void *tracker_
+    ) {
+        unloaded_code_tracker *tracker(
+            reinterpret_cast<unloaded_code_tracker *>(tracker_));
+
+        for(unsigned i(0); i < info->dlpi_phnum; ++i) {
+            const ElfW(Phdr) &phdr(info->dlpi_phdr[i]);
+            if(PT_LOAD != phdr.p_type || !(PF_X & phdr.p_flags)) {
+                continue;
+            }
+
+            if(unloaded_code_tracker::MAX_NUM_SEGMENTS
+                <= tracker->num_segments) {
+                return 1;
+            }
+
+            unloaded_code_tracker::segment &segment(
+                tracker->segments[tracker->num_segments++]);
+            segment.begin = info->dlpi_addr + phdr.p_vaddr;
+            segment.end = segment.begin + phdr.p_memsz;
+        }
+        return 0;
+    }
+
+
+    /// Mark a remembered segment as still loaded, by emptying it.
+    static int keep_loaded_segments(
+        struct dl_phdr_info *info,
+        size_t,
+        void *tracker_
+    ) {
+        unloaded_code_tracker *tracker(
+            reinterpret_cast<unloaded_code_tracker *>(tracker_));
+
+        for(unsigned i(0); i < info->dlpi_phnum; ++i) {
+            const ElfW(Phdr) &phdr(info->dlpi_phdr[i]);
+            if(PT_LOAD != phdr.p_type || !(PF_X & phdr.p_flags)) {
+                continue;
+            }
+
+            const unsigned long begin(info->dlpi_addr + phdr.p_vaddr);
+            for(unsigned j(0); j < tracker->num_segments; ++j) {
+                unloaded_code_tracker::segment &segment(tracker->segments[j]);
+                if(segment.begin == begin) {
+                    segment.end = segment.begin;
+                }
+            }
+        }
+        return 0;
+    }
+
+
+    /// Remember the executable segments of the loaded libraries.
+    unloaded_code_tracker::unloaded_code_tracker(void)
+        : num_segments(0)
+    {
+        dl_iterate_phdr(remember_segments, this);
+    }
+
+
+    /// Invalidate the remembered segments that are no longer loaded.
+    void unloaded_code_tracker::invalidate_unloaded_code(void) {
+        dl_iterate_phdr(keep_loaded_segments, this);
+        for(unsigned i(0); i < num_segments; ++i) {
+            const segment &seg(segments[i]);
+            if(seg.begin < seg.end) {
+                code_cache::invalidate(
+                    reinterpret_cast<app_pc>(seg.begin),
+                    reinterpret_cast<app_pc>(seg.end));
+            }
+        }
+    }
+}
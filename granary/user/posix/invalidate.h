@@ -0,0 +1,56 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * invalidate.h
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#ifndef GRANARY_USER_POSIX_INVALIDATE_H_
+#define GRANARY_USER_POSIX_INVALIDATE_H_
+
+namespace granary {
+
+
+    /// Invalidate the translations of any code in the memory
+    /// `[addr, addr + len)`, which has been unmapped.
+    void invalidate_unmapped_code(void *addr, unsigned long len) ;
+
+
+    /// Invalidate the translations of any code in the memory
+    /// `[addr, addr + len)`, whose protection has been changed to `prot`.
+    /// Translations are kept unless the memory is no longer executable, or
+    /// has become writable.
+    void invalidate_protected_code(void *addr, unsigned long len, int prot) ;
+
+
+    /// Invalidates the translations of the code of the shared libraries that
+    /// are unloaded by `dlclose`. The dynamic linker unmaps libraries
+    /// without going through `munmap`, so the executable segments of the
+    /// loaded libraries are remembered before a `dlclose`, and the segments
+    /// that are gone afterward are invalidated.
+    struct unloaded_code_tracker {
+    public:
+
+        enum {
+            MAX_NUM_SEGMENTS = 256
+        };
+
+        /// An executable segment of a loaded library.
+        struct segment {
+            unsigned long begin;
+            unsigned long end;
+        };
+
+        segment segments[MAX_NUM_SEGMENTS];
+        unsigned num_segments;
+
+        /// Remember the executable segments of the loaded libraries.
+        unloaded_code_tracker(void) ;
+
+        /// Invalidate the remembered segments that are no longer loaded.
+        void invalidate_unloaded_code(void) ;
+    };
+}
+
+#endif /* GRANARY_USER_POSIX_INVALIDATE_H_ */
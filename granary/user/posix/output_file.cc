@@ -0,0 +1,48 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * output_file.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/globals.h"
+#include "granary/user/posix/output_file.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace granary {
+
+    enum {
+        NUM_PID_DIGITS = 10
+    };
+
+
+    /// Create a new output file at `<prefix><pid>`.
+    int create_output_file(
+        char (&path)[MAX_OUTPUT_FILE_PATH_LENGTH],
+        const char *prefix,
+        int flags
+    ) {
+        const char *path_end(
+            &(path[MAX_OUTPUT_FILE_PATH_LENGTH - NUM_PID_DIGITS - 1]));
+        char *digits(&(path[0]));
+        for(; *prefix && digits < path_end; ) {
+            *digits++ = *prefix++;
+        }
+        if(*prefix) {
+            path[0] = '\0';
+            return -1;
+        }
+
+        unsigned pid(static_cast<unsigned>(getpid()));
+        for(unsigned i(NUM_PID_DIGITS); i--; pid /= 10) {
+            digits[i] = static_cast<char>('0' + (pid % 10));
+        }
+        digits[NUM_PID_DIGITS] = '\0';
+
+        return open(
+            &(path[0]), flags | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    }
+}
@@ -0,0 +1,35 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * output_file.h
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#ifndef GRANARY_USER_POSIX_OUTPUT_FILE_H_
+#define GRANARY_USER_POSIX_OUTPUT_FILE_H_
+
+namespace granary {
+
+    enum {
+        /// Maximum length (including the trailing `\0`) of the path of an
+        /// output file.
+        MAX_OUTPUT_FILE_PATH_LENGTH = 64
+    };
+
+
+    /// Create a new output file (e.g. a profile) at `<prefix><pid>`, with
+    /// the PID zero-padded to ten digits, and store the file's path in
+    /// `path`. Only the current user can access the file. The file must not
+    /// already exist, so that another user can't plant a file or symbolic
+    /// link at the (predictable) path ahead of time. Returns the file's
+    /// descriptor, opened with `flags`, or `-1` if the file can't be
+    /// created.
+    int create_output_file(
+        char (&path)[MAX_OUTPUT_FILE_PATH_LENGTH],
+        const char *prefix,
+        int flags
+    ) ;
+}
+
+#endif /* GRANARY_USER_POSIX_OUTPUT_FILE_H_ */
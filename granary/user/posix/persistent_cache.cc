@@ -0,0 +1,1666 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * persistent_cache.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/persistent_cache.h"
+
+#if CONFIG_PERSISTENT_CODE_CACHE
+
+#include "granary/basic_block.h"
+#include "granary/basic_block_info.h"
+#include "granary/code_cache.h"
+#include "granary/dbl.h"
+#include "granary/emit_utils.h"
+#include "granary/hash_table.h"
+#include "granary/perf.h"
+#include "granary/spin_lock.h"
+#include "granary/translated_ranges.h"
+#include "granary/utils.h"
+
+#include "deps/murmurhash/murmurhash.h"
+
+#ifndef _GNU_SOURCE
+#   define _GNU_SOURCE
+#endif
+
+#include <link.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+namespace granary {
+
+
+    enum {
+        PERSISTENT_CACHE_MAGIC = 0x43435047, // "GPCC"
+        PERSISTENT_CACHE_VERSION = 1,
+
+        /// Maximum number of modules (the program and its shared libraries)
+        /// that persisted traces can reference.
+        MAX_NUM_PERSISTED_MODULES = 512,
+
+        /// Maximum number of bytes of traces recorded in one run.
+        MAX_NUM_RECORDED_BYTES = 64 << 20,
+
+        /// Traces must be smaller than this to be persisted, so that offsets
+        /// into them fit in 16 bits.
+        MAX_PERSISTED_TRACE_SIZE = 1 << 16,
+
+        MAX_PATH_LENGTH = 256,
+
+        /// Maximum length of an x86 instruction. The native extents of
+        /// persisted blocks aren't recorded, so they are bounded using this.
+        MAX_NATIVE_INSTRUCTION_LENGTH = 15,
+
+        /// Number of bytes of a direct CTI, excluding prefixes, at and above
+        /// which its target is a `rel32`.
+        MIN_REL32_CTI_LENGTH = 5,
+
+        /// Length of a `MOV r64, imm64` or of a `MOV RAX, moffs64`. The 64-bit
+        /// value is the last 8 bytes of the instruction.
+        ABS64_INSTR_LENGTH = 10,
+
+        /// Addresses below this are assumed to be small constants and not
+        /// addresses when scanning 64-bit immediates.
+        MIN_PLAUSIBLE_ADDRESS = 0x10000,
+
+        WRITE_BUFFER_SIZE = 8192
+    };
+
+
+    static const uint64_t POLICY_BITS_SHIFT = \
+        64 - mangled_address::NUM_MANGLED_BITS;
+    static const uint64_t ADDRESS_MASK = (1ULL << POLICY_BITS_SHIFT) - 1;
+    static const uint64_t MAX_USER_ADDRESS = 1ULL << 47;
+
+
+    /// Kinds of values referenced by the code of a persisted trace.
+    enum persisted_reloc_kind : uint8_t {
+
+        /// A `rel32` to code or data in a module: `value` is its offset from
+        /// the base of the module.
+        RELOC_MODULE_REL32,
+
+        /// A 64-bit immediate that is an (optionally policy-mangled) address
+        /// in a module: `value` is its offset from the base of the module.
+        RELOC_MODULE_ABS64,
+
+        /// A 64-bit immediate that is an address in the trace itself: `value`
+        /// is its offset from the beginning of the trace.
+        RELOC_TRACE_ABS64,
+
+        /// An address in a module that is encoded in a way that can't be
+        /// patched, e.g. a 32-bit absolute address. Nothing is patched; the
+        /// trace can only be installed if the module is loaded at the same
+        /// base address as when it was recorded.
+        RELOC_MODULE_FIXED,
+
+        /// A direct jump to another basic block, whose policy-mangled address
+        /// is `value` (relative to the module base) and `policy_bits`.
+        RELOC_LINK,
+        RELOC_CONDITIONAL_LINK,
+
+        NUM_PERSISTED_RELOC_KINDS
+    };
+
+
+    /// Header of a persisted code cache file. This is followed by the
+    /// module records, then the trace records.
+    struct persisted_cache_header {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t key;
+        uint64_t num_bytes;
+        uint32_t num_modules;
+        uint32_t num_traces;
+    };
+
+
+    /// A module that is referenced by persisted traces.
+    struct persisted_module_record {
+        uint64_t id;
+        uint64_t base;
+    };
+
+
+    /// A persisted trace. This is followed by `num_blocks` block records,
+    /// `num_relocs` relocation records, and then the code of the trace,
+    /// padded out to a multiple of 8 bytes.
+    struct persisted_trace {
+        uint32_t num_bytes;
+        uint32_t num_code_bytes;
+        uint16_t num_blocks;
+        uint16_t _;
+        uint32_t num_relocs;
+    };
+
+
+    /// A basic block of a persisted trace.
+    struct persisted_block {
+        uint64_t module_offset;
+        uint32_t module;
+        uint16_t policy_bits;
+        uint16_t code_offset;
+        uint16_t num_bytes;
+        uint16_t generating_num_instructions;
+        uint16_t num_instructions;
+        uint16_t _;
+    };
+
+
+    /// A value referenced by the code of a persisted trace.
+    struct persisted_reloc {
+        uint64_t value;
+        uint32_t module;
+        uint16_t instr_offset;
+        uint16_t policy_bits;
+        persisted_reloc_kind kind;
+        uint8_t field_offset;
+        uint8_t instr_length;
+        uint8_t _[5];
+    };
+
+
+    static_assert(16 == sizeof(persisted_trace),
+        "Invalid structure packing of `persisted_trace`.");
+    static_assert(24 == sizeof(persisted_block),
+        "Invalid structure packing of `persisted_block`.");
+    static_assert(24 == sizeof(persisted_reloc),
+        "Invalid structure packing of `persisted_reloc`.");
+
+
+    /// A trace that was recorded in this run.
+    struct recorded_trace {
+        recorded_trace *next;
+        unsigned num_allocated_bytes;
+        unsigned _;
+
+        /// Must be last; the trace's records follow it.
+        persisted_trace trace;
+    };
+
+
+    static_assert(
+        sizeof(recorded_trace) ==
+            (offsetof(recorded_trace, trace) + sizeof(persisted_trace)),
+        "The records of a `recorded_trace` must directly follow it.");
+
+
+    /// A loaded (or previously loaded) module. Modules are never removed from
+    /// the table; if a module is unloaded then it is only marked as such.
+    struct persisted_module {
+        uint64_t id;
+
+        /// Load bias of the module. For modules that are only known from the
+        /// cache file, this is the base that the module had when its traces
+        /// were recorded.
+        uintptr_t base;
+
+        /// Range of addresses covered by the module's segments.
+        uintptr_t begin;
+        uintptr_t end;
+
+        std::atomic<bool> is_loaded;
+    };
+
+
+    /// Is persistence enabled for this run?
+    static bool IS_ENABLED(false);
+
+
+    /// Path to the cache file of this program.
+    static char CACHE_PATH[MAX_PATH_LENGTH] = {'\0'};
+
+
+    /// Identity of the program and of Granary.
+    static uint64_t CACHE_KEY(0);
+
+
+    /// Table of modules.
+    static persisted_module MODULES[MAX_NUM_PERSISTED_MODULES];
+    static std::atomic<unsigned> NUM_MODULES(ATOMIC_VAR_INIT(0U));
+    static atomic_spin_lock MODULES_LOCK;
+
+
+    /// Number of objects that have been added and removed by the dynamic
+    /// loader as of when the module table was last refreshed.
+    static unsigned long long NUM_LOADER_CHANGES(0);
+
+
+    /// The mapped cache file.
+    static const uint8_t *FILE_BEGIN(nullptr);
+    static const uint8_t *FILE_END(nullptr);
+    static const persisted_module_record *FILE_MODULES(nullptr);
+    static unsigned NUM_FILE_MODULES(0);
+    static unsigned NUM_FILE_TRACES(0);
+
+
+    /// Maps the module indexes in the cache file to indexes in `MODULES`.
+    static unsigned FILE_MODULE_MAP[MAX_NUM_PERSISTED_MODULES];
+
+
+    /// Traces recorded in this run.
+    static std::atomic<recorded_trace *> RECORDED_TRACES(
+        ATOMIC_VAR_INIT(nullptr));
+    static std::atomic<unsigned> NUM_RECORDED_BYTES(ATOMIC_VAR_INIT(0U));
+
+
+    /// Maps the policy-mangled address of the first block of a trace to the
+    /// trace. Traces are either in the cache file or were recorded in this
+    /// run.
+    static static_data<
+        concurrent_hash_table<app_pc, const persisted_trace *>
+    > INDEX;
+
+
+    /// Returns a policy-mangled address.
+    static mangled_address make_address(uintptr_t addr, uint16_t policy_bits) {
+        mangled_address am;
+        am.as_uint = static_cast<uint64_t>(addr)
+                   | (static_cast<uint64_t>(policy_bits) << POLICY_BITS_SHIFT);
+        return am;
+    }
+
+
+    static const persisted_block *blocks_of(const persisted_trace *trace) {
+        return reinterpret_cast<const persisted_block *>(trace + 1);
+    }
+
+
+    static const persisted_reloc *relocs_of(const persisted_trace *trace) {
+        return reinterpret_cast<const persisted_reloc *>(
+            blocks_of(trace) + trace->num_blocks);
+    }
+
+
+    static const uint8_t *code_of(const persisted_trace *trace) {
+        return reinterpret_cast<const uint8_t *>(
+            relocs_of(trace) + trace->num_relocs);
+    }
+
+
+    /// Returns the number of bytes of the records of a trace.
+    static uint64_t record_size(
+        uint64_t num_blocks,
+        uint64_t num_relocs,
+        uint64_t num_code_bytes
+    ) {
+        return sizeof(persisted_trace)
+             + num_blocks * sizeof(persisted_block)
+             + num_relocs * sizeof(persisted_reloc)
+             + ((num_code_bytes + 7) & ~7ULL);
+    }
+
+
+    static bool is_file_trace(const persisted_trace *trace) {
+        const uint8_t *addr(reinterpret_cast<const uint8_t *>(trace));
+        return FILE_BEGIN <= addr && addr < FILE_END;
+    }
+
+
+    /// Returns the index into `MODULES` of the module `module` of `trace`.
+    static unsigned module_index(
+        const persisted_trace *trace,
+        unsigned module
+    ) {
+        return is_file_trace(trace) ? FILE_MODULE_MAP[module] : module;
+    }
+
+
+    /// Hash some bytes into an existing hash.
+    static uint64_t hash_bytes(const void *data, uint64_t size, uint64_t hash) {
+        uint64_t out[2] = {0, 0};
+        MurmurHash3_x64_128(
+            data, static_cast<int>(size),
+            static_cast<uint32_t>(hash ^ (hash >> 32)), &(out[0]));
+        return out[0] ^ (hash * 31);
+    }
+
+
+    /// Compute the identity of a loaded module. This is a hash of its ELF
+    /// build ID if it has one, and of its code otherwise.
+    static uint64_t module_id(const dl_phdr_info *info) {
+        uint64_t id(0);
+
+        for(unsigned i(0); i < info->dlpi_phnum; ++i) {
+            const ElfW(Phdr) &phdr(info->dlpi_phdr[i]);
+            if(PT_NOTE != phdr.p_type) {
+                continue;
+            }
+
+            const uint8_t *note(reinterpret_cast<const uint8_t *>(
+                info->dlpi_addr + phdr.p_vaddr));
+            const uint8_t *notes_end(note + phdr.p_memsz);
+
+            while((note + sizeof(ElfW(Nhdr))) <= notes_end) {
+                const ElfW(Nhdr) *header(
+                    reinterpret_cast<const ElfW(Nhdr) *>(note));
+                const uint8_t *name(note + sizeof(ElfW(Nhdr)));
+                const uint8_t *desc(name + ((header->n_namesz + 3) & ~3U));
+                note = desc + ((header->n_descsz + 3) & ~3U);
+
+                if(NT_GNU_BUILD_ID == header->n_type
+                && 4 == header->n_namesz
+                && 0 == memcmp(name, "GNU", 4)
+                && note <= notes_end) {
+                    return hash_bytes(desc, header->n_descsz, 1);
+                }
+            }
+        }
+
+        for(unsigned i(0); i < info->dlpi_phnum; ++i) {
+            const ElfW(Phdr) &phdr(info->dlpi_phdr[i]);
+            if(PT_LOAD == phdr.p_type && (PF_X & phdr.p_flags)) {
+                id = hash_bytes(
+                    reinterpret_cast<const void *>(
+                        info->dlpi_addr + phdr.p_vaddr),
+                    phdr.p_filesz, id);
+            }
+        }
+
+        return id;
+    }
+
+
+    /// Returns the index of the module with identity `id`, or
+    /// `MAX_NUM_PERSISTED_MODULES` if there is no such module.
+    static unsigned find_module_by_id(uint64_t id) {
+        const unsigned num_modules(NUM_MODULES.load());
+        for(unsigned i(0); i < num_modules; ++i) {
+            if(id == MODULES[i].id) {
+                return i;
+            }
+        }
+        return MAX_NUM_PERSISTED_MODULES;
+    }
+
+
+    /// Add a module to the table. Must be called with `MODULES_LOCK` held.
+    static unsigned add_module(uint64_t id, uintptr_t base) {
+        const unsigned index(NUM_MODULES.load());
+        if(MAX_NUM_PERSISTED_MODULES <= index) {
+            return MAX_NUM_PERSISTED_MODULES;
+        }
+
+        persisted_module &module(MODULES[index]);
+        module.id = id;
+        module.base = base;
+        module.begin = 0;
+        module.end = 0;
+        module.is_loaded.store(false);
+        NUM_MODULES.store(index + 1);
+        return index;
+    }
+
+
+    /// State of a walk over the loaded modules.
+    struct module_refresh {
+        bool is_seen[MAX_NUM_PERSISTED_MODULES];
+        unsigned main_module;
+        bool is_first;
+        bool loaded_known_module;
+        unsigned long long num_loader_changes;
+    };
+
+
+    /// Update the module table with one loaded module.
+    static int refresh_module(dl_phdr_info *info, size_t, void *data) {
+        module_refresh *refresh(reinterpret_cast<module_refresh *>(data));
+        const bool is_first(refresh->is_first);
+        refresh->is_first = false;
+
+        uintptr_t begin(~static_cast<uintptr_t>(0));
+        uintptr_t end(0);
+        for(unsigned i(0); i < info->dlpi_phnum; ++i) {
+            const ElfW(Phdr) &phdr(info->dlpi_phdr[i]);
+            if(PT_LOAD == phdr.p_type) {
+                const uintptr_t seg_begin(info->dlpi_addr + phdr.p_vaddr);
+                begin = seg_begin < begin ? seg_begin : begin;
+                end = (seg_begin + phdr.p_memsz) > end ?
+                    (seg_begin + phdr.p_memsz) : end;
+            }
+        }
+
+        if(begin >= end) {
+            return 0;
+        }
+
+        // Fast path: the module is already in the table.
+        const unsigned num_modules(NUM_MODULES.load());
+        unsigned index(MAX_NUM_PERSISTED_MODULES);
+        for(unsigned i(0); i < num_modules; ++i) {
+            persisted_module &module(MODULES[i]);
+            if(module.is_loaded.load() && module.begin == begin
+            && module.end == end && module.base == info->dlpi_addr) {
+                index = i;
+                break;
+            }
+        }
+
+        if(MAX_NUM_PERSISTED_MODULES == index) {
+            const uint64_t id(module_id(info));
+            index = find_module_by_id(id);
+
+            // Two loaded copies of the same module can't be told apart by
+            // their identities; only use the first copy.
+            if(MAX_NUM_PERSISTED_MODULES != index
+            && (MODULES[index].is_loaded.load() || refresh->is_seen[index])) {
+                return 0;
+            }
+
+            if(MAX_NUM_PERSISTED_MODULES == index) {
+                index = add_module(id, info->dlpi_addr);
+            } else {
+                refresh->loaded_known_module = true;
+            }
+
+            if(MAX_NUM_PERSISTED_MODULES == index) {
+                return 0;
+            }
+
+            persisted_module &module(MODULES[index]);
+            module.base = info->dlpi_addr;
+            module.begin = begin;
+            module.end = end;
+            module.is_loaded.store(true);
+        }
+
+        refresh->is_seen[index] = true;
+        if(is_first) {
+            refresh->main_module = index;
+        }
+        return 0;
+    }
+
+
+    /// Read the number of objects added and removed by the dynamic loader.
+    static int read_loader_changes(
+        dl_phdr_info *info,
+        size_t size,
+        void *data
+    ) {
+        unsigned long long *num_changes(
+            reinterpret_cast<unsigned long long *>(data));
+
+        if(size >= (offsetof(dl_phdr_info, dlpi_subs)
+                    + sizeof info->dlpi_subs)) {
+            *num_changes = info->dlpi_adds + info->dlpi_subs;
+        } else {
+            *num_changes = ~0ULL;
+        }
+        return 1;
+    }
+
+
+    static void index_file_traces(void) ;
+
+
+    /// Bring the module table up-to-date with the loaded modules. Returns the
+    /// index of the main program's module.
+    static unsigned refresh_modules(bool force) {
+        static module_refresh refresh;
+        unsigned long long num_changes(0);
+        unsigned main_module(MAX_NUM_PERSISTED_MODULES);
+        bool loaded_known_module(false);
+
+        dl_iterate_phdr(&read_loader_changes, &num_changes);
+
+        MODULES_LOCK.acquire();
+        if(force || ~0ULL == num_changes
+        || num_changes != NUM_LOADER_CHANGES) {
+            memset(&refresh, 0, sizeof refresh);
+            refresh.is_first = true;
+            refresh.main_module = MAX_NUM_PERSISTED_MODULES;
+            dl_iterate_phdr(&refresh_module, &refresh);
+
+            const unsigned num_modules(NUM_MODULES.load());
+            for(unsigned i(0); i < num_modules; ++i) {
+                if(!refresh.is_seen[i]) {
+                    MODULES[i].is_loaded.store(false);
+                }
+            }
+
+            NUM_LOADER_CHANGES = num_changes;
+            main_module = refresh.main_module;
+            loaded_known_module = refresh.loaded_known_module;
+        }
+        MODULES_LOCK.release();
+
+        // A module that traces in the cache file depend on was just loaded.
+        if(loaded_known_module && NUM_FILE_TRACES) {
+            index_file_traces();
+        }
+
+        return main_module;
+    }
+
+
+    /// Returns the index of the loaded module containing `addr`, or
+    /// `MAX_NUM_PERSISTED_MODULES` if no loaded module contains `addr`.
+    static unsigned find_module(uintptr_t addr) {
+        const unsigned num_modules(NUM_MODULES.load());
+        for(unsigned i(0); i < num_modules; ++i) {
+            const persisted_module &module(MODULES[i]);
+            if(module.is_loaded.load(std::memory_order_acquire)
+            && module.begin <= addr && addr < module.end) {
+                return i;
+            }
+        }
+        return MAX_NUM_PERSISTED_MODULES;
+    }
+
+
+    /// Like `find_module`, but refreshes the module table if `addr` isn't
+    /// in a known module, in case a module was recently loaded.
+    static unsigned find_or_load_module(uintptr_t addr) {
+        unsigned index(find_module(addr));
+        if(MAX_NUM_PERSISTED_MODULES == index) {
+            refresh_modules(false);
+            index = find_module(addr);
+        }
+        return index;
+    }
+
+
+    /// Returns true iff `addr` is in memory that Granary manages at runtime:
+    /// the code cache, gencode (e.g. IBL and DBL stubs), wrappers, or the
+    /// heap. This memory is within Granary's own module, but its contents
+    /// differ from run to run, so a module-relative relocation to it would
+    /// be wrong once the trace is reloaded.
+    static bool is_runtime_address(uintptr_t addr) {
+        const app_pc pc(reinterpret_cast<app_pc>(addr));
+        return is_code_cache_address(pc)
+            || is_gencode_address(pc)
+            || is_wrapper_address(pc)
+            || is_heap_address(pc);
+    }
+
+
+    /// Returns true iff the records of `trace` are internally consistent.
+    static bool is_well_formed(const persisted_trace *trace) {
+        if(!trace->num_blocks
+        || MAX_PERSISTED_TRACE_SIZE <= trace->num_code_bytes) {
+            return false;
+        }
+
+        const bool is_in_file(is_file_trace(trace));
+        translated_trace *native_code(allocate_translated_trace(
+            code, code + trace->num_code_bytes, trace->num_blocks));
+
+        const persisted_block *blocks(blocks_of(trace));
+        for(unsigned i(0); i < trace->num_blocks; ++i) {
+            const persisted_block &block(blocks[i]);
+            if((is_in_file && NUM_FILE_MODULES <= block.module)
+            || trace->num_code_bytes < (block.code_offset + block.num_bytes)) {
+                return false;
+            }
+        }
+
+        if(blocks[0].code_offset) {
+            return false;
+        }
+
+        const persisted_reloc *relocs(relocs_of(trace));
+        for(unsigned i(0); i < trace->num_relocs; ++i) {
+            const persisted_reloc &reloc(relocs[i]);
+            if(NUM_PERSISTED_RELOC_KINDS <= reloc.kind
+            || (is_in_file && NUM_FILE_MODULES <= reloc.module)
+            || reloc.instr_length < (reloc.field_offset + sizeof(uint32_t))
+            || trace->num_code_bytes
+                < (reloc.instr_offset + reloc.instr_length)) {
+                return false;
+            }
+
+            if((RELOC_MODULE_ABS64 == reloc.kind
+                || RELOC_TRACE_ABS64 == reloc.kind)
+            && reloc.instr_length < (reloc.field_offset + sizeof(uint64_t))) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+
+    /// Returns the base address that `trace` assumes for its module
+    /// `module`.
+    static uintptr_t recorded_base(
+        const persisted_trace *trace,
+        unsigned module
+    ) {
+        if(is_file_trace(trace)) {
+            return FILE_MODULES[module].base;
+        }
+        return MODULES[module].base;
+    }
+
+
+    /// Returns true iff the modules that `trace` depends on are all loaded,
+    /// and if none of the modules with fixed references to them have moved.
+    static bool can_install(const persisted_trace *trace) {
+        if(!is_well_formed(trace)) {
+            return false;
+        }
+
+        translated_trace *native_code(allocate_translated_trace(
+            code, code + trace->num_code_bytes, trace->num_blocks));
+
+        const persisted_block *blocks(blocks_of(trace));
+        for(unsigned i(0); i < trace->num_blocks; ++i) {
+            const unsigned module(module_index(trace, blocks[i].module));
+            if(!MODULES[module].is_loaded.load(std::memory_order_acquire)) {
+                return false;
+            }
+        }
+
+        const persisted_reloc *relocs(relocs_of(trace));
+        for(unsigned i(0); i < trace->num_relocs; ++i) {
+            const persisted_reloc &reloc(relocs[i]);
+            if(RELOC_TRACE_ABS64 == reloc.kind) {
+                continue;
+            }
+
+            const persisted_module &module(
+                MODULES[module_index(trace, reloc.module)]);
+            if(!module.is_loaded.load(std::memory_order_acquire)) {
+                return false;
+            }
+
+            if(RELOC_MODULE_FIXED == reloc.kind
+            && recorded_base(trace, reloc.module) != module.base) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+
+    /// Returns true iff `trace` can be written to a new cache file, where
+    /// the base of each module is its base in `MODULES`.
+    static bool can_save(const persisted_trace *trace) {
+        if(!is_well_formed(trace)) {
+            return false;
+        }
+
+        const persisted_reloc *relocs(relocs_of(trace));
+        for(unsigned i(0); i < trace->num_relocs; ++i) {
+            const persisted_reloc &reloc(relocs[i]);
+            if(RELOC_MODULE_FIXED == reloc.kind
+            && recorded_base(trace, reloc.module)
+                != MODULES[module_index(trace, reloc.module)].base) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+
+    /// Add the traces in the cache file whose first blocks are in loaded
+    /// modules to the index.
+    static void index_file_traces(void) {
+        const uint8_t *record(
+            reinterpret_cast<const uint8_t *>(FILE_MODULES + NUM_FILE_MODULES));
+
+        for(unsigned i(0); i < NUM_FILE_TRACES; ++i) {
+            const persisted_trace *trace(
+                reinterpret_cast<const persisted_trace *>(record));
+            record += trace->num_bytes;
+
+            const persisted_block &block(blocks_of(trace)[0]);
+            if(NUM_FILE_MODULES <= block.module) {
+                continue;
+            }
+
+            const persisted_module &module(
+                MODULES[FILE_MODULE_MAP[block.module]]);
+            if(!module.is_loaded.load(std::memory_order_acquire)) {
+                continue;
+            }
+
+            const mangled_address am(make_address(
+                module.base + block.module_offset, block.policy_bits));
+            INDEX->store(am.as_address, trace, HASH_KEEP_PREV_ENTRY);
+        }
+    }
+
+
+    /// Returns true iff the file described by `info` belongs to this user,
+    /// and no one else can write to it. Cache files are copied into the code
+    /// cache, so a file that someone else could plant or change would let
+    /// them inject code.
+    static bool is_private(const struct stat &info) {
+        return geteuid() == info.st_uid
+            && !(info.st_mode & (S_IWGRP | S_IWOTH));
+    }
+
+
+    /// Map in a cache file and check that it is well formed. Returns true iff
+    /// the file was mapped.
+    static bool map_cache_file(void) {
+        const int fd(open(&(CACHE_PATH[0]), O_RDONLY | O_NOFOLLOW));
+        if(-1 == fd) {
+            return false;
+        }
+
+        struct stat info;
+        void *mapping(MAP_FAILED);
+        if(0 == fstat(fd, &info)
+        && S_ISREG(info.st_mode)
+        && is_private(info)
+        && sizeof(persisted_cache_header)
+            <= static_cast<size_t>(info.st_size)) {
+            mapping = mmap(
+                nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+
+        if(MAP_FAILED == mapping) {
+            return false;
+        }
+
+        const uint8_t *begin(reinterpret_cast<const uint8_t *>(mapping));
+        const uint8_t *end(begin + info.st_size);
+        const persisted_cache_header *header(
+            reinterpret_cast<const persisted_cache_header *>(begin));
+
+        bool is_valid(PERSISTENT_CACHE_MAGIC == header->magic
+            && PERSISTENT_CACHE_VERSION == header->version
+            && CACHE_KEY == header->key
+            && static_cast<uint64_t>(info.st_size) == header->num_bytes
+            && MAX_NUM_PERSISTED_MODULES >= header->num_modules);
+
+        const uint8_t *record(begin + sizeof *header);
+        if(is_valid) {
+            record += header->num_modules * sizeof(persisted_module_record);
+            is_valid = record <= end;
+        }
+
+        // Make sure that every trace record is contained in the file.
+        for(unsigned i(0); is_valid && i < header->num_traces; ++i) {
+            const persisted_trace *trace(
+                reinterpret_cast<const persisted_trace *>(record));
+
+            is_valid = (record + sizeof *trace) <= end
+                && static_cast<uint64_t>(end - record) >= trace->num_bytes
+                && trace->num_bytes == record_size(
+                    trace->num_blocks, trace->num_relocs,
+                    trace->num_code_bytes)
+                && trace->num_blocks;
+
+            record += trace->num_bytes;
+        }
+
+        if(!is_valid || record != end) {
+            munmap(mapping, info.st_size);
+            return false;
+        }
+
+        FILE_MODULES = reinterpret_cast<const persisted_module_record *>(
+            begin + sizeof *header);
+
+        // Map the file's modules onto the module table, adding in those that
+        // aren't loaded.
+        MODULES_LOCK.acquire();
+        for(unsigned i(0); is_valid && i < header->num_modules; ++i) {
+            unsigned index(find_module_by_id(FILE_MODULES[i].id));
+            if(MAX_NUM_PERSISTED_MODULES == index) {
+                index = add_module(FILE_MODULES[i].id, FILE_MODULES[i].base);
+            }
+            FILE_MODULE_MAP[i] = index;
+            is_valid = MAX_NUM_PERSISTED_MODULES != index;
+        }
+        MODULES_LOCK.release();
+
+        if(!is_valid) {
+            munmap(mapping, info.st_size);
+            FILE_MODULES = nullptr;
+            return false;
+        }
+
+        FILE_BEGIN = begin;
+        FILE_END = end;
+        NUM_FILE_MODULES = header->num_modules;
+        NUM_FILE_TRACES = header->num_traces;
+        return true;
+    }
+
+
+    static char *append_string(char *buff, const char *end, const char *str) {
+        for(; *str && buff < end; ) {
+            *buff++ = *str++;
+        }
+        return buff;
+    }
+
+
+    static char *append_hex(char *buff, const char *end, uint64_t value) {
+        for(int shift(60); shift >= 0 && buff < end; shift -= 4) {
+            *buff++ = "0123456789abcdef"[(value >> shift) & 0xF];
+        }
+        return buff;
+    }
+
+
+    static char *append_decimal(char *buff, const char *end, uint64_t value) {
+        uint64_t max_base(1);
+        for(; value / max_base >= 10; max_base *= 10) { }
+        for(; max_base && buff < end; max_base /= 10) {
+            *buff++ = static_cast<char>('0' + ((value / max_base) % 10));
+        }
+        return buff;
+    }
+
+
+    /// Find the loaded modules, compute the identity of this program, and
+    /// load its persisted code.
+    STATIC_INITIALISE_ID(persistent_cache, {
+        INDEX.construct();
+
+        // Default to a directory that only this user can access, e.g.
+        // `/tmp/granary-1000`.
+        char default_dir[MAX_PATH_LENGTH];
+        const char *dir(getenv("GRANARY_PERSISTENT_CACHE"));
+        if(!dir || !*dir) {
+            char *path(&(default_dir[0]));
+            const char *path_end(&(default_dir[MAX_PATH_LENGTH - 1]));
+            path = append_string(path, path_end, "/tmp/granary-");
+            path = append_decimal(path, path_end, geteuid());
+            *path = '\0';
+            dir = &(default_dir[0]);
+            mkdir(dir, 0700);
+        } else if('0' == dir[0] && '\0' == dir[1]) {
+            return;
+        }
+
+        struct stat dir_info;
+        if(0 != lstat(dir, &dir_info)
+        || !S_ISDIR(dir_info.st_mode)
+        || !is_private(dir_info)) {
+            return;
+        }
+
+        const unsigned main_module(refresh_modules(true));
+        const unsigned granary_module(find_module(
+            reinterpret_cast<uintptr_t>(&persistent_cache::save)));
+
+        if(MAX_NUM_PERSISTED_MODULES == main_module
+        || MAX_NUM_PERSISTED_MODULES == granary_module) {
+            return;
+        }
+
+        const uint64_t ids[] = {
+            MODULES[main_module].id,
+            MODULES[granary_module].id
+        };
+        CACHE_KEY = hash_bytes(&(ids[0]), sizeof ids, PERSISTENT_CACHE_VERSION);
+
+        char *path(&(CACHE_PATH[0]));
+        const char *path_end(&(CACHE_PATH[MAX_PATH_LENGTH - 1]));
+        path = append_string(path, path_end, dir);
+        path = append_string(path, path_end, "/granary-");
+        path = append_hex(path, path_end, CACHE_KEY);
+        path = append_string(path, path_end, ".cache");
+        if(path == path_end) {
+            return;
+        }
+        *path = '\0';
+
+        IS_ENABLED = true;
+        if(map_cache_file()) {
+            index_file_traces();
+        }
+    })
+
+
+    /// Relocate the code of `trace` that was copied to `code`. Returns false
+    /// if a `rel32` can't reach its target.
+    static bool relocate(const persisted_trace *trace, app_pc code) {
+        const persisted_reloc *relocs(relocs_of(trace));
+
+        for(unsigned i(0); i < trace->num_relocs; ++i) {
+            const persisted_reloc &reloc(relocs[i]);
+            app_pc field(code + reloc.instr_offset + reloc.field_offset);
+            app_pc next_pc(code + reloc.instr_offset + reloc.instr_length);
+            const uintptr_t base(
+                MODULES[module_index(trace, reloc.module)].base);
+
+            switch(reloc.kind) {
+            case RELOC_MODULE_REL32: {
+                const app_pc target(
+                    reinterpret_cast<app_pc>(base + reloc.value));
+                if(is_far_away(next_pc, target)) {
+                    return false;
+                }
+                *unsafe_cast<int32_t *>(field) = static_cast<int32_t>(
+                    target - next_pc);
+                break;
+            }
+
+            case RELOC_MODULE_ABS64:
+                *unsafe_cast<uint64_t *>(field) = base + reloc.value;
+                break;
+
+            case RELOC_TRACE_ABS64:
+                *unsafe_cast<uint64_t *>(field) =
+                    reinterpret_cast<uint64_t>(code) + reloc.value;
+                break;
+
+            // Fixed references were checked by `can_install`, and links are
+            // resolved after all other relocations have succeeded.
+            default:
+                break;
+            }
+        }
+
+        return true;
+    }
+
+
+    /// Point the direct jumps of the installed code of `trace` at DBL stubs
+    /// for their target basic blocks. The jumps aren't linked directly to
+    /// targets that are already in the code cache, because only links made
+    /// by patching DBL stubs are undone when their targets are invalidated.
+    static void link(const persisted_trace *trace, app_pc code) {
+        const persisted_reloc *relocs(relocs_of(trace));
+
+        for(unsigned i(0); i < trace->num_relocs; ++i) {
+            const persisted_reloc &reloc(relocs[i]);
+            if(RELOC_LINK != reloc.kind
+            && RELOC_CONDITIONAL_LINK != reloc.kind) {
+                continue;
+            }
+
+            const app_pc cti_pc(code + reloc.instr_offset);
+            const app_pc next_pc(cti_pc + reloc.instr_length);
+            const mangled_address target_address(make_address(
+                MODULES[module_index(trace, reloc.module)].base + reloc.value,
+                reloc.policy_bits));
+
+            const app_pc target(emit_dbl_lookup_stub(
+                cti_pc, target_address, RELOC_CONDITIONAL_LINK == reloc.kind));
+            ASSERT(!is_far_away(next_pc, target));
+
+            *unsafe_cast<int32_t *>(cti_pc + reloc.field_offset) =
+                static_cast<int32_t>(target - next_pc);
+        }
+    }
+
+
+    /// Install the persisted translation of `addr`.
+    app_pc persistent_cache::install(
+        cpu_state_handle cpu,
+        mangled_address addr,
+        unsigned &num_translated_bbs
+    ) {
+        const persisted_trace *trace(nullptr);
+        if(!IS_ENABLED
+        || !INDEX->load(addr.as_address, trace, cpu->id)
+        || !can_install(trace)) {
+            return nullptr;
+        }
+
+        IF_PERF( const uint64_t install_start(perf::timestamp()); )
+
+        // Make it look like a translation to `code_cache::find`, which might
+        // discard the installed block if it loses a race.
+        cpu->block_allocator.allocate_staged<uint8_t>();
+        cpu->stub_allocator.allocate_staged<uint8_t>();
+
+        app_pc code(cpu->current_fragment_allocator->allocate_array<uint8_t>(
+            trace->num_code_bytes));
+        memcpy(code, code_of(trace), trace->num_code_bytes);
+
+        if(!relocate(trace, code)) {
+            cpu->current_fragment_allocator->free_last();
+            IF_PERF( perf::visit_persisted_reject(); )
+            return nullptr;
+        }
+
+        link(trace, code);
+
+        trace_info info;
+        info.start_pc = code;
+        info.num_blocks = trace->num_blocks;
+        info.num_bytes = trace->num_code_bytes;
+        info.info = allocate_memory<basic_block_info>(trace->num_blocks);
+
+        translated_trace *native_code(allocate_translated_trace(
+            code, code + trace->num_code_bytes, trace->num_blocks));
+
+        const persisted_block *blocks(blocks_of(trace));
+        for(unsigned i(0); i < trace->num_blocks; ++i) {
+            const persisted_block &block(blocks[i]);
+            basic_block_info *block_info(&(info.info[i]));
+            const mangled_address am(make_address(
+                MODULES[module_index(trace, block.module)].base
+                    + block.module_offset,
+                block.policy_bits));
+
+            block_info->num_bbs_in_trace = trace->num_blocks;
+            block_info->start_pc = code + block.code_offset;
+            block_info->num_bytes = block.num_bytes;
+            block_info->generating_pc = am;
+            block_info->generating_num_instructions =
+                block.generating_num_instructions;
+            block_info->num_instructions = block.num_instructions;
+            block_info->state = nullptr;
+            block_info->allocator = cpu->current_fragment_allocator;
+
+            translated_block &native_block(native_code->blocks[i]);
+            native_block.begin = am.unmangled_address();
+            native_block.end = native_block.begin
+                + (block.generating_num_instructions
+                    * MAX_NATIVE_INSTRUCTION_LENGTH);
+
+            // Inject all of the internal trace basic blocks into the code
+            // cache. There is no basic block state to commit, as only the
+            // traces of clients without any state are persisted.
+            if(i) {
+                code_cache::add(am.as_address, block_info->start_pc);
+            }
+        }
+
+        store_trace_meta_info(info);
+        add_translated_trace(native_code);
+        num_translated_bbs = trace->num_blocks;
+
+        IF_PERF( perf::visit_trace(trace->num_blocks); )
+        IF_PERF( perf::visit_persisted_install(
+            perf::timestamp() - install_start); )
+
+        return code;
+    }
+
+
+    /// State for recording the relocations of a trace.
+    struct trace_recorder {
+        uintptr_t begin;
+        uintptr_t end;
+        persisted_reloc *relocs;
+        unsigned num_relocs;
+        unsigned max_num_relocs;
+
+
+        inline bool contains(uintptr_t addr) const {
+            return begin <= addr && addr < end;
+        }
+
+
+        /// Add a relocation to the instruction at `pc` of length `length`.
+        bool add(
+            app_pc pc,
+            unsigned length,
+            unsigned field_offset,
+            persisted_reloc_kind kind,
+            unsigned module,
+            uint64_t value
+        ) {
+            if(max_num_relocs <= num_relocs) {
+                return false;
+            }
+
+            persisted_reloc &reloc(relocs[num_relocs++]);
+            memset(&reloc, 0, sizeof reloc);
+            reloc.value = value;
+            reloc.module = module;
+            reloc.instr_offset = static_cast<uint16_t>(
+                reinterpret_cast<uintptr_t>(pc) - begin);
+            reloc.kind = kind;
+            reloc.field_offset = static_cast<uint8_t>(field_offset);
+            reloc.instr_length = static_cast<uint8_t>(length);
+            return true;
+        }
+
+
+        /// Add a relocation for the `rel32` at `field_offset` in the
+        /// instruction at `pc`.
+        bool add_rel32(app_pc pc, unsigned length, unsigned field_offset) {
+            const uintptr_t target(reinterpret_cast<uintptr_t>(pc + length)
+                + *unsafe_cast<int32_t *>(pc + field_offset));
+
+            if(contains(target)) {
+                return true;
+            } else if(is_runtime_address(target)) {
+                return false;
+            }
+
+            const unsigned module(find_or_load_module(target));
+            if(MAX_NUM_PERSISTED_MODULES == module) {
+                return false;
+            }
+
+            return add(pc, length, field_offset, RELOC_MODULE_REL32, module,
+                target - MODULES[module].base);
+        }
+
+
+        /// Add a relocation for a direct jump to the basic block whose
+        /// address is `target_address`.
+        bool add_link(
+            app_pc pc,
+            unsigned length,
+            unsigned field_offset,
+            mangled_address target_address,
+            bool is_conditional
+        ) {
+            const uintptr_t target(reinterpret_cast<uintptr_t>(
+                target_address.unmangled_address()));
+            const unsigned module(find_or_load_module(target));
+            if(MAX_NUM_PERSISTED_MODULES == module) {
+                return false;
+            }
+
+            if(!add(pc, length, field_offset,
+                    is_conditional ? RELOC_CONDITIONAL_LINK : RELOC_LINK,
+                    module, target - MODULES[module].base)) {
+                return false;
+            }
+
+            relocs[num_relocs - 1].policy_bits = static_cast<uint16_t>(
+                target_address.as_uint >> POLICY_BITS_SHIFT);
+            return true;
+        }
+
+
+        /// Record a direct CTI.
+        bool add_direct_cti(
+            instruction in,
+            app_pc pc,
+            unsigned length,
+            unsigned num_prefixes
+        ) {
+            // Targets of `rel8`s must be in the trace.
+            if(MIN_REL32_CTI_LENGTH > (length - num_prefixes)) {
+                const uintptr_t target(reinterpret_cast<uintptr_t>(pc + length)
+                    + *unsafe_cast<int8_t *>(pc + length - 1));
+                return contains(target);
+            }
+
+            const unsigned field_offset(length - sizeof(int32_t));
+            const app_pc target(pc + length
+                + *unsafe_cast<int32_t *>(pc + field_offset));
+
+            if(contains(reinterpret_cast<uintptr_t>(target))) {
+                return true;
+            }
+
+            mangled_address target_address;
+            if(is_dbl_lookup_cti(in, target_address)) {
+                return add_link(pc, length, field_offset, target_address,
+                    !in.is_unconditional_cti());
+            }
+
+            if(is_code_cache_address(target)) {
+                const basic_block_info *info(find_basic_block_info(target));
+                if(!info || info->start_pc != target) {
+                    return false;
+                }
+                return add_link(pc, length, field_offset, info->generating_pc,
+                    !in.is_unconditional_cti());
+            }
+
+            return add_rel32(pc, length, field_offset);
+        }
+
+
+        /// Record the 64-bit immediate at the end of the instruction at `pc`.
+        bool add_abs64(app_pc pc, unsigned length) {
+            const unsigned field_offset(length - sizeof(uint64_t));
+            const uint64_t value(*unsafe_cast<uint64_t *>(pc + field_offset));
+            const uintptr_t addr(value & ADDRESS_MASK);
+
+            if(contains(addr)) {
+                return add(pc, length, field_offset, RELOC_TRACE_ABS64, 0,
+                    value - begin);
+            } else if(is_runtime_address(addr)) {
+                return false;
+            }
+
+            const unsigned module(find_or_load_module(addr));
+            if(MAX_NUM_PERSISTED_MODULES != module) {
+                return add(pc, length, field_offset, RELOC_MODULE_ABS64,
+                    module, value - MODULES[module].base);
+            }
+
+            // Looks like an address of something else, e.g. heap memory.
+            return MIN_PLAUSIBLE_ADDRESS > addr || MAX_USER_ADDRESS <= addr;
+        }
+
+
+        /// Record the absolute addresses and immediates of an instruction
+        /// that has no other relocatable fields.
+        bool add_fixed(instruction in, app_pc pc, unsigned length) {
+            dynamorio::instr_t *instr(in.instr);
+            const int num_srcs(dynamorio::instr_num_srcs(instr));
+            const int num_dsts(dynamorio::instr_num_dsts(instr));
+
+            for(int i(0); i < (num_srcs + num_dsts); ++i) {
+                const operand op(i < num_srcs ?
+                    dynamorio::instr_get_src(instr, i) :
+                    dynamorio::instr_get_dst(instr, i - num_srcs));
+
+                uintptr_t addr(0);
+                bool is_addr(false);
+                // Thread-local addresses, e.g. `FS:[0x28]`, aren't in
+                // modules.
+                if(dynamorio::BASE_DISP_kind == op.kind
+                && (dynamorio::DR_SEG_FS == op.seg.segment
+                    || dynamorio::DR_SEG_GS == op.seg.segment)) {
+                    continue;
+
+                } else if(dynamorio::opnd_is_abs_addr(op)) {
+                    addr = reinterpret_cast<uintptr_t>(
+                        dynamorio::opnd_get_addr(op));
+                    is_addr = true;
+
+                } else if(dynamorio::IMMED_INTEGER_kind == op.kind) {
+                    addr = static_cast<uintptr_t>(op.value.immed_int);
+
+                } else {
+                    continue;
+                }
+
+                if(is_runtime_address(addr)) {
+                    return false;
+                }
+
+                const unsigned module(find_module(addr));
+                if(MAX_NUM_PERSISTED_MODULES != module) {
+                    if(!add(pc, length, 0, RELOC_MODULE_FIXED, module, 0)) {
+                        return false;
+                    }
+                } else if(is_addr) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+
+        /// Record the instruction `in`, which has been encoded into the
+        /// trace. Returns false if the instruction references something that
+        /// can't be persisted.
+        bool add_instruction(instruction in) {
+            app_pc pc(in.pc());
+            const unsigned length(in.instr->length);
+            int num_prefixes(0);
+            unsigned rip_rel_pos(0);
+
+            if(!contains(reinterpret_cast<uintptr_t>(pc)) || !length) {
+                return true;
+            }
+
+            if(static_cast<int>(length) != dynamorio::decode_sizeof(
+                instruction::DCONTEXT, pc, &num_prefixes, &rip_rel_pos)) {
+                return false;
+            }
+
+            const operand target(in.is_cti() ?
+                in.cti_target() : operand());
+            if(in.is_cti() && (dynamorio::opnd_is_pc(target)
+                            || dynamorio::opnd_is_instr(target))) {
+                return add_direct_cti(in, pc, length, num_prefixes);
+            }
+
+            if(rip_rel_pos) {
+                return add_rel32(pc, length, rip_rel_pos);
+            }
+
+            if(ABS64_INSTR_LENGTH <= length && is_abs64(in)) {
+                return add_abs64(pc, length);
+            }
+
+            return add_fixed(in, pc, length);
+        }
+
+
+        /// Returns true iff the last 8 bytes of `in` are a 64-bit address
+        /// or immediate.
+        static bool is_abs64(instruction in) {
+            dynamorio::instr_t *instr(in.instr);
+            const unsigned op_code(in.op_code());
+
+            if(dynamorio::OP_mov_imm == op_code) {
+                const operand src(dynamorio::instr_get_src(instr, 0));
+                return dynamorio::IMMED_INTEGER_kind == src.kind
+                    && dynamorio::OPSZ_8 == src.size;
+            }
+
+            // Only `MOV RAX, moffs64` and friends have absolute addresses
+            // that don't fit in 32 bits.
+            if(dynamorio::OP_mov_ld == op_code
+            || dynamorio::OP_mov_st == op_code) {
+                const operand mem(dynamorio::OP_mov_ld == op_code ?
+                    dynamorio::instr_get_src(instr, 0) :
+                    dynamorio::instr_get_dst(instr, 0));
+
+                if(!dynamorio::opnd_is_abs_addr(mem)) {
+                    return false;
+                }
+
+                const int64_t addr(reinterpret_cast<int64_t>(
+                    dynamorio::opnd_get_addr(mem)));
+                return addr != static_cast<int32_t>(addr);
+            }
+
+            return false;
+        }
+    };
+
+
+    /// Remember a just-emitted trace.
+    void persistent_cache::record(
+        const trace_info &trace,
+        instruction_list &ls
+    ) {
+        if(!IS_ENABLED
+        || basic_block_state::size()
+        || MAX_PERSISTED_TRACE_SIZE <= trace.num_bytes
+        || 0 != (reinterpret_cast<uintptr_t>(trace.start_pc) % CACHE_LINE_SIZE)
+        || MAX_NUM_RECORDED_BYTES <= NUM_RECORDED_BYTES.load()) {
+            return;
+        }
+
+        cpu_state_handle cpu;
+        const persisted_trace *existing_trace(nullptr);
+        if(INDEX->load(trace.info[0].generating_pc.as_address,
+                       existing_trace, cpu->id)) {
+            return;
+        }
+
+        // Every encoded instruction has at most two relocations (e.g. a fixed
+        // absolute address and a fixed immediate).
+        unsigned max_num_relocs(0);
+        for(instruction in(ls.first()); in.is_valid(); in = in.next()) {
+            max_num_relocs += 2;
+        }
+
+        const unsigned max_record_size(static_cast<unsigned>(
+            sizeof(recorded_trace) + record_size(
+                trace.num_blocks, max_num_relocs, trace.num_bytes)));
+
+        recorded_trace *rec(unsafe_cast<recorded_trace *>(
+            allocate_memory<uint8_t>(max_record_size)));
+        memset(rec, 0, sizeof *rec);
+        rec->num_allocated_bytes = max_record_size;
+
+        persisted_trace *persisted(&(rec->trace));
+        persisted->num_code_bytes = trace.num_bytes;
+        persisted->num_blocks = static_cast<uint16_t>(trace.num_blocks);
+
+        bool can_persist(trace.num_blocks == persisted->num_blocks);
+
+        // Record the basic blocks.
+        persisted_block *blocks(const_cast<persisted_block *>(
+            blocks_of(persisted)));
+        for(unsigned i(0); can_persist && i < trace.num_blocks; ++i) {
+            const basic_block_info &info(trace.info[i]);
+            const uintptr_t app_addr(reinterpret_cast<uintptr_t>(
+                info.generating_pc.unmangled_address()));
+            const unsigned module(find_or_load_module(app_addr));
+            if(MAX_NUM_PERSISTED_MODULES == module) {
+                can_persist = false;
+                break;
+            }
+
+            persisted_block &block(blocks[i]);
+            memset(&block, 0, sizeof block);
+            block.module = module;
+            block.module_offset = app_addr - MODULES[module].base;
+            block.policy_bits = static_cast<uint16_t>(
+                info.generating_pc.as_uint >> POLICY_BITS_SHIFT);
+            block.code_offset = static_cast<uint16_t>(
+                info.start_pc - trace.start_pc);
+            block.num_bytes = info.num_bytes;
+            block.generating_num_instructions =
+                info.generating_num_instructions;
+            block.num_instructions = info.num_instructions;
+        }
+
+        // Record the relocations.
+        trace_recorder recorder;
+        recorder.begin = reinterpret_cast<uintptr_t>(trace.start_pc);
+        recorder.end = recorder.begin + trace.num_bytes;
+        recorder.relocs = const_cast<persisted_reloc *>(
+            reinterpret_cast<const persisted_reloc *>(
+                blocks + trace.num_blocks));
+        recorder.num_relocs = 0;
+        recorder.max_num_relocs = max_num_relocs;
+
+        for(instruction in(ls.first());
+            can_persist && in.is_valid();
+            in = in.next()) {
+            can_persist = recorder.add_instruction(in);
+        }
+
+        if(!can_persist) {
+            free_memory<uint8_t>(
+                unsafe_cast<uint8_t *>(rec), max_record_size);
+            IF_PERF( perf::visit_persisted_reject(); )
+            return;
+        }
+
+        persisted->num_relocs = recorder.num_relocs;
+        persisted->num_bytes = static_cast<uint32_t>(record_size(
+            persisted->num_blocks, persisted->num_relocs,
+            persisted->num_code_bytes));
+
+        uint8_t *code(const_cast<uint8_t *>(code_of(persisted)));
+        memset(code, 0, (trace.num_bytes + 7) & ~7U);
+        memcpy(code, trace.start_pc, trace.num_bytes);
+
+        // Lost a race with another recording of the same trace.
+        if(!INDEX->store(trace.info[0].generating_pc.as_address, persisted,
+                         HASH_KEEP_PREV_ENTRY)) {
+            free_memory<uint8_t>(
+                unsafe_cast<uint8_t *>(rec), max_record_size);
+            return;
+        }
+
+        NUM_RECORDED_BYTES.fetch_add(persisted->num_bytes);
+
+        recorded_trace *next(RECORDED_TRACES.load());
+        do {
+            rec->next = next;
+        } while(!RECORDED_TRACES.compare_exchange_weak(next, rec));
+
+        IF_PERF( perf::visit_persisted_record(); )
+    }
+
+
+    /// Buffered writes to a cache file.
+    struct cache_writer {
+        int fd;
+        bool is_ok;
+        unsigned num_buffered_bytes;
+        uint64_t num_bytes;
+        uint8_t buffer[WRITE_BUFFER_SIZE];
+
+
+        void flush(void) {
+            const uint8_t *data(&(buffer[0]));
+            while(is_ok && num_buffered_bytes) {
+                const ssize_t ret(::write(fd, data, num_buffered_bytes));
+                if(0 >= ret) {
+                    is_ok = false;
+                    break;
+                }
+                data += ret;
+                num_buffered_bytes -= static_cast<unsigned>(ret);
+            }
+            num_buffered_bytes = 0;
+        }
+
+
+        void write(const void *data, unsigned size) {
+            const uint8_t *bytes(reinterpret_cast<const uint8_t *>(data));
+            num_bytes += size;
+            while(size) {
+                if(WRITE_BUFFER_SIZE == num_buffered_bytes) {
+                    flush();
+                }
+                unsigned chunk(WRITE_BUFFER_SIZE - num_buffered_bytes);
+                chunk = chunk < size ? chunk : size;
+                memcpy(&(buffer[num_buffered_bytes]), bytes, chunk);
+                num_buffered_bytes += chunk;
+                bytes += chunk;
+                size -= chunk;
+            }
+        }
+
+
+        /// Write out a trace, with its module indexes converted to indexes
+        /// into `MODULES`.
+        void write_trace(const persisted_trace *trace) {
+            write(trace, sizeof *trace);
+
+            const persisted_block *blocks(blocks_of(trace));
+            for(unsigned i(0); i < trace->num_blocks; ++i) {
+                persisted_block block(blocks[i]);
+                block.module = module_index(trace, block.module);
+                write(&block, sizeof block);
+            }
+
+            const persisted_reloc *relocs(relocs_of(trace));
+            for(unsigned i(0); i < trace->num_relocs; ++i) {
+                persisted_reloc reloc(relocs[i]);
+                if(RELOC_TRACE_ABS64 != reloc.kind) {
+                    reloc.module = module_index(trace, reloc.module);
+                }
+                write(&reloc, sizeof reloc);
+            }
+
+            write(code_of(trace), (trace->num_code_bytes + 7) & ~7U);
+        }
+    };
+
+
+    /// Write out the traces of the cache file that can still be used, along
+    /// with the traces recorded by this run, to a new cache file.
+    void persistent_cache::save(void) {
+        recorded_trace *recorded(RECORDED_TRACES.load());
+        if(!IS_ENABLED || !recorded) {
+            return;
+        }
+
+        // Write to a temporary file that is then renamed over the cache file,
+        // so that concurrently starting runs never see a partial file. The
+        // temporary file is created anew, and is only accessible by this
+        // user.
+        char temp_path[MAX_PATH_LENGTH + 24];
+        char *path(&(temp_path[0]));
+        const char *path_end(&(temp_path[sizeof temp_path - 1]));
+        path = append_string(path, path_end, &(CACHE_PATH[0]));
+        path = append_string(path, path_end, ".XXXXXX");
+        *path = '\0';
+
+        static cache_writer writer;
+        writer.fd = mkstemp(&(temp_path[0]));
+        if(-1 == writer.fd) {
+            return;
+        }
+
+        writer.is_ok = true;
+        writer.num_buffered_bytes = 0;
+        writer.num_bytes = 0;
+
+        persisted_cache_header header;
+        memset(&header, 0, sizeof header);
+        header.magic = PERSISTENT_CACHE_MAGIC;
+        header.version = PERSISTENT_CACHE_VERSION;
+        header.key = CACHE_KEY;
+        header.num_modules = NUM_MODULES.load();
+        writer.write(&header, sizeof header);
+
+        for(unsigned i(0); i < header.num_modules; ++i) {
+            persisted_module_record module;
+            module.id = MODULES[i].id;
+            module.base = MODULES[i].base;
+            writer.write(&module, sizeof module);
+        }
+
+        const uint8_t *record(
+            reinterpret_cast<const uint8_t *>(FILE_MODULES + NUM_FILE_MODULES));
+        for(unsigned i(0); i < NUM_FILE_TRACES; ++i) {
+            const persisted_trace *trace(
+                reinterpret_cast<const persisted_trace *>(record));
+            record += trace->num_bytes;
+
+            if(can_save(trace)) {
+                writer.write_trace(trace);
+                ++header.num_traces;
+            }
+        }
+
+        for(; recorded; recorded = recorded->next) {
+            writer.write_trace(&(recorded->trace));
+            ++header.num_traces;
+        }
+
+        writer.flush();
+        header.num_bytes = writer.num_bytes;
+
+        bool is_ok(writer.is_ok && static_cast<ssize_t>(sizeof header) ==
+            pwrite(writer.fd, &header, sizeof header, 0));
+        is_ok = (0 == close(writer.fd)) && is_ok;
+
+        if(!is_ok || 0 != rename(&(temp_path[0]), &(CACHE_PATH[0]))) {
+            unlink(&(temp_path[0]));
+        }
+    }
+
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+    static bool is_any_trace(app_pc, const persisted_trace *) {
+        return true;
+    }
+
+
+    /// Forget the traces of this run and of the old cache file, and then map
+    /// in the cache file again, as if this were a later run of the program.
+    unsigned persistent_cache::reload(void) {
+        if(!IS_ENABLED) {
+            return 0;
+        }
+
+        INDEX->remove_if(is_any_trace);
+
+        recorded_trace *recorded(RECORDED_TRACES.exchange(nullptr));
+        for(recorded_trace *next(nullptr); recorded; recorded = next) {
+            next = recorded->next;
+            free_memory<uint8_t>(
+                unsafe_cast<uint8_t *>(recorded),
+                recorded->num_allocated_bytes);
+        }
+        NUM_RECORDED_BYTES.store(0);
+
+        if(FILE_BEGIN) {
+            munmap(const_cast<uint8_t *>(FILE_BEGIN), FILE_END - FILE_BEGIN);
+            FILE_BEGIN = nullptr;
+            FILE_END = nullptr;
+            FILE_MODULES = nullptr;
+            NUM_FILE_MODULES = 0;
+            NUM_FILE_TRACES = 0;
+        }
+
+        if(map_cache_file()) {
+            index_file_traces();
+        }
+        return NUM_FILE_TRACES;
+    }
+#endif /* CONFIG_DEBUG_RUN_TEST_CASES */
+}
+
+#endif /* CONFIG_PERSISTENT_CODE_CACHE */
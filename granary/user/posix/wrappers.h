@@ -9,6 +9,8 @@
 #ifndef granary_USER_POSIX_OVERRIDE_WRAPPERS_H_
 #define granary_USER_POSIX_OVERRIDE_WRAPPERS_H_
 
+#include "granary/user/posix/invalidate.h"
+
 
 /// Disable wrapping of some Mac OS X types.
 #define APP_WRAPPER_FOR_struct___sFILE
@@ -113,6 +115,44 @@
 #endif
 
 
+/// The dynamic linker unmaps the library's code without going through
+/// `munmap`, so the unloaded code is found by comparing the loaded libraries
+/// before and after the `dlclose`.
+#if defined(CAN_WRAP_dlclose) && CAN_WRAP_dlclose
+#   define APP_WRAPPER_FOR_dlclose
+    FUNCTION_WRAPPER(APP, dlclose, (int), (void *handle), {
+        granary::unloaded_code_tracker tracker;
+        const int ret(dlclose(VALID_ADDRESS(handle)));
+        tracker.invalidate_unloaded_code();
+        return ret;
+    })
+#endif
+
+
+#if defined(CAN_WRAP_munmap) && CAN_WRAP_munmap
+#   define APP_WRAPPER_FOR_munmap
+    FUNCTION_WRAPPER(APP, munmap, (int), (void *addr, size_t len), {
+        const int ret(munmap(VALID_ADDRESS(addr), len));
+        if(!ret) {
+            granary::invalidate_unmapped_code(VALID_ADDRESS(addr), len);
+        }
+        return ret;
+    })
+#endif
+
+
+#if defined(CAN_WRAP_mprotect) && CAN_WRAP_mprotect
+#   define APP_WRAPPER_FOR_mprotect
+    FUNCTION_WRAPPER(APP, mprotect, (int), (void *addr, size_t len, int prot), {
+        const int ret(mprotect(VALID_ADDRESS(addr), len, prot));
+        if(!ret) {
+            granary::invalidate_protected_code(VALID_ADDRESS(addr), len, prot);
+        }
+        return ret;
+    })
+#endif
+
+
 #if defined(CAN_WRAP_dlsym) && CAN_WRAP_dlsym
 #   define APP_WRAPPER_FOR_dlsym
     FUNCTION_WRAPPER(APP, dlsym, (void *), (void *handle, const char* symbol), {
@@ -8,13 +8,101 @@
  */
 
 #include <atomic>
+#include <new>
 #include "granary/state.h"
+#include "granary/spin_lock.h"
+#include "granary/detach.h"
+#include "granary/perf.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <linux/futex.h>
+
+
+/// Detecting that the owner of a thread state has exited depends on the
+/// layout of glibc's `pthread_mutex_t` (see `is_cpu_state_dead`).
+#ifndef __GLIBC__
+#   error "Detecting exited threads requires glibc's robust mutexes."
+#endif
 
 namespace granary {
 
     /// User space thread-local storage.
     __thread cpu_state *CPU_STATE(nullptr);
 
+
+    /// Used to give each thread's state a unique id.
+    static std::atomic<unsigned> NEXT_CPU_ID = ATOMIC_VAR_INIT(0U);
+
+    /// List of all thread states.
+    static std::atomic<cpu_state *> CPU_STATES = ATOMIC_VAR_INIT(nullptr);
+
+
+    /// Pool of the states of exited threads. New threads adopt these states,
+    /// along with their warm CPU-private code caches, instead of allocating
+    /// new states.
+    static cpu_state *PARKED_CPU_STATES(nullptr);
+    static atomic_spin_lock PARKED_CPU_STATES_LOCK;
+
+
+    /// Thread-specific key whose destructor parks the state of an exiting
+    /// thread.
+    static pthread_key_t CPU_STATE_KEY;
+    static pthread_once_t CPU_STATE_KEY_ONCE = PTHREAD_ONCE_INIT;
+
+
+    /// Returns the first thread state in the list of all thread states.
+    cpu_state *first_cpu_state(void) {
+        return CPU_STATES.load();
+    }
+
+
+    /// Returns the current thread's state, if it has one.
+    cpu_state *current_cpu_state(void) {
+        return CPU_STATE;
+    }
+
+
+    /// The kernel marks a robust mutex as having a dead owner by setting
+    /// `FUTEX_OWNER_DIED` in the mutex's futex word, which glibc keeps in
+    /// the first (`int`-sized) field of the mutex. Reading that word
+    /// directly is the only way to check whether another thread has exited
+    /// without taking (and so changing the owner of) its mutex, so make sure
+    /// that glibc's layout is still the expected one.
+    static_assert(0 == offsetof(pthread_mutex_t, __data.__lock),
+        "glibc's robust mutex futex word has moved.");
+    static_assert(sizeof(int) == sizeof(pthread_mutex_t().__data.__lock),
+        "glibc's robust mutex futex word has changed size.");
+
+
+    /// Returns true iff `state` is parked, and the thread that last owned it
+    /// has finished exiting.
+    bool is_cpu_state_dead(const cpu_state *state) {
+        const code_cache_reclaim_state &reclaim(state->code_cache_reclaim);
+        if(!reclaim.is_parked) {
+            return false;
+        }
+
+        // An exiting thread can still execute code in the code cache after
+        // its state is parked, up until the kernel marks its robust mutexes
+        // as having a dead owner.
+        const int owner_word(__atomic_load_n(
+            &(reclaim.owner_lock.__data.__lock), __ATOMIC_ACQUIRE));
+        return 0 != (owner_word & FUTEX_OWNER_DIED);
+    }
+
+
+    /// Invoke `func` on the state of every thread.
+    void for_each_cpu_state(void (*func)(cpu_state *, void *), void *data) {
+        for(cpu_state *state(CPU_STATES.load());
+            state;
+            state = state->code_cache_reclaim.next) {
+            func(state, data);
+        }
+    }
+
+
     extern "C" uint64_t *granary_get_private_stack_top(void)
     {
         return &(cpu_state_handle()->stack.top[0]);
@@ -25,14 +113,151 @@ namespace granary {
     { }
 
 
+    /// Park the state of an exiting thread so that a new thread can adopt
+    /// it once the exiting thread is gone. The state's fragment, stub, and
+    /// block allocators stay with it, as their memory backs code that is
+    /// committed to the code cache, but its transient and free memory, and
+    /// the free objects of its heap magazines, are returned to the shared
+    /// pools.
+    ///
+    /// Note: The exiting thread keeps using its state, e.g. in later TLS
+    ///       destructors, so that it never attaches to another state.
+    static void park_cpu_state(void *state_) {
+        cpu_state *state(reinterpret_cast<cpu_state *>(state_));
+
+        state->transient_allocator.free_all();
+        state->transient_allocator.share_free_slabs();
+        state->instruction_allocator.free_all();
+        state->instruction_allocator.share_free_slabs();
+        state->fragment_allocator.share_free_slabs();
+        detail::flush_heap_cache(state->heap_cache);
+
+        PARKED_CPU_STATES_LOCK.acquire();
+        state->code_cache_reclaim.next_parked = PARKED_CPU_STATES;
+        state->code_cache_reclaim.is_parked = true;
+        PARKED_CPU_STATES = state;
+        PARKED_CPU_STATES_LOCK.release();
+
+        IF_PERF( perf::visit_parked_thread_state(); )
+    }
+
+
+    /// The thread-exit hook is invoked by (instrumented) libc.
+    GRANARY_DETACH_POINT(park_cpu_state)
+
+
+    static void create_cpu_state_key(void) {
+        pthread_key_create(&CPU_STATE_KEY, &park_cpu_state);
+    }
+
+
+    /// Adopt the parked state of a thread that has finished exiting. Returns
+    /// `nullptr` if there is no such state.
+    static cpu_state *adopt_cpu_state(void) {
+        if(!PARKED_CPU_STATES) {
+            return nullptr;
+        }
+
+        cpu_state *state(nullptr);
+        int lock_error(0);
+        PARKED_CPU_STATES_LOCK.acquire();
+        for(cpu_state **next_ptr(&PARKED_CPU_STATES);
+            *next_ptr;
+            next_ptr = &((*next_ptr)->code_cache_reclaim.next_parked)) {
+
+            if(is_cpu_state_dead(*next_ptr)) {
+                state = *next_ptr;
+                *next_ptr = state->code_cache_reclaim.next_parked;
+                break;
+            }
+        }
+
+        // Take over the dead owner's lock, so that the state is marked as
+        // dead again when the current thread exits.
+        if(state) {
+            pthread_mutex_t &owner_lock(state->code_cache_reclaim.owner_lock);
+            lock_error = pthread_mutex_trylock(&owner_lock);
+            if(EOWNERDEAD == lock_error) {
+                lock_error = pthread_mutex_consistent(&owner_lock);
+            }
+        }
+
+        // The new thread has a new stack, which must be scanned before any
+        // flushed code is reclaimed. The state's code cache generation is
+        // left alone: if the code cache has since been flushed, then the
+        // state's code is retired (and its CPU-private code cache is
+        // cleared) when the new thread first enters `code_cache::find`.
+        if(state) {
+            code_cache_reclaim_state &reclaim(state->code_cache_reclaim);
+            reclaim.in_find = false;
+            reclaim.scanned_epoch = 0;
+            reclaim.num_finds_since_scan = 0;
+            reclaim.next_parked = nullptr;
+            reclaim.is_parked = false;
+
+            state->thread_data.~thread_state();
+            new (&(state->thread_data)) thread_state;
+        }
+        PARKED_CPU_STATES_LOCK.release();
+
+        ASSERT(!lock_error);
+        return state;
+    }
+
+
+    /// Find the bounds of the current thread's stack.
+    static void find_stack_bounds(code_cache_reclaim_state &state) {
+        pthread_attr_t attr;
+        void *stack(nullptr);
+        size_t stack_size(0);
+        if(!pthread_getattr_np(pthread_self(), &attr)) {
+            pthread_attr_getstack(&attr, &stack, &stack_size);
+            pthread_attr_destroy(&attr);
+        }
+        state.stack_begin = reinterpret_cast<uintptr_t>(stack);
+        state.stack_end = state.stack_begin + stack_size;
+    }
+
+
+    /// Give the current thread a state, preferably by adopting the state of
+    /// an exited thread.
+    static cpu_state *attach_cpu_state(void) {
+        pthread_once(&CPU_STATE_KEY_ONCE, &create_cpu_state_key);
+
+        cpu_state *state(adopt_cpu_state());
+        if(state) {
+            IF_PERF( perf::visit_adopted_thread_state(); )
+        } else {
+            state = allocate_memory<cpu_state>();
+            state->id = NEXT_CPU_ID.fetch_add(1);
+
+            pthread_mutex_t &owner_lock(state->code_cache_reclaim.owner_lock);
+            pthread_mutexattr_t attr;
+            pthread_mutexattr_init(&attr);
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+            pthread_mutex_init(&owner_lock, &attr);
+            pthread_mutexattr_destroy(&attr);
+            pthread_mutex_lock(&owner_lock);
+
+            cpu_state *next(CPU_STATES.load());
+            do {
+                state->code_cache_reclaim.next = next;
+            } while(!CPU_STATES.compare_exchange_weak(next, state));
+
+            IF_PERF( perf::visit_allocated_thread_state(); )
+        }
+
+        find_stack_bounds(state->code_cache_reclaim);
+        pthread_setspecific(CPU_STATE_KEY, state);
+        return state;
+    }
+
+
     cpu_state_handle::cpu_state_handle(void) 
         : state(CPU_STATE)
     {
         if(!state) {
-            state = CPU_STATE = allocate_memory<cpu_state>();
+            state = CPU_STATE = attach_cpu_state();
         }
     }
 }
-
-
-
@@ -29,8 +29,16 @@
 #include <linux/gfp.h>
 #include <linux/stop_machine.h>
 #include <linux/types.h>
+#include <linux/topology.h>
 #include <linux/debugfs.h>
 #include <linux/relay.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/uaccess.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/err.h>
 
 #include <asm/page.h>
 #include <asm/cacheflush.h>
@@ -66,6 +74,20 @@
 MODULE_LICENSE("Dual BSD/GPL");
 
 
+/// Size (in bytes) of each CPU's execution trace buffer. Zero means that
+/// Granary's default size is used.
+static unsigned long trace_buffer_size = 0;
+module_param(trace_buffer_size, ulong, 0444);
+MODULE_PARM_DESC(trace_buffer_size,
+    "Size (in bytes) of each CPU's execution trace buffer.");
+
+
+/// Returns the size of each CPU's execution trace buffer.
+unsigned long kernel_trace_buffer_size(void) {
+    return trace_buffer_size;
+}
+
+
 /// Configuration for RelayFS.
 #define SUBBUF_SIZE 1048576
 #define N_SUBBUFS 8
@@ -85,6 +107,18 @@ void **kernel_get_cpu_state(void *ptr[]) {
 }
 
 
+/// Get the ID of the current CPU.
+int kernel_get_cpu_id(void) {
+    return raw_smp_processor_id();
+}
+
+
+/// Get the NUMA node of the current CPU.
+int kernel_get_numa_node(void) {
+    return numa_node_id();
+}
+
+
 /// Get access to the per-task Granary state. The Granary state field might
 /// be as small as a pointer, or might be a larger structure, depending on how
 /// the kernel's task struct has been changed.
@@ -141,6 +175,25 @@ extern void granary_initialise(void);
 extern void granary_report(void);
 
 
+/// C function defined in granary/kernel/module.cc that returns the address and
+/// size of Granary's exported performance counters, or NULL if performance
+/// counters are disabled.
+extern const void *granary_perf_counters(unsigned long *size);
+
+
+/// C function defined in granary/kernel/module.cc that returns the address and
+/// size of the client's exported binary log, or NULL if the client doesn't
+/// export a log.
+extern const void *granary_client_log(unsigned long *size);
+
+
+/// C function defined in granary/kernel/module.cc that drains the per-CPU
+/// execution trace buffers into a buffer, and returns the number of bytes
+/// drained.
+extern unsigned long granary_trace_drain(
+    char *buff, unsigned long size, int with_info);
+
+
 /// Function that is called before granary faults.
 void granary_break_on_fault(void) {
     __asm__ __volatile__ ("");
@@ -173,6 +226,42 @@ void kernel_run_synchronised(void (*func)(void)) {
 }
 
 
+/// Kernel threads started by Granary. These are stopped when Granary is
+/// unloaded.
+#define MAX_NUM_THREADS 64
+static struct task_struct *THREADS[MAX_NUM_THREADS];
+static int NUM_THREADS = 0;
+
+
+/// Start a kernel thread that runs `func(data)`.
+int kernel_start_thread(int (*func)(void *), void *data, const char *name) {
+    struct task_struct *thread = NULL;
+    if(MAX_NUM_THREADS <= NUM_THREADS) {
+        return -ENOMEM;
+    }
+
+    thread = kthread_run(func, data, "%s", name);
+    if(IS_ERR(thread)) {
+        return PTR_ERR(thread);
+    }
+
+    THREADS[NUM_THREADS++] = thread;
+    return 0;
+}
+
+
+/// Returns non-zero iff the current kernel thread should stop.
+int kernel_thread_should_stop(void) {
+    return kthread_should_stop();
+}
+
+
+/// Sleep for about `num_us` microseconds.
+void kernel_sleep_us(unsigned long num_us) {
+    usleep_range(num_us, 2 * num_us);
+}
+
+
 /// Log some data to user space through RelayFS.
 void kernel_log(const char *data, size_t size) {
     if(GRANARY_RELAY_CHANNEL) {
@@ -560,6 +649,107 @@ static ssize_t device_read(
 }
 
 
+/// Read Granary's performance counters from the `granary_perf` debugfs file.
+static ssize_t perf_read(
+    struct file *file, char *str, size_t size, loff_t *offset
+) {
+    unsigned long counters_size = 0;
+    const void *counters = granary_perf_counters(&counters_size);
+    (void) file;
+    if(!counters) {
+        return 0;
+    }
+    return simple_read_from_buffer(
+        str, size, offset, counters, counters_size);
+}
+
+
+/// Read the client's log from the `granary_log` debugfs file.
+static ssize_t log_read(
+    struct file *file, char *str, size_t size, loff_t *offset
+) {
+    unsigned long log_size = 0;
+    const void *log = granary_client_log(&log_size);
+    (void) file;
+    if(!log) {
+        return 0;
+    }
+    return simple_read_from_buffer(str, size, offset, log, log_size);
+}
+
+
+/// Map a page of the client's log into a reader's address space. The log
+/// lives in module memory, which is allocated with `vmalloc`.
+static int log_fault(struct vm_area_struct *vma, struct vm_fault *vmf) {
+    unsigned long log_size = 0;
+    const char *log = (const char *) granary_client_log(&log_size);
+    unsigned long offset = vmf->pgoff << PAGE_SHIFT;
+    (void) vma;
+    if(!log || offset >= log_size) {
+        return VM_FAULT_SIGBUS;
+    }
+    vmf->page = vmalloc_to_page(log + offset);
+    get_page(vmf->page);
+    return 0;
+}
+
+
+static struct vm_operations_struct log_vm_operations = {
+    .fault      = log_fault
+};
+
+
+/// Map the client's log from the `granary_log` debugfs file. The mapping is
+/// read-only, and reflects new log records as they are written.
+static int log_mmap(struct file *file, struct vm_area_struct *vma) {
+    (void) file;
+    if(vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_ops = &log_vm_operations;
+    return 0;
+}
+
+
+enum {
+    TRACE_READ_SIZE = 65536
+};
+
+
+/// Drained trace chunks that are waiting to be copied to user space.
+static DEFINE_MUTEX(TRACE_LOCK);
+static char TRACE_CHUNKS[TRACE_READ_SIZE];
+
+
+/// Stream the execution trace from the `granary_trace` debugfs file. Every
+/// read drains whatever the per-CPU trace buffers have accumulated since the
+/// last read, so the file is read like a pipe. The first read of an open file
+/// also emits a header chunk that describes the stream.
+static ssize_t trace_read(
+    struct file *file, char *str, size_t size, loff_t *offset
+) {
+    unsigned long drained = 0;
+    ssize_t ret = 0;
+    (void) file;
+
+    if(size > TRACE_READ_SIZE) {
+        size = TRACE_READ_SIZE;
+    }
+
+    mutex_lock(&TRACE_LOCK);
+    drained = granary_trace_drain(TRACE_CHUNKS, size, 0 == *offset);
+    if(drained && copy_to_user(str, TRACE_CHUNKS, drained)) {
+        ret = -EFAULT;
+    } else {
+        ret = (ssize_t) drained;
+        *offset += drained;
+    }
+    mutex_unlock(&TRACE_LOCK);
+    return ret;
+}
+
+
 static struct dentry *create_relay_file_handler(
     const char *filename,
     struct dentry *parent,
@@ -590,6 +780,30 @@ static struct file_operations operations = {
 };
 
 
+static struct file_operations perf_operations = {
+    .owner      = THIS_MODULE,
+    .read       = perf_read
+};
+
+
+static struct file_operations log_operations = {
+    .owner      = THIS_MODULE,
+    .read       = log_read,
+    .mmap       = log_mmap
+};
+
+
+static struct file_operations trace_operations = {
+    .owner      = THIS_MODULE,
+    .read       = trace_read
+};
+
+
+static struct dentry *PERF_FILE = NULL;
+static struct dentry *LOG_FILE = NULL;
+static struct dentry *TRACE_FILE = NULL;
+
+
 static struct miscdevice device = {
     .minor      = 0,
     .name       = "granary",
@@ -640,6 +854,27 @@ static int init_granary(void) {
         printk("[granary] Relay channel initialised.\n");
     }
 
+    // Export performance counters through debugfs.
+    PERF_FILE = debugfs_create_file(
+        "granary_perf", 0444, NULL, NULL, &perf_operations);
+    if(!PERF_FILE) {
+        printk("[granary] Unable to create the `granary_perf` file.\n");
+    }
+
+    // Export the client's binary log through debugfs.
+    LOG_FILE = debugfs_create_file(
+        "granary_log", 0444, NULL, NULL, &log_operations);
+    if(!LOG_FILE) {
+        printk("[granary] Unable to create the `granary_log` file.\n");
+    }
+
+    // Export the execution trace through debugfs.
+    TRACE_FILE = debugfs_create_file(
+        "granary_trace", 0444, NULL, NULL, &trace_operations);
+    if(!TRACE_FILE) {
+        printk("[granary] Unable to create the `granary_trace` file.\n");
+    }
+
     printk("[granary] Done; waiting for command to initialise Granary.\n");
 
     return 0;
@@ -652,8 +887,16 @@ static void exit_granary(void) {
     struct kernel_module *next_mod = NULL;
 
     printk("Unloading Granary... Goodbye!\n");
+
+    for(; NUM_THREADS > 0; --NUM_THREADS) {
+        kthread_stop(THREADS[NUM_THREADS - 1]);
+    }
+
     unregister_module_notifier(&NOTIFIER_BLOCK);
     misc_deregister(&device);
+    debugfs_remove(PERF_FILE);
+    debugfs_remove(LOG_FILE);
+    debugfs_remove(TRACE_FILE);
 
     // free the memory associated with internal modules
     for(; NULL != mod; mod = next_mod) {
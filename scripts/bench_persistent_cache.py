@@ -0,0 +1,105 @@
+"""Measure how long a program takes to start doing useful work under Granary,
+with and without the persistent code cache (`CONFIG_PERSISTENT_CODE_CACHE`).
+
+The program is run `-n` times with persistence disabled, and then `-n` times
+with persistence enabled after one warm-up run that fills the cache. The time
+to useful work is the time until the program exits, or until it first prints
+the `--until` marker to its standard output.
+
+Usage:
+
+  python scripts/bench_persistent_cache.py [-n 10] [--until MARKER] \\
+      [--cache-dir DIR] -- command [args ...]
+
+Note: A newline is written to the program's standard input so that Granary
+      doesn't wait for GDB to attach (`DEBUG_GDB_ATTACH_AT_INIT`).
+
+Copyright (C) 2013, Peter Goodman. All rights reserved.
+"""
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+
+LIBGRANARY = os.path.join(
+    os.path.dirname(os.path.dirname(os.path.abspath(__file__))),
+    "bin", "libgranary.so")
+
+
+def time_run(command, cache_dir, until):
+  """Run `command` once, and return the number of seconds until it exits or
+  prints `until`."""
+  env = dict(os.environ)
+  env["LD_PRELOAD"] = LIBGRANARY
+  env["GRANARY_PERSISTENT_CACHE"] = cache_dir
+
+  start = time.time()
+  proc = subprocess.Popen(
+      command, env=env, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+  proc.stdin.write(b"\n")
+  proc.stdin.close()
+
+  elapsed = None
+  if until:
+    marker = until.encode("latin-1")
+    for line in iter(proc.stdout.readline, b""):
+      if marker in line:
+        elapsed = time.time() - start
+        break
+
+  proc.stdout.read()
+  proc.wait()
+  if elapsed is None:
+    elapsed = time.time() - start
+  return elapsed
+
+
+def summarise(name, times):
+  times = sorted(times)
+  median = times[len(times) // 2]
+  sys.stdout.write("%s: median %.3fs, min %.3fs, max %.3fs\n" % (
+      name, median, times[0], times[-1]))
+  return median
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+  parser.add_argument("-n", type=int, default=10,
+                      help="Number of timed runs of each configuration.")
+  parser.add_argument("--until", default=None,
+                      help="Stop timing when this is printed to stdout.")
+  parser.add_argument("--cache-dir", default=None,
+                      help="Directory of the cache file (default: a new "
+                           "temporary directory).")
+  parser.add_argument("command", nargs=argparse.REMAINDER)
+  args = parser.parse_args()
+
+  command = args.command
+  if command and "--" == command[0]:
+    command = command[1:]
+  if not command:
+    parser.error("missing command to run")
+
+  cache_dir = args.cache_dir or tempfile.mkdtemp(prefix="granary-cache-")
+  try:
+    cold = [time_run(command, "0", args.until) for _ in range(args.n)]
+
+    time_run(command, cache_dir, args.until)
+    warm = [time_run(command, cache_dir, args.until) for _ in range(args.n)]
+  finally:
+    if not args.cache_dir:
+      shutil.rmtree(cache_dir, ignore_errors=True)
+
+  cold_median = summarise("Without persistence", cold)
+  warm_median = summarise("With persistence", warm)
+  if warm_median:
+    sys.stdout.write("Speedup: %.2fx\n" % (cold_median / warm_median))
+
+
+if __name__ == "__main__":
+  main()
@@ -0,0 +1,127 @@
+"""Read the binary profiles that are emitted by the CFG tool. The format is
+described in `clients/cfg/profile.h`.
+
+Usage as a library:
+
+  with open(path, "rb") as f:
+    profile = cfg_profile.Profile(f.read())
+  for block in profile.blocks:
+    ...
+
+Copyright (C) 2013, Peter Goodman. All rights reserved.
+"""
+
+import struct
+import sys
+
+
+CFG_PROFILE_MAGIC = 0x47464347
+CFG_PROFILE_VERSION = 1
+CFG_PROFILE_NO_MODULE = 0xFFFFFFFF
+
+CFG_PROFILE_MODULE = 1
+CFG_PROFILE_BLOCK = 2
+CFG_PROFILE_EDGE = 3
+
+CFG_EDGE_JMP = 0
+CFG_EDGE_CALL = 1
+CFG_EDGE_JCC = 2
+CFG_EDGE_INDIRECT_JMP = 3
+CFG_EDGE_INDIRECT_CALL = 4
+
+JCC_NAMES = (
+  "jo", "jno", "jb", "jnb", "jz", "jnz", "jbe", "jnbe",
+  "js", "jns", "jp", "jnp", "jl", "jnl", "jle", "jnle")
+
+HEADER = struct.Struct("<IIIIQ")
+RECORD = struct.Struct("<II")
+MODULE = struct.Struct("<II56s")
+BLOCK = struct.Struct("<QQQQQIIIIII")
+EDGE = struct.Struct("<IIQQQ")
+
+
+def is_profile(data):
+  """Returns True if `data` begins with a binary profile header."""
+  return len(data) >= 4 and \
+      CFG_PROFILE_MAGIC == struct.unpack_from("<I", data, 0)[0]
+
+
+class Module(object):
+  __slots__ = ('module_id', 'name')
+  def __init__(self, module_id, name):
+    self.module_id = module_id
+    self.name = name
+
+
+class Edge(object):
+  __slots__ = ('kind', 'condition', 'cti_pc', 'target_pc', 'fall_through_pc')
+  def __init__(self, fields):
+    self.kind, self.condition, self.cti_pc, self.target_pc, \
+        self.fall_through_pc = fields
+
+  def condition_name(self):
+    return JCC_NAMES[self.condition]
+
+
+class Block(object):
+  __slots__ = ('app_pc', 'cache_offset', 'allocator', 'num_executions',
+               'num_fall_through_executions', 'num_bytes', 'num_bbs_in_trace',
+               'module', 'module_offset', 'edges')
+  def __init__(self, fields, modules):
+    self.app_pc, self.cache_offset, self.allocator, self.num_executions, \
+        self.num_fall_through_executions, self.num_bytes, \
+        self.num_bbs_in_trace, module_id, self.module_offset = fields[:9]
+    self.module = modules.get(module_id)
+    self.edges = []
+
+
+class Profile(object):
+  """A parsed binary profile."""
+
+  def __init__(self, data):
+    magic, version, header_size, is_kernel, num_blocks = \
+        HEADER.unpack_from(data, 0)
+    if CFG_PROFILE_MAGIC != magic:
+      raise ValueError("Not a CFG profile.")
+    if CFG_PROFILE_VERSION != version:
+      raise ValueError("Unsupported CFG profile version %d." % version)
+
+    self.is_kernel = bool(is_kernel)
+    self.num_blocks = num_blocks
+    self.modules = {}
+    self.blocks = []
+
+    offset = header_size
+    end = len(data)
+    block = None
+    while offset + RECORD.size <= end:
+      kind, size = RECORD.unpack_from(data, offset)
+      if size < RECORD.size or offset + size > end:
+        break  # Truncated profile.
+
+      body = offset + RECORD.size
+      if CFG_PROFILE_BLOCK == kind:
+        block = Block(BLOCK.unpack_from(data, body), self.modules)
+        self.blocks.append(block)
+      elif CFG_PROFILE_EDGE == kind and block:
+        block.edges.append(Edge(EDGE.unpack_from(data, body)))
+      elif CFG_PROFILE_MODULE == kind:
+        module_id, _, name = MODULE.unpack_from(data, body)
+        name = name.split(b"\0", 1)[0].decode("latin-1")
+        self.modules[module_id] = Module(module_id, name)
+
+      offset += size
+
+
+def load(path):
+  with open(path, "rb") as f:
+    return Profile(f.read())
+
+
+# Print a summary of a profile given as input.
+if __name__ == "__main__":
+  PROFILE = load(sys.argv[1])
+  NUM_EDGES = sum(len(b.edges) for b in PROFILE.blocks)
+  NUM_EXECUTIONS = sum(b.num_executions for b in PROFILE.blocks)
+  sys.stdout.write("%d blocks, %d edges, %d modules, %d executions\n" % (
+      len(PROFILE.blocks), NUM_EDGES, len(PROFILE.modules), NUM_EXECUTIONS))
@@ -0,0 +1,137 @@
+"""Decode an execution trace recorded by Granary.
+
+Usage: python decode_trace.py [--regs] [/tmp/granary-trace.<pid>]
+
+In user space, traces are streamed to `/tmp/granary-trace.<pid>`. In kernel
+space, traces are streamed by reading `/sys/kernel/debug/granary_trace`, e.g.
+with `cat /sys/kernel/debug/granary_trace > trace`. The trace is made up of
+chunks; the data chunks of each CPU (thread, in user space) together form a
+stream of records. This prints the code cache address of every entry of every
+CPU, one CPU after the other.
+
+Copyright (C) 2013, Peter Goodman. All rights reserved.
+"""
+
+import struct
+import sys
+
+
+TRACE_STREAM_MAGIC = 0x43525447
+TRACE_STREAM_VERSION = 1
+
+TRACE_CHUNK_DATA = 0
+TRACE_CHUNK_INFO = 1
+
+TRACE_RECORD_DELTA = 0
+TRACE_RECORD_SYNC = 1
+TRACE_RECORD_REGS = 2
+
+CHUNK_HEADER = struct.Struct("<HHI")
+STREAM_INFO = struct.Struct("<4I")
+SYNC = struct.Struct("<3Q")
+
+REGS = ("r15", "r14", "r13", "r12", "r11", "r10", "r9", "r8", "rdi", "rsi",
+        "rbp", "rbx", "rdx", "rcx", "rax", "rsp")
+
+MASK_64 = (1 << 64) - 1
+
+
+class Entry(object):
+  __slots__ = ('cpu', 'pc', 'timestamp', 'num_dropped', 'regs')
+  def __init__(self, cpu, pc, timestamp=None, num_dropped=None, regs=None):
+    self.cpu = cpu
+    self.pc = pc
+    self.timestamp = timestamp
+    self.num_dropped = num_dropped
+    self.regs = regs
+
+
+def read_chunks(data):
+  """Split a trace into its info and the concatenated data of each CPU."""
+  info = None
+  streams = {}
+  offset = 0
+  while offset + CHUNK_HEADER.size <= len(data):
+    cpu, kind, size = CHUNK_HEADER.unpack_from(data, offset)
+    offset += CHUNK_HEADER.size
+    payload = data[offset:offset + size]
+    offset += size
+    if TRACE_CHUNK_INFO == kind:
+      info = STREAM_INFO.unpack_from(payload, 0)
+    elif TRACE_CHUNK_DATA == kind:
+      streams.setdefault(cpu, []).append(payload)
+  return info, dict((cpu, b"".join(parts)) for cpu, parts in streams.items())
+
+
+def read_varint(data, offset):
+  val = 0
+  shift = 0
+  while True:
+    byte = bytearray(data[offset:offset + 1])[0]
+    offset += 1
+    val |= (byte & 0x7F) << shift
+    shift += 7
+    if not (byte & 0x80):
+      return val, offset
+
+
+def decode_stream(cpu, data, regs_size):
+  """Generate the entries of one CPU's stream of records."""
+  pc = 0
+  offset = 0
+  while offset < len(data):
+    header, offset = read_varint(data, offset)
+    kind = header & 3
+    if TRACE_RECORD_DELTA == kind:
+      zig_zag = header >> 2
+      delta = (zig_zag >> 1) ^ -(zig_zag & 1)
+      pc = (pc + delta) & MASK_64
+      yield Entry(cpu, pc)
+      continue
+
+    pc, timestamp, num_dropped = SYNC.unpack_from(data, offset)
+    offset += SYNC.size
+    regs = None
+    if TRACE_RECORD_REGS == kind:
+      vals = struct.unpack_from("<%dQ" % (regs_size // 8), data, offset)
+      regs = dict(zip(REGS, vals))
+      offset += regs_size
+    yield Entry(cpu, pc, timestamp, num_dropped, regs)
+
+
+def decode(data):
+  """Generate the entries of a trace, one CPU at a time."""
+  info, streams = read_chunks(data)
+  if info is None:
+    raise ValueError("Trace is missing its info chunk.")
+  magic, version, regs_size, _ = info
+  if TRACE_STREAM_MAGIC != magic or TRACE_STREAM_VERSION != version:
+    raise ValueError("Unsupported trace format.")
+  for cpu in sorted(streams):
+    for entry in decode_stream(cpu, streams[cpu], regs_size):
+      yield entry
+
+
+def main(argv):
+  show_regs = "--regs" in argv
+  argv = [arg for arg in argv if arg != "--regs"]
+  path = len(argv) > 1 and argv[1] or "/sys/kernel/debug/granary_trace"
+  with open(path, "rb") as f:
+    data = f.read()
+
+  num_dropped = {}
+  for entry in decode(data):
+    line = "cpu=%d pc=%x" % (entry.cpu, entry.pc)
+    if entry.timestamp is not None:
+      line += " tsc=%d" % entry.timestamp
+      if num_dropped.get(entry.cpu, 0) != entry.num_dropped:
+        line += " dropped=%d" % (
+            entry.num_dropped - num_dropped.get(entry.cpu, 0))
+        num_dropped[entry.cpu] = entry.num_dropped
+    print(line)
+    if show_regs and entry.regs:
+      print("  " + " ".join("%s=%x" % (reg, entry.regs[reg]) for reg in REGS))
+
+
+if "__main__" == __name__:
+  main(sys.argv)
@@ -47,6 +47,10 @@ WHITELIST = {
   "write": ("write", "__write_nocancel"),
   "readlink": ("readlink", "__readlink_chk"),
 
+  # Unmapping or re-protecting code invalidates its translations.
+  "munmap": ("munmap", "__munmap"),
+  "mprotect": ("mprotect", "__mprotect"),
+
   "getc": ("getc", "_IO_getc",),
 }
 
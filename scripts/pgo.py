@@ -1,5 +1,6 @@
 """Parse the output of the CFG tool, and construct some code for
-profile-guided optimization.
+profile-guided optimization. The output can either be a binary profile, or
+a text report.
 
 Copyright (C) 2013, Peter Goodman. All rights reserved.
 """
@@ -7,6 +8,8 @@ Copyright (C) 2013, Peter Goodman. All rights reserved.
 import collections
 import sys
 
+import cfg_profile
+
 
 class Edge(object):
   __slots__ = ('count', 'source', 'target', 'is_fall_through')
@@ -28,6 +31,38 @@ def O(*args):
   print "".join(str(a) for a in args)
 
 
+def add_successor(bb, addr, count, is_fall_through=False):
+  bb.successors[addr].source = bb
+  bb.successors[addr].count += count
+  bb.successors[addr].target = BBS[addr]
+  if is_fall_through:
+    bb.successors[addr].is_fall_through = True
+
+
+# Fill in `BBS` and `VIRTUAL_CALLS` from a binary profile.
+def parse_binary_profile(profile):
+  addr = lambda pc: "%016x" % pc
+  for block in profile.blocks:
+    BBS[addr(block.app_pc)].count += block.num_executions
+
+  for block in profile.blocks:
+    bb = BBS[addr(block.app_pc)]
+    for edge in block.edges:
+      target = addr(edge.target_pc)
+      if cfg_profile.CFG_EDGE_JCC == edge.kind:
+        not_taken_count = block.num_fall_through_executions
+        add_successor(bb, target, bb.count - not_taken_count)
+        add_successor(bb, addr(edge.fall_through_pc), not_taken_count, True)
+
+      elif cfg_profile.CFG_EDGE_JMP == edge.kind:
+        if target in BBS:
+          add_successor(bb, target, bb.count)
+
+      elif edge.kind in (cfg_profile.CFG_EDGE_INDIRECT_JMP,
+                         cfg_profile.CFG_EDGE_INDIRECT_CALL):
+        VIRTUAL_CALLS[addr(edge.cti_pc)].add(target)
+
+
 if __name__ == "__main__":
 
   BBS = collections.defaultdict(BasicBlock)
@@ -35,8 +70,13 @@ if __name__ == "__main__":
   LINES = []
   LAST_BB = None
 
-  with open(sys.argv[1], "r") as lines:
-    for line in lines:
+  with open(sys.argv[1], "rb") as f:
+    DATA = f.read()
+
+  if cfg_profile.is_profile(DATA):
+    parse_binary_profile(cfg_profile.Profile(DATA))
+  else:
+    for line in DATA.splitlines():
       line = line.strip(" \r\n")
       if "BB" in line:
         parts = line.split(",")
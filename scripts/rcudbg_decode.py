@@ -0,0 +1,161 @@
+"""Decode the binary log exported by the RCU debugger.
+
+Usage: python rcudbg_decode.py [/sys/kernel/debug/granary_log]
+
+The log is made up of one stream of fixed-size records per CPU. This merges
+the streams by time stamp, and renders each record using the message formats
+that are embedded in the log.
+
+Copyright (C) 2013, Peter Goodman. All rights reserved.
+"""
+
+import heapq
+import re
+import struct
+import sys
+
+
+LOG_EXPORT_MAGIC = 0x4755434C
+LOG_EXPORT_VERSION = 1
+
+HEADER = struct.Struct("<15I")
+RECORD = struct.Struct("<QQHHBBH4QQ")
+STREAM_COUNTERS = struct.Struct("<QQ")
+STRING_LENGTH = struct.Struct("<I")
+
+FORMAT_SPECIFIER = re.compile(
+    r"%[-#0 +]*[0-9]*(?:\.[0-9]+)?(?:hh|h|ll|l|z|j|t)?([diouxXcsp%])")
+
+
+class Header(object):
+  __slots__ = ('magic', 'version', 'num_cpus', 'num_records_per_cpu',
+               'record_size', 'stream_size', 'num_formats', 'format_size',
+               'num_strings', 'string_size', 'overwrite', 'formats_offset',
+               'strings_offset', 'streams_offset', 'records_offset')
+  def __init__(self, data):
+    for name, val in zip(self.__slots__, HEADER.unpack_from(data, 0)):
+      setattr(self, name, val)
+
+
+class Record(object):
+  __slots__ = ('sequence', 'timestamp', 'cpu', 'message_id', 'num_args',
+               'string_args', 'args')
+  def __init__(self, data, offset):
+    fields = RECORD.unpack_from(data, offset)
+    self.sequence, self.timestamp, self.cpu, self.message_id = fields[:4]
+    self.num_args, self.string_args = fields[4:6]
+    self.args = fields[7:7 + self.num_args]
+
+
+def c_string(data, offset, size):
+  """Read a NUL-terminated string out of a fixed-size buffer."""
+  raw = data[offset:offset + size]
+  end = raw.find(b"\0")
+  if -1 != end:
+    raw = raw[:end]
+  return raw.decode("latin-1")
+
+
+def read_formats(data, header):
+  formats = []
+  for i in range(header.num_formats):
+    offset = header.formats_offset + i * header.format_size
+    level = STRING_LENGTH.unpack_from(data, offset)[0]
+    formats.append((level, c_string(data, offset + 4, header.format_size - 4)))
+  return formats
+
+
+def read_string(data, header, index):
+  if index >= header.num_strings:
+    index = 1
+  offset = header.strings_offset + index * header.string_size
+  if not STRING_LENGTH.unpack_from(data, offset)[0]:
+    return "(unknown)"
+  return c_string(data, offset + 4, header.string_size - 4)
+
+
+def read_stream(data, header, cpu):
+  """Returns the lost record count and the valid records of one stream, in
+  the order in which they were logged."""
+  stream_offset = header.streams_offset + cpu * header.stream_size
+  num_reserved, num_lost = STREAM_COUNTERS.unpack_from(data, stream_offset)
+
+  begin, end = 0, num_reserved
+  if end > header.num_records_per_cpu:
+    if header.overwrite:
+      begin = end - header.num_records_per_cpu
+    else:
+      end = header.num_records_per_cpu
+
+  records = []
+  for index in range(begin, end):
+    slot = index % header.num_records_per_cpu
+    record = Record(data, stream_offset + header.records_offset
+                          + slot * header.record_size)
+
+    # Skip records that were being written when the log was read.
+    if record.sequence != index + 1:
+      continue
+    if not (0 < record.message_id < header.num_formats):
+      continue
+    records.append(record)
+  return num_lost, records
+
+
+def render(data, header, formats, record):
+  args = []
+  for i, arg in enumerate(record.args):
+    if record.string_args & (1 << i):
+      args.append(read_string(data, header, arg))
+    else:
+      args.append(arg)
+
+  fmt = formats[record.message_id][1]
+  pos = [0]
+  def replace(match):
+    kind = match.group(1)
+    if "%" == kind:
+      return "%"
+    if pos[0] >= len(args):
+      return match.group(0)
+    arg = args[pos[0]]
+    pos[0] += 1
+    if "s" == kind:
+      return str(arg)
+    elif "p" == kind:
+      return "0x%x" % arg
+    elif kind in "di":
+      return str(struct.unpack("<q", struct.pack("<Q", arg))[0])
+    elif "c" == kind:
+      return chr(arg & 0xFF)
+    return match.group(0).replace("ll", "").replace("l", "").replace(
+        "z", "").replace("j", "").replace("t", "").replace("h", "") % arg
+
+  text = FORMAT_SPECIFIER.sub(replace, fmt)
+  return "[%d] cpu %d: %s" % (record.timestamp, record.cpu, text)
+
+
+if __name__ == "__main__":
+  path = len(sys.argv) > 1 and sys.argv[1] or "/sys/kernel/debug/granary_log"
+  with open(path, "rb") as f:
+    DATA = f.read()
+
+  HDR = Header(DATA)
+  if LOG_EXPORT_MAGIC != HDR.magic or LOG_EXPORT_VERSION != HDR.version:
+    sys.stderr.write("Unrecognized log format.\n")
+    sys.exit(1)
+
+  if RECORD.size != HDR.record_size:
+    sys.stderr.write("Unexpected log record size.\n")
+    sys.exit(1)
+
+  FORMATS = read_formats(DATA, HDR)
+  STREAMS = []
+  for CPU in range(HDR.num_cpus):
+    LOST, RECORDS = read_stream(DATA, HDR, CPU)
+    if LOST:
+      sys.stderr.write("Lost %d log records on CPU %d.\n" % (LOST, CPU))
+    STREAMS.append([(r.timestamp, CPU, i, r) for i, r in enumerate(RECORDS)])
+
+  for _, _, _, RECORD_ in heapq.merge(*STREAMS):
+    sys.stdout.write(render(DATA, HDR, FORMATS, RECORD_))
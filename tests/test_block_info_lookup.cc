@@ -0,0 +1,84 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_block_info_lookup.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+#include "granary/basic_block_info.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+namespace test {
+
+    static int block_info_collatz(int n) {
+        int num_steps(0);
+        for(; 1 < n; ++num_steps) {
+            if(n & 1) {
+                n = 3 * n + 1;
+            } else {
+                n /= 2;
+            }
+        }
+        return num_steps;
+    }
+
+
+    static int (* volatile BLOCK_INFO_COLLATZ)(int) = block_info_collatz;
+
+
+    /// Sum the Collatz step counts of `[1, n)` through an indirect call, so
+    /// that the test code spans several blocks and traces.
+    static int block_info_sum(int n) {
+        int sum(0);
+        for(int i(1); i < n; ++i) {
+            sum += BLOCK_INFO_COLLATZ(i);
+        }
+        return sum;
+    }
+
+
+    /// Check that every byte of the translated block at `block_pc` maps back
+    /// to the info of that block.
+    static void check_block_info(granary::app_pc block_pc) {
+        const granary::basic_block_info *info(
+            granary::find_basic_block_info(block_pc));
+        ASSERT(nullptr != info);
+        ASSERT(info->start_pc <= block_pc);
+        ASSERT(block_pc < (info->start_pc + info->num_bytes));
+
+        for(unsigned i(0); i < info->num_bytes; ++i) {
+            const granary::app_pc pc(info->start_pc + i);
+            const granary::basic_block_info *pc_info(
+                granary::find_basic_block_info(pc));
+            ASSERT(info == pc_info);
+        }
+    }
+
+
+    /// Test that code cache addresses map back to the info of the block that
+    /// contains them.
+    static void block_info_maps_every_byte(void) {
+        granary::basic_block bb_collatz(granary::code_cache::find(
+            (granary::app_pc) block_info_collatz, granary::TEST_POLICY));
+        granary::basic_block bb_sum(granary::code_cache::find(
+            (granary::app_pc) block_info_sum, granary::TEST_POLICY));
+
+        ASSERT(block_info_sum(64) == bb_sum.call<int, int>(64));
+        ASSERT(block_info_collatz(27) == bb_collatz.call<int, int>(27));
+
+        check_block_info(bb_collatz.cache_pc_start);
+        check_block_info(bb_sum.cache_pc_start);
+        ASSERT(bb_collatz.info == granary::find_basic_block_info(
+            bb_collatz.cache_pc_start));
+    }
+
+
+    ADD_TEST(block_info_maps_every_byte,
+        "Test that every byte of translated code maps back to the info of "
+        "the basic block that contains it.")
+}
+
+#endif
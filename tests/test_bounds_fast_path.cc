@@ -0,0 +1,204 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_bounds_fast_path.cc
+ *
+ *  Created on: 2026-10-17
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES \
+ && defined(CLIENT_WATCHPOINT_BOUND) \
+ && !CONFIG_ENV_KERNEL
+
+#include "clients/watchpoints/clients/bounds_checker/instrument.h"
+
+#if WP_INLINE_FAST_PATHS
+
+namespace test {
+
+    enum {
+        /// Must match `DIM` in `test_mat_mul.cc`; the array bounds are part of
+        /// the mangled name of `multiply_matrices`.
+        MAT_MUL_DIM = 10,
+
+        MD5_INPUT_LEN = 999,
+        NUM_BENCHMARK_TRIALS = 100
+    };
+
+
+    typedef int matrix[MAT_MUL_DIM][MAT_MUL_DIM];
+
+
+    /// Defined in `test_mat_mul.cc`.
+    extern void multiply_matrices(matrix &, matrix &, matrix &);
+
+
+    namespace md5 {
+        /// Defined in `test_md5.cc`.
+        extern void md5_digest(unsigned char *, const char *, int);
+    }
+
+
+    /// Return a watched version of `ptr`, whose bounds descriptor covers
+    /// `size` bytes.
+    template <typename T>
+    static T *watch(T *ptr, size_t size, granary::basic_block &bb) {
+        T *watched_ptr(ptr);
+        const client::wp::add_watchpoint_status status(
+            client::wp::add_watchpoint(
+                watched_ptr,
+                reinterpret_cast<void *>(ptr),
+                size,
+                reinterpret_cast<void *>(bb.cache_pc_start)));
+
+        ASSERT(client::wp::ADDRESS_WATCHED == status);
+        ASSERT(client::wp::is_watched_address(watched_ptr));
+        return watched_ptr;
+    }
+
+
+    /// Translate `func` with the bounds checker policy, using either the
+    /// inline fast path or the out-of-line bounds checkers.
+    static granary::basic_block translate(granary::app_pc func, bool inline_) {
+        client::wp::ENABLE_INLINE_FAST_PATHS = inline_;
+        granary::code_cache::flush();
+
+        granary::instrumentation_policy policy =
+            granary::policy_for<client::watchpoint_bound_policy>();
+        policy.force_attach(true);
+        policy.return_address_in_code_cache(true);
+        policy.begins_functional_unit(true);
+
+        return granary::basic_block(granary::code_cache::find(func, policy));
+    }
+
+
+    /// Run `num_trials` instrumented multiplications of watched matrices,
+    /// and return the number of cycles that they took.
+    static uint64_t time_mat_mul(bool inline_, unsigned num_trials) {
+        granary::basic_block bb(translate(
+            granary::unsafe_cast<granary::app_pc>(&multiply_matrices),
+            inline_));
+
+        matrix x;
+        matrix y;
+        matrix z_native;
+        matrix z_instrumented;
+
+        for(int i(0); i < MAT_MUL_DIM; ++i) {
+            for(int j(0); j < MAT_MUL_DIM; ++j) {
+                x[i][j] = i * j;
+                y[i][j] = i + j;
+            }
+        }
+
+        multiply_matrices(x, y, z_native);
+
+        matrix *wx(watch(&x, sizeof x, bb));
+        matrix *wy(watch(&y, sizeof y, bb));
+        matrix *wz(watch(&z_instrumented, sizeof z_instrumented, bb));
+
+        const uint64_t start(granary::test_timestamp());
+        for(unsigned i(0); i < num_trials; ++i) {
+            bb.call<void, matrix &, matrix &, matrix &>(*wx, *wy, *wz);
+        }
+        const uint64_t num_cycles(granary::test_timestamp() - start);
+
+        ASSERT(0 == memcmp(z_native, z_instrumented, sizeof z_native));
+
+        client::wp::free_descriptor_of(wx);
+        client::wp::free_descriptor_of(wy);
+        client::wp::free_descriptor_of(wz);
+        return num_cycles;
+    }
+
+
+    /// Run `num_trials` instrumented MD5 digests of a watched buffer, and
+    /// return the number of cycles that they took.
+    static uint64_t time_md5(bool inline_, unsigned num_trials) {
+        granary::basic_block bb(translate(
+            granary::unsafe_cast<granary::app_pc>(&md5::md5_digest),
+            inline_));
+
+        char str[MD5_INPUT_LEN];
+        unsigned char digest_native[16];
+        unsigned char digest_instrumented[16];
+
+        for(int i(0); i < MD5_INPUT_LEN; ++i) {
+            str[i] = static_cast<char>(i % 254 + 1);
+        }
+
+        md5::md5_digest(digest_native, str, MD5_INPUT_LEN);
+
+        char *wstr(watch(&(str[0]), sizeof str, bb));
+        unsigned char *wdigest(watch(
+            &(digest_instrumented[0]), sizeof digest_instrumented, bb));
+
+        const uint64_t start(granary::test_timestamp());
+        for(unsigned i(0); i < num_trials; ++i) {
+            bb.call<void, unsigned char *, const char *, int>(
+                wdigest, wstr, MD5_INPUT_LEN);
+        }
+        const uint64_t num_cycles(granary::test_timestamp() - start);
+
+        ASSERT(0 == memcmp(digest_native, digest_instrumented, 16));
+
+        client::wp::free_descriptor_of(wstr);
+        client::wp::free_descriptor_of(wdigest);
+        return num_cycles;
+    }
+
+
+    /// Test that the inline bounds checking fast path and the out-of-line
+    /// bounds checkers compute the same results on matrix multiplication and
+    /// MD5.
+    static void test_bounds_fast_path(void) {
+        time_mat_mul(false, 1);
+        time_mat_mul(true, 1);
+        time_md5(false, 1);
+        time_md5(true, 1);
+
+        client::wp::ENABLE_INLINE_FAST_PATHS = true;
+        granary::code_cache::flush();
+    }
+
+
+    ADD_TEST(test_bounds_fast_path,
+        "Test inline bounds checking fast paths.")
+
+
+#if CONFIG_DEBUG_RUN_BENCHMARKS
+
+    /// Compare the inline bounds checking fast path against the out-of-line
+    /// bounds checkers on matrix multiplication and MD5.
+    static void benchmark_bounds_fast_path(void) {
+        const uint64_t mat_mul_out_of_line(
+            time_mat_mul(false, NUM_BENCHMARK_TRIALS));
+        const uint64_t mat_mul_inline(
+            time_mat_mul(true, NUM_BENCHMARK_TRIALS));
+        const uint64_t md5_out_of_line(
+            time_md5(false, NUM_BENCHMARK_TRIALS));
+        const uint64_t md5_inline(
+            time_md5(true, NUM_BENCHMARK_TRIALS));
+
+        client::wp::ENABLE_INLINE_FAST_PATHS = true;
+        granary::code_cache::flush();
+
+        granary::printf(
+            "    mat_mul: %lu cycles (out-of-line: %lu cycles)\n",
+            mat_mul_inline, mat_mul_out_of_line);
+        granary::printf(
+            "    md5: %lu cycles (out-of-line: %lu cycles)\n",
+            md5_inline, md5_out_of_line);
+    }
+
+
+    ADD_TEST(benchmark_bounds_fast_path,
+        "Benchmark inline bounds checking fast paths.")
+#endif
+}
+
+#endif /* WP_INLINE_FAST_PATHS */
+#endif
@@ -0,0 +1,98 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_code_cache_flush.cc
+ *
+ *  Created on: 2026-10-17
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES && !CONFIG_ENV_KERNEL
+
+namespace test {
+
+    enum {
+        NUM_FLUSHES = 64,
+
+        /// Budget small enough that every lookup after the test functions
+        /// are translated is over budget.
+        FLUSH_TEST_BUDGET = 1
+    };
+
+
+    static int flush_test_fibonacci(int i) {
+        if(2 > i) {
+            return 1;
+        }
+        return flush_test_fibonacci(i - 1) + flush_test_fibonacci(i - 2);
+    }
+
+
+    static int (* volatile FLUSH_TEST_FIBONACCI)(int) = flush_test_fibonacci;
+
+
+    /// Calls the Fibonacci function indirectly so that IBL exit routines are
+    /// created (and flushed).
+    static int flush_test_indirect(int i) {
+        return FLUSH_TEST_FIBONACCI(i) + FLUSH_TEST_FIBONACCI(i + 1);
+    }
+
+
+    /// Translate and run the test functions.
+    static void run_flush_test_functions(void) {
+        granary::basic_block bb_fib(granary::code_cache::find(
+            (granary::app_pc) flush_test_fibonacci, granary::TEST_POLICY));
+        granary::basic_block bb_indirect(granary::code_cache::find(
+            (granary::app_pc) flush_test_indirect, granary::TEST_POLICY));
+
+        ASSERT(flush_test_fibonacci(10) == bb_fib.call<int, int>(10));
+        ASSERT(flush_test_indirect(10) == bb_indirect.call<int, int>(10));
+    }
+
+
+    /// Test that translated code keeps working across code cache flushes,
+    /// and that the memory of flushed code is reused, i.e. that the code
+    /// cache doesn't grow with the number of flushes.
+    static void code_cache_flush_reclaims_memory(void) {
+        const unsigned first_generation(granary::code_cache::generation());
+        unsigned long max_early_num_bytes(0);
+        unsigned long max_late_num_bytes(0);
+
+        granary::code_cache::set_budget(FLUSH_TEST_BUDGET);
+
+        for(unsigned i(0); i < NUM_FLUSHES; ++i) {
+            run_flush_test_functions();
+            granary::code_cache::flush();
+
+            const unsigned long num_bytes(
+                granary::detail::code_cache_bytes_in_use());
+
+            if(i < (NUM_FLUSHES / 4)) {
+                if(num_bytes > max_early_num_bytes) {
+                    max_early_num_bytes = num_bytes;
+                }
+            } else if(i >= (3 * NUM_FLUSHES / 4)) {
+                if(num_bytes > max_late_num_bytes) {
+                    max_late_num_bytes = num_bytes;
+                }
+            }
+        }
+
+        granary::code_cache::set_budget(0);
+
+        ASSERT(granary::code_cache::generation()
+            >= (first_generation + NUM_FLUSHES));
+
+        // If flushed code was never reclaimed then the code cache would grow
+        // linearly with the number of flushes.
+        ASSERT(max_late_num_bytes <= (2 * max_early_num_bytes));
+    }
+
+
+    ADD_TEST(code_cache_flush_reclaims_memory,
+        "Test that translated code survives code cache flushes, and that the "
+        "memory of flushed code is reclaimed.")
+}
+
+#endif
@@ -0,0 +1,177 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_code_cache_invalidate.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES && !CONFIG_ENV_KERNEL
+
+#include "granary/translated_ranges.h"
+#include "granary/user/posix/invalidate.h"
+
+extern "C" {
+#   include <sys/mman.h>
+}
+
+namespace test {
+
+    enum {
+        RWX = PROT_READ | PROT_WRITE | PROT_EXEC
+    };
+
+
+    /// Generated code. The first page has a caller, which directly calls the
+    /// callee at the beginning of the second page. Keeping them on separate
+    /// pages means that invalidating the callee leaves the caller's
+    /// translation, and so its DBL-patched call, in place.
+    struct generated_code {
+        granary::app_pc caller;
+        granary::app_pc callee;
+    };
+
+
+    /// Write `mov eax, value; ret` to `pc`.
+    static void write_return(granary::app_pc pc, int value) {
+        pc[0] = 0xB8;
+        for(unsigned i(0); i < 4; ++i) {
+            pc[1 + i] = static_cast<uint8_t>(
+                static_cast<unsigned>(value) >> (8 * i));
+        }
+        pc[5] = 0xC3;
+    }
+
+
+    /// Write `call target; ret` to `pc`.
+    static void write_call(granary::app_pc pc, granary::app_pc target) {
+        const int32_t rel32(static_cast<int32_t>(target - (pc + 5)));
+        pc[0] = 0xE8;
+        for(unsigned i(0); i < 4; ++i) {
+            pc[1 + i] = static_cast<uint8_t>(
+                static_cast<uint32_t>(rel32) >> (8 * i));
+        }
+        pc[5] = 0xC3;
+    }
+
+
+    /// Map two pages of code, where the callee returns `value`.
+    static generated_code map_generated_code(int value) {
+        void *mem(mmap(
+            nullptr, 2 * granary::PAGE_SIZE, RWX,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        ASSERT(MAP_FAILED != mem);
+
+        generated_code code;
+        code.caller = reinterpret_cast<granary::app_pc>(mem);
+        code.callee = code.caller + granary::PAGE_SIZE;
+        write_call(code.caller, code.callee);
+        write_return(code.callee, value);
+        return code;
+    }
+
+
+    /// Unmap the generated code, and forget its translations.
+    static void unmap_generated_code(generated_code &code) {
+        munmap(code.caller, 2 * granary::PAGE_SIZE);
+        granary::invalidate_unmapped_code(
+            code.caller, 2 * granary::PAGE_SIZE);
+    }
+
+
+    /// Translate and run the caller twice; the second call goes through the
+    /// patched direct call to the callee's translation.
+    static granary::basic_block run_caller(generated_code &code, int value) {
+        granary::basic_block bb(granary::code_cache::find(
+            code.caller, granary::TEST_POLICY));
+        ASSERT(value == bb.call<int>());
+        ASSERT(value == bb.call<int>());
+        return bb;
+    }
+
+
+    /// Test that code that is mapped in place of unmapped code is
+    /// re-translated, including when it is reached through a direct call
+    /// that was linked to the unmapped code's translation.
+    static void invalidate_unmapped_callee(void) {
+        generated_code code(map_generated_code(1));
+        granary::basic_block bb(run_caller(code, 1));
+
+        munmap(code.callee, granary::PAGE_SIZE);
+        granary::invalidate_unmapped_code(code.callee, granary::PAGE_SIZE);
+
+        void *mem(mmap(
+            code.callee, granary::PAGE_SIZE, RWX,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0));
+        ASSERT(code.callee == mem);
+        write_return(code.callee, 2);
+
+        ASSERT(2 == bb.call<int>());
+        ASSERT(2 == bb.call<int>());
+        unmap_generated_code(code);
+    }
+
+
+    ADD_TEST(invalidate_unmapped_callee,
+        "Test that code that is unmapped, and then re-mapped with different "
+        "code, is re-translated.")
+
+
+    /// Test that code that is made writable, modified, and then made
+    /// executable again is re-translated.
+    static void invalidate_protected_callee(void) {
+        generated_code code(map_generated_code(1));
+        granary::basic_block bb(run_caller(code, 1));
+
+        mprotect(code.callee, granary::PAGE_SIZE, PROT_READ | PROT_WRITE);
+        granary::invalidate_protected_code(
+            code.callee, granary::PAGE_SIZE, PROT_READ | PROT_WRITE);
+        write_return(code.callee, 2);
+        mprotect(code.callee, granary::PAGE_SIZE, PROT_READ | PROT_EXEC);
+        granary::invalidate_protected_code(
+            code.callee, granary::PAGE_SIZE, PROT_READ | PROT_EXEC);
+
+        ASSERT(2 == bb.call<int>());
+        ASSERT(2 == bb.call<int>());
+        unmap_generated_code(code);
+    }
+
+
+    ADD_TEST(invalidate_protected_callee,
+        "Test that code that is modified while it is made non-executable is "
+        "re-translated.")
+
+
+#if CONFIG_DETECT_SELF_MODIFYING_CODE
+
+    /// Test that code that is written to without first changing its
+    /// protection is re-translated once Granary is next entered.
+    static void invalidate_modified_callee(void) {
+        generated_code code(map_generated_code(1));
+        granary::basic_block bb(run_caller(code, 1));
+
+        // The callee's page is write-protected, so this write faults, and
+        // then is retried once the page's protection is restored.
+        write_return(code.callee, 2);
+        write_return(code.callee, 3);
+
+        granary::invalidate_modified_code();
+        ASSERT(3 == bb.call<int>());
+        ASSERT(3 == bb.call<int>());
+
+        // The callee's page is protected again by its re-translation.
+        write_return(code.callee, 4);
+        granary::invalidate_modified_code();
+        ASSERT(4 == bb.call<int>());
+        unmap_generated_code(code);
+    }
+
+
+    ADD_TEST(invalidate_modified_callee,
+        "Test that self-modifying code is detected and re-translated.")
+#endif
+}
+
+#endif
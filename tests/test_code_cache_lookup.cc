@@ -0,0 +1,175 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_code_cache_lookup.cc
+ *
+ *  Created on: 2026-10-17
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+#include "granary/hash_table.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+namespace test {
+
+    enum {
+        NUM_KEYS = 4096,
+        NUM_LOOKUPS = 1 << 20,
+        MAX_NUM_THREADS = IF_USER_ELSE(8, 1)
+    };
+
+
+    typedef granary::concurrent_hash_table<granary::app_pc, granary::app_pc>
+            lookup_table;
+
+
+    /// The table being tested.
+    static granary::static_data<lookup_table> TABLE;
+
+
+    /// Used to make a key/value for the `i`th entry.
+    static granary::app_pc key_for(unsigned i) {
+        return reinterpret_cast<granary::app_pc>(0x1000UL + (i * 16UL));
+    }
+
+
+    static granary::app_pc value_for(granary::app_pc key) {
+        return key + 1;
+    }
+
+
+    /// Per-thread state. One thread grows the table while the others look
+    /// up keys that are known to be in the table.
+    struct lookup_thread {
+        lookup_table *table;
+        bool is_writer;
+        unsigned reader_id;
+        unsigned num_misses;
+        uint64_t num_cycles;
+    };
+
+
+    /// Insert keys beyond the initial set so that the table grows (and
+    /// retires its old slots) while readers are running.
+    static void do_inserts(lookup_table *table) {
+        for(unsigned i(NUM_KEYS); i < (NUM_KEYS * 8); ++i) {
+            granary::app_pc key(key_for(i));
+            table->store(key, value_for(key), granary::HASH_KEEP_PREV_ENTRY);
+        }
+    }
+
+
+    /// Repeatedly look up keys that are known to be in the table, or grow
+    /// the table.
+    static void *do_lookups(void *arg) {
+        lookup_thread *thread(reinterpret_cast<lookup_thread *>(arg));
+        if(thread->is_writer) {
+            do_inserts(thread->table);
+            return nullptr;
+        }
+
+        unsigned num_misses(0);
+        const uint64_t start(granary::test_timestamp());
+
+        for(unsigned i(0); i < NUM_LOOKUPS; ++i) {
+            granary::app_pc key(key_for((i * 7U) % NUM_KEYS));
+            granary::app_pc value(nullptr);
+            if(!thread->table->load(key, value, thread->reader_id)
+            || value_for(key) != value) {
+                ++num_misses;
+            }
+        }
+
+        thread->num_cycles = granary::test_timestamp() - start;
+        thread->num_misses = num_misses;
+        return nullptr;
+    }
+
+
+    /// Fill `table` with the initial set of keys.
+    static void store_keys(lookup_table *table) {
+        for(unsigned i(0); i < NUM_KEYS; ++i) {
+            granary::app_pc key(key_for(i));
+            ASSERT(table->store(key, value_for(key)));
+        }
+    }
+
+
+    /// Look up keys from `num_readers` threads while another thread grows
+    /// `table`. Returns the number of cycles taken by the slowest reader.
+    static uint64_t run_threads(lookup_table *table, unsigned num_readers) {
+        lookup_thread threads[MAX_NUM_THREADS + 1];
+        for(unsigned i(0); i <= num_readers; ++i) {
+            threads[i].table = table;
+            threads[i].is_writer = (num_readers == i);
+            threads[i].reader_id = i;
+            threads[i].num_misses = 0;
+            threads[i].num_cycles = 0;
+        }
+
+        granary::run_test_threads(&do_lookups, threads, num_readers + 1);
+
+        for(unsigned i(0); i < num_readers; ++i) {
+            ASSERT(0 == threads[i].num_misses);
+        }
+        return granary::max_num_cycles(threads, num_readers);
+    }
+
+
+    /// Test lock-free lookups of the code cache table by a concurrent reader,
+    /// while a writer grows the table.
+    static void test_concurrent_lookup(void) {
+        TABLE.construct();
+        store_keys(TABLE.self);
+
+        // Storing an existing key with the keep policy doesn't overwrite it.
+        ASSERT(!TABLE->store(key_for(0), nullptr,
+            granary::HASH_KEEP_PREV_ENTRY));
+
+        run_threads(TABLE.self, 1);
+
+        for(unsigned i(0); i < (NUM_KEYS * 8); ++i) {
+            granary::app_pc key(key_for(i));
+            granary::app_pc value(nullptr);
+            ASSERT(TABLE->load(key, value, 0));
+            ASSERT(value_for(key) == value);
+        }
+    }
+
+
+    ADD_TEST(test_concurrent_lookup,
+        "Test lock-free lookups in the concurrent hash table.")
+
+
+#if CONFIG_DEBUG_RUN_BENCHMARKS
+
+    /// The table being benchmarked.
+    static granary::static_data<lookup_table> BENCHMARK_TABLE;
+
+
+    /// Measure lookup throughput of the lock-free code cache table from 1 to
+    /// `MAX_NUM_THREADS` concurrent readers, while a writer grows the table.
+    static void benchmark_concurrent_lookup(void) {
+        BENCHMARK_TABLE.construct();
+        store_keys(BENCHMARK_TABLE.self);
+
+        for(unsigned num_threads(1);
+            num_threads <= MAX_NUM_THREADS;
+            num_threads *= 2) {
+
+            granary::printf(
+                "    %u thread(s): %lu lookups in %lu cycles\n",
+                num_threads,
+                static_cast<uint64_t>(num_threads) * NUM_LOOKUPS,
+                run_threads(BENCHMARK_TABLE.self, num_threads));
+        }
+    }
+
+
+    ADD_TEST(benchmark_concurrent_lookup,
+        "Benchmark lock-free lookups in the concurrent hash table.")
+#endif
+}
+
+#endif
@@ -0,0 +1,74 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_code_template.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+#include "granary/code_template.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+namespace test {
+
+    /// Build a sequence of instructions with an absolute and a relative value.
+    static granary::instruction build_test_template(
+        granary::instruction_list &ls,
+        uint64_t abs_value,
+        granary::app_pc *slot,
+        granary::app_pc target
+    ) {
+        using namespace granary;
+        ls.append(mov_imm_(reg::rax, int64_(abs_value)));
+        ls.append(call_ind_(mem_pc_(slot)));
+        return ls.append(jmp_(pc_(target)));
+    }
+
+
+    /// Test that emitting a code template is the same as encoding the
+    /// equivalent instructions.
+    static void test_code_template_emit(void) {
+        static granary::app_pc placeholder_slot(nullptr);
+        static granary::app_pc slot(nullptr);
+        static granary::code_template tmpl;
+        static uint8_t emitted[granary::MAX_CODE_TEMPLATE_SIZE];
+        static uint8_t encoded[granary::MAX_CODE_TEMPLATE_SIZE];
+
+        granary::instruction_list tmpl_ls;
+        granary::instruction jmp(build_test_template(
+            tmpl_ls, 0xFEEDFACEDEADBEEFULL, &placeholder_slot,
+            &(tmpl.bytes[0])));
+
+        tmpl.compile(tmpl_ls);
+        tmpl.add_reloc(tmpl_ls.first(), granary::RELOC_ABS64);
+        tmpl.add_reloc(jmp.prev(), granary::RELOC_REL32);
+        tmpl.add_reloc(jmp, granary::RELOC_REL32);
+
+        const granary::app_pc target(&(encoded[0]));
+        const uint64_t relocs[] = {
+            0x8877665544332211ULL,
+            reinterpret_cast<uint64_t>(&slot),
+            reinterpret_cast<uint64_t>(target)
+        };
+
+        ASSERT(tmpl.can_emit(&(emitted[0]), relocs));
+        tmpl.emit(&(emitted[0]), relocs);
+
+        granary::instruction_list ls;
+        build_test_template(ls, relocs[0], &slot, target);
+        ASSERT(tmpl.size == ls.encoded_size());
+        ls.stage_encode(&(encoded[0]), &(emitted[0]));
+
+        for(unsigned i(0); i < tmpl.size; ++i) {
+            ASSERT(encoded[i] == emitted[i]);
+        }
+    }
+
+
+    ADD_TEST(test_code_template_emit,
+        "Test that emitted code templates match the encoder's output.")
+}
+
+#endif
@@ -0,0 +1,288 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_cpu_code_cache_replay.cc
+ *
+ *  Created on: 2026-10-17
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+#include "granary/cpu_code_cache.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+namespace test {
+
+    enum {
+        NUM_TARGETS = 1 << 14,
+        NUM_EVENTS = 1 << 18,
+        NUM_PHASES = 8,
+        LEGACY_MAX_SCAN = 8,
+        LEGACY_MIN_ENTRIES = 128
+    };
+
+
+    /// Used to make the code cache address for a target.
+    static granary::app_pc translate(granary::app_pc target) {
+        return target + 1;
+    }
+
+
+    /// Record a stream of indirect branch targets. The working set of the
+    /// program drifts through `NUM_PHASES` phases, and within a phase, a small
+    /// number of targets receive most of the control transfers. This mirrors
+    /// the targets observed by the CPU-private cache during `find_on_cpu`.
+    static void record_target_stream(granary::app_pc *stream) {
+        uint64_t state(0x2545F4914F6CDD1DULL);
+        const unsigned events_per_phase(NUM_EVENTS / NUM_PHASES);
+        const unsigned targets_per_phase(NUM_TARGETS / NUM_PHASES);
+
+        for(unsigned i(0); i < NUM_EVENTS; ++i) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            const unsigned phase(i / events_per_phase);
+            const unsigned rand(static_cast<unsigned>(state >> 33));
+
+            // Three quarters of all transfers go to 1/16th of the targets of
+            // the current phase; the rest go anywhere in the phase, or back
+            // into earlier phases.
+            unsigned target(0);
+            if(rand & 3) {
+                target = (phase * targets_per_phase)
+                       + ((rand >> 2) % (targets_per_phase / 16));
+            } else {
+                target = (rand >> 2) % ((phase + 1) * targets_per_phase);
+            }
+
+            stream[i] = reinterpret_cast<granary::app_pc>(
+                0x400000UL + (target * 24UL));
+        }
+    }
+
+
+    /// Replay a recorded stream of indirect branch targets through the
+    /// CPU-private code cache table. Each lookup miss is followed by a store
+    /// of the translated target.
+    static void test_cpu_code_cache_replay(void) {
+        granary::app_pc *stream(
+            granary::allocate_memory<granary::app_pc>(NUM_EVENTS));
+        record_target_stream(stream);
+
+        granary::cpu_private_code_cache table;
+        memset(&table, 0, sizeof table);
+        for(unsigned i(0); i < NUM_EVENTS; ++i) {
+            granary::app_pc target(table.lookup(stream[i]));
+            if(!target) {
+                target = translate(stream[i]);
+                table.store(stream[i], target);
+            }
+            ASSERT(translate(stream[i]) == target);
+        }
+
+        // Every target must remain findable, even if a resize is still being
+        // migrated.
+        for(unsigned i(0); i < NUM_EVENTS; ++i) {
+            ASSERT(translate(stream[i]) == table.find(stream[i]));
+        }
+
+        // The keep policy doesn't overwrite, regardless of which of the old
+        // or new tables holds the entry.
+        ASSERT(!table.store(stream[0], nullptr,
+            granary::HASH_KEEP_PREV_ENTRY));
+        ASSERT(translate(stream[0]) == table.find(stream[0]));
+
+        table.clear();
+        ASSERT(!table.find(stream[0]));
+
+        granary::free_memory(stream, NUM_EVENTS);
+    }
+
+
+    ADD_TEST(test_cpu_code_cache_replay,
+        "Replay recorded branch targets through the CPU-private code cache.")
+
+
+#if CONFIG_DEBUG_RUN_BENCHMARKS
+
+    /// 64-bit mix function from murmurhash3.
+    static uint64_t fmix(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    }
+
+
+    /// The packed, linearly-probed table that the CPU-private code cache used
+    /// before it switched to cache-line buckets and incremental resizing.
+    /// Growing this table rehashes every entry at once.
+    struct legacy_code_cache {
+
+        struct entry {
+            granary::app_pc source;
+            granary::app_pc dest;
+        } __attribute__((packed));
+
+        uint64_t bit_mask;
+        entry *entries;
+
+        granary::app_pc find(granary::app_pc key) const {
+            if(!entries) {
+                return nullptr;
+            }
+            uint64_t index(fmix(reinterpret_cast<uint64_t>(key)));
+            for(int m(0); ++m <= LEGACY_MAX_SCAN; ++index) {
+                index &= bit_mask;
+                if(!entries[index].source) {
+                    break;
+                }
+                if(key == entries[index].source) {
+                    return entries[index].dest;
+                }
+            }
+            return nullptr;
+        }
+
+        void store(granary::app_pc key, granary::app_pc value) {
+            if(!entries) {
+                entries = granary::allocate_memory<entry>(LEGACY_MIN_ENTRIES);
+                bit_mask = LEGACY_MIN_ENTRIES - 1;
+            }
+
+            uint64_t index(fmix(reinterpret_cast<uint64_t>(key)));
+            unsigned scan(0);
+            for(;; ++scan, ++index) {
+                index &= bit_mask;
+                if(!entries[index].source || key == entries[index].source) {
+                    entries[index].dest = value;
+                    entries[index].source = key;
+                    break;
+                }
+            }
+
+            // Lookups give up after `LEGACY_MAX_SCAN` probes, so an entry
+            // that is any further from its home slot must be rehashed.
+            if(LEGACY_MAX_SCAN <= scan) {
+                grow();
+            }
+        }
+
+        void grow(void) {
+            entry *old_entries(entries);
+            const uint64_t old_num_entries(bit_mask + 1);
+            entries = granary::allocate_memory<entry>(old_num_entries * 2);
+            bit_mask = (old_num_entries * 2) - 1;
+            for(uint64_t i(0); i < old_num_entries; ++i) {
+                if(old_entries[i].source) {
+                    store(old_entries[i].source, old_entries[i].dest);
+                }
+            }
+            granary::free_memory(old_entries, old_num_entries);
+        }
+
+        void destroy(void) {
+            if(entries) {
+                granary::free_memory(entries, bit_mask + 1);
+            }
+            entries = nullptr;
+        }
+    };
+
+
+    /// Result of replaying a target stream through a table.
+    struct replay_result {
+        uint64_t num_cycles;
+        uint64_t max_event_cycles;
+        unsigned num_misses;
+    };
+
+
+    /// Replay a stream of targets through a table. Each lookup miss is
+    /// followed by a store of the translated target.
+    template <typename T>
+    static replay_result replay(
+        T &table,
+        granary::app_pc *stream,
+        granary::app_pc (*lookup)(T &, granary::app_pc)
+    ) {
+        replay_result result;
+        result.num_cycles = 0;
+        result.max_event_cycles = 0;
+        result.num_misses = 0;
+
+        for(unsigned i(0); i < NUM_EVENTS; ++i) {
+            const uint64_t start(granary::test_timestamp());
+            granary::app_pc target(lookup(table, stream[i]));
+            if(!target) {
+                ++result.num_misses;
+                target = translate(stream[i]);
+                table.store(stream[i], target);
+            }
+            const uint64_t num_cycles(granary::test_timestamp() - start);
+
+            result.num_cycles += num_cycles;
+            if(num_cycles > result.max_event_cycles) {
+                result.max_event_cycles = num_cycles;
+            }
+        }
+
+        return result;
+    }
+
+
+    static granary::app_pc legacy_lookup(
+        legacy_code_cache &table,
+        granary::app_pc target
+    ) {
+        return table.find(target);
+    }
+
+
+    static granary::app_pc bucketed_lookup(
+        granary::cpu_private_code_cache &table,
+        granary::app_pc target
+    ) {
+        return table.lookup(target);
+    }
+
+
+    /// Replay a recorded stream of indirect branch targets through the legacy
+    /// and bucketed CPU-private code cache tables, and compare them.
+    static void benchmark_cpu_code_cache_replay(void) {
+        granary::app_pc *stream(
+            granary::allocate_memory<granary::app_pc>(NUM_EVENTS));
+        record_target_stream(stream);
+
+        legacy_code_cache legacy;
+        memset(&legacy, 0, sizeof legacy);
+        const replay_result legacy_result(
+            replay(legacy, stream, &legacy_lookup));
+
+        granary::cpu_private_code_cache bucketed;
+        memset(&bucketed, 0, sizeof bucketed);
+        const replay_result bucketed_result(
+            replay(bucketed, stream, &bucketed_lookup));
+
+        // Both tables see every distinct target miss exactly once.
+        ASSERT(legacy_result.num_misses == bucketed_result.num_misses);
+
+        granary::printf(
+            "    legacy:   %lu cycles, worst event %lu cycles\n",
+            legacy_result.num_cycles, legacy_result.max_event_cycles);
+        granary::printf(
+            "    bucketed: %lu cycles, worst event %lu cycles\n",
+            bucketed_result.num_cycles, bucketed_result.max_event_cycles);
+
+        bucketed.clear();
+        legacy.destroy();
+        granary::free_memory(stream, NUM_EVENTS);
+    }
+
+
+    ADD_TEST(benchmark_cpu_code_cache_replay,
+        "Benchmark the CPU-private code cache against the old table.")
+#endif
+}
+
+#endif
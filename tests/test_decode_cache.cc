@@ -0,0 +1,79 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_decode_cache.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES && CONFIG_OPTIMISE_DECODE_CACHE
+
+extern "C" {
+    extern void granary_test_decode_cache(void);
+    extern void granary_test_decode_cache_end(void);
+}
+
+
+/// Native code that is decoded. This is never executed.
+__asm__(
+    ".text;"
+IF_APPLE("_") "granary_test_decode_cache:"
+    "mov 8(%rdi,%rsi,4), %rax;"
+    "lea 16(%rip), %rcx;"
+    "push %rbx;"
+    "lock xadd %rax, (%rdx);"
+    "jz 1f;"
+    "call *%rax;"
+"1:  pop %rbx;"
+    "jmp " IF_APPLE("_") "granary_test_decode_cache;"
+IF_APPLE("_") "granary_test_decode_cache_end:"
+    "ret;"
+);
+
+
+namespace test {
+
+    /// Test that an instruction decoded through the decode cache is the same
+    /// as one decoded directly, whether the decode cache hits or misses.
+    static void test_decode_cache_equivalence(void) {
+        granary::app_pc pc(granary::unsafe_cast<granary::app_pc>(
+            &granary_test_decode_cache));
+        const granary::app_pc end_pc(granary::unsafe_cast<granary::app_pc>(
+            &granary_test_decode_cache_end));
+
+        while(pc < end_pc) {
+            granary::app_pc decode_pc(pc);
+            granary::app_pc miss_pc(pc);
+            granary::app_pc hit_pc(pc);
+
+            granary::instruction in(granary::instruction::decode(&decode_pc));
+            granary::instruction cached(
+                granary::instruction::decode_cached(&miss_pc));
+            granary::instruction cached_again(
+                granary::instruction::decode_cached(&hit_pc));
+
+            ASSERT(decode_pc == miss_pc);
+            ASSERT(decode_pc == hit_pc);
+            ASSERT(cached.instr != cached_again.instr);
+            ASSERT(dynamorio::instr_same(in.instr, cached.instr));
+            ASSERT(dynamorio::instr_same(in.instr, cached_again.instr));
+            ASSERT(in.pc() == cached_again.pc());
+            ASSERT(in.is_cti() == cached_again.is_cti());
+
+            if(in.is_cti()) {
+                ASSERT(dynamorio::opnd_same(
+                    in.cti_target(), cached_again.cti_target()));
+            }
+
+            pc = decode_pc;
+        }
+    }
+
+
+    ADD_TEST(test_decode_cache_equivalence,
+        "Test that cached decodes are the same as uncached decodes.")
+}
+
+#endif
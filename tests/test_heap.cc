@@ -0,0 +1,294 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_heap.cc
+ *
+ *  Created on: 2026-10-17
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+#include "granary/spin_lock.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+#if CONFIG_DEBUG_RUN_BENCHMARKS && !CONFIG_ENV_KERNEL
+#   include <sys/mman.h>
+#endif
+
+namespace test {
+
+    enum {
+        NUM_OPERATIONS = 1 << 16,
+        NUM_LIVE_OBJECTS = 256,
+        MAX_NUM_THREADS = IF_USER_ELSE(8, 1),
+        LEGACY_MIN_SCALE = 3,
+        LEGACY_NUM_FREE_LISTS = 32,
+
+        /// Upper bound on the memory that the old heap needs for one thread:
+        /// objects are only reused within a power of two, so each live
+        /// object might be at any power of two up to 2048 (the sum of which
+        /// is under 4096 bytes).
+        LEGACY_HEAP_SIZE_PER_THREAD = NUM_LIVE_OBJECTS * 4096,
+        LEGACY_HEAP_SIZE = MAX_NUM_THREADS * LEGACY_HEAP_SIZE_PER_THREAD
+    };
+
+
+    /// Sizes of allocated objects. These are skewed toward the small sizes
+    /// of instructions, list nodes, and basic block meta-information.
+    static const unsigned OBJECT_SIZES[16] = {
+        8, 16, 16, 24, 24, 32, 40, 48, 56, 64, 72, 96, 136, 200, 520, 1500
+    };
+
+
+    /// Per-thread state.
+    struct heap_thread {
+        void *(*allocate)(uintptr_t);
+        void (*free)(void *, uintptr_t);
+        unsigned seed;
+        unsigned num_corruptions;
+        uint64_t num_cycles;
+    };
+
+
+    /// Tag the first and last bytes of an object so that overlapping objects
+    /// are detected.
+    static void tag_object(uint8_t *object, unsigned size, uint8_t tag) {
+        object[0] = tag;
+        object[size - 1] = tag;
+    }
+
+
+    static bool check_object(uint8_t *object, unsigned size, uint8_t tag) {
+        return tag == object[0] && tag == object[size - 1];
+    }
+
+
+    /// Randomly allocate and free objects, keeping up to `NUM_LIVE_OBJECTS`
+    /// objects live at once.
+    static void *do_allocations(void *arg) {
+        heap_thread *thread(reinterpret_cast<heap_thread *>(arg));
+
+        uint8_t *objects[NUM_LIVE_OBJECTS] = {nullptr};
+        unsigned sizes[NUM_LIVE_OBJECTS] = {0};
+        uint8_t tags[NUM_LIVE_OBJECTS] = {0};
+        uint64_t state(thread->seed);
+        unsigned num_corruptions(0);
+        const uint64_t start(granary::test_timestamp());
+
+        for(unsigned i(0); i < NUM_OPERATIONS; ++i) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            const unsigned rand(static_cast<unsigned>(state >> 33));
+            const unsigned slot(rand % NUM_LIVE_OBJECTS);
+
+            if(objects[slot]) {
+                if(!check_object(objects[slot], sizes[slot], tags[slot])) {
+                    ++num_corruptions;
+                }
+                thread->free(objects[slot], sizes[slot]);
+                objects[slot] = nullptr;
+            }
+
+            if(rand & (1U << 20)) {
+                sizes[slot] = OBJECT_SIZES[(rand >> 8) % 16];
+                tags[slot] = static_cast<uint8_t>(i | 1);
+                objects[slot] = reinterpret_cast<uint8_t *>(
+                    thread->allocate(sizes[slot]));
+                tag_object(objects[slot], sizes[slot], tags[slot]);
+            }
+        }
+
+        for(unsigned slot(0); slot < NUM_LIVE_OBJECTS; ++slot) {
+            if(objects[slot]) {
+                if(!check_object(objects[slot], sizes[slot], tags[slot])) {
+                    ++num_corruptions;
+                }
+                thread->free(objects[slot], sizes[slot]);
+            }
+        }
+
+        thread->num_cycles = granary::test_timestamp() - start;
+        thread->num_corruptions = num_corruptions;
+        return nullptr;
+    }
+
+
+    /// Randomly allocate and free objects from `num_threads` threads at once,
+    /// and return the number of cycles taken by the slowest thread.
+    static uint64_t run_threads(
+        unsigned num_threads,
+        void *(*allocate)(uintptr_t),
+        void (*free)(void *, uintptr_t)
+    ) {
+        heap_thread threads[MAX_NUM_THREADS];
+        for(unsigned i(0); i < num_threads; ++i) {
+            threads[i].allocate = allocate;
+            threads[i].free = free;
+            threads[i].seed = 0x9E3779B9U * (i + 1);
+            threads[i].num_corruptions = 0;
+            threads[i].num_cycles = 0;
+        }
+
+        granary::run_test_threads(&do_allocations, threads, num_threads);
+
+        for(unsigned i(0); i < num_threads; ++i) {
+            ASSERT(0 == threads[i].num_corruptions);
+        }
+        return granary::max_num_cycles(threads, num_threads);
+    }
+
+
+    /// Returns the number of live small heap objects.
+    static uint64_t num_live_objects(void) {
+        static granary::detail::heap_statistics stats;
+        granary::detail::get_heap_statistics(stats);
+        uint64_t num_objects(0);
+        for(unsigned i(0); i < granary::detail::NUM_HEAP_SIZE_CLASSES; ++i) {
+            num_objects += stats.classes[i].num_live_objects;
+        }
+        return num_objects;
+    }
+
+
+    /// Test the size-class heap with per-CPU magazines, where objects are
+    /// allocated and freed from `MAX_NUM_THREADS` threads at once.
+    static void test_heap_allocate_free(void) {
+
+        // Every size maps to a class that holds it.
+        for(unsigned size(1); size <= 4096; ++size) {
+            uint8_t *object(reinterpret_cast<uint8_t *>(
+                granary::detail::global_allocate(size)));
+            tag_object(object, size, 0xAB);
+            granary::detail::global_free(object, size);
+        }
+
+        const uint64_t num_objects_before(num_live_objects());
+        run_threads(MAX_NUM_THREADS,
+            &granary::detail::global_allocate,
+            &granary::detail::global_free);
+
+        // Every object allocated by the threads was freed, even if it was
+        // freed into a different thread's magazine.
+        ASSERT(num_objects_before == num_live_objects());
+    }
+
+
+    ADD_TEST(test_heap_allocate_free,
+        "Test allocating and freeing from the size-class heap.")
+
+
+#if CONFIG_DEBUG_RUN_BENCHMARKS
+
+    /// The heap that Granary used before size classes and per-CPU magazines:
+    /// a bump pointer, and one locked free list per power of two.
+    struct legacy_heap {
+
+        struct free_object {
+            free_object *next;
+        };
+
+        struct free_list {
+            granary::atomic_spin_lock lock;
+            free_object *head;
+        };
+
+        uint8_t *memory;
+        std::atomic<uintptr_t> index;
+        free_list free_lists[LEGACY_NUM_FREE_LISTS];
+
+        static unsigned scale_of(uintptr_t size) {
+            unsigned scale(LEGACY_MIN_SCALE);
+            for(; (1UL << scale) < size; ++scale) { }
+            return scale;
+        }
+
+        void *allocate(uintptr_t size) {
+            const unsigned scale(scale_of(size));
+            free_list &list(free_lists[scale - LEGACY_MIN_SCALE]);
+
+            if(list.head) {
+                list.lock.acquire();
+                free_object *object(list.head);
+                if(object) {
+                    list.head = object->next;
+                }
+                list.lock.release();
+                if(object) {
+                    return object;
+                }
+            }
+
+            const uintptr_t offset(index.fetch_add(1UL << scale));
+            FAULT_IF((offset + (1UL << scale)) > LEGACY_HEAP_SIZE);
+            return &(memory[offset]);
+        }
+
+        void free(void *addr, uintptr_t size) {
+            free_list &list(free_lists[scale_of(size) - LEGACY_MIN_SCALE]);
+            free_object *object(reinterpret_cast<free_object *>(addr));
+            list.lock.acquire();
+            object->next = list.head;
+            list.head = object;
+            list.lock.release();
+        }
+    };
+
+
+    static granary::static_data<legacy_heap> LEGACY_HEAP;
+
+
+#if CONFIG_ENV_KERNEL
+    /// Memory of the old heap. This doesn't come from Granary's heap, as
+    /// the heap would never get it back.
+    static uint8_t LEGACY_HEAP_MEMORY[LEGACY_HEAP_SIZE];
+#endif
+
+
+    static void *legacy_allocate(uintptr_t size) {
+        return LEGACY_HEAP->allocate(size);
+    }
+
+
+    static void legacy_free(void *addr, uintptr_t size) {
+        LEGACY_HEAP->free(addr, size);
+    }
+
+
+    /// Compare the throughput of the size-class heap with per-CPU magazines
+    /// against the old power-of-two heap, from 1 to `MAX_NUM_THREADS`
+    /// threads.
+    static void benchmark_heap_allocate_free(void) {
+        LEGACY_HEAP.construct();
+#if CONFIG_ENV_KERNEL
+        LEGACY_HEAP->memory = &(LEGACY_HEAP_MEMORY[0]);
+#else
+        LEGACY_HEAP->memory = reinterpret_cast<uint8_t *>(mmap(
+            nullptr, LEGACY_HEAP_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        ASSERT(MAP_FAILED != LEGACY_HEAP->memory);
+#endif
+
+        for(unsigned num_threads(1);
+            num_threads <= MAX_NUM_THREADS;
+            num_threads *= 2) {
+
+            const uint64_t heap_cycles(run_threads(num_threads,
+                &granary::detail::global_allocate,
+                &granary::detail::global_free));
+            const uint64_t legacy_cycles(run_threads(
+                num_threads, &legacy_allocate, &legacy_free));
+
+            granary::printf(
+                "    %u thread(s): %lu cycles (old heap: %lu cycles)\n",
+                num_threads, heap_cycles, legacy_cycles);
+        }
+
+        IF_USER( munmap(LEGACY_HEAP->memory, LEGACY_HEAP_SIZE); )
+    }
+
+
+    ADD_TEST(benchmark_heap_allocate_free,
+        "Benchmark the size-class heap against the old heap.")
+#endif
+}
+
+#endif
@@ -0,0 +1,144 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_hot_traces.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES \
+ && CONFIG_BUILD_HOT_TRACES \
+ && !CONFIG_ENV_KERNEL
+
+#include "granary/basic_block_info.h"
+#include "granary/user/posix/invalidate.h"
+
+extern "C" {
+#   include <sys/mman.h>
+}
+
+namespace test {
+
+    enum {
+        /// Enough loop iterations for the loop's blocks to become hot, and
+        /// to then run their re-translations.
+        NUM_HOT_TRACE_ITERATIONS = 4 * CONFIG_OPTIMISE_ONLINE_PGO_THRESHOLD,
+
+        /// Offsets of the basic blocks of `HOT_LOOP_CODE`. The hot path
+        /// around the loop is head -> body -> add -> head.
+        HOT_LOOP_HEAD = 6,
+        HOT_LOOP_BODY = 10,
+        HOT_LOOP_ADD = 15,
+        NUM_HOT_LOOP_BLOCKS = 3
+    };
+
+
+    /// Sum `[0, n)`, except for every 16th number, which is subtracted.
+    /// This is the function that `HOT_LOOP_CODE` implements.
+    static int hot_loop_sum(int n) {
+        int sum(0);
+        for(int i(0); i < n; ++i) {
+            if(i % 16) {
+                sum += i;
+            } else {
+                sum -= i;
+            }
+        }
+        return sum;
+    }
+
+
+    /// Hand-assembled version of `hot_loop_sum`, so that the native addresses
+    /// of the loop's basic blocks are known.
+    static const uint8_t HOT_LOOP_CODE[] = {
+        0x31, 0xC0,         //  0: xor eax, eax
+        0x31, 0xC9,         //  2: xor ecx, ecx
+        0xEB, 0x00,         //  4: jmp head
+        0x39, 0xF9,         //  6: head: cmp ecx, edi
+        0x7D, 0x11,         //  8: jge done
+        0xF6, 0xC1, 0x0F,   // 10: body: test cl, 15
+        0x74, 0x06,         // 13: jz sub
+        0x01, 0xC8,         // 15: add: add eax, ecx
+        0xFF, 0xC1,         // 17: inc ecx
+        0xEB, 0xF1,         // 19: jmp head
+        0x29, 0xC8,         // 21: sub: sub eax, ecx
+        0xFF, 0xC1,         // 23: inc ecx
+        0xEB, 0xEB,         // 25: jmp head
+        0xC3                // 27: done: ret
+    };
+
+
+    /// Test that a hot loop is re-translated as a superblock, that the
+    /// superblock computes the same thing as the loop, and that every byte of
+    /// the superblock maps back to the info of the block that contains it.
+    static void hot_loop_becomes_superblock(void) {
+        void *mem(mmap(
+            nullptr, granary::PAGE_SIZE,
+            PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        ASSERT(MAP_FAILED != mem);
+        const granary::app_pc code(reinterpret_cast<granary::app_pc>(mem));
+        memcpy(code, &(HOT_LOOP_CODE[0]), sizeof HOT_LOOP_CODE);
+
+        granary::basic_block bb(granary::code_cache::find(
+            code, granary::TEST_POLICY));
+
+        // The first call profiles the loop and re-translates it once it is
+        // hot; the second call runs only the superblock.
+        for(unsigned i(0); i < 2; ++i) {
+            ASSERT(hot_loop_sum(NUM_HOT_TRACE_ITERATIONS)
+                == bb.call<int, int>(NUM_HOT_TRACE_ITERATIONS));
+        }
+
+        const granary::app_pc path[NUM_HOT_LOOP_BLOCKS] = {
+            code + HOT_LOOP_HEAD, code + HOT_LOOP_BODY, code + HOT_LOOP_ADD
+        };
+
+        // The loop head's code cache entry is now the superblock, which was
+        // emitted into the hot region of the code cache.
+        granary::instrumentation_policy policy(granary::TEST_POLICY);
+        const granary::mangled_address head(path[0], policy.base_policy());
+        const granary::app_pc superblock_pc(
+            granary::code_cache::lookup(head.as_address));
+        ASSERT(nullptr != superblock_pc);
+
+        const granary::basic_block_info *info(
+            granary::find_basic_block_info(superblock_pc));
+        granary::cpu_state_handle cpu;
+        ASSERT(nullptr != info);
+        ASSERT(superblock_pc == info->start_pc);
+        ASSERT(&(cpu->hot_fragment_allocator) == info->allocator);
+        ASSERT(NUM_HOT_LOOP_BLOCKS == info->num_bbs_in_trace);
+
+        // The blocks of the superblock are laid out in the order of the hot
+        // path, and only the head is an entry point.
+        granary::app_pc block_end_pc(info->start_pc);
+        for(unsigned i(0); i < NUM_HOT_LOOP_BLOCKS; ++i) {
+            const granary::basic_block_info *block_info(&(info[i]));
+            ASSERT(path[i] == block_info->generating_pc.unmangled_address());
+            ASSERT(block_end_pc <= block_info->start_pc);
+            block_end_pc = block_info->start_pc + block_info->num_bytes;
+
+            if(i) {
+                ASSERT(block_info->start_pc != granary::code_cache::lookup(
+                    block_info->generating_pc.as_address));
+            }
+
+            for(unsigned j(0); j < block_info->num_bytes; ++j) {
+                ASSERT(block_info == granary::find_basic_block_info(
+                    block_info->start_pc + j));
+            }
+        }
+
+        munmap(mem, granary::PAGE_SIZE);
+        granary::invalidate_unmapped_code(mem, granary::PAGE_SIZE);
+    }
+
+
+    ADD_TEST(hot_loop_becomes_superblock,
+        "Test that a hot loop is re-translated as a superblock.")
+}
+
+#endif
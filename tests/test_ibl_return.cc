@@ -0,0 +1,209 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_ibl_return.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES \
+ && !CONFIG_ENV_KERNEL \
+ && !CONFIG_OPTIMISE_DIRECT_RETURN
+
+#include "granary/ibl.h"
+#include "granary/detach.h"
+#include "granary/user/posix/invalidate.h"
+
+extern "C" {
+#   include <sys/mman.h>
+}
+
+namespace test {
+
+    enum {
+        /// Offsets of the trampoline and the callee within the generated
+        /// code.
+        IBL_RETURN_TRAMPOLINE = 32,
+        IBL_RETURN_CALLEE = 64,
+
+        /// Number of calls timed by the benchmark.
+        NUM_BENCHMARK_RETURNS = 1 << 20
+    };
+
+
+    /// Generated code. The trampoline is called natively, and pushes the
+    /// address of `granary::detach` as the return address of the translated
+    /// callee. The callee's RET is not known to return into the code cache,
+    /// so it goes through the IBL, which finds that `granary::detach` is a
+    /// detach point. `granary::detach` then natively returns to the caller of
+    /// the trampoline.
+    ///
+    /// The wrapper natively calls the trampoline, and then adds its first
+    /// argument, which is still in `RDI` only if the IBL preserved it.
+    struct generated_code {
+        granary::app_pc wrapper;
+        granary::app_pc trampoline;
+        granary::app_pc callee;
+    };
+
+
+    typedef int (adder_func)(int, int);
+
+
+    /// Write `mov rax, value` to `pc`, and return the next pc.
+    static granary::app_pc write_mov_rax(granary::app_pc pc, uint64_t value) {
+        pc[0] = 0x48;
+        pc[1] = 0xB8;
+        for(unsigned i(0); i < 8; ++i) {
+            pc[2 + i] = static_cast<uint8_t>(value >> (8 * i));
+        }
+        return pc + 10;
+    }
+
+
+    /// Map the wrapper, the trampoline, and the callee, which returns the sum
+    /// of its two arguments.
+    static generated_code map_generated_code(void) {
+        void *mem(mmap(
+            nullptr, granary::PAGE_SIZE,
+            PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        ASSERT(MAP_FAILED != mem);
+
+        generated_code code;
+        code.wrapper = reinterpret_cast<granary::app_pc>(mem);
+        code.trampoline = code.wrapper + IBL_RETURN_TRAMPOLINE;
+        code.callee = code.wrapper + IBL_RETURN_CALLEE;
+
+        // `call trampoline; add eax, edi; ret`
+        const int32_t rel32(static_cast<int32_t>(
+            code.trampoline - (code.wrapper + 5)));
+        code.wrapper[0] = 0xE8;
+        for(unsigned i(0); i < 4; ++i) {
+            code.wrapper[1 + i] = static_cast<uint8_t>(
+                static_cast<uint32_t>(rel32) >> (8 * i));
+        }
+        code.wrapper[5] = 0x01;
+        code.wrapper[6] = 0xF8;
+        code.wrapper[7] = 0xC3;
+
+        // `lea eax, [rdi + rsi]; ret`
+        code.callee[0] = 0x8D;
+        code.callee[1] = 0x04;
+        code.callee[2] = 0x37;
+        code.callee[3] = 0xC3;
+        return code;
+    }
+
+
+    /// Translate the callee so that its RET goes through the IBL, and link
+    /// the trampoline to the translation.
+    static adder_func *translate_callee(generated_code &code) {
+        granary::instrumentation_policy policy(granary::TEST_POLICY);
+        policy.return_address_in_code_cache(false);
+        policy.force_attach(false);
+
+        granary::basic_block bb(granary::code_cache::find(
+            code.callee, policy));
+
+        // `mov rax, detach; push rax; mov rax, bb.cache_pc_start; jmp rax`
+        granary::app_pc pc(write_mov_rax(
+            code.trampoline,
+            reinterpret_cast<uint64_t>(granary::unsafe_cast<granary::app_pc>(
+                &granary::detach))));
+        *pc++ = 0x50;
+        pc = write_mov_rax(pc, reinterpret_cast<uint64_t>(bb.cache_pc_start));
+        pc[0] = 0xFF;
+        pc[1] = 0xE0;
+
+        return granary::unsafe_cast<adder_func *>(code.trampoline);
+    }
+
+
+    /// Unmap the generated code, and forget its translations.
+    static void unmap_generated_code(generated_code &code) {
+        munmap(code.wrapper, granary::PAGE_SIZE);
+        granary::invalidate_unmapped_code(code.wrapper, granary::PAGE_SIZE);
+    }
+
+
+    /// Returns the number of IBL jump table lookups so far.
+    static uint64_t num_ibl_lookups(void) {
+        uint64_t num_lookups(0);
+        granary::ibl_bucket_stats stats;
+        for(unsigned i(0); granary::ibl_get_bucket_stats(i, stats); ++i) {
+            num_lookups += stats.num_hits + stats.num_misses;
+        }
+        return num_lookups;
+    }
+
+
+    /// Test that a RET whose return address was pushed by native code goes
+    /// through the IBL, that it returns to the right place with the stack,
+    /// the return value, and `RDI` intact, and that returning to a detach
+    /// point detaches.
+    static void ibl_return_to_native(void) {
+        generated_code code(map_generated_code());
+        translate_callee(code);
+        adder_func *add(granary::unsafe_cast<adder_func *>(code.wrapper));
+
+        for(int i(0); i < 4; ++i) {
+            IF_PERF( const uint64_t num_lookups(num_ibl_lookups()); )
+            ASSERT((i + i + 10) == add(i, 10));
+            IF_PERF( ASSERT((num_lookups + 1) == num_ibl_lookups()); )
+        }
+
+        unmap_generated_code(code);
+    }
+
+
+    ADD_TEST(ibl_return_to_native,
+        "Test that RETs to natively pushed return addresses go through the "
+        "IBL.")
+
+
+#if CONFIG_DEBUG_RUN_BENCHMARKS
+
+    /// Time `NUM_BENCHMARK_RETURNS` calls to `add`.
+    static uint64_t time_calls(adder_func *add) {
+        int sum(0);
+        const uint64_t start(granary::test_timestamp());
+        for(int i(0); i < NUM_BENCHMARK_RETURNS; ++i) {
+            sum = add(sum, 1);
+        }
+        const uint64_t num_cycles(granary::test_timestamp() - start);
+        ASSERT(NUM_BENCHMARK_RETURNS == sum);
+        return num_cycles;
+    }
+
+
+    /// Compare the cost of a RET that goes through the IBL against a RET
+    /// that returns natively into the code cache.
+    static void benchmark_ibl_return(void) {
+        generated_code code(map_generated_code());
+        const uint64_t ibl_cycles(time_calls(translate_callee(code)));
+
+        granary::basic_block bb(granary::code_cache::find(
+            code.callee, granary::TEST_POLICY));
+        const uint64_t native_cycles(time_calls(
+            granary::unsafe_cast<adder_func *>(bb.cache_pc_start)));
+
+        granary::printf(
+            "    IBL return: %lu cycles per call\n",
+            ibl_cycles / NUM_BENCHMARK_RETURNS);
+        granary::printf(
+            "    native return: %lu cycles per call\n",
+            native_cycles / NUM_BENCHMARK_RETURNS);
+
+        unmap_generated_code(code);
+    }
+
+
+    ADD_TEST(benchmark_ibl_return,
+        "Benchmark RETs that go through the IBL.")
+#endif
+}
+
+#endif
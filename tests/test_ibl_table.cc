@@ -0,0 +1,229 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_ibl_table.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES && !CONFIG_ENV_KERNEL
+
+#include "granary/ibl.h"
+#include "granary/user/posix/invalidate.h"
+
+extern "C" {
+#   include <sys/mman.h>
+}
+
+namespace test {
+
+    enum {
+        RWX = PROT_READ | PROT_WRITE | PROT_EXEC,
+
+        /// Number of jump targets that share one bucket of the IBL jump
+        /// table. This is more than a bucket holds, but after the table
+        /// grows, the targets are split between two buckets, each of which
+        /// then has a free way.
+        NUM_CONFLICTING_TARGETS = 6,
+
+        /// Upper bound on the number of indirect jumps that it takes for the
+        /// conflicting targets to grow the table.
+        MAX_NUM_GROW_JUMPS = 64 * granary::MIN_IBL_GROW_SAMPLE,
+
+        /// The IBL hashes mangled targets, ignoring their low 5 bits.
+        IBL_TARGET_ALIGN = 32
+    };
+
+
+    /// Generated code. The first page has a dispatcher, which indirectly
+    /// jumps to its first argument. Each target is on its own page, and is
+    /// `num_buckets * IBL_TARGET_ALIGN` bytes from the previous target, so
+    /// that all targets hash to the same bucket of a table with
+    /// `num_buckets` buckets.
+    struct generated_code {
+        granary::app_pc dispatcher;
+        granary::app_pc targets[NUM_CONFLICTING_TARGETS];
+        unsigned long size;
+    };
+
+
+    /// Write `mov eax, value; ret` to `pc`.
+    static void write_return(granary::app_pc pc, int value) {
+        pc[0] = 0xB8;
+        for(unsigned i(0); i < 4; ++i) {
+            pc[1 + i] = static_cast<uint8_t>(
+                static_cast<unsigned>(value) >> (8 * i));
+        }
+        pc[5] = 0xC3;
+    }
+
+
+    /// Map the dispatcher and targets, where the `i`th target returns `i`.
+    static generated_code map_generated_code(unsigned num_buckets) {
+        const unsigned long stride(num_buckets * IBL_TARGET_ALIGN);
+
+        generated_code code;
+        code.size = granary::PAGE_SIZE * 2
+                  + (stride * (NUM_CONFLICTING_TARGETS - 1));
+        void *mem(mmap(
+            nullptr, code.size, RWX, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        ASSERT(MAP_FAILED != mem);
+
+        // `jmp *%rdi`
+        code.dispatcher = reinterpret_cast<granary::app_pc>(mem);
+        code.dispatcher[0] = 0xFF;
+        code.dispatcher[1] = 0xE7;
+
+        for(unsigned i(0); i < NUM_CONFLICTING_TARGETS; ++i) {
+            code.targets[i] = code.dispatcher + granary::PAGE_SIZE
+                            + (i * stride);
+            write_return(code.targets[i], static_cast<int>(i));
+        }
+        return code;
+    }
+
+
+    /// Unmap the generated code, and forget its translations.
+    static void unmap_generated_code(generated_code &code) {
+        munmap(code.dispatcher, code.size);
+        granary::invalidate_unmapped_code(code.dispatcher, code.size);
+    }
+
+
+    /// Translate the dispatcher.
+    static granary::basic_block translate_dispatcher(generated_code &code) {
+        return granary::basic_block(granary::code_cache::find(
+            code.dispatcher, granary::TEST_POLICY));
+    }
+
+
+    /// Indirectly jump to the `i`th target through the translated
+    /// dispatcher.
+    static int jump_to(
+        granary::basic_block &bb,
+        generated_code &code,
+        unsigned i
+    ) {
+        return bb.call<int, granary::app_pc>(code.targets[i]);
+    }
+
+
+    /// Sums the statistics of every bucket of the IBL jump table.
+    static granary::ibl_bucket_stats sum_bucket_stats(void) {
+        granary::ibl_bucket_stats sum;
+        memset(&sum, 0, sizeof sum);
+        granary::ibl_bucket_stats stats;
+        for(unsigned i(0); granary::ibl_get_bucket_stats(i, stats); ++i) {
+            sum.num_hits += stats.num_hits;
+            sum.num_misses += stats.num_misses;
+            sum.num_conflicts += stats.num_conflicts;
+        }
+        return sum;
+    }
+
+
+    /// Test that targets that conflict in a bucket of the IBL jump table
+    /// evict each other, that the evicted targets are still reached through
+    /// the global code cache, and that repeated conflicts grow the table.
+    /// Once grown, the targets are rehashed, and all of them hit.
+    static void ibl_conflicts_grow_table(void) {
+        const unsigned num_buckets(granary::ibl_num_buckets());
+        generated_code code(map_generated_code(num_buckets));
+        granary::basic_block bb(translate_dispatcher(code));
+
+        // Two of the targets don't fit in the bucket. The table might grow
+        // if earlier insertions have already filled a sample.
+        const granary::ibl_bucket_stats before(sum_bucket_stats());
+        for(unsigned i(0); i < NUM_CONFLICTING_TARGETS; ++i) {
+            ASSERT(static_cast<int>(i) == jump_to(bb, code, i));
+        }
+        const granary::ibl_bucket_stats after(sum_bucket_stats());
+        ASSERT(num_buckets != granary::ibl_num_buckets()
+            || (before.num_conflicts + 2) <= after.num_conflicts);
+
+        // Cycling through more targets than fit in the bucket misses, and
+        // so re-adds, and evicts, on every jump.
+        for(unsigned i(0);
+            num_buckets == granary::ibl_num_buckets() && i < MAX_NUM_GROW_JUMPS;
+            ++i) {
+            const unsigned target(i % NUM_CONFLICTING_TARGETS);
+            ASSERT(static_cast<int>(target) == jump_to(bb, code, target));
+        }
+        ASSERT(num_buckets < granary::ibl_num_buckets());
+
+        // Every target was rehashed into the grown table, and now has its
+        // own way.
+        IF_PERF( const granary::ibl_bucket_stats grown(sum_bucket_stats()); )
+        for(unsigned i(0); i < NUM_CONFLICTING_TARGETS; ++i) {
+            ASSERT(static_cast<int>(i) == jump_to(bb, code, i));
+        }
+        IF_PERF( const granary::ibl_bucket_stats rehashed(
+            sum_bucket_stats()); )
+        IF_PERF( ASSERT((grown.num_hits + NUM_CONFLICTING_TARGETS)
+            == rehashed.num_hits); )
+        IF_PERF( ASSERT(grown.num_misses == rehashed.num_misses); )
+
+        unmap_generated_code(code);
+    }
+
+
+    ADD_TEST(ibl_conflicts_grow_table,
+        "Test that conflicting IBL targets are evicted, and grow the IBL jump "
+        "table.")
+
+
+    /// Test that targets that are removed from the IBL jump table, either
+    /// by invalidating their code or by flushing the code cache, are looked
+    /// up (and re-translated) in the global code cache.
+    static void ibl_invalidate_flush_targets(void) {
+
+        // A budget that is never exceeded, so that flushing is enabled, but
+        // only happens on demand.
+        granary::code_cache::set_budget(~0UL);
+
+        generated_code code(map_generated_code(granary::ibl_num_buckets()));
+        granary::basic_block bb(translate_dispatcher(code));
+        for(unsigned i(0); i < 2; ++i) {
+            ASSERT(static_cast<int>(i) == jump_to(bb, code, i));
+            ASSERT(static_cast<int>(i) == jump_to(bb, code, i));
+        }
+
+        // The first target is invalidated, and so its stale IBL entry must
+        // not be used.
+        granary::app_pc target(code.targets[0]);
+        mprotect(target, granary::PAGE_SIZE, PROT_READ | PROT_WRITE);
+        granary::invalidate_protected_code(
+            target, granary::PAGE_SIZE, PROT_READ | PROT_WRITE);
+        write_return(target, 10);
+        mprotect(target, granary::PAGE_SIZE, RWX);
+        granary::invalidate_protected_code(target, granary::PAGE_SIZE, RWX);
+
+        ASSERT(10 == jump_to(bb, code, 0));
+        ASSERT(10 == jump_to(bb, code, 0));
+        ASSERT(1 == jump_to(bb, code, 1));
+
+        // Flushing the code cache removes every IBL entry.
+        target = code.targets[1];
+        mprotect(target, granary::PAGE_SIZE, PROT_READ | PROT_WRITE);
+        write_return(target, 11);
+        mprotect(target, granary::PAGE_SIZE, RWX);
+        granary::code_cache::flush();
+
+        granary::basic_block flushed_bb(translate_dispatcher(code));
+        ASSERT(10 == jump_to(flushed_bb, code, 0));
+        ASSERT(11 == jump_to(flushed_bb, code, 1));
+        ASSERT(11 == jump_to(flushed_bb, code, 1));
+
+        unmap_generated_code(code);
+        granary::code_cache::set_budget(0);
+    }
+
+
+    ADD_TEST(ibl_invalidate_flush_targets,
+        "Test that IBL targets removed by invalidation or flushing are looked "
+        "up in the code cache.")
+}
+
+#endif
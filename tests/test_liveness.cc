@@ -0,0 +1,115 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_liveness.cc
+ *
+ *  Created on: 2026-10-17
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+#include "granary/liveness.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES && CONFIG_OPTIMISE_INTER_BLOCK_LIVENESS
+
+extern "C" {
+    extern void granary_test_liveness_branch(void);
+    extern void granary_test_liveness_loop(void);
+    extern void granary_test_liveness_loop_head(void);
+}
+
+
+/// Native code whose liveness is tested. These are never executed.
+__asm__(
+    ".text;"
+IF_APPLE("_") "granary_test_liveness_branch:"
+    "mov $1, %rax;"
+    "cmp $0, %rdi;"
+    "jz 1f;"
+    "add %rsi, %rax;"
+"1:  mov %rdx, %rcx;"
+    "ret;"
+
+IF_APPLE("_") "granary_test_liveness_loop:"
+    "mov $0, %rcx;"
+IF_APPLE("_") "granary_test_liveness_loop_head:"
+    "add %r8, %r9;"
+    "inc %rcx;"
+    "cmp $10, %rcx;"
+    "jnz " IF_APPLE("_") "granary_test_liveness_loop_head;"
+    "mov %r9, %rax;"
+    "ret;"
+);
+
+
+namespace test {
+
+    enum : unsigned {
+        ARITH_FLAGS = EFLAGS_READ_CF | EFLAGS_READ_PF | EFLAGS_READ_AF
+                    | EFLAGS_READ_ZF | EFLAGS_READ_SF | EFLAGS_READ_OF
+    };
+
+
+    /// Test that registers and flags that are written before they are read
+    /// on every path through the native code are dead.
+    static void test_branch_liveness(void) {
+        granary::app_pc func(granary::unsafe_cast<granary::app_pc>(
+            &granary_test_liveness_branch));
+
+        const granary::live_state state(
+            granary::find_live_state_before(func));
+
+        ASSERT(state.regs.is_dead(dynamorio::DR_REG_RAX));
+        ASSERT(state.regs.is_dead(dynamorio::DR_REG_RCX));
+        ASSERT(state.regs.is_live(dynamorio::DR_REG_RDI));
+        ASSERT(state.regs.is_live(dynamorio::DR_REG_RSI));
+        ASSERT(state.regs.is_live(dynamorio::DR_REG_RDX));
+        ASSERT(state.regs.is_live(dynamorio::DR_REG_RSP));
+        ASSERT(!(state.flags & ARITH_FLAGS));
+
+        // `RAX` is read by the fall-through of the `JZ`, and the `JZ` reads
+        // the zero flag.
+        const granary::live_state after(
+            granary::find_live_state_after_block(func));
+
+        ASSERT(after.regs.is_live(dynamorio::DR_REG_RAX));
+        ASSERT(after.regs.is_live(dynamorio::DR_REG_RDX));
+        ASSERT(after.regs.is_dead(dynamorio::DR_REG_RCX));
+        ASSERT(!(after.flags & ARITH_FLAGS));
+    }
+
+
+    ADD_TEST(test_branch_liveness,
+        "Test the liveness of registers and flags across a branch.")
+
+
+    /// Test that liveness is propagated around a loop.
+    static void test_loop_liveness(void) {
+        granary::app_pc func(granary::unsafe_cast<granary::app_pc>(
+            &granary_test_liveness_loop));
+        granary::app_pc loop_head(granary::unsafe_cast<granary::app_pc>(
+            &granary_test_liveness_loop_head));
+
+        const granary::live_state state(
+            granary::find_live_state_before(func));
+
+        ASSERT(state.regs.is_dead(dynamorio::DR_REG_RCX));
+        ASSERT(state.regs.is_live(dynamorio::DR_REG_R8));
+        ASSERT(state.regs.is_live(dynamorio::DR_REG_R9));
+        ASSERT(!(state.flags & ARITH_FLAGS));
+
+        // `RCX` is read by the `INC` in the loop head; `RAX` is written after
+        // the loop.
+        const granary::live_state head_state(
+            granary::find_live_state_before(loop_head));
+
+        ASSERT(head_state.regs.is_live(dynamorio::DR_REG_RCX));
+        ASSERT(head_state.regs.is_dead(dynamorio::DR_REG_RAX));
+        ASSERT(!(head_state.flags & ARITH_FLAGS));
+    }
+
+
+    ADD_TEST(test_loop_liveness,
+        "Test the liveness of registers and flags around a loop.")
+}
+
+#endif
@@ -18,7 +18,8 @@ namespace test {
         DIM = 10
     };
 
-    static void multiply_matrices(
+    /// Not `static` so that it can be benchmarked by other tests.
+    void multiply_matrices(
         int (&x)[DIM][DIM],
         int (&y)[DIM][DIM],
         int (&z)[DIM][DIM]
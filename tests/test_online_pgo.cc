@@ -0,0 +1,64 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_online_pgo.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES && CONFIG_OPTIMISE_ONLINE_PGO
+
+namespace test {
+
+    enum {
+        /// Enough loop iterations for the loop's blocks to become hot, and
+        /// to then run their re-translations.
+        NUM_PGO_ITERATIONS = 4 * CONFIG_OPTIMISE_ONLINE_PGO_THRESHOLD
+    };
+
+
+    /// Sum `[0, n)`, except for every `every`th number, which is subtracted.
+    /// The empty `ASM`s keep the branch from being if-converted. Depending on
+    /// `every`, the loop's Jcc is either mostly taken or mostly not taken.
+    static int pgo_biased_sum(int n, int every) {
+        int sum(0);
+        for(int i(0); i < n; ++i) {
+            if(i % every) {
+                ASM("");
+                sum += i;
+            } else {
+                ASM("");
+                sum -= i;
+            }
+        }
+        return sum;
+    }
+
+
+    /// Test that re-translated hot blocks compute the same thing as their
+    /// profiled translations, whichever way their Jcc is biased.
+    static void pgo_reverses_biased_jcc(void) {
+        granary::basic_block bb(granary::code_cache::find(
+            (granary::app_pc) pgo_biased_sum, granary::TEST_POLICY));
+
+        // The first call profiles the blocks and re-translates them once
+        // they are hot; the second call runs only the re-translations.
+        for(unsigned i(0); i < 2; ++i) {
+            ASSERT(pgo_biased_sum(NUM_PGO_ITERATIONS, 16)
+                == bb.call<int, int, int>(NUM_PGO_ITERATIONS, 16));
+            ASSERT(pgo_biased_sum(NUM_PGO_ITERATIONS, 1)
+                == bb.call<int, int, int>(NUM_PGO_ITERATIONS, 1));
+            ASSERT(pgo_biased_sum(NUM_PGO_ITERATIONS, 2)
+                == bb.call<int, int, int>(NUM_PGO_ITERATIONS, 2));
+        }
+    }
+
+
+    ADD_TEST(pgo_reverses_biased_jcc,
+        "Test that hot blocks whose Jcc is reversed using edge counts are "
+        "re-translated correctly.")
+}
+
+#endif
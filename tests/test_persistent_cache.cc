@@ -0,0 +1,65 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_persistent_cache.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES && CONFIG_PERSISTENT_CODE_CACHE
+
+#include "granary/persistent_cache.h"
+
+namespace test {
+
+    static int persist_square(int n) {
+        return n * n;
+    }
+
+
+    static int (* volatile PERSIST_SQUARE)(int) = persist_square;
+
+
+    /// Sum the squares of `[0, n)` through an indirect call, so that the
+    /// persisted trace contains an IBL lookup.
+    static int persist_sum_squares(int n) {
+        int sum(0);
+        for(int i(0); i < n; ++i) {
+            sum += PERSIST_SQUARE(i);
+        }
+        return sum;
+    }
+
+
+    /// Test that a trace with an indirect branch still runs correctly after
+    /// it has been saved to disk and then re-installed from the saved file.
+    static void persisted_indirect_call_reloads(void) {
+        const granary::app_pc sum_pc((granary::app_pc) persist_sum_squares);
+        granary::basic_block bb(granary::code_cache::find(
+            sum_pc, granary::TEST_POLICY));
+        ASSERT(persist_sum_squares(10) == bb.call<int, int>(10));
+
+        granary::persistent_cache::save();
+        ASSERT(0 < granary::persistent_cache::reload());
+
+        // Forget the translation, so that the next look-up installs the
+        // reloaded trace.
+        granary::code_cache::invalidate(sum_pc, sum_pc + 1);
+
+        granary::basic_block bb_reloaded(granary::code_cache::find(
+            sum_pc, granary::TEST_POLICY));
+        ASSERT(bb.cache_pc_start != bb_reloaded.cache_pc_start);
+        for(int i(0); i < 10; ++i) {
+            ASSERT(persist_sum_squares(i) == bb_reloaded.call<int, int>(i));
+        }
+    }
+
+
+    ADD_TEST(persisted_indirect_call_reloads,
+        "Test that a persisted trace with an indirect branch runs correctly "
+        "once it is reloaded from the cache file.")
+}
+
+#endif
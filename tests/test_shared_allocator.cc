@@ -0,0 +1,228 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_shared_allocator.cc
+ *
+ *  Created on: 2026-10-17
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+#include "granary/bump_allocator.h"
+#include "granary/spin_lock.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES
+
+namespace test {
+
+    enum {
+        NUM_ALLOCATIONS = 1 << 15,
+        MAX_NUM_THREADS = IF_USER_ELSE(8, 1)
+    };
+
+
+    /// Sizes of allocations made while translating a basic block: decoded
+    /// instructions, block meta-information, and encoded fragments.
+    static const unsigned ALLOCATION_SIZES[8] = {
+        16, 24, 40, 64, 72, 96, 136, 200
+    };
+
+
+    struct shared_allocator_config {
+        enum {
+            SLAB_SIZE = granary::PAGE_SIZE,
+            EXECUTABLE = false,
+            TRANSIENT = false,
+            SHARED = true,
+            SHARE_DEAD_SLABS = false,
+            EXEC_WHERE = granary::EXEC_NONE,
+            MIN_ALIGN = 16
+        };
+    };
+
+
+    struct private_allocator_config {
+        enum {
+            SLAB_SIZE = granary::PAGE_SIZE,
+            EXECUTABLE = false,
+            TRANSIENT = false,
+            SHARED = false,
+            SHARE_DEAD_SLABS = false,
+            EXEC_WHERE = granary::EXEC_NONE,
+            MIN_ALIGN = 16
+        };
+    };
+
+
+    typedef granary::bump_pointer_allocator<shared_allocator_config>
+        shared_allocator;
+
+
+    typedef granary::bump_pointer_allocator<private_allocator_config>
+        private_allocator;
+
+
+    static granary::static_data<shared_allocator> SHARED_ALLOCATOR;
+
+
+    static void *shared_allocate(unsigned size) {
+        return SHARED_ALLOCATOR->allocate_untyped(16, size);
+    }
+
+
+    /// Per-thread state.
+    struct allocator_thread {
+        void *(*allocate)(unsigned);
+        uint8_t tag;
+        unsigned num_corruptions;
+        uint64_t num_cycles;
+        uint8_t **objects;
+        unsigned *sizes;
+    };
+
+
+    /// Make a burst of allocations, filling each allocation with the thread's
+    /// tag, and then check that no other thread overwrote any of them.
+    static void *do_allocations(void *arg) {
+        allocator_thread *thread(reinterpret_cast<allocator_thread *>(arg));
+        uint64_t state(thread->tag * 0x9E3779B97F4A7C15ULL);
+        const uint64_t start(granary::test_timestamp());
+
+        for(unsigned i(0); i < NUM_ALLOCATIONS; ++i) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            const unsigned size(ALLOCATION_SIZES[(state >> 33) % 8]);
+            uint8_t *object(reinterpret_cast<uint8_t *>(
+                thread->allocate(size)));
+            object[0] = thread->tag;
+            object[size - 1] = thread->tag;
+            thread->objects[i] = object;
+            thread->sizes[i] = size;
+        }
+
+        thread->num_cycles = granary::test_timestamp() - start;
+
+        unsigned num_corruptions(0);
+        for(unsigned i(0); i < NUM_ALLOCATIONS; ++i) {
+            uint8_t *object(thread->objects[i]);
+            if(thread->tag != object[0]
+            || thread->tag != object[thread->sizes[i] - 1]
+            || (reinterpret_cast<uintptr_t>(object) % 16)) {
+                ++num_corruptions;
+            }
+        }
+        thread->num_corruptions = num_corruptions;
+        return nullptr;
+    }
+
+
+    /// Make allocations from `num_threads` threads at once, and return the
+    /// number of cycles taken by the slowest thread.
+    static uint64_t run_threads(
+        unsigned num_threads,
+        void *(*allocate)(unsigned)
+    ) {
+        allocator_thread threads[MAX_NUM_THREADS];
+        for(unsigned i(0); i < num_threads; ++i) {
+            threads[i].allocate = allocate;
+            threads[i].tag = static_cast<uint8_t>(i + 1);
+            threads[i].num_corruptions = 0;
+            threads[i].num_cycles = 0;
+            threads[i].objects = granary::allocate_memory<uint8_t *>(
+                NUM_ALLOCATIONS);
+            threads[i].sizes = granary::allocate_memory<unsigned>(
+                NUM_ALLOCATIONS);
+        }
+
+        granary::run_test_threads(&do_allocations, threads, num_threads);
+
+        for(unsigned i(0); i < num_threads; ++i) {
+            ASSERT(0 == threads[i].num_corruptions);
+            granary::free_memory(threads[i].objects, NUM_ALLOCATIONS);
+            granary::free_memory(threads[i].sizes, NUM_ALLOCATIONS);
+        }
+        return granary::max_num_cycles(threads, num_threads);
+    }
+
+
+    /// Test that racing allocations from `MAX_NUM_THREADS` threads in the
+    /// lock-free shared bump pointer allocator don't overlap.
+    static void test_shared_allocator(void) {
+        SHARED_ALLOCATOR.construct();
+
+        // Staged allocations don't move the bump pointer.
+        const uint8_t *staged(SHARED_ALLOCATOR->allocate_staged<uint8_t>());
+        ASSERT(staged == SHARED_ALLOCATOR->allocate_staged<uint8_t>());
+
+        // Allocations bigger than a slab get their own slab.
+        uint8_t *big(reinterpret_cast<uint8_t *>(
+            SHARED_ALLOCATOR->allocate_untyped(64, 3 * granary::PAGE_SIZE)));
+        ASSERT(0 == (reinterpret_cast<uintptr_t>(big) % 64));
+        big[3 * granary::PAGE_SIZE - 1] = 0xAB;
+
+        run_threads(MAX_NUM_THREADS, &shared_allocate);
+
+        // Racing allocations keep each slab's accounting consistent.
+        granary::bump_pointer_slab *slabs(SHARED_ALLOCATOR->detach_slabs());
+        ASSERT(nullptr != slabs);
+        for(granary::bump_pointer_slab *slab(slabs); slab; slab = slab->next) {
+            ASSERT(slab->size == (slab->index + slab->remaining));
+        }
+        shared_allocator::free_slab_list(slabs);
+    }
+
+
+    ADD_TEST(test_shared_allocator,
+        "Test the lock-free shared bump pointer allocator.")
+
+
+#if CONFIG_DEBUG_RUN_BENCHMARKS
+
+    /// How shared allocators behaved before they became lock-free: every
+    /// allocation is serialised by a single lock.
+    struct locked_allocator {
+        granary::spin_lock lock;
+        private_allocator allocator;
+    };
+
+
+    static granary::static_data<locked_allocator> LOCKED_ALLOCATOR;
+
+
+    static void *locked_allocate(unsigned size) {
+        LOCKED_ALLOCATOR->lock.acquire();
+        void *mem(LOCKED_ALLOCATOR->allocator.allocate_untyped(16, size));
+        LOCKED_ALLOCATOR->lock.release();
+        return mem;
+    }
+
+
+    /// Compare the lock-free shared bump pointer allocator against a shared
+    /// allocator that serialises every allocation, from 1 to
+    /// `MAX_NUM_THREADS` threads.
+    static void benchmark_shared_allocator(void) {
+        SHARED_ALLOCATOR.construct();
+        LOCKED_ALLOCATOR.construct();
+
+        for(unsigned num_threads(1);
+            num_threads <= MAX_NUM_THREADS;
+            num_threads *= 2) {
+
+            const uint64_t shared_cycles(
+                run_threads(num_threads, &shared_allocate));
+            const uint64_t locked_cycles(
+                run_threads(num_threads, &locked_allocate));
+
+            granary::printf(
+                "    %u thread(s): %lu cycles (locked: %lu cycles)\n",
+                num_threads, shared_cycles, locked_cycles);
+        }
+
+        shared_allocator::free_slab_list(SHARED_ALLOCATOR->detach_slabs());
+    }
+
+
+    ADD_TEST(benchmark_shared_allocator,
+        "Benchmark the lock-free shared bump pointer allocator.")
+#endif
+}
+
+#endif
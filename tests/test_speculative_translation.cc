@@ -0,0 +1,94 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_speculative_translation.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+#include "granary/basic_block_info.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES && CONFIG_SPECULATIVE_TRANSLATION \
+    && !CONFIG_ENV_KERNEL
+
+#include <unistd.h>
+
+namespace test {
+
+    enum {
+        /// How long to wait for the workers to patch the branches.
+        MAX_NUM_WAITS = 1000,
+        WAIT_US = 1000
+    };
+
+
+    static int speculate_digit_sum(int n) {
+        int sum(0);
+        for(; 0 < n; n /= 10) {
+            if(n % 3) {
+                sum += n % 10;
+            } else {
+                sum -= 1;
+            }
+        }
+        return sum;
+    }
+
+
+    /// Returns the number of direct branches of the trace whose first block
+    /// is `info` that still go to their DBL stubs.
+    static unsigned num_unpatched_branches(
+        const granary::basic_block_info *info
+    ) {
+        unsigned num_unpatched(0);
+        for(unsigned i(0); i < info->num_bbs_in_trace; ++i) {
+            granary::app_pc pc(info[i].start_pc);
+            const granary::app_pc end_pc(pc + info[i].num_bytes);
+
+            while(pc < end_pc) {
+                granary::instruction in(granary::instruction::decode(&pc));
+                if(!in.is_valid()) {
+                    break;
+                }
+
+                const granary::operand target(in.is_cti() ?
+                    in.cti_target() : granary::operand());
+                if(in.is_cti()
+                && dynamorio::opnd_is_pc(target)
+                && granary::is_gencode_address(
+                    dynamorio::opnd_get_pc(target))) {
+                    ++num_unpatched;
+                }
+            }
+        }
+        return num_unpatched;
+    }
+
+
+    /// Test that the workers translate the targets of direct branches, and
+    /// patch the branches, before the branches are first executed.
+    static void speculation_patches_unexecuted_branches(void) {
+        granary::basic_block bb(granary::code_cache::find(
+            (granary::app_pc) speculate_digit_sum, granary::TEST_POLICY));
+
+        ASSERT(0 < num_unpatched_branches(bb.info));
+        for(unsigned i(0); i < MAX_NUM_WAITS; ++i) {
+            if(!num_unpatched_branches(bb.info)) {
+                break;
+            }
+            usleep(WAIT_US);
+        }
+        ASSERT(0 == num_unpatched_branches(bb.info));
+
+        ASSERT(speculate_digit_sum(1234567) == bb.call<int, int>(1234567));
+        ASSERT(speculate_digit_sum(999) == bb.call<int, int>(999));
+    }
+
+
+    ADD_TEST(speculation_patches_unexecuted_branches,
+        "Test that direct branches are patched by speculative translation "
+        "before they are first executed.")
+}
+
+#endif
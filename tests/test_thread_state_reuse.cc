@@ -0,0 +1,138 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_thread_state_reuse.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES && !CONFIG_ENV_KERNEL
+
+#include <pthread.h>
+
+namespace test {
+
+    enum {
+        NUM_CHURNED_THREADS = 64,
+        NUM_CONCURRENT_THREADS = 4,
+
+        /// Each thread allocates and then frees this many heap objects,
+        /// which leaves some of them in its heap magazines when it exits.
+        NUM_HEAP_OBJECTS = 64,
+        HEAP_OBJECT_SIZE = 64
+    };
+
+
+    /// Thread-specific key whose destructor runs after the destructor that
+    /// parks the state of an exiting thread.
+    static pthread_key_t LATE_EXIT_KEY;
+
+
+    /// Number of exiting threads whose state changed after it was parked.
+    static std::atomic<unsigned> NUM_CHANGED_STATES(ATOMIC_VAR_INIT(0U));
+
+
+    static int churn_fib(int n) {
+        return n < 2 ? n : churn_fib(n - 1) + churn_fib(n - 2);
+    }
+
+
+    /// Enter Granary from an exiting thread, as a TLS destructor or a
+    /// wrapped `free` might.
+    static void enter_while_exiting(void *state) {
+        granary::cpu_state_handle cpu;
+        if(state != granary::current_cpu_state()) {
+            NUM_CHANGED_STATES.fetch_add(1);
+        }
+    }
+
+
+    /// Translate and run some code, which gives the thread a state, and
+    /// then use the thread's heap magazines.
+    static void *translate_and_exit(void *result_) {
+        int *result(reinterpret_cast<int *>(result_));
+        granary::basic_block bb(granary::code_cache::find(
+            (granary::app_pc) churn_fib, granary::TEST_POLICY));
+        *result = bb.call<int, int>(10);
+
+        void *objects[NUM_HEAP_OBJECTS];
+        for(unsigned i(0); i < NUM_HEAP_OBJECTS; ++i) {
+            objects[i] = granary::detail::global_allocate(HEAP_OBJECT_SIZE);
+        }
+        for(unsigned i(0); i < NUM_HEAP_OBJECTS; ++i) {
+            granary::detail::global_free(objects[i], HEAP_OBJECT_SIZE);
+        }
+
+        pthread_setspecific(LATE_EXIT_KEY, granary::current_cpu_state());
+        return nullptr;
+    }
+
+
+    /// Returns the number of thread states that have been allocated.
+    static unsigned num_cpu_states(void) {
+        unsigned num_states(0);
+        for(granary::cpu_state *state(granary::first_cpu_state());
+            state;
+            state = state->code_cache_reclaim.next) {
+            ++num_states;
+        }
+        return num_states;
+    }
+
+
+    /// Returns the number of bytes of the heap in use.
+    static unsigned long num_heap_bytes(void) {
+        granary::detail::heap_statistics stats;
+        granary::detail::get_heap_statistics(stats);
+        return stats.num_heap_bytes;
+    }
+
+
+    /// Test that the states of exited threads are adopted by new threads,
+    /// and that exiting threads keep their states until they are gone.
+    static void thread_states_are_reused(void) {
+        pthread_key_create(&LATE_EXIT_KEY, &enter_while_exiting);
+
+        const unsigned num_states(num_cpu_states());
+        unsigned long num_first_heap_bytes(0);
+        for(unsigned i(0); i < NUM_CHURNED_THREADS;) {
+            pthread_t threads[NUM_CONCURRENT_THREADS];
+            int results[NUM_CONCURRENT_THREADS];
+
+            for(unsigned j(0); j < NUM_CONCURRENT_THREADS; ++j) {
+                results[j] = -1;
+                pthread_create(
+                    &(threads[j]), nullptr, translate_and_exit,
+                    &(results[j]));
+            }
+
+            for(unsigned j(0); j < NUM_CONCURRENT_THREADS; ++j, ++i) {
+                pthread_join(threads[j], nullptr);
+                ASSERT(churn_fib(10) == results[j]);
+            }
+
+            if(!num_first_heap_bytes) {
+                num_first_heap_bytes = num_heap_bytes();
+            }
+        }
+
+        pthread_key_delete(LATE_EXIT_KEY);
+
+        // Each batch of threads adopts the states of the previous batch.
+        ASSERT(0 == NUM_CHANGED_STATES.load());
+        ASSERT(num_cpu_states() <= (num_states + NUM_CONCURRENT_THREADS));
+
+        // The free objects of exited threads' heap magazines are reused, so
+        // the heap doesn't grow with the number of exited threads.
+        ASSERT((num_heap_bytes() - num_first_heap_bytes) < (
+            NUM_CHURNED_THREADS * NUM_HEAP_OBJECTS * HEAP_OBJECT_SIZE / 4));
+    }
+
+
+    ADD_TEST(thread_states_are_reused,
+        "Test that the states of exited threads are re-used by new threads.")
+}
+
+#endif
@@ -0,0 +1,115 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_wp_counter_index.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES && defined(CLIENT_WATCHPOINTS)
+
+#include "clients/watchpoints/instrument.h"
+
+#if !CONFIG_ENV_KERNEL
+#   include <pthread.h>
+#endif
+
+#if WP_RECYCLE_COUNTER_INDEXES
+
+namespace test {
+
+    enum {
+        NUM_TEST_INDEXES = 2 * WP_COUNTER_INDEX_BATCH_SIZE
+    };
+
+
+    static_assert(NUM_TEST_INDEXES
+            < (WP_COUNTER_INDEX_BATCH_SIZE * WP_NUM_QUARANTINED_INDEX_BATCHES),
+        "Freed test indexes must still be quarantined when re-allocating.");
+
+
+    /// Allocate `NUM_TEST_INDEXES` distinct counter indexes.
+    static void allocate_indexes(uintptr_t *indexes) {
+        for(unsigned i(0); i < NUM_TEST_INDEXES; ++i) {
+            indexes[i] = client::wp::next_counter_index();
+            ASSERT(indexes[i] <= client::wp::MAX_COUNTER_INDEX);
+
+            for(unsigned j(0); j < i; ++j) {
+                ASSERT(indexes[i] != indexes[j]);
+            }
+        }
+    }
+
+
+    /// Test that counter indexes are unique while allocated, and that freed
+    /// counter indexes are not immediately re-used.
+    static void test_counter_index_grace_period(void) {
+        uintptr_t freed_indexes[NUM_TEST_INDEXES];
+        uintptr_t indexes[NUM_TEST_INDEXES];
+
+        allocate_indexes(freed_indexes);
+        for(unsigned i(0); i < NUM_TEST_INDEXES; ++i) {
+            client::wp::free_counter_index(freed_indexes[i]);
+        }
+
+        allocate_indexes(indexes);
+        for(unsigned i(0); i < NUM_TEST_INDEXES; ++i) {
+            for(unsigned j(0); j < NUM_TEST_INDEXES; ++j) {
+                ASSERT(indexes[i] != freed_indexes[j]);
+            }
+        }
+
+        for(unsigned i(0); i < NUM_TEST_INDEXES; ++i) {
+            client::wp::free_counter_index(indexes[i]);
+        }
+    }
+
+
+    ADD_TEST(test_counter_index_grace_period,
+        "Test that freed watchpoint counter indexes are quarantined.")
+
+
+#if !CONFIG_ENV_KERNEL
+    /// Allocate a single counter index, which fills this thread's cache with
+    /// a batch of indexes, and then exit.
+    static void *allocate_index_and_exit(void *index_) {
+        uintptr_t *index(reinterpret_cast<uintptr_t *>(index_));
+        *index = client::wp::next_counter_index();
+        return nullptr;
+    }
+
+
+    /// Test that the counter indexes cached by an exiting thread are
+    /// returned to the global pool.
+    static void test_counter_index_thread_exit(void) {
+        for(unsigned i(0); i < 4; ++i) {
+            const uintptr_t num_pooled(
+                client::wp::num_pooled_counter_indexes());
+
+            uintptr_t index(client::wp::MAX_COUNTER_INDEX + 1);
+            pthread_t thread;
+            pthread_create(
+                &thread, nullptr, allocate_index_and_exit, &index);
+            pthread_join(thread, nullptr);
+
+            // Only the index that the thread allocated is missing; the rest
+            // of its cached batch is back in the pool.
+            ASSERT(index <= client::wp::MAX_COUNTER_INDEX);
+            ASSERT(num_pooled
+                <= (client::wp::num_pooled_counter_indexes() + 1));
+
+            client::wp::free_counter_index(index);
+        }
+    }
+
+
+    ADD_TEST(test_counter_index_thread_exit,
+        "Test that the watchpoint counter indexes cached by exited threads "
+        "are returned to the pool.")
+#endif /* CONFIG_ENV_KERNEL */
+}
+
+#endif /* WP_RECYCLE_COUNTER_INDEXES */
+#endif
@@ -0,0 +1,93 @@
+/* Copyright 2012-2013 Peter Goodman, all rights reserved. */
+/*
+ * test_wp_unwatched_regs.cc
+ *
+ *  Created on: 2026-10-18
+ *      Author: Peter Goodman
+ */
+
+#include "granary/test.h"
+
+#if CONFIG_DEBUG_RUN_TEST_CASES && defined(CLIENT_WATCHPOINTS)
+
+#include "clients/watchpoints/instrument.h"
+
+#if WP_ELIDE_UNWATCHED_CHECKS
+
+namespace test {
+
+    using namespace granary;
+
+
+    /// Returns the registers known to be unwatched after the instructions of
+    /// `ls`.
+    static register_manager unwatched_regs_after(instruction_list &ls) {
+        return client::wp::find_unwatched_regs(ls.append(nop1byte_()));
+    }
+
+
+    /// Test that only address-preserving definitions make a register
+    /// unwatched.
+    static void test_unwatched_regs(void) {
+
+        // Copies and small non-negative adjustments of the stack pointer are
+        // unwatched.
+        {
+            instruction_list ls;
+            ls.append(mov_ld_(reg::rax, reg::rsp));
+            ls.append(lea_(reg::rbx, reg::rsp[8]));
+            ls.append(add_(reg::rbx, int8_(16)));
+            ls.append(sub_(reg::rax, int8_(8)));
+
+            register_manager regs(unwatched_regs_after(ls));
+            ASSERT(regs.is_live(dynamorio::DR_REG_RAX));
+            ASSERT(regs.is_live(dynamorio::DR_REG_RBX));
+            ASSERT(!regs.is_live(dynamorio::DR_REG_RCX));
+        }
+
+        // Negative immediates can borrow into the watchpoint bits.
+        {
+            instruction_list ls;
+            ls.append(mov_ld_(reg::rax, reg::rsp));
+            ls.append(mov_ld_(reg::rbx, reg::rsp));
+            ls.append(add_(reg::rax, int8_(-1)));
+            ls.append(sub_(reg::rbx, int8_(-1)));
+
+            register_manager regs(unwatched_regs_after(ls));
+            ASSERT(!regs.is_live(dynamorio::DR_REG_RAX));
+            ASSERT(!regs.is_live(dynamorio::DR_REG_RBX));
+        }
+
+        // Writes to 8- and 16-bit registers keep the high-order bits, which
+        // might belong to a watched address.
+        {
+            instruction_list ls;
+            ls.append(mov_ld_(reg::rax, reg::rcx));
+            ls.append(mov_imm_(reg::al, int8_(1)));
+            ls.append(mov_ld_(reg::rbx, reg::rcx));
+            ls.append(add_(reg::bx, int8_(1)));
+
+            register_manager regs(unwatched_regs_after(ls));
+            ASSERT(!regs.is_live(dynamorio::DR_REG_RAX));
+            ASSERT(!regs.is_live(dynamorio::DR_REG_RBX));
+        }
+
+        // Writes to 32-bit registers zero-extend.
+        {
+            instruction_list ls;
+            ls.append(mov_ld_(reg::rax, reg::rcx));
+            ls.append(mov_imm_(reg::eax, int32_(1)));
+
+            register_manager regs(unwatched_regs_after(ls));
+            ASSERT(regs.is_live(dynamorio::DR_REG_RAX));
+        }
+    }
+
+
+    ADD_TEST(test_unwatched_regs,
+        "Test that only address-preserving definitions of registers make them "
+        "known to be unwatched.")
+}
+
+#endif /* WP_ELIDE_UNWATCHED_CHECKS */
+#endif